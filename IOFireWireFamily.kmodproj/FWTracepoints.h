@@ -154,7 +154,9 @@ enum
 	kTPControllerProcessLockRequest			= 28,
 	kTPControllerAsyncLockResponse			= 29,
 	kTPControllerTimeoutQBusReset			= 30,
-	kTPControllerTimeoutQProcessTimeout		= 31
+	kTPControllerTimeoutQProcessTimeout		= 31,
+	kTPControllerProcessRcvPackets			= 32,
+	kTPControllerIsochRealloc				= 33
 };
 
 // FireWire Device Tracepoints			
@@ -172,7 +174,7 @@ enum
 {
 	// IRM
 	kTPIsochIRMAllocateIsochResources		= 1,
-	kTPIsochIRMThreadFunc					= 2,
+	kTPIsochIRMThreadFunc					= 2,	// unused, IRM allocations are restored by the controller
 	// 3-10 reserved
 	
 	// channel
@@ -237,12 +239,13 @@ enum
 	kTPResetAssignCycleMaster					= 5,
 	kTPResetFinishedBusScan						= 6,
 	kTPResetUpdatePlane							= 7,
-	kTPResetAddUnitDirectory					= 8,
-	kTPResetRemoveUnitDirectory					= 9,
+	kTPResetAddUnitDirectory					= 8,	// unused, directory changes no longer reset, see kTPResetPublishROM
+	kTPResetRemoveUnitDirectory					= 9,	// unused, see kTPResetPublishROM
 	kTPResetMakeRoot							= 10,
 	kTPResetFWIMHandleSelfIDInt					= 11,
 	kTPResetFWIMHAABB							= 12,
-	kTPResetFWIMHandleSystemShutDown			= 13
+	kTPResetFWIMHandleSystemShutDown			= 13,
+	kTPResetPublishROM							= 14
 };
 	
 // FireWire StateChange Action Tracepoints		
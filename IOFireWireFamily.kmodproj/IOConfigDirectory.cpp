@@ -33,6 +33,7 @@
 #import <libkern/c++/OSIterator.h>
 #import <libkern/c++/OSData.h>
 #import <libkern/OSByteOrder.h>
+#import <libkern/OSAtomic.h>
 
 static int findIndex(const UInt32* base, int size, int key,
                      UInt32 type = kInvalidConfigROMEntryType);
@@ -118,9 +119,144 @@ bool IOConfigDirectory::initWithOffset(int start, int type)
 		fNumEntries = 0;
 	}
 	
+	// without it lookups just scan the entries
+	if( reserved == NULL )
+	{
+		reserved = (ExpansionData *)IOMalloc( sizeof(ExpansionData) );
+		if( reserved != NULL )
+			bzero( reserved, sizeof(ExpansionData) );
+	}
+	
 	return true;
 }
 
+// free
+//
+//
+
+void IOConfigDirectory::free()
+{
+	if( reserved != NULL )
+	{
+		IOFree( reserved, sizeof(ExpansionData) );
+		reserved = NULL;
+	}
+	
+	OSObject::free();
+}
+
+// setKeyIndexEnabled
+//
+//
+
+void IOConfigDirectory::setKeyIndexEnabled( bool enabled )
+{
+	if( reserved != NULL )
+	{
+		reserved->fKeyIndexDisabled = !enabled;
+	}
+}
+
+// invalidateKeyIndex
+//
+// the entries of a remote directory never change once read, the cache only grows and a
+// changed ROM gets a new cache and new directories. local directories call this on compile.
+
+void IOConfigDirectory::invalidateKeyIndex( void )
+{
+	if( reserved != NULL )
+	{
+		reserved->fKeyIndexValid = false;
+		OSMemoryBarrier();
+	}
+}
+
+// buildKeyIndex
+//
+// record the first entry for every key type and value. walking backwards leaves the
+// first occurrence in each slot. concurrent builders write the same bytes.
+
+void IOConfigDirectory::buildKeyIndex( void )
+{
+	UInt8 keyIndex[kConfigKeyIndexSize];
+	
+	memset( keyIndex, kConfigKeyIndexNone, sizeof(keyIndex) );
+	
+	const UInt32 * data = lockData() + fStart + 1;
+	for( int i = fNumEntries - 1; i >= 0; i-- )
+	{
+		UInt32 entry = OSSwapBigToHostInt32( data[i] );
+		keyIndex[(entry & (kConfigEntryKeyType | kConfigEntryKeyValue)) >> kConfigEntryKeyValuePhase] = i;
+	}
+	unlockData();
+	
+	bcopy( keyIndex, reserved->fKeyIndex, sizeof(keyIndex) );
+	
+	OSMemoryBarrier();
+	reserved->fKeyIndexValid = true;
+}
+
+// findKeyIndex
+//
+// same answer as findIndex over the directory's entries. like findIndex, a key above
+// the key value range carries type bits that a matching entry must have set.
+
+int IOConfigDirectory::findKeyIndex( int key, UInt32 type )
+{
+	int index;
+	
+	bool indexed = (reserved != NULL) && 
+				   !reserved->fKeyIndexDisabled &&
+				   (fNumEntries <= kConfigKeyIndexNone) &&
+				   (key >= 0) && (key < kConfigKeyIndexSize);
+	
+	if( !indexed )
+	{
+		const UInt32 * data = lockData() + fStart + 1;
+		index = findIndex( data, fNumEntries, key, type );
+		unlockData();
+		
+		return index;
+	}
+	
+	if( !reserved->fKeyIndexValid )
+	{
+		buildKeyIndex();
+	}
+	
+	OSMemoryBarrier();
+	
+	const UInt32 typeShift = kConfigEntryKeyTypePhase - kConfigEntryKeyValuePhase;
+	const UInt32 keyValue = key & (kConfigEntryKeyValue >> kConfigEntryKeyValuePhase);
+	const UInt32 keyType = key >> typeShift;
+	const UInt8 * keyIndex = reserved->fKeyIndex;
+	
+	index = kConfigKeyIndexNone;
+	
+	if( type != kInvalidConfigROMEntryType )
+	{
+		index = keyIndex[((type | keyType) << typeShift) | keyValue];
+	}
+	else
+	{
+		// any type with the key's own type bits set will do, the earliest entry wins
+		for( UInt32 t = 0; t < 4; t++ )
+		{
+			if( (t & keyType) == keyType )
+			{
+				int i = keyIndex[(t << typeShift) | keyValue];
+				if( i < index )
+					index = i;
+			}
+		}
+	}
+	
+	if( index == kConfigKeyIndexNone )
+		index = -1;
+	
+	return index;
+}
+
 // createIterator
 //
 //
@@ -170,9 +306,7 @@ IOReturn IOConfigDirectory::getKeyType(int key, IOConfigKeyType &type)
 	
 	if( status == kIOReturnSuccess )
 	{
-		const UInt32 * data = lockData() + fStart + 1;
-		index = findIndex(data, fNumEntries, key);
-		unlockData();
+		index = findKeyIndex(key);
 
 		if( index < 0 )
 			status = kIOConfigNoEntry;
@@ -199,9 +333,7 @@ IOReturn IOConfigDirectory::getKeyValue(int key, UInt32 &value, OSString** text)
 	
 	if( status == kIOReturnSuccess )
 	{
-		const UInt32 * data = lockData() + fStart + 1;
-		index = findIndex(data, fNumEntries, key);
-		unlockData();
+		index = findKeyIndex(key);
 	
 		if( index < 0 )
         	status = kIOConfigNoEntry;
@@ -237,9 +369,7 @@ IOReturn IOConfigDirectory::getKeyValue(int key, OSData *&value, OSString** text
 
 	if( status == kIOReturnSuccess )
 	{    
-		const UInt32 * data = lockData() + fStart + 1;
-		index = findIndex(data, fNumEntries, key, kConfigLeafKeyType);
-		unlockData();
+		index = findKeyIndex(key, kConfigLeafKeyType);
 		
 		if( index < 0 )
 		{
@@ -278,9 +408,7 @@ IOReturn IOConfigDirectory::getKeyValue(int key, IOConfigDirectory *&value,
 	
 	if( status == kIOReturnSuccess )
 	{
-		const UInt32 * data = lockData() + fStart + 1;
-		index = findIndex(data, fNumEntries, key, kConfigDirectoryKeyType);
-		unlockData();
+		index = findKeyIndex(key, kConfigDirectoryKeyType);
 		
 		if( index < 0 )
 		{
@@ -318,9 +446,7 @@ IOReturn IOConfigDirectory::getKeyOffset(int key, FWAddress &value, OSString** t
 	
 	if( status == kIOReturnSuccess )
 	{
-		const UInt32 * data = lockData() + fStart + 1;
-		index = findIndex(data, fNumEntries, key, kConfigOffsetKeyType);
-		unlockData();
+		index = findKeyIndex(key, kConfigOffsetKeyType);
 	
 		if( index < 0 )
         	status = kIOConfigNoEntry;
@@ -33,6 +33,9 @@ class OSString;
 class OSIterator;
 class IOFireWireDevice;
 
+#define kConfigKeyIndexSize		256		// one slot for each key type and key value
+#define kConfigKeyIndexNone		0xff	// no entry with this key, also the most entries indexed
+
 /*! @class IOConfigDirectory 
 */
 class IOConfigDirectory : public OSObject
@@ -47,13 +50,19 @@ protected:
 /*! @struct ExpansionData
     @discussion This structure will be used to expand the capablilties of the class in the future.
     */    
-    struct ExpansionData { };
+    struct ExpansionData 
+	{
+		UInt8			fKeyIndex[kConfigKeyIndexSize];		// first entry index for each (type << 6) | key
+		volatile bool	fKeyIndexValid;
+		bool			fKeyIndexDisabled;
+	};
 
 /*! @var reserved
     Reserved for future use.  (Internal use only)  */
     ExpansionData *reserved;
 
     virtual bool initWithOffset(int start, int type);
+    virtual void free();
 
     virtual const UInt32 *getBase() = 0;
     virtual IOReturn createIterator(UInt32 testVal, UInt32 testMask,
@@ -166,6 +175,19 @@ protected:
 	virtual IOReturn updateROMCache( UInt32 offset, UInt32 length ) = 0;
 	virtual IOReturn checkROMState( void ) = 0;
 	
+	int findKeyIndex( int key, UInt32 type = kInvalidConfigROMEntryType );
+	void buildKeyIndex( void );
+	void invalidateKeyIndex( void );
+
+public:
+    /*!
+        @function setKeyIndexEnabled
+        Key lookups use an index of the directory built on first use. Disabling it
+        makes every lookup scan the directory entries, for comparison and debugging.
+        @param enabled false to scan the entries on every lookup.
+    */
+	void setKeyIndexEnabled( bool enabled );
+	
 private:
     OSMetaClassDeclareReservedUnused(IOConfigDirectory, 0);
     OSMetaClassDeclareReservedUnused(IOConfigDirectory, 1);
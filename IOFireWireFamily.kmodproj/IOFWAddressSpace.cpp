@@ -40,7 +40,7 @@
 OSDefineMetaClassAndStructors(IOFWAddressSpaceAux, OSObject);
 
 OSMetaClassDefineReservedUsed(IOFWAddressSpaceAux, 0);			// intersects
-OSMetaClassDefineReservedUnused(IOFWAddressSpaceAux, 1);
+OSMetaClassDefineReservedUsed(IOFWAddressSpaceAux, 1);			// getAddressRange
 OSMetaClassDefineReservedUnused(IOFWAddressSpaceAux, 2);
 OSMetaClassDefineReservedUnused(IOFWAddressSpaceAux, 3);
 OSMetaClassDefineReservedUnused(IOFWAddressSpaceAux, 4);
@@ -237,6 +237,15 @@ bool IOFWAddressSpaceAux::intersects( IOFWAddressSpace * space )
 	return false;
 }
 
+// getAddressRange
+//
+//
+
+bool IOFWAddressSpaceAux::getAddressRange( FWAddress * base, UInt32 * length )
+{
+	return false;
+}
+
 #pragma mark -
 
 /*
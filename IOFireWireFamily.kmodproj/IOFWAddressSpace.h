@@ -136,10 +136,12 @@ protected:
 	void setExclusive( bool exclusive );
 	
 	virtual bool intersects( IOFWAddressSpace * space );
+
+	virtual bool getAddressRange( FWAddress * base, UInt32 * length );
 		
 private:
     OSMetaClassDeclareReservedUsed(IOFWAddressSpaceAux, 0);
-    OSMetaClassDeclareReservedUnused(IOFWAddressSpaceAux, 1);
+    OSMetaClassDeclareReservedUsed(IOFWAddressSpaceAux, 1);
     OSMetaClassDeclareReservedUnused(IOFWAddressSpaceAux, 2);
     OSMetaClassDeclareReservedUnused(IOFWAddressSpaceAux, 3);
     OSMetaClassDeclareReservedUnused(IOFWAddressSpaceAux, 4);
@@ -310,6 +312,16 @@ public:
 	inline bool intersects( IOFWAddressSpace * space )
 		{ return fIOFWAddressSpaceExpansion->fAuxiliary->intersects( space ); }
 
+	/*!	@function	getAddressRange
+		@abstract	Returns the fixed address range this address space answers to. Currently only supported by IOFWPsuedoAddressSpaces.
+		@param		base  Returns the first address in the range
+		@param		length  Returns the length of the range in bytes
+		@result		True if the address space has a fixed range, false if it must be asked about every address
+	*/
+		
+	inline bool getAddressRange( FWAddress * base, UInt32 * length )
+		{ return fIOFWAddressSpaceExpansion->fAuxiliary->getAddressRange( base, length ); }
+
 		
 protected:
 	
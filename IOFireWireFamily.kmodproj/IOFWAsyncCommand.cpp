@@ -400,6 +400,11 @@ IOReturn IOFWAsyncCommand::complete(IOReturn status)
         fControl->freeTrans(fTrans);
         fTrans = NULL;
     }
+	else
+	{
+		// we may have been handed a label while waiting for one and never used it
+		fControl->releaseReservedTrans( this, NULL );
+	}
 	
     // If we're in the middle of processing a bus reset and
     // the command should be retried after a bus reset, put it on the
@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 1998-2002 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include "FWDebugging.h"
+
+#include "IOFWAsyncCommandPool.h"
+
+#include <IOKit/firewire/IOFireWireController.h>
+#include <IOKit/firewire/IOFWCommand.h>
+
+#include <libkern/c++/OSDictionary.h>
+#include <libkern/c++/OSNumber.h>
+#include <libkern/c++/OSSerialize.h>
+
+OSDefineMetaClassAndStructors(IOFWAsyncCommandPool, OSObject)
+
+#define kCommandPoolDefaultTimeout	(1000*125)	// what initAll gives a new command, 125mSec
+
+static const char * sPoolNames[] =
+{
+	"ReadQuad",
+	"Read",
+	"WriteQuad",
+	"Write"
+};
+
+// create
+//
+//
+
+IOFWAsyncCommandPool * IOFWAsyncCommandPool::create( IOFireWireController * control, UInt32 lowWater, UInt32 highWater )
+{
+    IOFWAsyncCommandPool * me = OSTypeAlloc( IOFWAsyncCommandPool );
+
+    if( me && !me->initWithController( control, lowWater, highWater ) ) 
+	{
+        me->release();
+        return NULL;
+    }
+	
+    return me;
+}
+
+// initWithController
+//
+//
+
+bool IOFWAsyncCommandPool::initWithController( IOFireWireController * control, UInt32 lowWater, UInt32 highWater )
+{
+	if( !OSObject::init() )
+		return false;
+	
+	fControl = control;
+	fHighWater = highWater;
+	fLowWater = (lowWater < highWater) ? lowWater : highWater;
+	
+	fLock = IOLockAlloc();
+	if( fLock == NULL )
+		return false;
+	
+	for( UInt32 index = 0; index < kPoolCount; index++ )
+	{
+		CommandPool * pool = &fPools[index];
+		
+		if( fHighWater == 0 )
+			continue;
+		
+		pool->fIdle = (IOFWAsyncCommand**)IOMalloc( sizeof(IOFWAsyncCommand*) * fHighWater );
+		if( pool->fIdle == NULL )
+			return false;
+		
+		while( pool->fIdleCount < fLowWater )
+		{
+			IOFWAsyncCommand * cmd = createCommand( index );
+			if( cmd == NULL )
+				return false;
+			
+			pool->fIdle[pool->fIdleCount++] = cmd;
+		}
+	}
+	
+	return true;
+}
+
+// free
+//
+//
+
+void IOFWAsyncCommandPool::free( void )
+{
+	for( UInt32 index = 0; index < kPoolCount; index++ )
+	{
+		CommandPool * pool = &fPools[index];
+		
+		while( pool->fIdleCount > 0 )
+		{
+			pool->fIdle[--pool->fIdleCount]->release();
+		}
+		
+		if( pool->fIdle != NULL )
+		{
+			IOFree( pool->fIdle, sizeof(IOFWAsyncCommand*) * fHighWater );
+			pool->fIdle = NULL;
+		}
+	}
+	
+	if( fLock != NULL )
+	{
+		IOLockFree( fLock );
+		fLock = NULL;
+	}
+	
+	OSObject::free();
+}
+
+// poolIndex
+//
+// kPoolCount if the class isn't pooled, subclasses aren't
+
+UInt32 IOFWAsyncCommandPool::poolIndex( const OSMetaClass * type )
+{
+	if( type == OSTypeID(IOFWReadQuadCommand) )
+		return kReadQuadPool;
+	
+	if( type == OSTypeID(IOFWReadCommand) )
+		return kReadPool;
+	
+	if( type == OSTypeID(IOFWWriteQuadCommand) )
+		return kWriteQuadPool;
+	
+	if( type == OSTypeID(IOFWWriteCommand) )
+		return kWritePool;
+	
+	return kPoolCount;
+}
+
+// createCommand
+//
+// an absolute command with nothing to transfer, it is reinit'd before it is used
+
+IOFWAsyncCommand * IOFWAsyncCommandPool::createCommand( UInt32 index )
+{
+	IOFWAsyncCommand * cmd = NULL;
+	bool success = false;
+	
+	switch( index )
+	{
+		case kReadQuadPool:
+		{
+			IOFWReadQuadCommand * read_quad = OSTypeAlloc( IOFWReadQuadCommand );
+			if( read_quad )
+				success = read_quad->initAll( fControl, 0, FWAddress(), NULL, 0, NULL, NULL );
+			cmd = read_quad;
+			break;
+		}
+		
+		case kReadPool:
+		{
+			IOFWReadCommand * read = OSTypeAlloc( IOFWReadCommand );
+			if( read )
+				success = read->initAll( fControl, 0, FWAddress(), NULL, NULL, NULL );
+			cmd = read;
+			break;
+		}
+		
+		case kWriteQuadPool:
+		{
+			IOFWWriteQuadCommand * write_quad = OSTypeAlloc( IOFWWriteQuadCommand );
+			if( write_quad )
+				success = write_quad->initAll( fControl, 0, FWAddress(), NULL, 0, NULL, NULL );
+			cmd = write_quad;
+			break;
+		}
+		
+		case kWritePool:
+		{
+			IOFWWriteCommand * write = OSTypeAlloc( IOFWWriteCommand );
+			if( write )
+				success = write->initAll( fControl, 0, FWAddress(), NULL, NULL, NULL );
+			cmd = write;
+			break;
+		}
+	}
+	
+	if( cmd && !success )
+	{
+		cmd->release();
+		cmd = NULL;
+	}
+	
+	return cmd;
+}
+
+// resetCommand
+//
+// puts back everything a client can change that reinit leaves alone
+
+void IOFWAsyncCommandPool::resetCommand( IOFWAsyncCommand * cmd, UInt32 index )
+{
+	cmd->fDevice = NULL;
+	cmd->fComplete = NULL;
+	cmd->fRefCon = NULL;
+	cmd->fMemDesc = NULL;
+	cmd->fFailOnReset = true;
+	
+	cmd->setTimeout( kCommandPoolDefaultTimeout );
+	cmd->setRetries( kFWCmdDefaultRetries );
+	cmd->setMaxSpeed( kFWSpeedMaximum );
+	cmd->setFastRetryCount( 0 );
+	cmd->setForceBlockRequests( false );
+	cmd->setFlush( true );
+	
+	switch( index )
+	{
+		case kReadQuadPool:
+			((IOFWReadQuadCommand*)cmd)->setPingTime( false );
+			break;
+		
+		case kReadPool:
+			((IOFWReadCommand*)cmd)->setWindowSize( 1 );
+			break;
+		
+		case kWriteQuadPool:
+			((IOFWWriteQuadCommand*)cmd)->setDeferredNotify( false );
+			break;
+		
+		case kWritePool:
+		{
+			IOFWWriteCommand * write = (IOFWWriteCommand*)cmd;
+			write->setDeferredNotify( false );
+			write->setFastRetryOnBusy( false );
+			write->setWindowOrdered( false );
+			write->setWindowSize( 1 );
+			break;
+		}
+	}
+}
+
+// checkoutCommand
+//
+//
+
+IOFWAsyncCommand * IOFWAsyncCommandPool::checkoutCommand( const OSMetaClass * type, IOFireWireNub * device )
+{
+	UInt32 index = poolIndex( type );
+	if( index == kPoolCount )
+		return NULL;
+	
+	CommandPool * pool = &fPools[index];
+	IOFWAsyncCommand * cmd = NULL;
+	
+	IOLockLock( fLock );
+	
+	if( pool->fIdleCount > 0 )
+	{
+		cmd = pool->fIdle[--pool->fIdleCount];
+		pool->fHits++;
+	}
+	else
+	{
+		pool->fMisses++;
+	}
+	
+	IOLockUnlock( fLock );
+	
+	if( cmd )
+	{
+		// reinit takes the node ID and generation from the device when there is one
+		cmd->fDevice = device;
+	}
+	
+	return cmd;
+}
+
+// recycleCommand
+//
+//
+
+void IOFWAsyncCommandPool::recycleCommand( IOFWAsyncCommand * cmd )
+{
+	if( cmd == NULL )
+		return;
+	
+	IOFWAsyncCommandPool * pool = cmd->fControl->getCommandPool();
+	if( pool == NULL )
+	{
+		cmd->release();
+		return;
+	}
+	
+	pool->keepCommand( cmd );
+}
+
+// keepCommand
+//
+//
+
+void IOFWAsyncCommandPool::keepCommand( IOFWAsyncCommand * cmd )
+{
+	UInt32 index = poolIndex( cmd->getMetaClass() );
+	
+	// anyone else holding on to the command may still use it
+	if( index == kPoolCount || 
+		cmd->getRetainCount() != 1 || 
+		cmd->Busy() || 
+		cmd->getStatus() == kIOFireWireCompleting ||
+		cmd->fQueue != NULL )
+	{
+		cmd->release();
+		return;
+	}
+	
+	resetCommand( cmd, index );
+	
+	CommandPool * pool = &fPools[index];
+	bool kept = false;
+	
+	IOLockLock( fLock );
+	
+	if( pool->fIdleCount < fHighWater )
+	{
+		pool->fIdle[pool->fIdleCount++] = cmd;
+		pool->fRecycled++;
+		kept = true;
+	}
+	else
+	{
+		pool->fDiscarded++;
+	}
+	
+	IOLockUnlock( fLock );
+	
+	if( !kept )
+	{
+		cmd->release();
+	}
+}
+
+// serialize
+//
+//
+
+bool IOFWAsyncCommandPool::serialize( OSSerialize * s ) const
+{
+	OSDictionary *	dictionary;
+	bool			ok;
+	
+	dictionary = OSDictionary::withCapacity( kPoolCount + 2 );
+	if( !dictionary )
+		return false;
+	
+	OSNumber * number;
+	
+	number = OSNumber::withNumber( fLowWater, 32 );
+	dictionary->setObject( "LowWater", number );
+	number->release();
+	
+	number = OSNumber::withNumber( fHighWater, 32 );
+	dictionary->setObject( "HighWater", number );
+	number->release();
+	
+	IOLockLock( fLock );
+	
+	for( UInt32 index = 0; index < kPoolCount; index++ )
+	{
+		const CommandPool * pool = &fPools[index];
+		
+		OSDictionary * stats = OSDictionary::withCapacity( 5 );
+		if( !stats )
+			continue;
+		
+		number = OSNumber::withNumber( pool->fIdleCount, 32 );
+		stats->setObject( "Idle", number );
+		number->release();
+		
+		number = OSNumber::withNumber( pool->fHits, 32 );
+		stats->setObject( "Hits", number );
+		number->release();
+		
+		number = OSNumber::withNumber( pool->fMisses, 32 );
+		stats->setObject( "Misses", number );
+		number->release();
+		
+		number = OSNumber::withNumber( pool->fRecycled, 32 );
+		stats->setObject( "Recycled", number );
+		number->release();
+		
+		number = OSNumber::withNumber( pool->fDiscarded, 32 );
+		stats->setObject( "Discarded", number );
+		number->release();
+		
+		dictionary->setObject( sPoolNames[index], stats );
+		stats->release();
+	}
+	
+	IOLockUnlock( fLock );
+	
+	ok = dictionary->serialize( s );
+	dictionary->release();
+	
+	return ok;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 1998-2002 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef __IOFWASYNCCOMMANDPOOL_H__
+#define __IOFWASYNCCOMMANDPOOL_H__
+
+#include <libkern/c++/OSObject.h>
+#include <IOKit/system.h>
+
+#include <IOKit/IOLocks.h>
+
+#include <IOKit/firewire/IOFireWireFamilyCommon.h>
+
+class IOFireWireController;
+class IOFireWireNub;
+class IOFWAsyncCommand;
+
+#define kFWCommandPoolLowWater		4		// idle commands made up front for each class
+#define kFWCommandPoolHighWater		64		// most idle commands kept for each class
+
+/*!
+    @class IOFWAsyncCommandPool
+    @abstract Recycles the controller's read and write commands.
+    @discussion The controller keeps one pool, with a list of idle commands for each of
+	IOFWReadQuadCommand, IOFWReadCommand, IOFWWriteQuadCommand and IOFWWriteCommand.
+	The create routines of the user client and of IOFireWireNub take an idle command of
+	the right class and reinit it before allocating a new one. Commands come back only
+	from callers that know they hold the last reference, and go back to their defaults
+	on the way in. Each class starts with kFWCommandPoolLowWater idle commands, and
+	commands returned while kFWCommandPoolHighWater are idle are freed instead.
+*/
+
+class IOFWAsyncCommandPool : public OSObject
+{
+    OSDeclareDefaultStructors(IOFWAsyncCommandPool)
+
+protected:
+
+	enum
+	{
+		kReadQuadPool,
+		kReadPool,
+		kWriteQuadPool,
+		kWritePool,
+		kPoolCount
+	};
+
+	struct CommandPool
+	{
+		IOFWAsyncCommand **		fIdle;
+		UInt32					fIdleCount;
+		UInt32					fHits;
+		UInt32					fMisses;
+		UInt32					fRecycled;
+		UInt32					fDiscarded;
+	};
+
+	IOFireWireController *	fControl;
+	IOLock *				fLock;
+	CommandPool				fPools[kPoolCount];
+	UInt32					fLowWater;
+	UInt32					fHighWater;
+
+	virtual bool initWithController( IOFireWireController * control, UInt32 lowWater, UInt32 highWater );
+	virtual void free( void );
+
+	static UInt32 poolIndex( const OSMetaClass * type );
+	IOFWAsyncCommand * createCommand( UInt32 index );
+	void resetCommand( IOFWAsyncCommand * cmd, UInt32 index );
+	void keepCommand( IOFWAsyncCommand * cmd );
+
+public:
+
+	/*!
+        @function create
+        @abstract Creates a pool for a controller, with lowWater idle commands of each class.
+        @param control The controller the commands run on. Not retained.
+        @param lowWater Idle commands made for each class up front.
+        @param highWater Most idle commands kept for each class.
+        @result The new pool, or NULL.
+    */
+	
+	static IOFWAsyncCommandPool * create( IOFireWireController * control, 
+										  UInt32 lowWater = kFWCommandPoolLowWater, 
+										  UInt32 highWater = kFWCommandPoolHighWater );
+
+	/*!
+        @function checkoutCommand
+        @abstract Takes an idle command from the pool.
+        @discussion The command still has to be reinit'd by the caller with the reinit
+		that matches device, the one taking a generation when device is NULL.
+        @param type Metaclass of the command wanted.
+        @param device The nub the command is for, or NULL for a command with an absolute address.
+        @result A command of exactly that class, or NULL if there is none idle.
+    */
+	
+	IOFWAsyncCommand * checkoutCommand( const OSMetaClass * type, IOFireWireNub * device );
+
+	/*!
+        @function recycleCommand
+        @abstract Hands a command back to its controller's pool, or releases it.
+        @discussion Takes over the caller's reference. The command is only kept if it is
+		of one of the pooled classes, is not running and nothing else holds a reference to it.
+        @param cmd The command to return, may be NULL.
+    */
+	
+	static void recycleCommand( IOFWAsyncCommand * cmd );
+
+	virtual bool serialize( OSSerialize * s ) const;
+};
+
+#endif
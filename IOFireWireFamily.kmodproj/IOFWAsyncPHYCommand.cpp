@@ -164,6 +164,11 @@ IOReturn IOFWAsyncPHYCommand::complete(IOReturn status)
         fControl->freeTrans( fTrans );
         fTrans = NULL;
     }
+	else
+	{
+		// we may have been handed a label while waiting for one and never used it
+		fControl->releaseReservedTrans( NULL, this );
+	}
 	
     // If we're in the middle of processing a bus reset and
     // the command should be retried after a bus reset, put it on the
@@ -296,7 +301,9 @@ IOReturn IOFWAsyncPHYCommand::execute()
 	else
 	{
 		//IOLog("IOFWAsyncPHYCommand::execute: Out of tLabels?\n");
-        result = kIOFireWireOutOfTLabels;
+		// wait for a label to this node to free up, we are restarted from the pendingQ
+		result = fControl->waitForTrans( this );
+		fStatus = kIOFireWirePending;
 	}
 	
 	// complete could release us so protect fStatus with retain and release
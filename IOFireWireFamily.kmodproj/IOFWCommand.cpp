@@ -349,107 +349,13 @@ void IOFWCommand::updateTimer()
         clock_interval_to_absolutetime_interval(fTimeout, kMicrosecondScale, &delta);
         IOFWGetAbsoluteTime(&fDeadline);
         ADD_ABSOLUTETIME(&fDeadline, &delta);
-        if(fQueue) 
-		{
-            IOFWCommand *oldHead = fQueue->fHead;
-            IOFWCommand *next;
-    
-            // Now move command down list to keep list sorted
-            next = fQueueNext;
-            while(next) 
-			{
-                if(CMP_ABSOLUTETIME(&next->fDeadline, &fDeadline) == 1)
-                    break;	// Next command's deadline still later than new deadline.
-                next = next->fQueueNext;
-            }
-			
-            if(next != fQueueNext) 
-			{
-                // Move this command from where it is to just before 'next'
-                IOFWCommand *prev;
-                
-				if(fQueuePrev) 
-				{
-                    assert(fQueuePrev->fQueueNext == this);
-                    fQueuePrev->fQueueNext = fQueueNext;
-                }
-                else 
-				{
-                    // First in list.
-                    assert(fQueue->fHead == this);
-                    fQueue->fHead = fQueueNext;
-                }
-                
-				assert(fQueueNext);	// Can't be last already!
-                assert(fQueueNext->fQueuePrev == this);
-                fQueueNext->fQueuePrev = fQueuePrev;
-    
-                if(!next) 
-				{
-                    prev = fQueue->fTail;
-                    fQueue->fTail = this;
-                }
-                else 
-				{
-                    prev = next->fQueuePrev;
-                    next->fQueuePrev = this;
-                }
-    
-                assert(prev);	// Must be a command to go after
-                prev->fQueueNext = this;
-                fQueuePrev = prev;
-                fQueueNext = next;
-            }
-			
-            // if the command was at the head, then either:
-            // 1) it still is, but with a new, later, deadline
-            // 2) it isn't, another command now is.
-            // Either way, need to update the clock timeout.
-            if(oldHead == this) {
-                fQueue->headChanged(this);
-            }
-        }
-        else 
+        
+		// a command parked on one of the controller's other queues keeps its place there,
+		// otherwise it is filed on the timeout wheel under its new deadline
+		IOFireWireController::timeoutQ &timeoutQ = fControl->fTimeoutQ;
+		if( fQueue == NULL || timeoutQ.contains( fQueue ) ) 
 		{
-            // Not already on timeout queue
-            IOFWCommand *prev;
-            IOFWCmdQ &timeoutQ = fControl->getTimeoutQ();
-            // add cmd to right place in list, which is sorted by deadline
-            prev = timeoutQ.fTail;
-            while(prev) 
-			{
-                if(CMP_ABSOLUTETIME(&prev->getDeadline(), &fDeadline) != 1)
-                    break; // prev command's deadline is before new one, so insert here.
-                prev = prev->getPrevious();
-            }
-    
-            if(!prev) 
-			{
-                setHead(timeoutQ);
-            }
-            else 
-			{
-                insertAfter(*prev);
-                /** DUMP Q **/
-#if 0
-                {
-                    AbsoluteTime now, dead;
-                    IOFWGetAbsoluteTime(&now);
-                    IOLog("%s: insertAfter %s, time is %llx\n",
-                        getMetaClass()->getClassName(), prev->getMetaClass()->getClassName(), AbsoluteTime_to_scalar(&now) );
-                    {
-                        IOFWCommand *t = timeoutQ.fHead;
-                        while(t) 
-						{
-                            AbsoluteTime d = t->getDeadline();
-                            IOLog("%s:%p deadline %llx\n",
-                                t->getMetaClass()->getClassName(), t, AbsoluteTime_to_scalar(&d) );
-                            t = t->getNext();
-                        }
-                    }
-                }
-#endif
-            }
-        }
+			timeoutQ.add( this );
+		}
     }
 }
@@ -39,6 +39,8 @@
 #define kFWCmdReducedRetries 2
 #define kFWCmdIncreasedRetries 6
 
+#define kFWCmdMaxWindowPackets 32
+
 class IOMemoryDescriptor;
 class IOSyncer;
 class IOFireWireBus;
@@ -195,6 +197,8 @@ public:
     
     void setTimeout( UInt32 timeout )
         { fTimeout = timeout; };
+    UInt32 getTimeout() const
+        { return fTimeout; };
         
     friend class IOFWCmdQ;
 
@@ -357,6 +361,9 @@ protected:
                                 FWDeviceCallback completion, void *refcon);
 	bool createMemberVariables( void );
 	void destroyMemberVariables( void );
+	
+	friend class IOFWAsyncCommandPool;
+	
 public:
 	// Utility for setting generation on newly created command
 	virtual void	setGeneration(UInt32 generation)
@@ -400,6 +407,10 @@ public:
         return kIOReturnSuccess;
     }
 
+    // smaller than the size passed to setMaxPacket if the device rejected block requests
+    UInt32 getMaxPacket( void ) const
+    { return fMaxPack; }
+
 	void setMaxSpeed( int speed );
 	
 	void setAckCode( int ack );
@@ -448,11 +459,43 @@ class IOFWReadCommand : public IOFWAsyncCommand
 
 protected:
 	
+	typedef struct 
+	{ 
+		UInt32				fWindowSize;		// max packets in flight, <= 1 is stop and wait
+		IOFWReadCommand **	fWindowCmds;		// one single packet command per window slot
+		IOByteCount *		fWindowOffsets;		// fMemDesc offset each slot is reading
+		UInt32				fWindowCmdCount;
+		UInt32				fInFlight;
+		IOByteCount			fStartOffset;		// fBytesTransferred when the window was opened
+		IOByteCount			fNextOffset;		// next byte to request
+		IOByteCount			fEndOffset;
+		IOByteCount			fErrorOffset;		// lowest byte not known to have arrived
+		UInt32				fStartAddressLo;
+		IOReturn			fWindowStatus;
+		bool				fWindowActive;
+		bool				fFilling;
+	}
+	MemberVariables;
+	
+	bool createMemberVariables( void );
+	void destroyMemberVariables( void );
+	virtual void free( void );
+	
     virtual void 	gotPacket(int rcode, const void* data, int size);
 
     virtual IOReturn	execute();
+    virtual IOReturn	complete( IOReturn status );
+
+	bool createWindowCommands( void );
+	void destroyWindowCommands( void );
+	IOReturn executeWindow( void );
+	void fillWindow( void );
+	void finishWindow( void );
+	void windowPacketComplete( IOFWReadCommand * cmd, IOReturn status );
+	static void windowPacketCompletion( void * refcon, IOReturn status, IOFireWireNub * device, IOFWCommand * fwCmd );
 
 public:
+	virtual bool	initWithController( IOFireWireController * control );
     virtual bool	initAll(IOFireWireNub *device, FWAddress devAddress,
 				IOMemoryDescriptor *hostMem,
 				FWDeviceCallback completion, void *refcon, bool failOnReset);
@@ -466,6 +509,19 @@ public:
     virtual IOReturn	reinit(UInt32 generation, FWAddress devAddress, IOMemoryDescriptor *hostMem,
                                 FWDeviceCallback completion=NULL, void *refcon=NULL);
 
+    /*!
+        @function setWindowSize
+        Sets the number of block read packets the command keeps outstanding at once.
+        Each packet uses its own transaction label, and responses may complete in any order.
+        The default of 1 issues one packet per round trip. Reads from the local node are
+        always stop and wait. Call this method before calling submit().
+        @param packets Number of packets in flight, clipped to kFWCmdMaxWindowPackets.
+    */
+	IOReturn setWindowSize( UInt32 packets );
+	
+	UInt32 getWindowSize( void ) const
+		{ return ((MemberVariables*)fMembers->fSubclassMembers)->fWindowSize; };
+
 private:
     OSMetaClassDeclareReservedUnused(IOFWReadCommand, 0);
     OSMetaClassDeclareReservedUnused(IOFWReadCommand, 1);
@@ -541,18 +597,44 @@ protected:
 	
 	typedef struct 
 	{ 
-		bool 	fDeferredNotify;
-		bool	fFastRetryOnBusy;
+		bool 					fDeferredNotify;
+		bool					fFastRetryOnBusy;
+		bool					fWindowOrdered;		// stop and wait once a packet is busied, abort later packets on error
+		bool					fWindowSerial;		// an ordered window saw a busy, one packet at a time from here on
+		bool					fWindowActive;
+		bool					fFilling;
+		UInt32					fWindowSize;		// max packets in flight, <= 1 is stop and wait
+		IOFWWriteCommand **		fWindowCmds;		// one single packet command per window slot
+		IOByteCount *			fWindowOffsets;		// fMemDesc offset each slot is writing
+		UInt32					fWindowCmdCount;
+		UInt32					fInFlight;
+		IOByteCount				fStartOffset;		// fBytesTransferred when the window was opened
+		IOByteCount				fNextOffset;		// next byte to send
+		IOByteCount				fEndOffset;
+		IOByteCount				fErrorOffset;		// lowest byte not known to be committed
+		IOByteCount				fCommitted;			// bytes acked or responded complete, in any order
+		UInt32					fStartAddressLo;
+		IOReturn				fWindowStatus;
 	}
 	MemberVariables;
 		
     virtual IOReturn	execute();
+    virtual IOReturn	complete( IOReturn status );
 
     virtual void 	gotPacket( int rcode, const void* data, int size );
 
 	bool createMemberVariables( void );
 	void destroyMemberVariables( void );
 	
+	bool createWindowCommands( void );
+	void destroyWindowCommands( void );
+	IOReturn executeWindow( void );
+	void fillWindow( void );
+	void finishWindow( void );
+	void settleWindow( void );
+	void windowPacketComplete( IOFWWriteCommand * cmd, IOReturn status );
+	static void windowPacketCompletion( void * refcon, IOReturn status, IOFireWireNub * device, IOFWCommand * fwCmd );
+	
 public:
 
 	virtual bool	initWithController(IOFireWireController *control);
@@ -589,6 +671,39 @@ public:
 	void setFastRetryOnBusy( bool state ) 
 		{ ((MemberVariables*)fMembers->fSubclassMembers)->fFastRetryOnBusy = state; };
 	
+    /*!
+        @function setWindowSize
+        Sets the number of block write packets the command keeps outstanding at once.
+        Each packet uses its own transaction label. The default of 1 issues one packet
+        per round trip. Writes to the local node are always stop and wait.
+        Call this method before calling submit().
+        @param packets Number of packets in flight, clipped to kFWCmdMaxWindowPackets.
+    */
+	IOReturn setWindowSize( UInt32 packets );
+
+	UInt32 getWindowSize( void ) const
+		{ return ((MemberVariables*)fMembers->fSubclassMembers)->fWindowSize; };
+	
+    /*!
+        @function setWindowOrdered
+        Limits reordering for targets that want writes in address order. Once any packet
+        is acked busy the command falls back to one packet at a time for the rest of the
+        execution, and after a failure the packets behind it are aborted instead of being
+        allowed to finish. Packets already in flight when the first busy is seen can still
+        land ahead of the busied one. Targets that must never see writes out of order
+        need a window size of 1.
+    */
+	void setWindowOrdered( bool state ) 
+		{ ((MemberVariables*)fMembers->fSubclassMembers)->fWindowOrdered = state; };
+	
+    /*!
+        @function getBytesCommitted
+        Number of bytes the target acknowledged, counted across every packet of the
+        last execution. After a windowed write fails this can exceed getBytesTransferred(),
+        which only counts the contiguous prefix from the start of the buffer.
+    */
+	IOByteCount getBytesCommitted( void ) const;
+	
 private:
 
     OSMetaClassDeclareReservedUnused(IOFWWriteCommand, 0);
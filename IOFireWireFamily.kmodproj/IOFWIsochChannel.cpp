@@ -923,265 +923,112 @@ IOReturn IOFWIsochChannel::allocateChannelBegin( 	IOFWSpeed		inSpeed,
     return status;
 }
 
-// ChannelThreadInfo
-//
-// A little struct for keeping track of our this pointer and generation
-// when transitioning to a second thread during bandwidth reallocation.
-
-struct ChannelThreadInfo
-{
-    IOFWIsochChannel *		fChannel;
-    UInt32 					fGeneration;
-};
-
 // handleBusReset
 //
-//
+// the controller restores every queued channel and IRM allocation together once
+// startBusScan has told them all about the reset, see reallocIsochResources
 
 void IOFWIsochChannel::handleBusReset()
 {
-	//
-	// setup thread info and spawn a thread
-	//
-	
-	ChannelThreadInfo * threadInfo = (ChannelThreadInfo *)IOMalloc( sizeof(ChannelThreadInfo) );
-	if( threadInfo ) 
-	{
-		threadInfo->fGeneration = fControl->getGeneration();
-		threadInfo->fChannel = this;
-		retain();	// retain ourself for the thread to use
-		
-		thread_t		thread;
-		if( kernel_thread_start((thread_continue_t)threadFunc, threadInfo, &thread ) == KERN_SUCCESS )
-		{
-			thread_deallocate(thread);
-		}
-	}
+	fControl->queueIsochRealloc( this );
 }
 
-// threadFunc
-//
+// reallocBandwidth
 //
+// cannot be called on the workloop
 
-void IOFWIsochChannel::threadFunc( void * arg )
+void IOFWIsochChannel::reallocBandwidth( UInt32 generation )
 {
-	//
-	// extract info from thread info
-	//
+	UInt64 channels;
+	UInt32 bandwidth;
 	
-    ChannelThreadInfo * threadInfo = (ChannelThreadInfo *)arg;
-    IOFWIsochChannel * 	channel = threadInfo->fChannel;
-	UInt32 				generation = threadInfo->fGeneration;
+	if( !beginRealloc( generation, &channels, &bandwidth ) )
+		return;
 	
-	//
-	// realloc bandwidth
-	//
+	// the controller gives back whatever it got if it can't get all of it
+	IOReturn result = fControl->allocateIRMResourcesInGeneration( channels, bandwidth, generation );
 	
-	channel->reallocBandwidth( generation );	
-	
-	//
-	// clean up thread info
-	//
-	
-	IOFree( threadInfo, sizeof(threadInfo) );
-    channel->release();		// retain occurred in handleBusReset
+	if( endRealloc( generation, result ) )
+	{
+		reallocFailed();
+	}
 }
 
-// reallocBandwidth
+// beginRealloc
 //
-// cannot be called on the workloop
+// takes the lock and reports what this channel held before the reset. returns false, 
+// unlocked, if the channel was already reallocated in this generation.
 
-void IOFWIsochChannel::reallocBandwidth( UInt32 generation )
+bool IOFWIsochChannel::beginRealloc( UInt32 generation, UInt64 * channels, UInt32 * bandwidth )
 {
-	IOReturn result = kIOReturnSuccess;
-
-    FWAddress addr( kCSRRegisterSpaceBaseAddressHi, kCSRBandwidthAvailable );
-		
 	IOLockLock( fLock );
 
-	InfoLog( "IOFWIsochChannel<%p>::reallocBandwidth() - bandwidth %ld, channel = %ld\n", this, fBandwidth, fChannel );
-	
-	if( result == kIOReturnSuccess )
-	{
-		UInt32 current_generation;
-		UInt16 irm;
-		fControl->getIRMNodeID( current_generation, irm );
-		addr.nodeID = irm;
-		if( current_generation != generation )
-		{
-			result = kIOFireWireBusReset;
-		}
-
-//		FWKLOG(( "IOFWIsochChannel::reallocBandwidth - realloc generation %d, current generation = %d\n", generation, current_generation ));
-	}
+	InfoLog( "IOFWIsochChannel<%p>::beginRealloc() - bandwidth %ld, channel = %ld\n", this, fBandwidth, fChannel );
 	
-	if( result == kIOReturnSuccess )
+	// check to make sure we don't allocate twice on a generation
+	if( fGeneration == generation )
 	{
-		// check to make sure we don't allocate twice on a generation
-		
-		if( fGeneration == generation )
-		{
-			result = kIOReturnError;
-		}
+		IOLockUnlock( fLock );
+		return false;
 	}
 	
-	//
-	// reallocate bandwidth
-	//
+	*channels = (fChannel < 64) ? (1ULL << fChannel) : 0;
+	*bandwidth = fBandwidth;
 	
-	if( fBandwidth != 0 ) 
-	{
-		UInt32 oldVal = 0;
-		
-		//
-		// read the bandwidth available register
-		//
-		
-		if( result == kIOReturnSuccess ) 
-		{
-            fReadCmd->reinit( generation, addr, &oldVal, 1 );
-            result = fReadCmd->submit();
-		}
+	return true;
+}
 
-		//
-		// compare swap loop
-		//
-		
-		bool done = false;
-		while( (result == kIOReturnSuccess) && !done )
-		{
-			UInt32 newVal = 0;
-			UInt32 old_bandwidth = OSSwapBigToHostInt32( oldVal );
-			
-			// make sure there's space
-			if( old_bandwidth < fBandwidth ) 
-			{
-				result = kIOReturnNoSpace;
-			}
-			
-			if( result == kIOReturnSuccess )
-			{
-				newVal = OSSwapHostToBigInt32(old_bandwidth - fBandwidth);
-		
-				fLockCmd->reinit( generation, addr, &oldVal, &newVal, 1 );
-				result = fLockCmd->submit();
-			}
-			
-			if( result == kIOReturnSuccess )
-			{
-				done = fLockCmd->locked(&oldVal);
-			}
-		} 
-		
-		if( result == kIOReturnNoSpace ) 
-		{
-			DebugLog( "IOFWIsochChannel<%p>::reallocBandwidth() - failed to reallocate bandwidth = %d, channel = %d\n", this, (uint32_t)fBandwidth, (uint32_t)fChannel );
-			
-			// Couldn't reallocate bandwidth!
-			fBandwidth = 0;
-			fChannel = 64;	// this will keep us from reallocating the channel
-		}
-		else
-		{
-			InfoLog( "IOFWIsochChannel<%p>::reallocBandwidth() - reallocated bandwidth = %ld\n", this, fBandwidth );
-		}
-	}
+// endRealloc
+//
+// records the outcome and drops the lock taken by beginRealloc. returns true if the 
+// channel lost its resources and reallocFailed should be called.
 
-	//
-	// reallocate channel
-	//
+bool IOFWIsochChannel::endRealloc( UInt32 generation, IOReturn status )
+{
+	bool lost = (status != kIOReturnSuccess) && (status != kIOFireWireBusReset);
 	
-	if( fChannel != 64 ) 
+	if( lost )
 	{
-		UInt32 	mask = 0;
-		UInt32	oldVal = 0;
-        
-		//
-		// read the channels available register
-		//
-		
-		if( result == kIOReturnSuccess )
-		{
-			if( fChannel <= 31 ) 
-			{
-                addr.addressLo = kCSRChannelsAvailable31_0;
-                mask = 1 << (31-fChannel);
-            }
-            else 
-			{
-                addr.addressLo = kCSRChannelsAvailable63_32;
-                mask = 1 << (63-fChannel);
-            }
-            
-			fReadCmd->reinit( generation, addr, &oldVal, 1 );
-            result = fReadCmd->submit();
-		}
-		
-		//
-		// compare swap loop
-		//
-		
-		bool done = false;
-		while( (result == kIOReturnSuccess) && !done )
-		{
-			UInt32 old_channels_avail = OSSwapBigToHostInt32( oldVal );
-			UInt32 newVal = OSSwapHostToBigInt32( old_channels_avail & ~mask );
-			if( newVal == oldVal ) 
-			{
-				// Channel already allocated!
-				result = kIOFireWireChannelNotAvailable ;
-			}
-		
-			if( result == kIOReturnSuccess )
-			{
-				fLockCmd->reinit( generation, addr, &oldVal, &newVal, 1 );
-                result = fLockCmd->submit();
-			}
-			
-			if( result == kIOReturnSuccess )
-			{
-				done = fLockCmd->locked( &oldVal );
-			}
-		}
+		DebugLog( "IOFWIsochChannel<%p>::endRealloc() - failed to reallocate bandwidth = %d, channel = %d\n", this, (uint32_t)fBandwidth, (uint32_t)fChannel );
 		
-		if( result == kIOFireWireChannelNotAvailable )
-		{
-			DebugLog( "IOFWIsochChannel<%p>::reallocBandwidth() - failed to reallocate channel = %d\n", this, (uint32_t)fChannel );
-
-			// Couldn't reallocate the channel
-			fChannel = 64;
-			// fBandwidth will be set to 0 once it is released in the call to releaseChannel below
-		}
-		else
-		{
-			InfoLog( "IOFWIsochChannel<%p>::reallocBandwidth() - reallocated channel = %ld\n", this, fChannel );
-		}
+		// the controller has already given back anything it managed to reallocate,
+		// this keeps releaseChannel() from releasing it again
+		fBandwidth = 0;
+		fChannel = 64;
+	}
+	else if( status == kIOReturnSuccess )
+	{
+		InfoLog( "IOFWIsochChannel<%p>::endRealloc() - reallocated bandwidth = %ld, channel = %ld\n", this, fBandwidth, fChannel );
 	}
 
 	fGeneration = generation;
 
-	FWTrace( kFWTIsoch, kTPIsochReallocBandwidth, (uintptr_t)(fControl->getLink()), fChannel, fBandwidth, result );
-	DebugLogCond( result, "IOFWIsochChannel<%p>::reallocBandwidth() - exited with result = 0x%x\n", this, result );
+	FWTrace( kFWTIsoch, kTPIsochReallocBandwidth, (uintptr_t)(fControl->getLink()), fChannel, fBandwidth, status );
+	DebugLogCond( status, "IOFWIsochChannel<%p>::endRealloc() - exited with result = 0x%x\n", this, status );
 
 	IOLockUnlock( fLock );
-    
-	if( result == kIOReturnNoSpace || result == kIOFireWireChannelNotAvailable ) 
-	{
-        // Couldn't reallocate bandwidth or channel
-		
-		stop();
-        
-		// fChannel and fBandwidth have been left in such a way that releaseChannel() 
-		// will know to release both, one, or none
-		
-		releaseChannel();
-		
-		if ( fStopProc )
-		{
-			(*fStopProc)( fStopRefCon, this, kIOFireWireChannelNotAvailable );
-		}
-    }
 	
+	return lost;
+}
+
+// reallocFailed
+//
+// stops a channel that couldn't get its bandwidth or channel back after a reset.
+// called without the lock held.
+
+void IOFWIsochChannel::reallocFailed( void )
+{
+	stop();
+	
+	// fChannel and fBandwidth have been left in such a way that releaseChannel() 
+	// will know there is nothing left to release
+	
+	releaseChannel();
+	
+	if ( fStopProc )
+	{
+		(*fStopProc)( fStopRefCon, this, kIOFireWireChannelNotAvailable );
+	}
 }
 
 // releaseChannel
@@ -84,8 +84,6 @@ protected:
     Reserved for future use.  (Internal use only)  */
     ExpansionData *reserved;
 
-    static void					threadFunc( void * arg );
-    
     virtual IOReturn			updateBandwidth(bool claim);
     virtual void				reallocBandwidth( UInt32 generation );	
     virtual void				free();
@@ -97,6 +95,12 @@ public:
 										void *stopRefCon );
     virtual void 				handleBusReset();
 
+    // Called from IOFireWireController's reallocation pass, not on the workloop.
+    // beginRealloc returns with the channel locked when it has anything to restore.
+    bool						beginRealloc( UInt32 generation, UInt64 * channels, UInt32 * bandwidth );
+    bool						endRealloc( UInt32 generation, IOReturn status );
+    void						reallocFailed( void );
+
     // Called by clients
     virtual IOReturn 			setTalker(IOFWIsochPort *talker);
     virtual IOReturn 			addListener(IOFWIsochPort *listener);
@@ -175,6 +175,22 @@ bool IOFWPseudoAddressSpaceAux::intersects( IOFWAddressSpace * space )
 	return intersects;
 }
 
+// getAddressRange
+//
+//
+
+bool IOFWPseudoAddressSpaceAux::getAddressRange( FWAddress * base, UInt32 * length )
+{
+	IOFWPseudoAddressSpace * pseudo_space = OSDynamicCast( IOFWPseudoAddressSpace, fPrimary );
+	if( pseudo_space == NULL )
+		return false;
+	
+	*base = pseudo_space->fBase;
+	*length = pseudo_space->fLen;
+	
+	return true;
+}
+
 #pragma mark -
 	
 /*
@@ -477,6 +493,8 @@ IOFWAddressSpaceAux * IOFWPseudoAddressSpace::createAuxiliary( void )
 
 void IOFWPseudoAddressSpace::free()
 {
+	releaseLockMap();
+	
     if(fDesc)
 		fDesc->release();
     
@@ -536,6 +554,234 @@ UInt32 IOFWPseudoAddressSpace::doWrite(UInt16 nodeID, IOFWSpeed &speed, FWAddres
     return fWriter(fRefCon, nodeID, speed, addr, len, buf, refcon);
 }
 
+// doLock
+//
+//
+
+UInt32 IOFWPseudoAddressSpace::doLock( UInt16 nodeID, IOFWSpeed &speed, FWAddress addr, UInt32 inLen,
+									   const UInt32 *newVal, UInt32 &outLen, UInt32 *oldVal, UInt32 type,
+									   IOFWRequestRefCon refcon )
+{
+	// reads and writes go straight to the backing store, so can locks
+	if( fDesc != NULL && fReader == &simpleReader && fWriter == &simpleWriter )
+		return lockBackingStore( nodeID, addr, inLen, newVal, outLen, oldVal, type );
+	
+	return IOFWAddressSpace::doLock( nodeID, speed, addr, inLen, newVal, outLen, oldVal, type, refcon );
+}
+
+// lockValue32
+//
+// applies an extended lock to bus order operands, returns false if the old value is to stay
+
+static bool lockValue32( UInt32 type, UInt32 old, UInt32 arg, UInt32 data, UInt32 * result )
+{
+	switch( type )
+	{
+		case kFWExtendedTCodeMaskSwap:
+			*result = data | (old & ~arg);
+			return true;
+		
+		case kFWExtendedTCodeCompareSwap:
+			*result = data;
+			return (old == arg);
+		
+		case kFWExtendedTCodeFetchAdd:
+			*result = OSSwapHostToBigInt32( OSSwapBigToHostInt32( old ) + OSSwapBigToHostInt32( data ) );
+			return true;
+		
+		case kFWExtendedTCodeLittleAdd:
+			*result = OSSwapHostToLittleInt32( OSSwapLittleToHostInt32( old ) + OSSwapLittleToHostInt32( data ) );
+			return true;
+		
+		case kFWExtendedTCodeBoundedAdd:
+			*result = OSSwapHostToBigInt32( OSSwapBigToHostInt32( old ) + OSSwapBigToHostInt32( data ) );
+			return (old != arg);
+		
+		case kFWExtendedTCodeWrapAdd:
+			if( old != arg )
+				*result = OSSwapHostToBigInt32( OSSwapBigToHostInt32( old ) + OSSwapBigToHostInt32( data ) );
+			else
+				*result = data;
+			return true;
+	}
+	
+	return false;
+}
+
+// lockValue64
+//
+// 64 bit flavor of lockValue32
+
+static bool lockValue64( UInt32 type, UInt64 old, UInt64 arg, UInt64 data, UInt64 * result )
+{
+	switch( type )
+	{
+		case kFWExtendedTCodeMaskSwap:
+			*result = data | (old & ~arg);
+			return true;
+		
+		case kFWExtendedTCodeCompareSwap:
+			*result = data;
+			return (old == arg);
+		
+		case kFWExtendedTCodeFetchAdd:
+			*result = OSSwapHostToBigInt64( OSSwapBigToHostInt64( old ) + OSSwapBigToHostInt64( data ) );
+			return true;
+		
+		case kFWExtendedTCodeLittleAdd:
+			*result = OSSwapHostToLittleInt64( OSSwapLittleToHostInt64( old ) + OSSwapLittleToHostInt64( data ) );
+			return true;
+		
+		case kFWExtendedTCodeBoundedAdd:
+			*result = OSSwapHostToBigInt64( OSSwapBigToHostInt64( old ) + OSSwapBigToHostInt64( data ) );
+			return (old != arg);
+		
+		case kFWExtendedTCodeWrapAdd:
+			if( old != arg )
+				*result = OSSwapHostToBigInt64( OSSwapBigToHostInt64( old ) + OSSwapBigToHostInt64( data ) );
+			else
+				*result = data;
+			return true;
+	}
+	
+	return false;
+}
+
+// lockBackingStore
+//
+// the operands are arg_value then data_value for mask_swap, compare_swap, bounded_add and
+// wrap_add, and data_value alone for fetch_add and little_add. the store is made with a
+// compare and swap on a kernel mapping of the backing store, so it is atomic against the
+// owner of the memory too. if the operand is not naturally aligned in that mapping the
+// workloop gate is all that serializes it.
+
+UInt32 IOFWPseudoAddressSpace::lockBackingStore( UInt16 nodeID, FWAddress addr, UInt32 inLen,
+												 const UInt32 *newVal, UInt32 &outLen, UInt32 *oldVal, UInt32 type )
+{
+	IOFWPseudoAddressSpaceAux * aux = (IOFWPseudoAddressSpaceAux*)fIOFWAddressSpaceExpansion->fAuxiliary;
+	UInt32 size;
+	UInt32 argLen;
+	
+	if( !isTrustedNode( nodeID ) )
+		return kFWResponseAddressError;
+	
+	switch( type )
+	{
+		case kFWExtendedTCodeMaskSwap:
+		case kFWExtendedTCodeCompareSwap:
+		case kFWExtendedTCodeBoundedAdd:
+		case kFWExtendedTCodeWrapAdd:
+			size = inLen / 2;
+			argLen = size;
+			break;
+		
+		case kFWExtendedTCodeFetchAdd:
+		case kFWExtendedTCodeLittleAdd:
+			size = inLen;
+			argLen = 0;
+			break;
+		
+		default:
+			return kFWResponseTypeError;
+	}
+	
+	if( size != 4 && size != 8 )
+		return kFWResponseTypeError;
+	
+	if( addr.addressHi != fBase.addressHi || addr.addressLo < fBase.addressLo || addr.addressLo + size > fBase.addressLo + fLen )
+		return kFWResponseAddressError;
+	
+	IOByteCount offset = addr.addressLo - fBase.addressLo;
+	
+	if( aux->fMembers->fLockMap == NULL )
+		aux->fMembers->fLockMap = fDesc->map();
+	
+	volatile void * target = NULL;
+	if( aux->fMembers->fLockMap != NULL )
+	{
+		IOVirtualAddress address = aux->fMembers->fLockMap->getVirtualAddress() + offset;
+		if( (address & (size - 1)) == 0 )
+			target = (volatile void *)address;
+	}
+	
+	if( size == 4 )
+	{
+		UInt32 old;
+		UInt32 arg = argLen ? newVal[0] : 0;
+		UInt32 data = newVal[argLen / 4];
+		UInt32 result;
+		
+		if( target != NULL )
+		{
+			do
+			{
+				old = *(volatile UInt32 *)target;
+				if( !lockValue32( type, old, arg, data, &result ) )
+					break;
+			} while( !OSCompareAndSwap( old, result, (volatile UInt32 *)target ) );
+		}
+		else
+		{
+			fDesc->readBytes( offset, &old, size );
+			if( lockValue32( type, old, arg, data, &result ) )
+				fDesc->writeBytes( offset, &result, size );
+		}
+		
+		bcopy( &old, oldVal, size );
+	}
+	else
+	{
+		UInt64 old;
+		UInt64 arg = 0;
+		UInt64 data;
+		UInt64 result;
+		
+		if( argLen )
+			bcopy( newVal, &arg, size );
+		bcopy( newVal + (argLen / 4), &data, size );
+		
+		if( target != NULL )
+		{
+			do
+			{
+				old = *(volatile UInt64 *)target;
+				if( !lockValue64( type, old, arg, data, &result ) )
+					break;
+			} while( !OSCompareAndSwap64( old, result, (volatile UInt64 *)target ) );
+		}
+		else
+		{
+			fDesc->readBytes( offset, &old, size );
+			if( lockValue64( type, old, arg, data, &result ) )
+				fDesc->writeBytes( offset, &result, size );
+		}
+		
+		bcopy( &old, oldVal, size );
+	}
+	
+	outLen = size;
+	
+	return kFWResponseComplete;
+}
+
+// releaseLockMap
+//
+//
+
+void IOFWPseudoAddressSpace::releaseLockMap( void )
+{
+	IOFWPseudoAddressSpaceAux * aux = NULL;
+	
+	if( fIOFWAddressSpaceExpansion != NULL )
+		aux = (IOFWPseudoAddressSpaceAux*)fIOFWAddressSpaceExpansion->fAuxiliary;
+	
+	if( aux != NULL && aux->fMembers != NULL && aux->fMembers->fLockMap != NULL )
+	{
+		aux->fMembers->fLockMap->release();
+		aux->fMembers->fLockMap = NULL;
+	}
+}
+
 // contains
 //
 //
@@ -68,6 +68,7 @@ protected:
 	{ 		
 		IOFWARxReqIntCompleteHandler		fARxReqIntCompleteHandler;
 		void *	  							fARxReqIntCompleteHandlerRefcon;	
+		IOMemoryMap *						fLockMap;		// kernel mapping of the backing store, made on the first lock
 	};
 	  
     MemberVariables * fMembers;
@@ -95,6 +96,8 @@ public:
 	virtual void setARxReqIntCompleteHandler( void * refcon, IOFWARxReqIntCompleteHandler handler );
 
 	virtual bool intersects( IOFWAddressSpace * space );
+
+	virtual bool getAddressRange( FWAddress * base, UInt32 * length );
 	
 private:
 
@@ -327,6 +330,30 @@ public:
 											const void*				buf,
                                             IOFWRequestRefCon		reqrefcon);
 
+/*!	@function	doLock
+	@abstract	A method for processing a lock request. Spaces answering reads and writes
+				from their backing store carry out every extended lock on it atomically.
+	@param		nodeID	FireWire Lock request for nodeID.
+	@param		speed	at this 'speed'.
+	@param		addr	with FireWire address 'addr'.
+	@param		inLen	'inLen' bytes to use.
+	@param		newVal	operands from the lock request.
+	@param		outLen	'outLen' bytes for result.
+	@param		oldVal	old value read from 'addr' location.
+	@param		type	Type like kFWExtendedTCodeCompareSwap.
+	@param		refcon  Can be queried for extra info about the request.
+	@result		UIn32	returns kFWResponseComplete on success */
+    virtual UInt32 					doLock(
+											UInt16 					nodeID,
+											IOFWSpeed &				speed,
+											FWAddress 				addr,
+											UInt32 					inLen,
+											const UInt32 *			newVal,
+											UInt32 &				outLen,
+											UInt32 *				oldVal,
+											UInt32 					type,
+											IOFWRequestRefCon		refcon);
+
 /*!	@function	contains
 	@abstract	returns number of bytes starting at addr in this space
 	@result		0 if it doesn't contain the address
@@ -346,6 +373,19 @@ protected:
 	
 	virtual IOFWAddressSpaceAux * createAuxiliary( void );
 
+	// carry out a lock on the backing store, the response goes out without a trip to the client
+	UInt32							lockBackingStore(
+											UInt16 					nodeID,
+											FWAddress 				addr,
+											UInt32 					inLen,
+											const UInt32 *			newVal,
+											UInt32 &				outLen,
+											UInt32 *				oldVal,
+											UInt32 					type);
+
+	// drop the kernel mapping locks use, before the backing store goes away
+	void							releaseLockMap( void );
+
 protected:
 	inline void handleARxReqIntComplete( void )
 		{ ((IOFWPseudoAddressSpaceAux*)fIOFWAddressSpaceExpansion->fAuxiliary)->handleARxReqIntComplete(); }
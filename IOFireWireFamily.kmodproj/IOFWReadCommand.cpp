@@ -77,6 +77,26 @@ void IOFWReadCommand::gotPacket(int rcode, const void* data, int size)
     }
 }
 
+// initWithController
+//
+//
+
+bool IOFWReadCommand::initWithController(IOFireWireController *control)
+{
+	bool success = true;
+	
+    success = IOFWAsyncCommand::initWithController(control);
+						  
+	// create member variables
+	
+	if( success )
+	{
+		success = createMemberVariables();
+	}
+	
+	return success;
+}
+
 // initAll
 //
 //
@@ -85,8 +105,19 @@ bool IOFWReadCommand::initAll(IOFireWireNub *device, FWAddress devAddress,
 	IOMemoryDescriptor *hostMem, FWDeviceCallback completion,
 	void *refcon, bool failOnReset)
 {
-    return IOFWAsyncCommand::initAll(device, devAddress,
+	bool success = true;
+	
+    success = IOFWAsyncCommand::initAll(device, devAddress,
                           hostMem, completion, refcon, failOnReset);
+						  
+	// create member variables
+	
+	if( success )
+	{
+		success = createMemberVariables();
+	}
+	
+	return success;
 }
 
 // initAll
@@ -98,8 +129,89 @@ bool IOFWReadCommand::initAll(IOFireWireController *control,
         IOMemoryDescriptor *hostMem, FWDeviceCallback completion,
         void *refcon)
 {
-    return IOFWAsyncCommand::initAll(control, generation, devAddress,
+	bool success = true;
+	
+    success = IOFWAsyncCommand::initAll(control, generation, devAddress,
                           hostMem, completion, refcon);
+						  
+	// create member variables
+	
+	if( success )
+	{
+		success = createMemberVariables();
+	}
+	
+	return success;
+}
+
+// createMemberVariables
+//
+//
+
+bool IOFWReadCommand::createMemberVariables( void )
+{
+	bool success = true;
+	
+	if( fMembers == NULL )
+	{
+		success = IOFWAsyncCommand::createMemberVariables();
+	}
+	
+	if( fMembers && fMembers->fSubclassMembers == NULL )
+	{
+		if( success )
+		{
+			fMembers->fSubclassMembers = IOMalloc( sizeof(MemberVariables) );
+			if( fMembers->fSubclassMembers == NULL )
+				success = false;
+		}
+		
+		// zero member variables
+		
+		if( success )
+		{
+			bzero( fMembers->fSubclassMembers, sizeof(MemberVariables) );
+			
+			((MemberVariables*)fMembers->fSubclassMembers)->fWindowSize = 1;
+		}
+		
+		// clean up on failure
+		
+		if( !success )
+		{
+			destroyMemberVariables();
+		}
+	}
+	
+	return success;
+}
+
+// destroyMemberVariables
+//
+//
+
+void IOFWReadCommand::destroyMemberVariables( void )
+{
+	if( fMembers && fMembers->fSubclassMembers != NULL )
+	{		
+		destroyWindowCommands();
+		
+		// free member variables
+		
+		IOFree( fMembers->fSubclassMembers, sizeof(MemberVariables) );
+		fMembers->fSubclassMembers = NULL;
+	}
+}
+
+// free
+//
+//
+
+void IOFWReadCommand::free()
+{	
+	destroyMemberVariables();
+	
+	IOFWAsyncCommand::free();
 }
 
 // reinit
@@ -155,6 +267,18 @@ IOReturn IOFWReadCommand::execute()
 		transfer = maxPack;
 	}
 
+	// hand multi-packet reads to the window engine, local reads complete
+	// synchronously so there is nothing to overlap
+	
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	if( members && 
+		members->fWindowSize > 1 && 
+		fSize > transfer &&
+		fNodeID != fControl->getLocalNodeID() )
+	{
+		return executeWindow();
+	}
+
 	UInt32 flags = kIOFWReadFlagsNone;
 
 	if( fMembers )
@@ -172,7 +296,9 @@ IOReturn IOFWReadCommand::execute()
     }
     else {
     //    IOLog("IOFWReadCommand::execute: Out of tLabels?\n");
-        result = kIOFireWireOutOfTLabels;
+        // wait for a label to this node to free up, we are restarted from the pendingQ
+        result = fControl->waitForTrans( this );
+        fStatus = kIOFireWirePending;
     }
 
 	// complete could release us so protect fStatus with retain and release
@@ -187,3 +313,390 @@ IOReturn IOFWReadCommand::execute()
 		
 	return status;
 }
+
+#pragma mark -
+
+// setWindowSize
+//
+//
+
+IOReturn IOFWReadCommand::setWindowSize( UInt32 packets )
+{
+	if( fStatus == kIOReturnBusy || fStatus == kIOFireWirePending )
+		return fStatus;
+
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	if( packets == 0 )
+	{
+		packets = 1;
+	}
+	
+	if( packets > kFWCmdMaxWindowPackets )
+	{
+		packets = kFWCmdMaxWindowPackets;
+	}
+	
+	if( packets != members->fWindowSize )
+	{
+		// window commands are recreated on the next windowed execute
+		
+		destroyWindowCommands();
+		members->fWindowSize = packets;
+	}
+	
+	return kIOReturnSuccess;
+}
+
+// createWindowCommands
+//
+//
+
+bool IOFWReadCommand::createWindowCommands( void )
+{
+	bool success = true;
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	if( members->fWindowCmds != NULL )
+	{
+		return true;
+	}
+	
+	UInt32 count = members->fWindowSize;
+	
+	members->fWindowCmds = (IOFWReadCommand**)IOMalloc( sizeof(IOFWReadCommand*) * count );
+	if( members->fWindowCmds == NULL )
+		success = false;
+	
+	if( success )
+	{
+		bzero( members->fWindowCmds, sizeof(IOFWReadCommand*) * count );
+		members->fWindowCmdCount = count;
+		
+		members->fWindowOffsets = (IOByteCount*)IOMalloc( sizeof(IOByteCount) * count );
+		if( members->fWindowOffsets == NULL )
+			success = false;
+	}
+	
+	for( UInt32 i = 0; success && i < count; i++ )
+	{
+		IOFWReadCommand * cmd = OSTypeAlloc( IOFWReadCommand );
+		if( cmd == NULL )
+		{
+			success = false;
+			break;
+		}
+		
+		members->fWindowCmds[i] = cmd;
+		
+		if( fDevice )
+		{
+			success = cmd->initAll( fDevice, FWAddress(fAddressHi, fAddressLo), fMemDesc, windowPacketCompletion, this, fFailOnReset );
+		}
+		else
+		{
+			success = cmd->initAll( fControl, fGeneration, FWAddress(fAddressHi, fAddressLo, fNodeID), fMemDesc, windowPacketCompletion, this );
+		}
+	}
+	
+	if( !success )
+	{
+		destroyWindowCommands();
+	}
+	
+	return success;
+}
+
+// destroyWindowCommands
+//
+//
+
+void IOFWReadCommand::destroyWindowCommands( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	if( members->fWindowCmds != NULL )
+	{
+		for( UInt32 i = 0; i < members->fWindowCmdCount; i++ )
+		{
+			if( members->fWindowCmds[i] != NULL )
+			{
+				members->fWindowCmds[i]->release();
+				members->fWindowCmds[i] = NULL;
+			}
+		}
+		
+		IOFree( members->fWindowCmds, sizeof(IOFWReadCommand*) * members->fWindowCmdCount );
+		members->fWindowCmds = NULL;
+	}
+	
+	if( members->fWindowOffsets != NULL )
+	{
+		IOFree( members->fWindowOffsets, sizeof(IOByteCount) * members->fWindowCmdCount );
+		members->fWindowOffsets = NULL;
+	}
+	
+	members->fWindowCmdCount = 0;
+}
+
+// executeWindow
+//
+// keep up to fWindowSize single packet reads outstanding. each packet
+// lands at its own offset in fMemDesc, so completion order does not matter.
+
+IOReturn IOFWReadCommand::executeWindow( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+
+	// the packets carry their own timeouts and retries
+	removeFromQ();
+	
+	if( !createWindowCommands() )
+	{
+		IOReturn status;
+		
+		retain();
+		complete( kIOReturnNoMemory );
+		status = fStatus;
+		release();
+		
+		return status;
+	}
+	
+	members->fStartOffset = fBytesTransferred;
+	members->fNextOffset = fBytesTransferred;
+	members->fEndOffset = fBytesTransferred + fSize;
+	members->fErrorOffset = members->fEndOffset;
+	members->fStartAddressLo = fAddressLo;
+	members->fInFlight = 0;
+	members->fWindowStatus = kIOReturnSuccess;
+	members->fFilling = false;
+	members->fWindowActive = true;
+	
+	// complete could release us so protect fStatus with retain and release
+	retain();
+	fillWindow();
+	IOReturn status = fStatus;
+	release();
+	
+	return status;
+}
+
+// fillWindow
+//
+//
+
+void IOFWReadCommand::fillWindow( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	// packets that fail synchronously complete back into this loop
+	members->fFilling = true;
+	
+	while( members->fWindowStatus == kIOReturnSuccess && 
+		   members->fNextOffset < members->fEndOffset &&
+		   members->fInFlight < members->fWindowCmdCount )
+	{
+		UInt32 slot;
+		for( slot = 0; slot < members->fWindowCmdCount; slot++ )
+		{
+			if( !members->fWindowCmds[slot]->Busy() )
+				break;
+		}
+		
+		if( slot == members->fWindowCmdCount )
+		{
+			break;
+		}
+		
+		IOFWReadCommand * cmd = members->fWindowCmds[slot];
+		
+		int transfer = members->fEndOffset - members->fNextOffset;
+		if( transfer > fMaxPack )
+		{
+			transfer = fMaxPack;
+		}
+		
+		int maxPack = (1 << fControl->maxPackLog(fWrite, fNodeID));
+		if( maxPack < transfer )
+		{
+			transfer = maxPack;
+		}
+		
+		IOByteCount offset = members->fNextOffset;
+		UInt32 addressLo = members->fStartAddressLo + (offset - members->fStartOffset);
+		
+		IOReturn status;
+		if( fDevice )
+		{
+			status = cmd->reinit( FWAddress(fAddressHi, addressLo), fMemDesc, windowPacketCompletion, this, fFailOnReset );
+		}
+		else
+		{
+			status = cmd->reinit( fGeneration, FWAddress(fAddressHi, addressLo, fNodeID), fMemDesc, windowPacketCompletion, this );
+		}
+		
+		if( status != kIOReturnSuccess )
+		{
+			members->fWindowStatus = status;
+			if( offset < members->fErrorOffset )
+				members->fErrorOffset = offset;
+			break;
+		}
+		
+		// reinit latched the device's current generation, keep ours so a packet
+		// issued after a reset fails the way a stop and wait read would
+		if( fDevice && fFailOnReset )
+		{
+			cmd->setGeneration( fGeneration );
+		}
+		
+		// the packet reads into our descriptor at its own offset
+		cmd->fBytesTransferred = offset;
+		cmd->fSize = transfer;
+		cmd->fMaxPack = fMaxPack;
+		cmd->setMaxSpeed( fMembers->fMaxSpeed );
+		cmd->setRetries( fMaxRetries );
+		cmd->setTimeout( fTimeout );
+		cmd->setForceBlockRequests( fMembers->fForceBlockRequests );
+		
+		members->fWindowOffsets[slot] = offset;
+		members->fNextOffset += transfer;
+		members->fInFlight++;
+		
+		cmd->submit();
+	}
+	
+	members->fFilling = false;
+	
+	if( members->fWindowActive && 
+		members->fInFlight == 0 &&
+		(members->fNextOffset >= members->fEndOffset || members->fWindowStatus != kIOReturnSuccess) )
+	{
+		finishWindow();
+	}
+}
+
+// windowPacketCompletion
+//
+//
+
+void IOFWReadCommand::windowPacketCompletion( void * refcon, IOReturn status, IOFireWireNub * device, IOFWCommand * fwCmd )
+{
+	IOFWReadCommand * me = (IOFWReadCommand*)refcon;
+	
+	me->retain();
+	me->windowPacketComplete( (IOFWReadCommand*)fwCmd, status );
+	me->release();
+}
+
+// windowPacketComplete
+//
+//
+
+void IOFWReadCommand::windowPacketComplete( IOFWReadCommand * cmd, IOReturn status )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	members->fInFlight--;
+	
+	setAckCode( cmd->getAckCode() );
+	setResponseCode( cmd->getResponseCode() );
+	setResponseSpeed( cmd->getResponseSpeed() );
+	
+	// a packet that drew a type error finished its range a quad at a time, 
+	// the rest of the window should not retry block requests
+	if( cmd->fMaxPack < fMaxPack )
+	{
+		fMaxPack = cmd->fMaxPack;
+	}
+	
+	if( status != kIOReturnSuccess )
+	{
+		// a failed packet may still have landed its leading quadlets
+		if( cmd->fBytesTransferred < members->fErrorOffset )
+		{
+			members->fErrorOffset = cmd->fBytesTransferred;
+		}
+		
+		if( members->fWindowStatus == kIOReturnSuccess )
+		{
+			members->fWindowStatus = status;
+		}
+	}
+	
+	if( !members->fFilling )
+	{
+		fillWindow();
+	}
+}
+
+// finishWindow
+//
+// report the contiguous prefix that is known to have arrived
+
+void IOFWReadCommand::finishWindow( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	IOByteCount done = members->fNextOffset;
+	if( members->fErrorOffset < done )
+	{
+		done = members->fErrorOffset;
+	}
+	
+	fSize -= (done - fBytesTransferred);
+	fAddressLo += (done - fBytesTransferred);
+	fBytesTransferred = done;
+	
+	members->fWindowActive = false;
+	
+	complete( members->fWindowStatus );
+}
+
+// complete
+//
+//
+
+IOReturn IOFWReadCommand::complete( IOReturn status )
+{
+	MemberVariables * members = NULL;
+	if( fMembers )
+	{
+		members = (MemberVariables*)fMembers->fSubclassMembers;
+	}
+	
+	if( members && members->fWindowActive )
+	{
+		// cancelled with packets outstanding, abort them before completing
+		
+		if( members->fWindowStatus == kIOReturnSuccess )
+		{
+			members->fWindowStatus = status;
+		}
+		
+		members->fFilling = true;
+		for( UInt32 i = 0; i < members->fWindowCmdCount; i++ )
+		{
+			if( members->fWindowCmds[i]->Busy() )
+			{
+				members->fWindowCmds[i]->cancel( kIOReturnAborted );
+			}
+		}
+		members->fFilling = false;
+		
+		IOByteCount done = members->fNextOffset;
+		if( members->fErrorOffset < done )
+		{
+			done = members->fErrorOffset;
+		}
+		
+		fSize -= (done - fBytesTransferred);
+		fAddressLo += (done - fBytesTransferred);
+		fBytesTransferred = done;
+		
+		members->fWindowActive = false;
+	}
+	
+	return IOFWAsyncCommand::complete( status );
+}
@@ -298,7 +298,9 @@ IOReturn IOFWReadQuadCommand::execute()
     }
     else {
 	//	IOLog("IOFWReadCommand::execute: Out of tLabels?\n");
-        result = kIOFireWireOutOfTLabels;
+        // wait for a label to this node to free up, we are restarted from the pendingQ
+        result = fControl->waitForTrans( this );
+        fStatus = kIOFireWirePending;
     }
 
 	// complete could release us so protect fStatus with retain and release
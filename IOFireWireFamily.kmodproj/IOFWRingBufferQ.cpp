@@ -33,11 +33,15 @@
 
 // system
 #import <IOKit/IOTypes.h>
+#import <libkern/OSAtomic.h>
 //#import <IOKit/firewire/FireLog.h>
 
+using namespace IOFireWireLib;
+
 // IOFWRingBufferQ class
 // *** This class is not multithread safe ***
-// Its usage must be lock protected to ensure only one consumer at a time
+// Its usage must be lock protected to ensure only one producer at a time, the
+// consumer is the user client library and is only seen through the head index
 
 #define super OSObject
 OSDefineMetaClassAndStructors( IOFWRingBufferQ, OSObject ) ;
@@ -63,11 +67,14 @@ IOFWRingBufferQ * IOFWRingBufferQ::withAddressRange( mach_vm_address_t address,
 }
 
 // initQ
-// inits class specific variables
+// inits class specific variables, maps the queue into the kernel
 
 bool IOFWRingBufferQ::initQ( mach_vm_address_t address, mach_vm_size_t length, IOOptionBits options, task_t task )
 {
 	DebugLog("IOFWRingBufferQ::initQ\n");
+	if ( length <= sizeof(PacketQueueHeader) )
+		return false;
+	
 	fMemDescriptor = IOMemoryDescriptor::withAddressRange( address, length, options, task );
 	if ( !fMemDescriptor )
 		return false;
@@ -76,9 +83,21 @@ bool IOFWRingBufferQ::initQ( mach_vm_address_t address, mach_vm_size_t length, I
 		return false;
 	
 	fMemDescriptorPrepared = true;
-	fFrontOffset = NULL;
-	fQueueLength = 0;
-	fBufferSize = fMemDescriptor->getLength();
+	
+	fMemMap = fMemDescriptor->map();
+	if ( !fMemMap )
+		return false;
+	
+	fHeader = (PacketQueueHeader *)fMemMap->getVirtualAddress();
+	fData = (UInt8 *)(fHeader + 1);
+	fBufferSize = fMemDescriptor->getLength() - sizeof(PacketQueueHeader);
+	
+	// the library starts out with an empty queue
+	fTail = 0;
+	fEnqueued = 0;
+	fHeader->tail = 0;
+	fHeader->head = 0;
+	fHeader->retired = 0;
 	
 	return true;
 }
@@ -87,6 +106,9 @@ bool IOFWRingBufferQ::initQ( mach_vm_address_t address, mach_vm_size_t length, I
 //
 void IOFWRingBufferQ::free()
 {
+	if ( fMemMap )
+		fMemMap->release();
+	
 	if ( fMemDescriptorPrepared )
 		fMemDescriptor->complete();
 	
@@ -96,85 +118,73 @@ void IOFWRingBufferQ::free()
 	super::free();
 }
 
-// isEmpty
-//
-
-bool IOFWRingBufferQ::isEmpty( void )
-{
-	return (fQueueLength == 0);
-}
-
-// dequeueBytes
-// Remove the next n bytes in queue given by 'size', but do not return bytes
+// head
+// The library's head index, or one that leaves no room at all if the library has
+// written something that can't be an entry boundary
 
-bool IOFWRingBufferQ::dequeueBytes( IOByteCount size )
+UInt32 IOFWRingBufferQ::head( void )
 {
-	return dequeueBytesWithCopy(NULL, size);
-}
-
-// dequeueBytesWithCopy
-// Remove the next n bytes in queue given by 'size' and write bytes into 'copy'
-
-bool IOFWRingBufferQ::dequeueBytesWithCopy( void * copy, IOByteCount size )
-{
-	// zzz is there a guarantee that we will dequeue in first-out order? Maybe it's First-In, Any-Out
+	UInt32 head = fHeader->head;
 	
-	bool success = true;
-	IOByteCount paddingBytes = 0;
+	// don't let writes into space the library just gave back get ahead of reading head
+	OSMemoryBarrier();
 	
-	if ( copy )
-	{
-		// get first entry (of size 'size') in queue
-		if ( front(copy, size, &paddingBytes) )
-		{
-			fFrontOffset = ( fFrontOffset + paddingBytes + size ) % fBufferSize; // advance front pointer by padding and by this dequeue
-			fQueueLength = fQueueLength - paddingBytes - size;	// remove padding and this dequeue size
-		}
-		else
-			success = false;
-	}
-	else
+	if ( head > fBufferSize )
 	{
-		// copy not necessary, simply make bytes available in queue
-		
-		IOByteCount theRealFrontOffset = frontEntryOffset( size, &paddingBytes );	// get front offset that corresponds to 'size'
-		fFrontOffset = theRealFrontOffset + size;	// advance front pointer by this dequeue
-		fQueueLength = fQueueLength - paddingBytes - size;	// remove padding and this dequeue size
-		
-		// should have checks to make sure numbers are sensible, if not success=false
+		DebugLog("IOFWRingBufferQ::head bad head %u, buffer size %u\n", head, fBufferSize);
+		head = (fTail == fBufferSize) ? 0 : fTail + 1;
 	}
 	
-	DebugLog("<<< IOFWRingBufferQ::dequeueBytesWithCopy BSize: %u Length: %u Front: %u Size: %u Copy: %p\n", fBufferSize, fQueueLength, fFrontOffset, size, copy);
-
-	return success;
+	return head;
 }
 
-// getBytes
+// isEmpty
 //
 
+bool IOFWRingBufferQ::isEmpty( void )
+{
+	return (head() == fTail);
+}
+
+// readBytes
+// Copy out bytes the kernel wrote earlier, 'offset' is from the start of the queue memory
+
 IOByteCount IOFWRingBufferQ::readBytes(IOByteCount offset, void * bytes, IOByteCount withLength)
 {
-	return fMemDescriptor->readBytes( offset, bytes, withLength );
+	if ( (offset < sizeof(PacketQueueHeader)) || 
+		 (offset - sizeof(PacketQueueHeader) > fBufferSize) ||
+		 (withLength > fBufferSize - (offset - sizeof(PacketQueueHeader))) )
+	{
+		return 0;
+	}
+	
+	bcopy( fData + offset - sizeof(PacketQueueHeader), bytes, withLength );
+	
+	return withLength;
 }
 
 // enqueueBytes
-// Insert 'bytes' into queue contiguously
+// Insert 'bytes' into queue contiguously and publish them to the library
 
 bool IOFWRingBufferQ::enqueueBytes( void * bytes, IOByteCount size )
 {
 	bool success = true;
 	
 	IOByteCount offset = 0;
-	IOByteCount paddingBytes = 0;
 	
 	// determine if 'bytes' will fit in queue and get the appropriate insertion offset
-	if ( success = willFitAtEnd(size, &offset, &paddingBytes) )
+	if ( (success = willFitAtEnd(size, &offset, NULL)) )
 	{
 		if ( bytes )
 		{
-			fQueueLength = fQueueLength + size + paddingBytes;	// grow queue appropriately
-			if ( fMemDescriptor->writeBytes(offset, bytes, size) == 0 )			// write 'bytes' into queue at insertion offset
-				success = false;
+			offset -= sizeof(PacketQueueHeader);
+			bcopy( bytes, fData + offset, size );
+			
+			// the entry has to be visible before the tail that covers it
+			OSMemoryBarrier();
+			fTail = offset + size;
+			fEnqueued++;
+			fHeader->tail = fTail;
 		}
 		else
 		{
@@ -182,7 +192,7 @@ bool IOFWRingBufferQ::enqueueBytes( void * bytes, IOByteCount size )
 		}
 	}
 	
-	DebugLog(">>> IOFWRingBufferQ::enqueueBytes BSize: %u Length: %u Front: %u Insert: %u/%u\n", fBufferSize, fQueueLength, fFrontOffset, offset, paddingBytes);
+	DebugLog(">>> IOFWRingBufferQ::enqueueBytes BSize: %u Tail: %u Insert: %u\n", fBufferSize, fTail, offset);
 	return success;
 }
 
@@ -191,178 +201,85 @@ bool IOFWRingBufferQ::enqueueBytes( void * bytes, IOByteCount size )
 
 bool IOFWRingBufferQ::isSpaceAvailable( IOByteCount size, IOByteCount * offset )
 {
-#if 0
-	FireLog("[");
-	UInt16 i;
-	UInt16 drawBufferWidth = 64;
-	UInt32 drawBufferSize = fBufferSize;
-	UInt32 drawBufAvail = drawBufferWidth * (fBufferSize-fQueueLength) / drawBufferSize;
-	UInt32 drawStartOff = drawBufferWidth * fFrontOffset / drawBufferSize;
-	UInt32 drawDestOff = drawBufferWidth * endOffset / drawBufferSize;
-
-	if ( drawStartOff != 0 ) drawStartOff--;
-	if ( drawDestOff != 0 ) drawDestOff--;
-
-	bool drawFilled = drawStartOff > drawDestOff ? true : false;
-	for ( i=0; i < drawBufferWidth; i++ )
-	{
-		if ( i == drawStartOff )
-			FireLog("s");
-		else if ( i == drawDestOff )
-			FireLog("d");
-		else if ( drawFilled )
-			FireLog("o");
-		else if ( drawBufAvail <= (drawBufferWidth/2) )
-			FireLog("?");
-		else
-			FireLog(".");
-
-		if ( i == drawStartOff )
-			drawFilled = true;
-		if ( i == drawDestOff )
-			drawFilled = false;
-	}
-	
-	FireLog("]\n");
-	FireLog("-- Units Available: %lu  StartPtr: %lu  DestinationPtr: %lu --\n", drawBufAvail, drawStartOff, drawDestOff );
-#endif
-	
 	return willFitAtEnd(size, offset, NULL);
 }
 
-// front
-// Return a copy of first entry, of size 'size'
-
-bool IOFWRingBufferQ::front( void * copy, IOByteCount size, IOByteCount * paddingBytes )
-{
-	//FireLog("IOFWRingBufferQ::front\n");
-	bool success = true;
-	
-	if ( isEmpty() )
-	{
-		success = false;
-	}
-	else
-	{
-		if ( copy )
-		{
-			IOByteCount frontOffset = frontEntryOffset( size, paddingBytes );	// get proper offset for first entry
-			if ( fMemDescriptor->readBytes(frontOffset, copy, size) == 0 )
-				success = false;
-		}
-		else
-		{
-			success = false;
-		}
-	}
-
-	return success;
-}
-
-// It's a beautiful day.
-
 // spaceAvailable
 //
 
 IOByteCount IOFWRingBufferQ::spaceAvailable( void )
 {
-	return fBufferSize - fQueueLength;
+	UInt32 headOffset = head();
+	
+	if ( fTail >= headOffset )
+		return fBufferSize - fTail + headOffset;
+	
+	return headOffset - fTail;
 }
 
 // willFitAtEnd
-// Checks to see if an entry of 'sizeOfEntry' bytes will fit in queue. If so, it will return the offset to which the entry should be written and any padding bytes that should be added to the queue length to compensate for entries that don't fit at the end of the memory range and should be written at beginning of memory range.
+// Checks to see if an entry of 'sizeOfEntry' bytes will fit in queue. If so, it will return the offset, from the start of the queue memory, to which the entry should be written and any padding bytes left at the end of the memory range when the entry has to go at the beginning instead. The tail never catches up with the head from behind, so head == tail always means empty.
 
 bool IOFWRingBufferQ::willFitAtEnd( IOByteCount sizeOfEntry, IOByteCount * offset, IOByteCount * paddingBytes )
 {
 	bool success = true;
+	IOByteCount headOffset = head();
+	IOByteCount endOffset = fTail;
 	
 	if ( paddingBytes )
 		*paddingBytes = 0;
 	
-	IOByteCount endOffset = (fFrontOffset + fQueueLength) % fBufferSize;	// pointer that designates end of queue
-	
-	if ( fQueueLength < fBufferSize ) // is not full; has space available - avoids empty vs. full confusion
+	if ( endOffset >= headOffset )	// [__h....t__]
 	{
-		if ( endOffset >= fFrontOffset )	// [__f....e__]
-		{
-			if ( sizeOfEntry > (fBufferSize - endOffset) )
-			{
-				// cannot fit at end
-				IOByteCount padding = fBufferSize - endOffset;	// the number of bytes to get insertion offset to wrap
-				
-				if ( paddingBytes )
-					*paddingBytes = padding;
-				
-				endOffset = (fFrontOffset + fQueueLength + padding) % fBufferSize;	// advance insertion offset past end of memory range; should be zero
-				
-				if ( sizeOfEntry > fFrontOffset )
-					success = false;	// cannot fit at start either
-			}
-		}
-		else	// [..e____f..]
+		if ( sizeOfEntry > (fBufferSize - endOffset) )
 		{
-			if ( sizeOfEntry > (fBufferSize - fQueueLength) )
-				success = false;	// cannot fit in space available
+			// cannot fit at end, try the start
+			if ( paddingBytes )
+				*paddingBytes = fBufferSize - endOffset;
+			
+			endOffset = 0;
+			
+			if ( sizeOfEntry >= headOffset )
+				success = false;	// cannot fit at start either
 		}
 	}
-	else if ( fQueueLength > fBufferSize )
+	else	// [..t____h..]
 	{
-		//FireLog("IOFWRingBufferQ::willFitAtEnd queue has grown larger (%u) than buffer size (%u)!\n", fQueueLength, fBufferSize);
-		success = false;
-	}
-	else
-	{
-		// queue is full
-		success = false;
+		if ( sizeOfEntry >= (headOffset - endOffset) )
+			success = false;	// cannot fit in space available
 	}
 	
 	if ( offset )
-		*offset = endOffset;
+		*offset = sizeof(PacketQueueHeader) + endOffset;
 	
-	DebugLog("IOFWRingBufferQ::willFitAtEnd BSize: %u Length: %u Front: %u Insert: %u EntrySize: %u\n", fBufferSize, fQueueLength, fFrontOffset, endOffset, sizeOfEntry);
+	DebugLog("IOFWRingBufferQ::willFitAtEnd BSize: %u Head: %u Tail: %u Insert: %u EntrySize: %u\n", fBufferSize, headOffset, fTail, endOffset, sizeOfEntry);
 	
 	return success;
 }
 
-// frontEntryOffset
-// Get the first entry in the queue. First entry is determined by collecting 'sizeOfEntry' bytes of front of queue. If first entry cannot have been fit between the front queue offset and the actual end of the memory range of the buffer, then it probably exists at the beginning of memory range - paddingBytes represents the number of bytes skipped at the end of memory range to get back to beginning of memory range.
+// getEnqueueCount
+// The number of the entry enqueued last, pass it to isRetired() later on
 
-IOByteCount IOFWRingBufferQ::frontEntryOffset( IOByteCount sizeOfEntry, IOByteCount * paddingBytes )
+UInt32 IOFWRingBufferQ::getEnqueueCount( void )
 {
-	IOByteCount frontEntryOffset = fFrontOffset;
-	
-	IOByteCount endOffset = (fFrontOffset + fQueueLength) % fBufferSize;	// pointer that designates end of queue
+	return fEnqueued;
+}
+
+// isRetired
+// True once the library has moved head past entry number 'entry'. A retired count
+// from the library that runs ahead of what was enqueued is ignored.
+
+bool IOFWRingBufferQ::isRetired( UInt32 entry )
+{
+	UInt32 retired = fHeader->retired;
 	
-	if ( paddingBytes )
-		*paddingBytes = 0;
+	OSMemoryBarrier();
 	
-	if ( !isEmpty() )	// avoid empty vs. full confusion
+	if ( (SInt32)(retired - fEnqueued) > 0 )
 	{
-		if ( fFrontOffset >= endOffset )	// [..e____f..]
-		{
-			if ( sizeOfEntry > (fBufferSize - fFrontOffset) )
-			{
-				// cannot fit at end
-				IOByteCount padding = fBufferSize - fFrontOffset;	// the number of bytes to get insertion offset to wrap
-				
-				if ( paddingBytes )
-					*paddingBytes = padding;
-				
-				frontEntryOffset = (fFrontOffset + padding) % fBufferSize;	// should be zero, since padding made it wrap
-				
-				DebugLogCond( (sizeOfEntry > endOffset), "IOFWRingBufferQ::frontEntryOffset Front entry cannot occur within queue starting at buffer index zero!\n");
-			}
-			// else - normal front offset will work (no padding), do nothing
-		}
-		else	// [__f....e__]
-		{
-			DebugLogCond( (sizeOfEntry > fQueueLength), "IOFWRingBufferQ::frontEntryOffset Front entry cannot occur within queue!\n");
-		}
-	}
-	else
-	{
-		DebugLog("IOFWRingBufferQ::frontEntryOffset Queue is empty!\n");
+		DebugLog("IOFWRingBufferQ::isRetired bad retired count %u, enqueued %u\n", retired, fEnqueued);
+		return false;
 	}
 	
-	return frontEntryOffset;
+	return ( (SInt32)(retired - entry) >= 0 );
 }
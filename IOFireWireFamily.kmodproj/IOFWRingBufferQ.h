@@ -34,10 +34,21 @@
 // public
 #import <IOKit/IOMemoryDescriptor.h>
 
+// private
+#import "IOFireWireLibPriv.h"
+
 //using namespace IOFireWireLib;
 
 // IOFWRingBufferQ
-// Description: A ring buffered FIFO queue
+// Description: A ring buffered FIFO queue in memory shared with a user client
+//
+// The queue starts with an IOFireWireLib::PacketQueueHeader holding the tail, written
+// here, and the head, written by the library as it finishes with entries, each on a
+// cache line of its own. Entries are written straight through a kernel mapping of the
+// queue and never straddle the end, offsets handed out are from the start of the
+// queue memory. There is one producer, so the kernel side needs no lock of its own.
+// Entries are numbered from 1 as they are enqueued, and the library counts the ones it
+// has moved head past, so isRetired() can tell whether a given entry is still in use.
 	
 class IOFWRingBufferQ: public OSObject
 {
@@ -50,22 +61,25 @@ public:
 	virtual bool			initQ( mach_vm_address_t address, mach_vm_size_t length, IOOptionBits options, task_t task );
 	virtual void			free( void );	
 	virtual bool			isEmpty( void );
-	virtual bool			dequeueBytes( IOByteCount size );
-	virtual bool			dequeueBytesWithCopy( void * copy, IOByteCount size );
 	virtual IOByteCount		readBytes(IOByteCount offset, void * bytes, IOByteCount withLength);
 	virtual bool			enqueueBytes( void * bytes, IOByteCount size );
 	virtual bool			isSpaceAvailable( IOByteCount size, IOByteCount * offset );
-	virtual bool			front( void * copy, IOByteCount size, IOByteCount * paddingBytes );
 	virtual IOByteCount		spaceAvailable( void );
 	virtual bool			willFitAtEnd( IOByteCount sizeOfEntry, IOByteCount * offset, IOByteCount * paddingBytes );
-	virtual IOByteCount		frontEntryOffset( IOByteCount sizeOfEntry, IOByteCount * paddingBytes );
+	virtual UInt32			getEnqueueCount( void );
+	virtual bool			isRetired( UInt32 entry );
 	
 private:
+	UInt32					head( void );
+
 	IOMemoryDescriptor *			fMemDescriptor;
 	bool							fMemDescriptorPrepared;
+	IOMemoryMap *					fMemMap;
+	IOFireWireLib::PacketQueueHeader *	fHeader;
+	UInt8 *							fData;
 	IOByteCount						fBufferSize;
-	IOByteCount						fFrontOffset;
-	IOByteCount						fQueueLength;
+	UInt32							fTail;
+	UInt32							fEnqueued;
 } ;
 
 #endif //__IOFWRingBufferQ_H__
@@ -50,7 +50,7 @@ IOReturn IOFireWireController::createTimeoutQ( void )
 		return false;
 	}
 	
-    fTimeoutQ.fTimer = fTimer;
+    fTimeoutQ.init( fTimer, &fTLabelWaitQ );
 	
 	fWorkLoop->addEventSource( fTimer );
 	
@@ -67,88 +67,358 @@ void IOFireWireController::destroyTimeoutQ( void )
     fTimer->release();
 }
 
-// headChanged
+#pragma mark -
+
+// init
 //
 //
 
-void IOFireWireController::timeoutQ::headChanged(IOFWCommand *oldHead)
+void IOFireWireController::timeoutQ::init( IOTimerEventSource *timer, IOFWCmdQ *waiters )
 {
+	fTimer = timer;
+	fWaiters = waiters;
+	
+	for( UInt32 level = 0; level < kTimeoutWheelLevels; level++ )
+	{
+		for( UInt32 index = 0; index < kTimeoutWheelSlots; index++ )
+		{
+			fSlots[level][index].fWheel = this;
+			fSlots[level][index].fLevel = level;
+			fSlots[level][index].fIndex = index;
+		}
+		
+		fOccupied[level] = 0;
+	}
+	
+	AbsoluteTime tick;
+	clock_interval_to_absolutetime_interval( kTimeoutWheelTick, kMicrosecondScale, &tick );
+	fTickLength = AbsoluteTime_to_scalar( &tick );
+	
+	fCurrentTick = currentTick();
+	fArmedTick = 0;
+}
 
-#if 0
-    {
-        IOFWCommand *t = fHead;
-        if(oldHead)
-            IOLog("IOFireWireController::timeoutQ::headChanged(%s:%p)\n",
-                oldHead->getMetaClass()->getClassName(), oldHead);
-        else
-            IOLog("IOFireWireController::timeoutQ::headChanged(0)\n");
-            
-        while(t) {
-            AbsoluteTime d = t->getDeadline();
-            IOLog("%s:%p deadline %llx\n",
-                t->getMetaClass()->getClassName(), t, AbsoluteTime_to_scalar(&d));
-            t = t->getNext();
-        }
-    }
-#endif
-    
-	if(!fHead) 
+// contains
+//
+// true if a command on this queue is waiting to time out
+
+bool IOFireWireController::timeoutQ::contains( IOFWCmdQ *queue ) const
+{
+	if( queue == this )
+		return true;
+	
+	return (queue >= &fSlots[0][0]) && (queue <= &fSlots[kTimeoutWheelLevels - 1][kTimeoutWheelSlots - 1]);
+}
+
+// currentTick
+//
+//
+
+UInt64 IOFireWireController::timeoutQ::currentTick() const
+{
+	AbsoluteTime now;
+	IOFWGetAbsoluteTime( &now );
+	
+	return AbsoluteTime_to_scalar( &now ) / fTickLength;
+}
+
+// place
+//
+// files a command that is on no queue on the lowest level that can hold it,
+// or on the expired list if it is already due
+
+void IOFireWireController::timeoutQ::place( IOFWCommand *cmd )
+{
+	UInt64 tick = deadlineTick( cmd );
+	
+	if( tick <= fCurrentTick )
 	{
-        //IOLog("timeoutQ empty\n");
-        fTimer->cancelTimeout();
-    }
-    else 
+		append( *this, cmd );
+		return;
+	}
+	
+	UInt32 level = 0;
+	while( (level < kTimeoutWheelLevels - 1) && 
+		   ((tick >> ((level + 1) * kTimeoutWheelSlotBits)) != (fCurrentTick >> ((level + 1) * kTimeoutWheelSlotBits))) )
 	{
-        fTimer->wakeAtTime(fHead->getDeadline());
-        //AbsoluteTime now;
-        //IOFWGetAbsoluteTime(&now);
-        //IOLog("timeoutQ waketime %lx:%lx (now %lx:%lx)\n",
-        //        fHead->getDeadline().hi, fHead->getDeadline().lo, now.hi, now.lo);
-    }
+		level++;
+	}
+	
+	UInt32 index = (tick >> (level * kTimeoutWheelSlotBits)) & (kTimeoutWheelSlots - 1);
+	append( fSlots[level][index], cmd );
+}
+
+// deadlineTick
+//
+// the first tick at or after the command's deadline
 
+UInt64 IOFireWireController::timeoutQ::deadlineTick( IOFWCommand *cmd ) const
+{
+	AbsoluteTime deadline = cmd->getDeadline();
+	
+	return (AbsoluteTime_to_scalar( &deadline ) + fTickLength - 1) / fTickLength;
 }
 
-// busReset
+// append
 //
 //
 
-void IOFireWireController::timeoutQ::busReset()
+void IOFireWireController::timeoutQ::append( IOFWCmdQ &queue, IOFWCommand *cmd )
 {
+	IOFWCommand *tail = queue.fTail;
+	if( tail == NULL )
+		cmd->setHead( queue );
+	else
+		cmd->insertAfter( *tail );
+}
 
-#if 0
-    {
-        IOFWCommand *t = fHead;
-        if(oldHead)
-            IOLog("IOFireWireController::timeoutQ::headChanged(%s:%p)\n",
-                oldHead->getMetaClass()->getClassName(), oldHead);
-        else
-            IOLog("IOFireWireController::timeoutQ::headChanged(0)\n");
-            
-        while(t) {
-            AbsoluteTime d = t->getDeadline();
-            IOLog("%s:%p deadline %lx:%lx\n",
-                t->getMetaClass()->getClassName(), t, d.hi, d.lo);
-            t = t->getNext();
-        }
-    }
-#endif
+// nextEvent
+//
+// the tick at which the earliest non-empty slot comes around, and its level. every
+// command below the top level is in a slot ahead of the wheel's position on that
+// level, so the lowest occupied level always has the earliest event. the top level
+// can wrap, a slot at or behind the wheel's position is on the next turn.
 
-    IOFWCommand *cmd;
-    cmd = fHead;
-    while(cmd) 
+bool IOFireWireController::timeoutQ::nextEvent( UInt64 *tick, UInt32 *level ) const
+{
+	for( UInt32 l = 0; l < kTimeoutWheelLevels; l++ )
 	{
-        IOFWCommand *next;
-        next = cmd->getNext();
-        if(cmd->cancelOnReset()) 
+		UInt64 occupied = fOccupied[l];
+		if( occupied == 0 )
+			continue;
+		
+		UInt32 shift = l * kTimeoutWheelSlotBits;
+		UInt64 turn = (fCurrentTick >> (shift + kTimeoutWheelSlotBits)) << (shift + kTimeoutWheelSlotBits);
+		
+		if( l == kTimeoutWheelLevels - 1 )
 		{
-			FWTrace( kFWTController, kTPControllerTimeoutQBusReset, (uintptr_t)(cmd->getFWIMRefCon()), (uintptr_t)cmd, 0, 0 );
-            cmd->cancel(kIOFireWireBusReset);
-        }
-        cmd = next;
-    }
+			UInt32 position = (fCurrentTick >> shift) & (kTimeoutWheelSlots - 1);
+			UInt64 ahead = occupied & ~((2ULL << position) - 1);
+			if( ahead == 0 )
+			{
+				turn += (1ULL << (shift + kTimeoutWheelSlotBits));
+				ahead = occupied;
+			}
+			
+			occupied = ahead;
+		}
+		
+		*tick = turn | ((UInt64)__builtin_ctzll( occupied ) << shift);
+		*level = l;
+		
+		return true;
+	}
+	
+	return false;
+}
+
+// advance
+//
+// turns the wheel up to the given tick. due commands are moved to the expired
+// list, those in higher level slots that come around are refiled lower down.
+
+void IOFireWireController::timeoutQ::advance( UInt64 tick )
+{
+	UInt64 next;
+	UInt32 level;
+	
+	while( nextEvent( &next, &level ) && next <= tick )
+	{
+		fCurrentTick = next;
+		
+		timeoutSlot &slot = fSlots[level][(next >> (level * kTimeoutWheelSlotBits)) & (kTimeoutWheelSlots - 1)];
+		while( slot.fHead )
+		{
+			IOFWCommand *cmd = slot.fHead;
+			cmd->removeFromQ();
+			
+			if( level == 0 )
+				append( *this, cmd );
+			else
+				place( cmd );
+		}
+	}
 	
+	// nothing else is due before the next event, it's safe to skip ahead
+	if( tick > fCurrentTick )
+		fCurrentTick = tick;
 }
 
+// add
+//
+// puts a command with a new deadline on the wheel
+
+void IOFireWireController::timeoutQ::add( IOFWCommand *cmd )
+{
+	cmd->removeFromQ();
+	
+	// catch the wheel up to now so the command lands on the right level, but not
+	// past a slot that is due and hasn't been handled yet
+	UInt64 now = currentTick();
+	UInt64 next;
+	UInt32 level;
+	
+	if( nextEvent( &next, &level ) && next <= now )
+		now = next - 1;
+	
+	if( now > fCurrentTick )
+		fCurrentTick = now;
+	
+	place( cmd );
+	arm();
+}
+
+// expire
+//
+// moves every command that is due to the expired list, true if there are any
+
+bool IOFireWireController::timeoutQ::expire()
+{
+	advance( currentTick() );
+	expireWaiters();
+	
+	return fHead != NULL;
+}
+
+// nextWaiter
+//
+// the earliest deadline among the commands waiting for a tLabel. there are only
+// ever a few of them, they aren't worth a place on the wheel.
+
+bool IOFireWireController::timeoutQ::nextWaiter( UInt64 *tick ) const
+{
+	bool found = false;
+	
+	for( IOFWCommand *cmd = fWaiters->fHead; cmd; cmd = cmd->getNext() )
+	{
+		if( cmd->getTimeout() == 0 )
+			continue;
+		
+		UInt64 due = deadlineTick( cmd );
+		if( !found || due < *tick )
+		{
+			*tick = due;
+			found = true;
+		}
+	}
+	
+	return found;
+}
+
+// expireWaiters
+//
+// moves the commands that timed out while waiting for a tLabel to the expired list
+
+void IOFireWireController::timeoutQ::expireWaiters()
+{
+	IOFWCommand *cmd = fWaiters->fHead;
+	while( cmd )
+	{
+		IOFWCommand *next = cmd->getNext();
+		
+		if( cmd->getTimeout() != 0 && deadlineTick( cmd ) <= fCurrentTick )
+		{
+			cmd->removeFromQ();
+			append( *this, cmd );
+		}
+		
+		cmd = next;
+	}
+}
+
+// arm
+//
+// makes sure the timer fires by the next event, an early wakeup just rearms it
+
+void IOFireWireController::timeoutQ::arm()
+{
+	UInt64 next;
+	UInt64 waiter;
+	UInt32 level;
+	
+	if( fHead )
+	{
+		next = fCurrentTick;
+	}
+	else if( !nextEvent( &next, &level ) )
+	{
+		if( !nextWaiter( &next ) )
+			return;
+	}
+	else if( nextWaiter( &waiter ) && waiter < next )
+	{
+		next = waiter;
+	}
+	
+	if( fArmedTick && fArmedTick <= next )
+		return;
+	
+	fArmedTick = next;
+	
+	AbsoluteTime wake;
+	AbsoluteTime_to_scalar( &wake ) = next * fTickLength;
+	fTimer->wakeAtTime( wake );
+}
+
+// headChanged
+//
+// keeps the occupied bits in step with the slot
+
+void IOFireWireController::timeoutSlot::headChanged( IOFWCommand *oldHead )
+{
+	if( fHead )
+		fWheel->fOccupied[fLevel] |= (1ULL << fIndex);
+	else
+		fWheel->fOccupied[fLevel] &= ~(1ULL << fIndex);
+}
+
+// busReset
+//
+//
+
+void IOFireWireController::timeoutQ::busReset()
+{
+	for( UInt32 level = 0; level <= kTimeoutWheelLevels; level++ )
+	{
+		UInt64 occupied = (level < kTimeoutWheelLevels) ? fOccupied[level] : 1;
+		
+		while( occupied )
+		{
+			UInt32 index = __builtin_ctzll( occupied );
+			occupied &= occupied - 1;
+			
+			// the expired list last
+			IOFWCommand *cmd = (level < kTimeoutWheelLevels) ? fSlots[level][index].fHead : fHead;
+			while(cmd) 
+			{
+				IOFWCommand *next;
+				next = cmd->getNext();
+				if(cmd->cancelOnReset()) 
+				{
+					FWTrace( kFWTController, kTPControllerTimeoutQBusReset, (uintptr_t)(cmd->getFWIMRefCon()), (uintptr_t)cmd, 0, 0 );
+					cmd->cancel(kIOFireWireBusReset);
+				}
+				cmd = next;
+			}
+		}
+	}
+	
+	// commands waiting for a tLabel haven't sent anything but are just as stale
+	IOFWCommand *cmd = fWaiters->fHead;
+	while( cmd )
+	{
+		IOFWCommand *next = cmd->getNext();
+		if( cmd->cancelOnReset() )
+		{
+			FWTrace( kFWTController, kTPControllerTimeoutQBusReset, (uintptr_t)(cmd->getFWIMRefCon()), (uintptr_t)cmd, 0, 0 );
+			cmd->cancel(kIOFireWireBusReset);
+		}
+		cmd = next;
+	}
+}
+
+#pragma mark -
+
 // clockTick
 //
 //
@@ -167,58 +437,24 @@ void IOFireWireController::clockTick(OSObject *obj, IOTimerEventSource *src)
 
 void IOFireWireController::processTimeout(IOTimerEventSource *src)
 {
+	fTimeoutQ.fArmedTick = 0;
+	
     // complete() might take significant time, enough to cause
     // a later command to timeout too, so we loop here until there is no timeout.
-    while (fTimeoutQ.fHead) 
+    while( fTimeoutQ.expire() ) 
 	{
-        AbsoluteTime now, dead;
-        IOFWGetAbsoluteTime(&now);
-
-#if 0
-        IOLog("processTimeout, time is %llx\n", AbsoluteTime_to_scalar(&now));
-        {
-            IOFWCommand *t = fTimeoutQ.fHead;
-            while(t) {
-                AbsoluteTime d = t->getDeadline();
-                IOLog("%s:%p deadline %lx:%lx\n",
-                    t->getMetaClass()->getClassName(), t, AbsoluteTime_to_scalar(&d));
-                t = t->getNext();
-            }
-        }
-#endif
-        dead = fTimeoutQ.fHead->getDeadline();
-        if(CMP_ABSOLUTETIME(&dead, &now) == 1)
-            break;	// Command with earliest deadline is OK.
-
         // Make sure there isn't a packet waiting.
         fFWIM->handleInterrupts( NULL, 1 );
 		fFWIM->flushWaitingPackets();
 
-        // Which may have changed the queue - see if earliest deadline has changed.
-        if(!fTimeoutQ.fHead)
-            break;
-
-        if(CMP_ABSOLUTETIME(&dead, &fTimeoutQ.fHead->getDeadline()) != 0)
-            continue;
-
-        //IOLog("Cmd 0x%x timing out\r", fTimeoutQ.fHead);
-
-		FWTrace( kFWTController, kTPControllerTimeoutQProcessTimeout, (uintptr_t)fFWIM, (uintptr_t)(fTimeoutQ.fHead), 0, 0 );
-		
-        fTimeoutQ.fHead->cancel(kIOReturnTimeout);
-    };
-    
-	if(fTimeoutQ.fHead) 
-	{
-        src->wakeAtTime(fTimeoutQ.fHead->getDeadline());
-        //AbsoluteTime now;
-        //IOFWGetAbsoluteTime(&now);
-        //IOLog("processTimeout, timeoutQ waketime %lx:%lx (now %llx)\n",
-        //        fTimeoutQ.fHead->getDeadline().hi, fTimeoutQ.fHead->getDeadline().lo, AbsoluteTime_to_scalar(&now));
-    }
-    else 
-	{
-        //IOLog("processTimeout, timeoutQ empty\n");
-        src->cancelTimeout();
+        // Which may have completed some of the expired commands.
+		while( fTimeoutQ.fHead )
+		{
+			FWTrace( kFWTController, kTPControllerTimeoutQProcessTimeout, (uintptr_t)fFWIM, (uintptr_t)(fTimeoutQ.fHead), 0, 0 );
+			
+			fTimeoutQ.fHead->cancel(kIOReturnTimeout);
+		}
     }
+    
+	fTimeoutQ.arm();
 }
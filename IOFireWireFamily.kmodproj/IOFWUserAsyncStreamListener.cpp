@@ -128,11 +128,11 @@ IOFWUserAsyncStreamListener::serialize(OSSerialize *s) const
 void
 IOFWUserAsyncStreamListener::free()
 {
-	if ( fPacketQueuePrepared )
-		fPacketQueueBuffer->complete() ;
-
-	if ( fPacketQueueBuffer )
-		fPacketQueueBuffer->release() ;
+	if ( fPacketQueue )
+	{
+		fPacketQueue->release() ;
+		fPacketQueue = NULL ;
+	}
 
 	delete fLastWrittenHeader ;
 
@@ -166,7 +166,6 @@ IOFWUserAsyncStreamListener::deactivate()
 	
 	IOLockLock(fLock) ;
 	
-	fBufferAvailable = 0 ;	// zzz do we need locking here to protect our data?
 	fLastReadHeader = NULL ;	
 	
 	IOFWPacketHeader*	firstHeader = fLastWrittenHeader ;
@@ -208,30 +207,17 @@ IOFWUserAsyncStreamListener::completeInit( IOFireWireUserClient* userclient, FWU
 		status = false ;
 	}
 	
-	// make memory descriptor around queue
+	// make packet queue
 	if ( status )
 	{
 		if ( params->queueBuffer )
 		{
-			fPacketQueueBuffer = IOMemoryDescriptor::withAddressRange(	params->queueBuffer,
-																		params->queueSize,
-																		kIODirectionOutIn,
-																		fUserClient->getOwningTask() ) ;
-			if ( !fPacketQueueBuffer )
+			fPacketQueue = IOFWRingBufferQ::withAddressRange( params->queueBuffer, params->queueSize, kIODirectionOutIn, fUserClient->getOwningTask() ) ;
+			if ( !fPacketQueue )
 			{
-				DebugLog("%s %u: couldn't make fPacketQueueBuffer memory descriptor\n", __FILE__, __LINE__) ;
+				DebugLog("%s %u: couldn't make fPacketQueue\n", __FILE__, __LINE__) ;
 				status = false ;
 			}
-			
-			if ( status )
-			{
-				status =  ( kIOReturnSuccess == fPacketQueueBuffer->prepare() ) ;
-		
-				fPacketQueuePrepared = status ;
-			}
-
-			if ( status )
-				fBufferAvailable = fPacketQueueBuffer->getLength() ;
 		}
 	}
 	
@@ -298,29 +284,7 @@ IOFWUserAsyncStreamListener::doPacket(
 
 	if ( tag == IOFWPacketHeader::kIncomingPacket )
 	{
-		IOByteCount		spaceAtEnd	= fPacketQueueBuffer->getLength() ;
-
-		spaceAtEnd -= (IOFWPacketHeaderGetOffset(currentHeader) + IOFWPacketHeaderGetSize(currentHeader)) ;
-	
-		if ( fBufferAvailable < len )
-        {
-			wontFit = true ;
-        }
-		else
-		{
-			if (len <= spaceAtEnd)
-				destOffset = IOFWPacketHeaderGetOffset(currentHeader) + IOFWPacketHeaderGetSize(currentHeader) ;
-			else
-			{
-				if ( (len + spaceAtEnd) <= fBufferAvailable )
-					destOffset = 0 ;
-				else
-				{
-					destOffset = IOFWPacketHeaderGetOffset(currentHeader) ;
-					wontFit = true ;
-				}
-			}
-		}
+		wontFit = !fPacketQueue->isSpaceAvailable( len, &destOffset ) ;
 	}
 	
 	if (wontFit)
@@ -384,9 +348,7 @@ IOFWUserAsyncStreamListener::doPacket(
 				addr,
 				false) ;
 
-		fPacketQueueBuffer->writeBytes(destOffset, buf, len) ;
-		
-		fBufferAvailable -= len ;
+		fPacketQueue->enqueueBytes( (void *)buf, len ) ;
 
 		fLastWrittenHeader = currentHeader ;
 	}
@@ -432,8 +394,8 @@ IOFWUserAsyncStreamListener::clientCommandIsComplete(
 	{
 		IOFWPacketHeader*			oldHeader 	= fLastReadHeader ;
 		fLastReadHeader							= fLastReadHeader->CommonHeader.next ;
-				
-		fBufferAvailable += oldHeader->IncomingPacket.packetSize ;
+		
+		// the library has already moved the queue head past this packet
 		
 		oldHeader->CommonHeader.type = IOFWPacketHeader::kFree ;
 		oldHeader->CommonHeader.whichAsyncRef = 0;
@@ -122,14 +122,13 @@ public:
 											IOFWPacketHeader*		inPacketHeader ) ;
 
 private:
-    IOMemoryDescriptor*			fPacketQueueBuffer ;			// the queue where incoming packets, etc., go
+    IOFWRingBufferQ *			fPacketQueue ;					// the queue where incoming packets, etc., go
 	IOLock*						fLock ;							// to lock this object
 
 	mach_vm_address_t			fUserRefCon ;
 	IOFireWireUserClient*		fUserClient ;
 	IOFWPacketHeader*			fLastWrittenHeader ;
 	IOFWPacketHeader*			fLastReadHeader;
-	UInt32						fBufferAvailable ;				// amount of queue space remaining
 	
 	OSAsyncReference64			fSkippedPacketAsyncNotificationRef ;
 	OSAsyncReference64			fPacketAsyncNotificationRef ;
@@ -137,8 +136,6 @@ private:
 	bool						fUserLocks ;					// are we doing locks in user space?
 	
 	UInt32						fFlags ;
-	
-	Boolean						fPacketQueuePrepared ;
 } ;
 
 #endif // __IOFWUSERASYNCSTREAMLISTENER_H__
\ No newline at end of file
@@ -16,6 +16,7 @@
 #import "IOFWUserCommand.h"
 #import "IOFireWireLib.h"
 #import "IOFWUserVectorCommand.h"
+#import "IOFWAsyncCommandPool.h"
 
 OSDefineMetaClassAndAbstractStructors(IOFWUserCommand, OSObject)
 OSDefineMetaClassAndStructors(IOFWUserReadCommand, IOFWUserCommand)
@@ -39,7 +40,7 @@ IOFWUserCommand::free()
 			fCommand->cancel( kIOReturnAborted ) ;
 		}
 		
-		fCommand->release() ;
+		IOFWAsyncCommandPool::recycleCommand( fCommand ) ;
 		fCommand = NULL;
 	}
 
@@ -125,6 +126,25 @@ IOFWUserCommand::initWithSubmitParams(
 	return true ;
 }
 
+// sendCompletion
+//
+// completions of commands submitted with kFWCommandInterfaceCompletionQueue go through
+// the user client's completion queue, everything else gets a message of its own
+
+IOReturn
+IOFWUserCommand::sendCompletion(
+	IOReturn				status,
+	io_user_reference_t		args[],
+	UInt32					numArgs )
+{
+	if( fQueueCompletion )
+	{
+		return ((IOFireWireUserClient*)fUserClient)->queueCompletion( fAsyncRef, status, args, numArgs );
+	}
+	
+	return IOFireWireUserClient::sendAsyncResult64( fAsyncRef, status, args, numArgs );
+}
+
 
 void
 IOFWUserCommand::asyncReadWriteCommandCompletion(
@@ -149,7 +169,7 @@ IOFWUserCommand::asyncReadWriteCommandCompletion(
 #if IOFIREWIREDEBUG > 0
 		IOReturn		error = 
 #endif
-		IOFireWireUserClient::sendAsyncResult64( cmd->fAsyncRef, status, args, 3 );
+		cmd->sendCompletion( status, args, 3 );
 		
 		DebugLogCond ( error, "IOFWUserCommand::asyncReadWriteCommandCompletion: sendAsyncResult64 returned error %x\n", error ) ;
 	}
@@ -164,7 +184,12 @@ IOFWUserCommand::asyncReadQuadletCommandCompletion(
 {
 	IOFWUserCommand*	cmd = (IOFWUserCommand*)refcon ;
 
-	if (refcon && cmd->fAsyncRef[0] )
+	// tell the vector
+	if( cmd->fVectorCommand )
+	{
+		cmd->fVectorCommand->asyncCompletion( refcon, status, device, fwCmd );
+	}
+	else if (refcon && cmd->fAsyncRef[0] )
 	{
 		cmd->fOutputArgs[0] = cmd->fCommand->getAckCode();
 		cmd->fOutputArgs[1] = cmd->fCommand->getResponseCode();
@@ -173,7 +198,7 @@ IOFWUserCommand::asyncReadQuadletCommandCompletion(
 #if IOFIREWIREDEBUG > 0
 		IOReturn result =
 #endif
-		IOFireWireUserClient::sendAsyncResult64( cmd->fAsyncRef, status, (io_user_reference_t *)cmd->fOutputArgs, ( cmd->fCommand->getBytesTransferred() >> 2) + 2 ) ;
+		cmd->sendCompletion( status, (io_user_reference_t *)cmd->fOutputArgs, ( cmd->fCommand->getBytesTransferred() >> 2) + 2 ) ;
 		DebugLogCond ( result, "IOFireWireUserClient::asyncReadQuadletCommandCompletion: sendAsyncResult64 returned error 0x%08x\n", result) ;
 	}
 }
@@ -297,7 +322,7 @@ IOFWUserReadCommand::submit(
 		if (fCopyFlag != copyFlag)
 			if (fCommand)
 			{
-				fCommand->release() ;	// we had a normal command and need a quadlet command or vice-versa
+				IOFWAsyncCommandPool::recycleCommand( fCommand ) ;	// we had a normal command and need a quadlet command or vice-versa
 				fCommand = NULL ;
 			}
 
@@ -318,7 +343,7 @@ IOFWUserReadCommand::submit(
 					error = ((IOFWReadQuadCommand*)fCommand)->reinit( target_address,
 																	   fQuads,
 																	   fNumQuads,
-																	   & IOFWUserCommand::asyncReadWriteCommandCompletion,
+																	   & IOFWUserCommand::asyncReadQuadletCommandCompletion,
 																	   this,
 																	   params->newFailOnReset) ;
 				}
@@ -387,6 +412,9 @@ IOFWUserReadCommand::submit(
 			if (!fCommand)
 				error = kIOReturnNoMemory ;
 		}
+		
+		// remember which kind of command we hold so it is only rebuilt when that changes
+		fCopyFlag = copyFlag ;
 	}
 	
 	if ( not error )
@@ -534,7 +562,7 @@ IOFWUserWriteCommand::submit(
 		if (fCopyFlag != copyFlag)
 			if (fCommand)
 			{
-				fCommand->release() ;	// we had a normal command and need a quadlet command or vice-versa
+				IOFWAsyncCommandPool::recycleCommand( fCommand ) ;	// we had a normal command and need a quadlet command or vice-versa
 				fCommand = NULL ;
 			}
 
@@ -602,6 +630,9 @@ IOFWUserWriteCommand::submit(
 			if (!fCommand)
 				result = kIOReturnNoMemory ;
 		}
+		
+		// remember which kind of command we hold so it is only rebuilt when that changes
+		fCopyFlag = copyFlag ;
 	}
 	
 	if ( kIOReturnSuccess == result)
@@ -799,7 +830,7 @@ IOFWUserPHYCommand::asyncPHYCommandCompletion(
 #if IOFIREWIREDEBUG > 0
 		IOReturn		error = 
 #endif
-		IOFireWireUserClient::sendAsyncResult64( cmd->fAsyncRef, status, args, 3 );
+		cmd->sendCompletion( status, args, 3 );
 		
 		DebugLogCond ( error, "IOFWUserCommand::asyncReadWriteCommandCompletion: sendAsyncResult64 returned error %x\n", error ) ;
 	}
@@ -948,7 +979,12 @@ IOFWUserCompareSwapCommand::asyncCompletion(
 {
 	IOFWUserCompareSwapCommand*	cmd = (IOFWUserCompareSwapCommand*)refcon ;
 
-	if (refcon && cmd->fAsyncRef[0] )
+	// tell the vector
+	if( cmd->fVectorCommand )
+	{
+		cmd->fVectorCommand->asyncCompletion( refcon, status, device, fwCmd );
+	}
+	else if (refcon && cmd->fAsyncRef[0] )
 	{
 		UInt32 lock_value[2];
 		lock_value[0] = 0;
@@ -978,7 +1014,7 @@ IOFWUserCompareSwapCommand::asyncCompletion(
 #if IOFIREWIREDEBUG > 0
 		IOReturn error =
 #endif	
-		IOFireWireUserClient::sendAsyncResult64( cmd->fAsyncRef, status, args, 7 );
+		cmd->sendCompletion( status, args, 7 );
 		DebugLogCond ( error, "IOFireWireUserClient::asyncCompareSwapCommandCompletion: sendAsyncResult64 returned error 0x%08x\n", error ) ;
 
 
@@ -1174,7 +1210,7 @@ IOFWUserAsyncStreamCommand::asyncStreamCommandCompletion(void						*refcon,
 #if IOFIREWIREDEBUG > 0
 		IOReturn		error = 
 #endif
-		IOFireWireUserClient::sendAsyncResult64( cmd->fAsyncRef, status, args, 3 );
+		cmd->sendCompletion( status, args, 3 );
 		
 		DebugLogCond ( error, "IOFWUserCommand::asyncStreamCommandCompletion: sendAsyncResult64 returned error %x\n", error ) ;
 	}
@@ -84,8 +84,17 @@ public:
 	mach_vm_address_t			getRefCon( void )		
 										{ return fRefCon; }
 	
-	void						setVectorCommand( IOFWUserVectorCommand * vector ) 
-										{ fVectorCommand = vector; }
+	void						setVectorCommand( IOFWUserVectorCommand * vector, UInt32 index = 0, UInt32 node = 0 ) 
+										{ fVectorCommand = vector; fVectorIndex = index; fVectorNode = node; }
+	IOFWUserVectorCommand *		getVectorCommand( void )
+										{ return fVectorCommand; }
+	UInt32						getVectorIndex( void )
+										{ return fVectorIndex; }
+	UInt32						getVectorNode( void )
+										{ return fVectorNode; }
+
+	void						setQueueCompletion( bool queue )
+										{ fQueueCompletion = queue; }
 	
 	virtual IOFWAsyncCommand *		getAsyncCommand( void ) { return fCommand;  }
 										
@@ -103,6 +112,14 @@ protected:
 	bool							fFlush;
 	mach_vm_address_t				fRefCon;
 	IOFWUserVectorCommand *			fVectorCommand;
+	UInt32							fVectorIndex;		// entry in fVectorCommand's buffers
+	UInt32							fVectorNode;		// label pool the entry draws from
+	bool							fQueueCompletion;
+
+	IOReturn					sendCompletion(
+										IOReturn				status,
+										io_user_reference_t		args[],
+										UInt32					numArgs ) ;
 } ;
 
 class IOFWUserReadCommand: public IOFWUserCommand
@@ -138,6 +138,9 @@ IOFWUserObjectExporter::init()
 	if ( ! fLock )
 		return false ;
 	
+	fFreeHead = kNoSlot ;
+	fFreeTail = kNoSlot ;
+	
 	return super::init () ;
 }
 
@@ -156,6 +159,22 @@ IOFWUserObjectExporter::free ()
 
 	removeAllObjects () ;
 
+	for ( unsigned chunk = 0; chunk < kMaxChunks; ++chunk )
+	{
+		if ( fChunks[ chunk ] )
+		{
+			IOFree( fChunks[ chunk ], sizeof( Slot ) * kSlotsPerChunk ) ;
+			fChunks[ chunk ] = NULL ;
+		}
+	}
+	
+	if ( fBuckets )
+	{
+		IOFree( fBuckets, sizeof( UInt32 ) * fBucketCount ) ;
+		fBuckets = NULL ;
+		fBucketCount = 0 ;
+	}
+	
 	if ( fLock )
 		IOLockFree( fLock ) ;
 	
@@ -170,6 +189,17 @@ IOFWUserObjectExporter::serialize (
 {
 	lock() ;
 
+	OSArray * array = OSArray::withCapacity( fObjectCount ) ;
+	if ( array )
+	{
+		for ( UInt32 index = 0; index < fCapacity; ++index )
+		{
+			const OSObject * object = slotAt( index )->object ;
+			if ( object )
+				array->setObject( object ) ;
+		}
+	}
+	
 	const OSString * keys[ 3 ] =
 	{
 		OSString::withCString( "capacity" )
@@ -181,7 +211,7 @@ IOFWUserObjectExporter::serialize (
 	{
 		OSNumber::withNumber( (unsigned long long)fCapacity, 32 )
 		, OSNumber::withNumber( (unsigned long long)fObjectCount, 32 )
-		, fObjects ? OSArray::withObjects( fObjects, fObjectCount ) : OSArray::withCapacity(0)
+		, array
 	} ;
 	
 	OSDictionary * dict = OSDictionary::withObjects( objects, keys, sizeof( keys ) / sizeof( OSObject* ) ) ;
@@ -199,91 +229,211 @@ IOFWUserObjectExporter::serialize (
 	return result ;
 }
 
+// hashObject
+//
+// bucket for an object's address, objects are at least 16 byte aligned
+
+UInt32
+IOFWUserObjectExporter::hashObject ( const OSObject * obj, unsigned bucketCount )
+{
+	uintptr_t value = (uintptr_t)obj >> 4 ;
+	
+	return (UInt32)( value ^ ( value >> 12 ) ^ ( value >> 24 ) ) & ( bucketCount - 1 ) ;
+}
+
+// slotForHandle
+//
+// the slot a handle names, or kNoSlot if the handle is bad or stale. call with the lock held.
+// handles from method selectors have no generation bits to check.
+
+UInt32
+IOFWUserObjectExporter::slotForHandle ( IOFireWireLib::UserObjectHandle handle, bool checkGeneration ) const
+{
+	UInt32 index = ( (UInt32)handle & kHandleIndexMask ) ;	// handle is object's index + 1; this means 0 is always in invalid/NULL index...
+	if ( index == 0 || index > fCapacity )
+	{
+		return kNoSlot ;
+	}
+	
+	--index ;
+	
+	const Slot * slot = slotAt( index ) ;
+	if ( !slot->object || ( checkGeneration && ( slot->generation != ( (UInt32)handle >> kHandleIndexBits ) ) ) )
+	{
+		return kNoSlot ;
+	}
+	
+	return index ;
+}
+
+// growSlots
+//
+// adds a chunk of slots to the end of the free list. call with the lock held.
+
 IOReturn
-IOFWUserObjectExporter::addObject ( OSObject * obj, CleanupFunction cleanupFunction, IOFireWireLib::UserObjectHandle * outHandle )
+IOFWUserObjectExporter::growSlots ()
 {
-	IOReturn error = kIOReturnSuccess ;
+	if ( fCapacity >= kMaxSlots )
+	{
+		DebugLog( "Can't grow object exporter\n" ) ;
+		return kIOReturnNoMemory ;
+	}
 	
-	lock () ;
+	unsigned chunk = fCapacity / kSlotsPerChunk ;
 	
-	if ( ! fObjects )
+	fChunks[ chunk ] = (Slot *)IOMalloc( sizeof( Slot ) * kSlotsPerChunk ) ;
+	if ( !fChunks[ chunk ] )
 	{
-		fCapacity = 8 ;
-		fObjects = (const OSObject **) new const OSObject * [ fCapacity ] ;
-		fCleanupFunctions = new CleanupFunctionWithExporter[ fCapacity ] ;
-		
-		if ( ! fObjects || !fCleanupFunctions )
-		{
-			DebugLog( "Couldn't make fObjects\n" ) ;
-			error = kIOReturnNoMemory ;
-		}
+		return kIOReturnNoMemory ;
 	}
 	
-	// if at capacity, expand pool
-	if ( fObjectCount == fCapacity )
+	bzero( fChunks[ chunk ], sizeof( Slot ) * kSlotsPerChunk ) ;
+	
+	unsigned count = kMaxSlots - fCapacity ;
+	if ( count > kSlotsPerChunk )
+		count = kSlotsPerChunk ;
+	
+	UInt32 first = fCapacity ;
+	fCapacity += count ;
+	
+	for ( UInt32 index = first; index < first + count; ++index )
 	{
-		unsigned newCapacity = fCapacity + ( fCapacity >> 1 ) ;
-		if ( newCapacity > 0xFFFE )
-			newCapacity = 0xFFFE ;
-			
-		if ( newCapacity == fCapacity )	// can't grow!
-		{
-			DebugLog( "Can't grow object exporter\n" ) ;
-			error = kIOReturnNoMemory ;
-		}
-		
-		const OSObject ** newObjects = NULL ;
-		CleanupFunctionWithExporter * newCleanupFunctions = NULL ;
+		freeSlot( index ) ;
+	}
+	
+	return kIOReturnSuccess ;
+}
 
-		if ( ! error )
+// growBuckets
+//
+// doubles the reverse map so chains stay about one slot long. call with the lock held.
+
+IOReturn
+IOFWUserObjectExporter::growBuckets ()
+{
+	unsigned newCount = fBucketCount ? ( fBucketCount << 1 ) : 64 ;
+	
+	UInt32 * newBuckets = (UInt32 *)IOMalloc( sizeof( UInt32 ) * newCount ) ;
+	if ( !newBuckets )
+	{
+		return kIOReturnNoMemory ;
+	}
+	
+	memset( newBuckets, 0xFF, sizeof( UInt32 ) * newCount ) ;		// all kNoSlot
+	
+	if ( fBuckets )
+	{
+		IOFree( fBuckets, sizeof( UInt32 ) * fBucketCount ) ;
+	}
+	
+	fBuckets = newBuckets ;
+	fBucketCount = newCount ;
+	
+	for ( UInt32 index = 0; index < fCapacity; ++index )
+	{
+		if ( slotAt( index )->object )
 		{
-			newObjects = (const OSObject **) new OSObject * [ newCapacity ] ;
-		
-			if ( !newObjects )
-				error = kIOReturnNoMemory ;
+			hashInsert( index ) ;
 		}
-		
-		if ( !error )
+	}
+	
+	return kIOReturnSuccess ;
+}
+
+// hashInsert
+//
+//
+
+void
+IOFWUserObjectExporter::hashInsert ( UInt32 index )
+{
+	Slot * slot = slotAt( index ) ;
+	UInt32 bucket = hashObject( slot->object, fBucketCount ) ;
+	
+	slot->next = fBuckets[ bucket ] ;
+	fBuckets[ bucket ] = index ;
+}
+
+// hashRemove
+//
+//
+
+void
+IOFWUserObjectExporter::hashRemove ( UInt32 index )
+{
+	Slot * slot = slotAt( index ) ;
+	UInt32 * link = &fBuckets[ hashObject( slot->object, fBucketCount ) ] ;
+	
+	while ( *link != kNoSlot )
+	{
+		if ( *link == index )
 		{
-			newCleanupFunctions = new CleanupFunctionWithExporter[ newCapacity ] ;
-			if ( !newCleanupFunctions )
-				error = kIOReturnNoMemory ;
+			*link = slot->next ;
+			break ;
 		}
 		
-		if ( ! error )
-		{
-			bcopy ( fObjects, newObjects, fCapacity * sizeof ( OSObject * ) ) ;
-			delete[] fObjects ;
+		link = &slotAt( *link )->next ;
+	}
+	
+	slot->next = kNoSlot ;
+}
 
-			bcopy ( fCleanupFunctions, newCleanupFunctions, fCapacity * sizeof( CleanupFunction * ) ) ;
-			delete[] fCleanupFunctions ;
+// freeSlot
+//
+// puts an empty slot at the end of the free list, the slot at the front has been free the longest
 
-			fObjects = newObjects ;
-			fCleanupFunctions = newCleanupFunctions ;
-			fCapacity = newCapacity ;
-		}
+void
+IOFWUserObjectExporter::freeSlot ( UInt32 index )
+{
+	slotAt( index )->next = kNoSlot ;
+	
+	if ( fFreeTail == kNoSlot )
+	{
+		fFreeHead = index ;
+	}
+	else
+	{
+		slotAt( fFreeTail )->next = index ;
+	}
+	
+	fFreeTail = index ;
+}
+
+IOReturn
+IOFWUserObjectExporter::addObject ( OSObject * obj, CleanupFunction cleanupFunction, IOFireWireLib::UserObjectHandle * outHandle )
+{
+	IOReturn error = kIOReturnSuccess ;
+	
+	lock () ;
+	
+	if ( fFreeHead == kNoSlot )
+	{
+		error = growSlots() ;
+	}
+	
+	if ( !error && ( fObjectCount >= fBucketCount ) )
+	{
+		error = growBuckets() ;
 	}
 	
 	if ( ! error )
 	{
-		error = kIOReturnNoMemory ;
-		unsigned index = 0 ;
+		UInt32 index = fFreeHead ;
+		Slot * slot = slotAt( index ) ;
 		
-		while ( index < fCapacity )
+		fFreeHead = slot->next ;
+		if ( fFreeHead == kNoSlot )
 		{
-			if ( ! fObjects [ index ] )
-			{
-				obj->retain () ;
-				fObjects[ index ] = obj ;
-				fCleanupFunctions[ index ] = (CleanupFunctionWithExporter)cleanupFunction ;
-				*outHandle = (IOFireWireLib::UserObjectHandle)(index + 1) ;		// return index + 1; this means 0 is always an invalid/NULL index...
-				++fObjectCount ;
-				error = kIOReturnSuccess ;
-				break ;
-			}
-			
-			++index ;
+			fFreeTail = kNoSlot ;
 		}
+		
+		obj->retain () ;
+		slot->object = obj ;
+		slot->cleanup = (CleanupFunctionWithExporter)cleanupFunction ;
+		hashInsert( index ) ;
+		
+		*outHandle = makeHandle( index, slot->generation ) ;
+		++fObjectCount ;
 	}
 	
 	unlock () ;
@@ -305,25 +455,29 @@ IOFWUserObjectExporter::removeObject ( IOFireWireLib::UserObjectHandle handle )
 	
 	DebugLog("user object exporter removing handle %d\n", (uint32_t)handle);
 
-	unsigned index = (unsigned)handle - 1 ;		// handle is object's index + 1; this means 0 is always in invalid/NULL index...
-	
 	const OSObject * object = NULL ;
 	CleanupFunctionWithExporter cleanupFunction = NULL ;
 	
-	if ( fObjects && ( index < fCapacity ) )
+	UInt32 index = slotForHandle( handle ) ;
+	if ( index != kNoSlot )
 	{
-		if ( fObjects[ index ] )
-		{
-			DebugLog( "found object %p (%s), retain count=%d\n", fObjects[ index ], fObjects[ index ]->getMetaClass()->getClassName(), fObjects[ index ]->getRetainCount() );
-			
-			object = fObjects[ index ] ;
-			fObjects[ index ] = NULL ;
+		Slot * slot = slotAt( index ) ;
+		
+		DebugLog( "found object %p (%s), retain count=%d\n", slot->object, slot->object->getMetaClass()->getClassName(), slot->object->getRetainCount() );
+		
+		hashRemove( index ) ;
+		
+		object = slot->object ;
+		slot->object = NULL ;
 
-			cleanupFunction = fCleanupFunctions[ index ] ;				
-			fCleanupFunctions[ index ] = NULL ;
-			
-			--fObjectCount ;
-		}
+		cleanupFunction = slot->cleanup ;
+		slot->cleanup = NULL ;
+		
+		// outstanding copies of this handle no longer match the slot
+		slot->generation = ( slot->generation + 1 ) & kHandleGenerationMask ;
+		freeSlot( index ) ;
+		
+		--fObjectCount ;
 	}
 
 	unlock () ;
@@ -353,17 +507,21 @@ IOFWUserObjectExporter::lookupHandle ( OSObject * object ) const
 	
 	lock () ;
 
-	unsigned index = 0 ;
-	
-	while ( index < fCapacity )
+	if ( fBuckets )
 	{
-		if( fObjects[index] == object )
+		UInt32 index = fBuckets[ hashObject( object, fBucketCount ) ] ;
+		
+		while ( index != kNoSlot )
 		{
-			out_handle = (IOFireWireLib::UserObjectHandle)(index + 1) ;		// return index + 1; this means 0 is always an invalid/NULL index...
-			break;
+			const Slot * slot = slotAt( index ) ;
+			if( slot->object == object )
+			{
+				out_handle = makeHandle( index, slot->generation ) ;
+				break;
+			}
+			
+			index = slot->next ;
 		}
-		
-		++index;
 	}
 	
 	unlock ();
@@ -383,15 +541,35 @@ IOFWUserObjectExporter::lookupObject ( IOFireWireLib::UserObjectHandle handle )
 	
 	lock () ;
 	
-	unsigned index = (unsigned)handle - 1 ;
+	UInt32 index = slotForHandle( handle ) ;
+	if ( index != kNoSlot )
+	{
+		result = slotAt( index )->object ;
+		result->retain() ;
+	}
+		
+	unlock () ;
 	
-	if ( fObjects && ( index < fCapacity ) )
+	return result ;
+}
+
+const OSObject *
+IOFWUserObjectExporter::lookupObjectForIndex ( IOFireWireLib::UserObjectHandle handle ) const
+{
+	if ( !handle )
 	{
-		result = fObjects [ index ] ;
-		if ( result )
-		{
-			result->retain() ;
-		}
+		return NULL ;
+	}
+
+	const OSObject * result = NULL ;
+	
+	lock () ;
+	
+	UInt32 index = slotForHandle( handle & kHandleIndexMask, false ) ;
+	if ( index != kNoSlot )
+	{
+		result = slotAt( index )->object ;
+		result->retain() ;
 	}
 		
 	unlock () ;
@@ -411,11 +589,10 @@ IOFWUserObjectExporter::lookupObjectForType( IOFireWireLib::UserObjectHandle han
 	
 	lock ();
 	
-	unsigned index = (unsigned)handle - 1;
-	
-	if ( fObjects && ( index < fCapacity ) )
+	UInt32 index = slotForHandle( handle );
+	if ( index != kNoSlot )
 	{
-		result = fObjects [ index ];
+		result = slotAt( index )->object;
 	}
 	
 	if( result )
@@ -441,52 +618,60 @@ IOFWUserObjectExporter::removeAllObjects ()
 	const OSObject ** objects = NULL ;
 	CleanupFunctionWithExporter * cleanupFunctions = NULL ;
 
-	unsigned capacity = fCapacity ;
+	unsigned count = fObjectCount ;
 
-	if ( fObjects )
+	if ( count )
 	{		
-		objects = (const OSObject **)IOMalloc( sizeof(const OSObject *) * capacity ) ;
-		cleanupFunctions = (CleanupFunctionWithExporter*)IOMalloc( sizeof( CleanupFunctionWithExporter ) * capacity ) ;
+		objects = (const OSObject **)IOMalloc( sizeof(const OSObject *) * count ) ;
+		cleanupFunctions = (CleanupFunctionWithExporter*)IOMalloc( sizeof( CleanupFunctionWithExporter ) * count ) ;
 	
-		if ( objects )
-			bcopy( fObjects, objects, sizeof( const OSObject * ) * capacity ) ;
-		
-		if ( cleanupFunctions )
-			bcopy( fCleanupFunctions, cleanupFunctions, sizeof( CleanupFunction) * capacity ) ;
+		unsigned found = 0 ;
+		for ( UInt32 index = 0; index < fCapacity; ++index )
+		{
+			Slot * slot = slotAt( index ) ;
+			if ( !slot->object )
+				continue ;
 			
-		delete[] fObjects ;
-		fObjects = NULL ;
+			if ( objects && cleanupFunctions )
+			{
+				objects[ found ] = slot->object ;
+				cleanupFunctions[ found ] = slot->cleanup ;
+				++found ;
+			}
+			
+			hashRemove( index ) ;
+			slot->object = NULL ;
+			slot->cleanup = NULL ;
+			slot->generation = ( slot->generation + 1 ) & kHandleGenerationMask ;
+			freeSlot( index ) ;
+		}
 		
-		delete[] fCleanupFunctions ;
-		fCleanupFunctions = NULL ;		
-
 		fObjectCount = 0 ;
-		fCapacity = 0 ;
 	}
 	
 	unlock() ;
 
 	if ( objects && cleanupFunctions )
 	{
-		for ( unsigned index=0; index < capacity; ++index )
+		for ( unsigned index=0; index < count; ++index )
 		{
-			if ( objects[index] )
+			InfoLog("IOFWUserObjectExporter<%p>::removeAllObjects() -- remove object %p of class %s\n", this, objects[ index ], objects[ index ]->getMetaClass()->getClassName() ) ;
+			
+			if ( cleanupFunctions[ index ] )
 			{
-				InfoLog("IOFWUserObjectExporter<%p>::removeAllObjects() -- remove object %p of class %s\n", this, objects[ index ], objects[ index ]->getMetaClass()->getClassName() ) ;
-				
-				if ( cleanupFunctions[ index ] )
-				{
-					InfoLog("IOFWUserObjectExporter<%p>::removeAllObjects() -- calling cleanup function for object %p of type %s\n", this, objects[ index ], objects[ index ]->getMetaClass()->getClassName() ) ;
-					(*cleanupFunctions[ index ])( objects[ index ], this ) ;
-				}
-				
-				objects[index]->release() ;
+				InfoLog("IOFWUserObjectExporter<%p>::removeAllObjects() -- calling cleanup function for object %p of type %s\n", this, objects[ index ], objects[ index ]->getMetaClass()->getClassName() ) ;
+				(*cleanupFunctions[ index ])( objects[ index ], this ) ;
 			}
+			
+			objects[index]->release() ;
 		}
-
-		IOFree( objects, sizeof(const OSObject *) * capacity ) ;
-		IOFree( cleanupFunctions, sizeof( CleanupFunction ) * capacity ) ;
 	}
+	
+	if ( objects )
+		IOFree( objects, sizeof(const OSObject *) * count ) ;
+	
+	if ( cleanupFunctions )
+		IOFree( cleanupFunctions, sizeof( CleanupFunctionWithExporter ) * count ) ;
 }
 
 // getOwner
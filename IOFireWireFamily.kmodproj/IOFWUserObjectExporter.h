@@ -42,13 +42,53 @@
 			
 		private :
 		
+			// A handle is ( generation << kHandleIndexBits ) | ( slot index + 1 ), so 0 is never
+			// a valid handle. The generation is checked when the whole handle is passed as a
+			// scalar argument. Handles that reach us in the top 16 bits of a method selector
+			// only carry the index, see lookupObjectForIndex. Freed slots are reused oldest first.
+			
+			enum
+			{
+				kHandleIndexBits			= 16,
+				kHandleIndexMask			= (1 << kHandleIndexBits) - 1,
+				kHandleGenerationMask		= (1 << (32 - kHandleIndexBits)) - 1,
+				kMaxSlots					= kHandleIndexMask,
+				kSlotsPerChunk				= 256,
+				kMaxChunks					= (kMaxSlots + kSlotsPerChunk - 1) / kSlotsPerChunk,
+				kNoSlot						= 0xFFFFFFFF
+			} ;
+			
+			struct Slot
+			{
+				const OSObject *				object ;
+				CleanupFunctionWithExporter		cleanup ;
+				UInt32							generation ;
+				UInt32							next ;			// free list when empty, hash chain when in use
+			} ;
+			
 			unsigned							fCapacity;
 			unsigned							fObjectCount;
-			const OSObject **					fObjects;
-			CleanupFunctionWithExporter *		fCleanupFunctions;
+			Slot *								fChunks[ kMaxChunks ];		// allocated as the table grows, never moved
+			UInt32								fFreeHead;
+			UInt32								fFreeTail;
+			UInt32 *							fBuckets;					// object address -> first slot of its chain
+			unsigned							fBucketCount;
 			IOLock *							fLock;
 			OSObject *							fOwner;
 			
+			Slot *					slotAt ( UInt32 index ) const
+										{ return &fChunks[ index / kSlotsPerChunk ][ index % kSlotsPerChunk ] ; }
+			static IOFireWireLib::UserObjectHandle	makeHandle ( UInt32 index, UInt32 generation )
+										{ return (IOFireWireLib::UserObjectHandle)( (generation << kHandleIndexBits) | (index + 1) ) ; }
+			static UInt32			hashObject ( const OSObject * obj, unsigned bucketCount ) ;
+			
+			UInt32					slotForHandle ( IOFireWireLib::UserObjectHandle handle, bool checkGeneration = true ) const ;
+			IOReturn				growSlots () ;
+			IOReturn				growBuckets () ;
+			void					hashInsert ( UInt32 index ) ;
+			void					hashRemove ( UInt32 index ) ;
+			void					freeSlot ( UInt32 index ) ;
+			
 		public :
 		
 			static IOFWUserObjectExporter *		createWithOwner( OSObject * owner );
@@ -68,6 +108,9 @@
 			// Release the returned value when you're done!!
 			const OSObject *		lookupObject ( IOFireWireLib::UserObjectHandle handle ) const;
 			const OSObject *		lookupObjectForType( IOFireWireLib::UserObjectHandle handle, const OSMetaClass * toType ) const;
+			
+			// for a handle cut down to its index bits, as in a method selector. Also retained.
+			const OSObject *		lookupObjectForIndex ( IOFireWireLib::UserObjectHandle handle ) const;
 			void					removeAllObjects ();
 
 			void					lock () const;
@@ -321,6 +321,10 @@ IOFWUserPseudoAddressSpace::serialize(OSSerialize *s) const
 			snprintf(temp+strlen(temp), sizeof(temp), " shared") ;
 		if (fFlags & kFWAddressSpaceExclusive)
 			snprintf(temp+strlen(temp), sizeof(temp), " exclusive") ;			
+		if (fFlags & kFWAddressSpaceAutoRetireWrites)
+			snprintf(temp+strlen(temp), sizeof(temp), " auto-retire") ;
+		if (fFlags & kFWAddressSpaceAutoLockReply)
+			snprintf(temp+strlen(temp), sizeof(temp), " auto-lock") ;
 	}
 	else
 	{
@@ -348,6 +352,8 @@ IOFWUserPseudoAddressSpace::free()
 		fPacketQueue = NULL;
 	}
 	
+	releaseLockMap() ;
+	
 	if ( fBackingStorePrepared )
 		fDesc->complete() ;
 
@@ -399,6 +405,8 @@ IOFWUserPseudoAddressSpace::deactivate()
 	
 	}
 	
+	releaseLockMap() ;
+	
 	if ( fBackingStorePrepared )
 	{
 		fDesc->complete() ;
@@ -528,6 +536,15 @@ IOFWUserPseudoAddressSpace::completeInit( IOFireWireUserClient* userclient, Addr
 			}
 		}
 
+		if (params->flags & kFWAddressSpaceAutoLockReply)
+		{
+			if (params->backingStore)
+				fUserLocks = false ;
+			else
+			{	// this macro needs braces
+				DebugLog("IOFireWireUserClient::allocateAddressSpace(): can't create auto-lock address space w/o backing store!\n") ;
+			}
+		}
 	}
 	
 	return status ;
@@ -578,6 +595,11 @@ UInt32 IOFWUserPseudoAddressSpace::doLock(UInt16 nodeID, IOFWSpeed &speed, FWAdd
                         const UInt32 *newVal, UInt32 &outLen, UInt32 *oldVal, UInt32 type,
                           IOFWRequestRefCon refcon)
 {
+	// locks are made on the backing store in the kernel, the client is not told of them.
+	// still needs both read and write access, as compare/swap always has.
+	if ( (fFlags & kFWAddressSpaceAutoLockReply) && fDesc && fReader && fWriter )
+		return lockBackingStore( nodeID, addr, inLen, newVal, outLen, oldVal, type ) ;
+	
 	if ( fUserLocks )
 	{
 	    if(addr.addressHi != fBase.addressHi)
@@ -621,11 +643,18 @@ IOFWUserPseudoAddressSpace::doPacket(
 	// 6. Send notification of next packet ???
 	// ...
 	// 7. When client complete, mark header free and send notification for next packet ???
-	
+	//
+	// With kFWAddressSpaceAutoRetireWrites every packet is notified as it arrives, and the
+	// writes at the front that the library has moved the queue head past are retired here
+	// rather than by a call from the library, as are skipped packet notices.
+
 	DebugLog("doPacket\n");
 
 	if ( !fPacketQueue ) DebugLog("\tdP fPacketQueue is invalid!\n");
 	
+	if ( fFlags & kFWAddressSpaceAutoRetireWrites )
+		retireWrites() ;
+
 	if ( tag == IOFWPacketHeader::kIncomingPacket || tag == IOFWPacketHeader::kLockPacket ) {
 		skip = !(fPacketQueue->isSpaceAvailable(len, &destOffset));
 	}
@@ -653,9 +682,10 @@ IOFWUserPseudoAddressSpace::doPacket(
 		if ( skip )
 		{
 			// create a skipped packet header if last one wasn't a skipped pkt,
-			// otherwise, bump count and reuse header
-			
-			if (IsSkippedPacketHeader(fLastWrittenHeader))
+			// otherwise, bump count and reuse header. A header that has already
+			// been notified can't be reused when notifications don't wait.
+
+			if (IsSkippedPacketHeader(fLastWrittenHeader) && !(fFlags & kFWAddressSpaceAutoRetireWrites))
 				++(fLastWrittenHeader->SkippedPacket.skippedPacketCount) ;
 			else
 			{
@@ -667,11 +697,12 @@ IOFWUserPseudoAddressSpace::doPacket(
 						newHeader->CommonHeader.next = fLastWrittenHeader->CommonHeader.next ;
 						fLastWrittenHeader->CommonHeader.next = newHeader ;
 					}
-
-					currentHeader = fLastWrittenHeader->CommonHeader.next ;
-
 				}
-
+				
+				// as for other packets, the header after the last written one is next in
+				// line even when the last written one has been retired already
+				currentHeader = fLastWrittenHeader->CommonHeader.next ;
+				
 				InitSkippedPacketHeader(
 						currentHeader,
 						currentHeader->CommonHeader.next,
@@ -718,6 +749,7 @@ IOFWUserPseudoAddressSpace::doPacket(
 
 					// zzz this write should probably be eliminated when kFWAddressSpaceAutoCopyOnWrite is set..
 					enqueued = fPacketQueue->enqueueBytes((void *)buf, len);
+					currentHeader->CommonHeader.queueEntry = fPacketQueue->getEnqueueCount() ;
 					
 					DebugLog("\tdP Write: Copy cmd ID: 0x%llx %s\n", currentHeader->IncomingPacket.commandID, enqueued ? "succeeded" : "failed");
 					
@@ -740,6 +772,7 @@ IOFWUserPseudoAddressSpace::doPacket(
 		
 					// copy data to queue
 					enqueued = fPacketQueue->enqueueBytes((void *)buf, len);
+					currentHeader->CommonHeader.queueEntry = fPacketQueue->getEnqueueCount() ;
 					response = kFWResponsePending ;
 					
 					DebugLog("\tdP Lock: Copy cmd ID: 0x%llx %s\n", currentHeader->IncomingPacket.commandID, enqueued ? "succeeded" : "failed");
@@ -843,60 +876,23 @@ IOFWUserPseudoAddressSpace::clientCommandIsComplete(
 	FWClientCommandID 	inCommandID,
 	IOReturn			inResult)
 {
+	if ( fFlags & kFWAddressSpaceAutoRetireWrites )
+	{
+		// packets don't wait on each other, so this one may have others in front of it
+		clientCommandsAreComplete( inCommandID, inResult ) ;
+		return ;
+	}
+	
 	IOLockLock(fLock) ;
-
+	
 	if ( fWaitingForUserCompletion )
 	{
 		IOFWPacketHeader*			oldHeader 	= fLastReadHeader ;
-		IOFWPacketHeader::QueueTag	type 		= oldHeader->CommonHeader.type ;
 		fLastReadHeader = fLastReadHeader->CommonHeader.next ;
 		
-		DebugLog("Cplt cmdID: 0x%llx\n", oldHeader->IncomingPacket.commandID);
-		
-		switch(type)
-		{
-			case IOFWPacketHeader::kLockPacket:
-			{
-				DebugLog("\tCplt lock\n");
-				fUserClient->getOwner()->getController()->asyncLockResponse( oldHeader->IncomingPacket.generation,
-																			oldHeader->IncomingPacket.nodeID, 
-																			oldHeader->IncomingPacket.speed,
-																			fDesc,//fBackingStore
-																			oldHeader->IncomingPacket.addrLo - fAddress.addressLo,
-																			oldHeader->IncomingPacket.packetSize >> 1,
-																			(void*)oldHeader->IncomingPacket.reqrefcon ) ;
-			}
-			// fall through
-				
-			case IOFWPacketHeader::kIncomingPacket:
-			{
-				DebugLog("\tCplt write\n");
-				fPacketQueue->dequeueBytes(oldHeader->IncomingPacket.packetSize);
-				break ;
-			}
-				
-			case IOFWPacketHeader::kReadPacket:
-			{
-				DebugLog("\tCplt read\n");
-                    fUserClient->getOwner()->getController()->asyncReadResponse( oldHeader->ReadPacket.generation,
-                                                                                oldHeader->ReadPacket.nodeID, 
-                                                                                oldHeader->ReadPacket.speed,
-                                                                                fDesc,//fBackingStore
-                                                                                oldHeader->ReadPacket.addrLo - fAddress.addressLo,
-                                                                                oldHeader->ReadPacket.packetSize,
-                                                                                (void*)oldHeader->ReadPacket.reqrefcon ) ;
-				break;
-			}
-				
-			default:
-				// nothing...
-				DebugLog("\tCplt type %u\n", type); 
-				break ;
-		}
-		
-		oldHeader->CommonHeader.type = IOFWPacketHeader::kFree ;
+		retireHeader( oldHeader ) ;
 		fWaitingForUserCompletion = false ;
-	
+		
 		// send *next* packet notification
 		if ( fLastReadHeader->CommonHeader.type != IOFWPacketHeader::kFree )
 		{
@@ -904,10 +900,154 @@ IOFWUserPseudoAddressSpace::clientCommandIsComplete(
 			sendPacketNotification(fLastReadHeader) ;
 		}
 	}
+	
+	IOLockUnlock(fLock) ;
+}
 
+// clientCommandsAreComplete
+//
+// Retires every outstanding packet up to and including inLastCommandID in one go. Only
+// address spaces created with kFWAddressSpaceAutoRetireWrites have more than one
+// packet outstanding, for the others this is the same as clientCommandIsComplete.
+
+void
+IOFWUserPseudoAddressSpace::clientCommandsAreComplete(
+	FWClientCommandID 	inLastCommandID,
+	IOReturn			inResult)
+{
+	if ( !(fFlags & kFWAddressSpaceAutoRetireWrites) )
+	{
+		clientCommandIsComplete( inLastCommandID, inResult ) ;
+		return ;
+	}
+	
+	IOLockLock(fLock) ;
+	
+	// don't retire anything unless inLastCommandID is still outstanding, a stale
+	// command ID may name a header that has been reused for a later packet
+	IOFWPacketHeader *	lastHeader	= NULL ;
+	IOFWPacketHeader *	header		= fLastReadHeader ;
+	
+	while ( header && !IsFreePacketHeader(header) )
+	{
+		if ( header->CommonHeader.args[0] == (io_user_reference_t)inLastCommandID )
+		{
+			lastHeader = header ;
+			break ;
+		}
+		
+		header = header->CommonHeader.next ;
+		if ( header == fLastReadHeader )
+			break ;
+	}
+	
+	if ( lastHeader )
+	{
+		IOFWPacketHeader * oldHeader ;
+		do
+		{
+			oldHeader = fLastReadHeader ;
+			fLastReadHeader = fLastReadHeader->CommonHeader.next ;
+			retireHeader( oldHeader ) ;
+		} while ( oldHeader != lastHeader ) ;
+	}
+	else
+	{
+		DebugLog("Cplt cmdID: 0x%llx not outstanding\n", (io_user_reference_t)inLastCommandID);
+	}
+	
+	retireWrites() ;
+	
 	IOLockUnlock(fLock) ;
 }
 
+// retireHeader
+//
+// Sends the response a packet is waiting on, if any, and frees its header. The caller
+// has already moved fLastReadHeader past it and holds fLock.
+
+void
+IOFWUserPseudoAddressSpace::retireHeader(
+	IOFWPacketHeader*	oldHeader)
+{
+	IOFWPacketHeader::QueueTag	type 		= oldHeader->CommonHeader.type ;
+
+	DebugLog("Cplt cmdID: 0x%llx\n", oldHeader->IncomingPacket.commandID);
+	
+	switch(type)
+	{
+		case IOFWPacketHeader::kLockPacket:
+		{
+			DebugLog("\tCplt lock\n");
+			fUserClient->getOwner()->getController()->asyncLockResponse( oldHeader->IncomingPacket.generation,
+																		oldHeader->IncomingPacket.nodeID, 
+																		oldHeader->IncomingPacket.speed,
+																		fDesc,//fBackingStore
+																		oldHeader->IncomingPacket.addrLo - fAddress.addressLo,
+																		oldHeader->IncomingPacket.packetSize >> 1,
+																		(void*)oldHeader->IncomingPacket.reqrefcon ) ;
+		}
+		// fall through
+		
+		case IOFWPacketHeader::kIncomingPacket:
+		{
+			DebugLog("\tCplt write\n");
+			// the library has already moved the queue head past this packet
+			break ;
+		}
+		
+		case IOFWPacketHeader::kReadPacket:
+		{
+			DebugLog("\tCplt read\n");
+			fUserClient->getOwner()->getController()->asyncReadResponse( oldHeader->ReadPacket.generation,
+																		oldHeader->ReadPacket.nodeID, 
+																		oldHeader->ReadPacket.speed,
+																		fDesc,//fBackingStore
+																		oldHeader->ReadPacket.addrLo - fAddress.addressLo,
+																		oldHeader->ReadPacket.packetSize,
+																		(void*)oldHeader->ReadPacket.reqrefcon ) ;
+			break;
+		}
+		
+		default:
+			// nothing...
+			DebugLog("\tCplt type %u\n", type); 
+			break ;
+	}
+	
+	oldHeader->CommonHeader.type = IOFWPacketHeader::kFree ;
+}
+
+// retireWrites
+//
+// Frees the headers at the front that nothing waits on any more, writes once the library
+// has moved the queue head past their packets and notices of skipped packets, which
+// don't need completing in this mode. Stops at the first packet that still needs a call
+// from the library. Called with fLock held.
+
+void
+IOFWUserPseudoAddressSpace::retireWrites()
+{
+	while ( fLastReadHeader )
+	{
+		IOFWPacketHeader::QueueTag type = fLastReadHeader->CommonHeader.type ;
+		
+		if ( type == IOFWPacketHeader::kIncomingPacket )
+		{
+			if ( !fPacketQueue->isRetired( fLastReadHeader->CommonHeader.queueEntry ) )
+				break ;
+		}
+		else if ( type != IOFWPacketHeader::kSkippedPacket )
+		{
+			break ;
+		}
+		
+		IOFWPacketHeader * oldHeader = fLastReadHeader ;
+		fLastReadHeader = fLastReadHeader->CommonHeader.next ;
+		retireHeader( oldHeader ) ;
+	}
+}
+
 void
 IOFWUserPseudoAddressSpace::sendPacketNotification(
 	IOFWPacketHeader*	inPacketHeader)
@@ -952,7 +1092,10 @@ IOFWUserPseudoAddressSpace::sendPacketNotification(
 							kIOReturnSuccess,
 							(io_user_reference_t*)inPacketHeader->CommonHeader.args,
 							inPacketHeader->CommonHeader.argCount) ;
-			fWaitingForUserCompletion = true ;
+			
+			// without kFWAddressSpaceAutoRetireWrites the next packet waits for this one
+			if ( !(fFlags & kFWAddressSpaceAutoRetireWrites) )
+				fWaitingForUserCompletion = true ;
 		}
 	}
 }
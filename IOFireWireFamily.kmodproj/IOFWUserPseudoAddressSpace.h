@@ -112,6 +112,7 @@ typedef union IOFWPacketHeader_t
         UInt32						argCount ;
         io_user_reference_t			headerSize ;		// only valid for skipped packets
 		io_user_reference_t			headerOffset ;		// only valid for skipped packets
+		UInt32						queueEntry ;		// only valid for writes and locks
         
         io_user_reference_t			args[9] ;
     } CommonHeader ;
@@ -125,6 +126,7 @@ typedef union IOFWPacketHeader_t
         UInt32						argCount ;
 		io_user_reference_t			headerSize ;		// only valid for skipped packets
 		io_user_reference_t			headerOffset ;		// only valid for skipped packets
+		UInt32						queueEntry ;		// only valid for writes and locks
         // -----------------------------------------------
         
         io_user_reference_t			commandID ;			//	0
@@ -149,6 +151,7 @@ typedef union IOFWPacketHeader_t
         UInt32						argCount ;
 		io_user_reference_t			headerSize ;		// only valid for skipped packets
 		io_user_reference_t			headerOffset ;		// only valid for skipped packets
+		UInt32						queueEntry ;		// only valid for writes and locks
         // -----------------------------------------------
 
         io_user_reference_t					commandID ;			//	0
@@ -164,6 +167,7 @@ typedef union IOFWPacketHeader_t
 		UInt32						argCount ;
 		io_user_reference_t			headerSize ;		// only valid for skipped packets
 		io_user_reference_t			headerOffset ;		// only valid for skipped packets
+		UInt32						queueEntry ;		// only valid for writes and locks
 		// -----------------------------------------------
 
         io_user_reference_t			commandID ;			//	0
@@ -305,9 +309,16 @@ public:
 	void							clientCommandIsComplete(
 											FWClientCommandID		inCommandID,
 											IOReturn				inResult ) ;
+	void							clientCommandsAreComplete(
+											FWClientCommandID		inLastCommandID,
+											IOReturn				inResult ) ;
 	void							sendPacketNotification(
 											IOFWPacketHeader*		inPacketHeader) ;
 private:
+	void							retireHeader(
+											IOFWPacketHeader*		inPacketHeader) ;
+	void							retireWrites() ;
+
 	IOFWRingBufferQ *			fPacketQueue;					// the queue where incoming packets go before being written to the backingstore
 	IOLock*						fLock ;							// to lock this object
 
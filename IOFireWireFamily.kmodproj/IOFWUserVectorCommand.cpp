@@ -96,7 +96,7 @@ IOFWUserVectorCommand::free( void )
 #pragma mark -
 /////////////////////////////////////////////////////////////////////////////////
 
-// submit
+// setBuffers
 //
 //
 
@@ -114,50 +114,64 @@ IOFWUserVectorCommand::setBuffers(	mach_vm_address_t submit_buffer_address, mach
 	
 	if( status == kIOReturnSuccess )
 	{
-		if( fSubmitDesc )
+		// the busy check and the swap go together, or a submit could start on the old buffers
+		fControl->closeGate();
+		
+		if( fEntryCount != 0 )
 		{
-			fSubmitDesc->complete();
-			fSubmitDesc->release();
-			fSubmitDesc = NULL;
+			// the running submit is still reading and writing the old buffers
+			status = kIOReturnBusy;
 		}
+		
+		if( status == kIOReturnSuccess )
+		{
+			if( fSubmitDesc )
+			{
+				fSubmitDesc->complete();
+				fSubmitDesc->release();
+				fSubmitDesc = NULL;
+			}
 
-		fSubmitDesc = IOMemoryDescriptor::withAddressRange(	submit_buffer_address, 
-															submit_buffer_size, 
-															kIODirectionOut, 
-															fUserClient->getOwningTask() );
-		if( fSubmitDesc == NULL )
+			fSubmitDesc = IOMemoryDescriptor::withAddressRange(	submit_buffer_address, 
+																submit_buffer_size, 
+																kIODirectionOut, 
+																fUserClient->getOwningTask() );
+			if( fSubmitDesc == NULL )
+			{
+				status = kIOReturnNoMemory;
+			}
+		}
+		
+		if( status == kIOReturnSuccess )
 		{
-			status = kIOReturnNoMemory;
+			status = fSubmitDesc->prepare();
 		}
-	}
-	
-	if( status == kIOReturnSuccess )
-	{
-		status = fSubmitDesc->prepare();
-	}
 
-	if( status == kIOReturnSuccess )
-	{
-		if( fResultDesc )
+		if( status == kIOReturnSuccess )
 		{
-			fResultDesc->complete();
-			fResultDesc->release();
-			fResultDesc = NULL;
+			if( fResultDesc )
+			{
+				fResultDesc->complete();
+				fResultDesc->release();
+				fResultDesc = NULL;
+			}
+
+			fResultDesc = IOMemoryDescriptor::withAddressRange(	result_buffer_address, 
+																result_buffer_size, 
+																kIODirectionIn, 
+																fUserClient->getOwningTask() );
+			if( fResultDesc == NULL )
+			{
+				status = kIOReturnNoMemory;
+			}
 		}
 
-		fResultDesc = IOMemoryDescriptor::withAddressRange(	result_buffer_address, 
-															result_buffer_size, 
-															kIODirectionIn, 
-															fUserClient->getOwningTask() );
-		if( fResultDesc == NULL )
+		if( status == kIOReturnSuccess )
 		{
-			status = kIOReturnNoMemory;
+			status = fResultDesc->prepare();
 		}
-	}
-
-	if( status == kIOReturnSuccess )
-	{
-		status = fResultDesc->prepare();
+		
+		fControl->openGate();
 	}
 		
 	return status;
@@ -165,48 +179,193 @@ IOFWUserVectorCommand::setBuffers(	mach_vm_address_t submit_buffer_address, mach
 
 // submit
 //
-//
+// runs the first count entries of the submit buffer, flags are the vector's
+// kFWVectorCommandInterface flags
 
 IOReturn 
-IOFWUserVectorCommand::submit( OSAsyncReference64 async_ref, mach_vm_address_t callback, io_user_reference_t refCon )
+IOFWUserVectorCommand::submit( OSAsyncReference64 async_ref, mach_vm_address_t callback, io_user_reference_t refCon,
+							   UInt32 count, UInt32 flags )
 {
 	IOReturn status = kIOReturnSuccess;
 	
-	if( fSubmitDesc == NULL )
+	// setBuffers swaps the buffers under the gate
+	fControl->closeGate();
+	
+	if( (fSubmitDesc == NULL) || (fResultDesc == NULL) )
 	{
 		status = kIOReturnNoMemory;
 	}
 	
 	if( status == kIOReturnSuccess )
 	{
-		IOFireWireUserClient::setAsyncReference64( fAsyncRef, (mach_port_t)async_ref[0], callback, refCon );
+		if( (count == 0) ||
+			(count > (fSubmitDesc->getLength() / sizeof(VectorSubmitParams))) ||
+			(count > (fResultDesc->getLength() / sizeof(VectorSubmitResult))) )
+		{
+			status = kIOReturnBadArgument;
+		}
 	}
 	
 	if( status == kIOReturnSuccess )
 	{
-		fControl->closeGate();
+		if( fEntryCount != 0 )
+		{
+			// the last submit is still running
+			status = kIOReturnBusy;
+		}
 		
-		fInflightCmds = 0;
-		fResultOffset = 0;
-		fVectorStatus = kIOReturnSuccess;
+		if( status == kIOReturnSuccess )
+		{
+			IOFireWireUserClient::setAsyncReference64( fAsyncRef, (mach_port_t)async_ref[0], callback, refCon );
+			
+			fFlags = flags;
+			fEntryCount = count;
+			fNextEntry = 0;
+			fInflightCmds = 0;
+			bzero( fNodeInflight, sizeof(fNodeInflight) );
+			fDeferredCount = 0;
+			fFenced = false;
+			fVectorStatus = kIOReturnSuccess;
+			
+			// our commands point back at us, stay around until the last one completes
+			retain();
+			
+			dispatchCommands();
+		}
+	}
+	
+	fControl->openGate();
+	
+	return status;
+}
+
+// dispatchCommands
+//
+// sends entries in order until one has to wait for a barrier and picks up from there as
+// commands complete. an entry for a node that has used up its share of labels is set
+// aside and later entries go to the other nodes, up to kVectorCommandMaxDeferred of them.
+// completions that come in while we are submitting just update the counts, the pass
+// already underway carries on.
+
+void
+IOFWUserVectorCommand::dispatchCommands( void )
+{
+	if( fDispatching )
+	{
+		return;
+	}
+	
+	fDispatching = true;
+	
+	// entries set aside go first, in order, once their node has room
+	UInt32 kept = 0;
+	for( UInt32 i = 0; i < fDeferredCount; i++ )
+	{
+		UInt32 node = fDeferredNode[i];
+		if( fNodeInflight[node] >= kVectorCommandMaxNodeInflight )
+		{
+			fDeferred[kept] = fDeferred[i];
+			fDeferredNode[kept] = node;
+			kept++;
+			continue;
+		}
+		
+		VectorSubmitParams entry;
+		fSubmitDesc->readBytes( fDeferred[i] * sizeof(VectorSubmitParams), &entry, sizeof(VectorSubmitParams) );
 		
-		mach_vm_size_t offset = 0;
-		mach_vm_size_t length = sizeof(CommandSubmitParams);
-		mach_vm_size_t size = fSubmitDesc->getLength();
-		while( (status == kIOReturnSuccess) && ((offset + length) <= size) )
+		dispatchEntry( &entry, fDeferred[i], node );
+	}
+	
+	fDeferredCount = kept;
+	
+	while( fNextEntry < fEntryCount )
+	{
+		VectorSubmitParams entry;
+		fSubmitDesc->readBytes( fNextEntry * sizeof(VectorSubmitParams), &entry, sizeof(VectorSubmitParams) );
+		
+		// an entry set aside means its node has commands in flight, so a barrier still waits for it
+		bool barrier = ((fFlags & kFWVectorCommandInterfaceOrdered) != 0) || 
+					   ((entry.params.flags & kFWCommandInterfaceVectorBarrier) != 0);
+		if( (fInflightCmds > 0) && (barrier || fFenced) )
 		{
-			CommandSubmitParams params;
-			fSubmitDesc->readBytes( offset, &params, length );
-			status = submitOneCommand( &params );
-			//zzz probably need an output array communicating which commands succeeded and failed
+			// a barrier waits for everything ahead of it and holds back everything behind it
+			break;
+		}
+		
+		UInt32 node = entryNodeIndex( &entry.params );
+		if( fNodeInflight[node] >= kVectorCommandMaxNodeInflight )
+		{
+			if( fDeferredCount == kVectorCommandMaxDeferred )
+			{
+				break;
+			}
 			
-			offset += length;
+			fDeferred[fDeferredCount] = fNextEntry++;
+			fDeferredNode[fDeferredCount] = node;
+			fDeferredCount++;
+			continue;
 		}
 		
-		fControl->openGate();
+		dispatchEntry( &entry, fNextEntry++, node );
+		
+		fFenced = barrier;
 	}
 	
-	return status;
+	fDispatching = false;
+	
+	if( (fEntryCount != 0) && (fNextEntry == fEntryCount) && (fDeferredCount == 0) && (fInflightCmds == 0) )
+	{
+		// we're done
+		fEntryCount = 0;
+		IOFireWireUserClient::sendAsyncResult64( fAsyncRef, fVectorStatus, NULL, 0 );
+		
+		release();
+	}
+}
+
+// dispatchEntry
+//
+// a command that can't be submitted gets its result written here
+
+void
+IOFWUserVectorCommand::dispatchEntry( VectorSubmitParams * entry, UInt32 index, UInt32 node )
+{
+	IOReturn status = submitOneCommand( entry, index, node );
+	if( status != kIOReturnSuccess )
+	{
+		VectorSubmitResult result;
+		bzero( &result, sizeof(result) );
+		result.result.result = status;
+		result.result.refCon = entry->params.refCon;
+		
+		writeResult( index, &result );
+		fVectorStatus = status;
+	}
+}
+
+// entryNodeIndex
+//
+// which of the controller's transaction label pools an entry draws from
+
+UInt32
+IOFWUserVectorCommand::entryNodeIndex( const CommandSubmitParams * params )
+{
+	UInt16 nodeID = kFWBroadcastNodeID;		// phy packets share the broadcast pool
+	
+	if( params->type != kFireWireCommandType_PHY )
+	{
+		if( params->flags & kFireWireCommandAbsolute )
+		{
+			nodeID = (UInt16)(params->newTarget >> 48);
+		}
+		else
+		{
+			UInt32 generation;
+			fUserClient->getOwner()->getNodeIDGeneration( generation, nodeID );
+		}
+	}
+	
+	return nodeID & kFWMaxNodesPerBus;
 }
 
 // submitOneCommand
@@ -214,9 +373,10 @@ IOFWUserVectorCommand::submit( OSAsyncReference64 async_ref, mach_vm_address_t c
 //
 
 IOReturn 
-IOFWUserVectorCommand::submitOneCommand( CommandSubmitParams * params )
+IOFWUserVectorCommand::submitOneCommand( VectorSubmitParams * entry, UInt32 index, UInt32 node )
 {
 	IOReturn status = kIOReturnSuccess;
+	CommandSubmitParams * params = &entry->params;
 	
 	if( status == kIOReturnSuccess )
 	{
@@ -226,6 +386,30 @@ IOFWUserVectorCommand::submitOneCommand( CommandSubmitParams * params )
 		}
 	}
 	
+	// only commands that complete through the vector can be part of one
+	if( status == kIOReturnSuccess )
+	{
+		switch( params->type )
+		{
+			case kFireWireCommandType_Read:
+			case kFireWireCommandType_Write:
+			case kFireWireCommandType_ReadQuadlet:
+			case kFireWireCommandType_WriteQuadlet:
+			case kFireWireCommandType_CompareSwap:
+			case kFireWireCommandType_PHY:
+				break;
+			
+			default:
+				status = kIOReturnBadArgument;
+				break;
+		}
+		
+		if( params->flags & kFWCommandInterfaceSyncExecute )
+		{
+			status = kIOReturnBadArgument;
+		}
+	}
+	
 	const OSObject * object = NULL;
 	if( status == kIOReturnSuccess )
 	{
@@ -251,15 +435,38 @@ IOFWUserVectorCommand::submitOneCommand( CommandSubmitParams * params )
 
 	if( status == kIOReturnSuccess )
 	{
-	//	OSAsyncReference64 * async_ref = cmd->getAsyncReference64();
-	//	setAsyncReference64( *async_ref, (mach_port_t)async_ref[0], (mach_vm_address_t)params->callback, (io_user_reference_t)params->refCon);	
-		
+		if( cmd->getVectorCommand() != NULL )
+		{
+			// already in flight as an earlier entry
+			status = kIOReturnBusy;
+		}
+	}
+	
+	if( status == kIOReturnSuccess )
+	{
 		// disable packet flushing during vector submit
 		cmd->setFlush( false );
-		cmd->setVectorCommand( this );	// connect to vector
+		cmd->setVectorCommand( this, index, node );	// connect to vector
 		
-		status = cmd->submit( params, NULL );
+		// count it first, it can complete before submit returns
 		fInflightCmds++;
+		fNodeInflight[node]++;
+		
+		status = cmd->submit( params, NULL );
+		
+		if( (status != kIOReturnSuccess) && (cmd->getVectorCommand() == this) )
+		{
+			// it never started, so it won't complete either
+			cmd->setVectorCommand( NULL );
+			fInflightCmds--;
+			fNodeInflight[node]--;
+		}
+		else
+		{
+			// a failure that went through the completion already has its result
+			status = kIOReturnSuccess;
+		}
+		
 		// turn flush back on for future submits (possibly not using a vector);
 		cmd->setFlush( true );
 	}
@@ -273,6 +480,59 @@ IOFWUserVectorCommand::submitOneCommand( CommandSubmitParams * params )
 	return status;
 }
 
+// writeResult
+//
+//
+
+void
+IOFWUserVectorCommand::writeResult( UInt32 index, VectorSubmitResult * result )
+{
+	fResultDesc->writeBytes( index * sizeof(VectorSubmitResult), result, sizeof(VectorSubmitResult) );
+}
+
+// completeEntry
+//
+// records a command's result at its own index and keeps the vector moving
+
+void
+IOFWUserVectorCommand::completeEntry( IOFWUserCommand * cmd, VectorSubmitResult * result )
+{
+	UInt32 index = cmd->getVectorIndex();
+	UInt32 node = cmd->getVectorNode();
+	
+	cmd->setVectorCommand( NULL );	// disconnect from vector
+
+	if( fInflightCmds > 0 )
+	{
+		fInflightCmds--;
+	}
+	
+	if( fNodeInflight[node] > 0 )
+	{
+		fNodeInflight[node]--;
+	}
+	
+	result->result.kernCommandRef = 0;	// not used on vector path
+	result->result.refCon = cmd->getRefCon();
+	
+	writeResult( index, result );
+	
+	if( result->result.result != kIOReturnSuccess )
+	{
+		fVectorStatus = result->result.result;
+	}
+	
+	if( fFlags & kFWVectorCommandInterfaceProgress )
+	{
+		// let the library complete this entry now rather than with the whole vector
+		io_user_reference_t args[1];
+		args[0] = index;
+		IOFireWireUserClient::sendAsyncResult64( fAsyncRef, result->result.result, args, 1 );
+	}
+	
+	dispatchCommands();
+}
+
 // asyncCompletion
 //
 //
@@ -284,38 +544,31 @@ IOFWUserVectorCommand::asyncCompletion(
 	IOFireWireNub *			device, 
 	IOFWCommand *			fwCmd )
 {
-	if( fInflightCmds > 0 )
+	IOFWUserCommand * cmd = (IOFWUserCommand*)refcon;
+	IOFWAsyncCommand * async_cmd = cmd->getAsyncCommand();
+	
+	VectorSubmitResult result;
+	bzero( &result, sizeof(result) );
+	
+	result.result.result = status;
+	result.result.bytesTransferred = async_cmd->getBytesTransferred();
+	result.result.ackCode = async_cmd->getAckCode();
+	result.result.responseCode = async_cmd->getResponseCode();
+	
+	// lock commands hand back the old value
+	IOFWCompareAndSwapCommand * lock_cmd = OSDynamicCast( IOFWCompareAndSwapCommand, async_cmd );
+	if( lock_cmd )
 	{
-		fInflightCmds--;
-		
-		IOFWUserCommand * cmd = (IOFWUserCommand*)refcon;
-		IOFWAsyncCommand * async_cmd = cmd->getAsyncCommand();
-		
-		CommandSubmitResult result;
-		
-		result.kernCommandRef = 0;	// not used on vector path
-		result.result = status;
-		result.bytesTransferred = async_cmd->getBytesTransferred();
-		result.ackCode = async_cmd->getAckCode();
-		result.responseCode = async_cmd->getResponseCode();
-		result.refCon = cmd->getRefCon();
-		
-		fResultDesc->writeBytes( fResultOffset, &result, sizeof(CommandSubmitResult) );
-		fResultOffset += sizeof(CommandSubmitResult);
-		
-		if( status != kIOReturnSuccess )
-		{
-			fVectorStatus = status;
-		}
-		
-		cmd->setVectorCommand( NULL );	// disconnect from vector
+		UInt32 lock_value[2];
+		lock_value[0] = 0;
+		lock_value[1] = 0;
 		
-		if( fInflightCmds == 0 )
-		{
-			// we're done
-			IOFireWireUserClient::sendAsyncResult64( fAsyncRef, fVectorStatus, NULL, 0 );
-		}
+		result.lockInfo.didLock = lock_cmd->locked( lock_value );
+		result.lockInfo.value[0] = lock_value[0];
+		result.lockInfo.value[1] = lock_value[1];
 	}
+	
+	completeEntry( cmd, &result );
 }
 
 // asyncPHYCompletion
@@ -329,36 +582,16 @@ IOFWUserVectorCommand::asyncPHYCompletion(
 	IOFireWireBus *			bus, 
 	IOFWAsyncPHYCommand *	fwCmd )
 {
-	if( fInflightCmds > 0 )
-	{
-		fInflightCmds--;
-		
-		IOFWUserPHYCommand * cmd = (IOFWUserPHYCommand*)refcon;
-		IOFWAsyncPHYCommand * async_cmd = cmd->getAsyncPHYCommand();
-		
-		CommandSubmitResult result;
-		
-		result.kernCommandRef = 0;	// not used on vector path
-		result.result = status;
-		result.bytesTransferred = 8;
-		result.ackCode = async_cmd->getAckCode();
-		result.responseCode = async_cmd->getResponseCode();
-		result.refCon = cmd->getRefCon();
-		
-		fResultDesc->writeBytes( fResultOffset, &result, sizeof(CommandSubmitResult) );
-		fResultOffset += sizeof(CommandSubmitResult);
-		
-		if( status != kIOReturnSuccess )
-		{
-			fVectorStatus = status;
-		}
-		
-		cmd->setVectorCommand( NULL );	// disconnect from vector
-		
-		if( fInflightCmds == 0 )
-		{
-			// we're done
-			IOFireWireUserClient::sendAsyncResult64( fAsyncRef, fVectorStatus, NULL, 0 );
-		}
-	}
-}
\ No newline at end of file
+	IOFWUserPHYCommand * cmd = (IOFWUserPHYCommand*)refcon;
+	IOFWAsyncPHYCommand * async_cmd = cmd->getAsyncPHYCommand();
+	
+	VectorSubmitResult result;
+	bzero( &result, sizeof(result) );
+	
+	result.result.result = status;
+	result.result.bytesTransferred = 8;
+	result.result.ackCode = async_cmd->getAckCode();
+	result.result.responseCode = async_cmd->getResponseCode();
+	
+	completeEntry( cmd, &result );
+}
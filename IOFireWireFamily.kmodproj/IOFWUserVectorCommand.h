@@ -29,8 +29,19 @@
 // system
 #import <libkern/c++/OSObject.h>
 
+class IOFWUserCommand;
+
 #pragma mark -
 
+// a vector never holds more than half of a node's transaction labels
+// so other clients talking to the same node are not starved
+
+#define kVectorCommandMaxNodeInflight		(kMaxPendingTransfers / 2)
+
+// entries held back for a busy node while later entries go to other nodes
+
+#define kVectorCommandMaxDeferred			kMaxPendingTransfers
+
 class IOFWUserVectorCommand : public OSObject
 {
 	OSDeclareDefaultStructors( IOFWUserVectorCommand );
@@ -42,8 +53,16 @@ class IOFWUserVectorCommand : public OSObject
 		IOMemoryDescriptor *		fSubmitDesc;
 		IOMemoryDescriptor *		fResultDesc;
 		
-		int							fInflightCmds;
-		mach_vm_size_t				fResultOffset;
+		UInt32						fFlags;
+		UInt32						fEntryCount;
+		UInt32						fNextEntry;
+		UInt32						fInflightCmds;
+		UInt8						fNodeInflight[kFWMaxNodesPerBus + 1];
+		UInt32						fDeferred[kVectorCommandMaxDeferred];		// entry indexes, oldest first
+		UInt8						fDeferredNode[kVectorCommandMaxDeferred];
+		UInt32						fDeferredCount;
+		bool						fDispatching;
+		bool						fFenced;
 		
 		OSAsyncReference64			fAsyncRef;
 		IOReturn					fVectorStatus;
@@ -59,7 +78,8 @@ class IOFWUserVectorCommand : public OSObject
 
 		IOReturn		setBuffers(	mach_vm_address_t submit_buffer_address, mach_vm_size_t submit_buffer_size,
 									mach_vm_address_t result_buffer_address, mach_vm_size_t result_buffer_size );
-		IOReturn		submit( OSAsyncReference64 async_ref, mach_vm_address_t callback, io_user_reference_t refCon );
+		IOReturn		submit( OSAsyncReference64 async_ref, mach_vm_address_t callback, io_user_reference_t refCon,
+								UInt32 count, UInt32 flags );
 
 		void			asyncCompletion(	void *					refcon, 
 											IOReturn 				status, 
@@ -72,7 +92,12 @@ class IOFWUserVectorCommand : public OSObject
 											IOFWAsyncPHYCommand *	fwCmd );
 	
 	protected:
-		IOReturn		submitOneCommand( CommandSubmitParams * params );
+		void			dispatchCommands( void );
+		void			dispatchEntry( VectorSubmitParams * entry, UInt32 index, UInt32 node );
+		UInt32			entryNodeIndex( const CommandSubmitParams * params );
+		IOReturn		submitOneCommand( VectorSubmitParams * entry, UInt32 index, UInt32 node );
+		void			completeEntry( IOFWUserCommand * cmd, VectorSubmitResult * result );
+		void			writeResult( UInt32 index, VectorSubmitResult * result );
 		
 };
 
@@ -35,6 +35,84 @@
 // system
 #import <IOKit/assert.h>
 #import <IOKit/IOLib.h>
+#import <libkern/OSAtomic.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CRC-16 tables
+//
+//   The IEEE 1212 CRC is the ITU-T polynomial x^16 + x^12 + x^5 + 1, most significant
+//   bit first, starting from zero. sCRC16Table[k][x] is the CRC of the byte x followed
+//   by k zero bytes, so eight bytes can be folded in with eight lookups. Built on first
+//   use; builders racing each other write the same values.
+//
+
+static UInt16			sCRC16Table[8][256];
+static volatile bool	sCRC16TableReady = false;
+
+static void FWBuildCRC16Table( void )
+{
+	UInt32 x;
+	UInt32 k;
+	
+	for( x = 0; x < 256; x++ )
+	{
+		UInt32 crc = x << 8;
+		UInt32 bit;
+		for( bit = 0; bit < 8; bit++ )
+		{
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+		sCRC16Table[0][x] = crc & 0xFFFF;
+	}
+	
+	for( k = 1; k < 8; k++ )
+	{
+		for( x = 0; x < 256; x++ )
+		{
+			UInt32 crc = sCRC16Table[k - 1][x];
+			sCRC16Table[k][x] = ((crc << 8) ^ sCRC16Table[0][crc >> 8]) & 0xFFFF;
+		}
+	}
+	
+	OSMemoryBarrier();
+	sCRC16TableReady = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// FWUpdateCRC16Bytes
+//
+//   Slicing by 8, with the quadlets in bus order the bytes are already in the
+//   order the CRC wants them.
+//
+
+static UInt16 FWUpdateCRC16Bytes( UInt32 crc, const UInt8 * bytes, UInt32 length )
+{
+	if( !sCRC16TableReady )
+		FWBuildCRC16Table();
+	
+	while( length >= 8 )
+	{
+		crc = sCRC16Table[7][bytes[0] ^ (crc >> 8)] ^
+			  sCRC16Table[6][bytes[1] ^ (crc & 0xFF)] ^
+			  sCRC16Table[5][bytes[2]] ^
+			  sCRC16Table[4][bytes[3]] ^
+			  sCRC16Table[3][bytes[4]] ^
+			  sCRC16Table[2][bytes[5]] ^
+			  sCRC16Table[1][bytes[6]] ^
+			  sCRC16Table[0][bytes[7]];
+		bytes += 8;
+		length -= 8;
+	}
+	
+	while( length-- > 0 )
+	{
+		crc = ((crc << 8) ^ sCRC16Table[0][((crc >> 8) ^ *bytes++) & 0xFF]) & 0xFFFF;
+	}
+	
+	return crc;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -45,16 +123,10 @@
 
 UInt16 FWUpdateCRC16(UInt16 crc16, UInt32 quad)
 {
-	UInt32 host_quad = OSSwapBigToHostInt32( quad );
-    SInt32 shift;
-    UInt32 sum;
-    UInt32 crc = crc16;
-    for (shift = 28; shift >= 0; shift -= 4) {
-        sum = ((crc >> 12) ^ (host_quad >> shift)) & 0x0F;
-        crc = (crc << 4) ^ (sum << 12) ^ (sum << 5) ^ (sum);
-    }
-    return (crc & 0xFFFF);
+	// quad is in bus order like the quads passed to FWComputeCRC16
+	return FWUpdateCRC16Bytes( crc16, (const UInt8 *)&quad, sizeof(quad) );
 }
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // FWComputeCRC16
@@ -63,6 +135,19 @@ UInt16 FWUpdateCRC16(UInt16 crc16, UInt32 quad)
 //
 
 UInt16	FWComputeCRC16(const UInt32 *pQuads, UInt32 numQuads)
+{
+	return FWUpdateCRC16Bytes( 0, (const UInt8 *)pQuads, numQuads * sizeof(UInt32) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// FWComputeCRC16Reference
+//
+//   A nibble at a time, as the IEEE 1212 spec gives it. The table driven
+//   version must always agree with this one.
+//
+
+UInt16	FWComputeCRC16Reference(const UInt32 *pQuads, UInt32 numQuads)
 {
     SInt32	shift;
     UInt32	sum;
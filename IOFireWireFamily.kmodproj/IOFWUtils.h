@@ -20,6 +20,7 @@ extern "C" {
 
 UInt16 FWComputeCRC16(const UInt32 *pQuads, UInt32 numQuads);
 UInt16 FWUpdateCRC16(UInt16 crc16, UInt32 quad);
+UInt16 FWComputeCRC16Reference(const UInt32 *pQuads, UInt32 numQuads);
 
 UInt32 AddFWCycleTimeToFWCycleTime( UInt32 cycleTime1, UInt32 cycleTime2 );
 UInt32 SubtractFWCycleTimeFromFWCycleTime( UInt32 cycleTime1, UInt32 cycleTime2);
@@ -130,7 +130,7 @@ bool IOFWWriteCommand::createMemberVariables( void )
 		success = IOFWAsyncCommand::createMemberVariables();
 	}
 	
-	if( fMembers )
+	if( fMembers && fMembers->fSubclassMembers == NULL )
 	{
 		if( success )
 		{
@@ -144,6 +144,8 @@ bool IOFWWriteCommand::createMemberVariables( void )
 		if( success )
 		{
 			bzero( fMembers->fSubclassMembers, sizeof(MemberVariables) );
+			
+			((MemberVariables*)fMembers->fSubclassMembers)->fWindowSize = 1;
 		}
 		
 		// clean up on failure
@@ -165,6 +167,8 @@ void IOFWWriteCommand::destroyMemberVariables( void )
 {
 	if( fMembers->fSubclassMembers != NULL )
 	{		
+		destroyWindowCommands();
+		
 		// free member variables
 		
 		IOFree( fMembers->fSubclassMembers, sizeof(MemberVariables) );
@@ -193,11 +197,18 @@ IOReturn IOFWWriteCommand::reinit(	FWAddress 				devAddress,
 									void *					refcon, 
 									bool failOnReset )
 {
-    return IOFWAsyncCommand::reinit(	devAddress,
-										hostMem, 
-										completion, 
-										refcon, 
-										failOnReset );
+	IOReturn status = IOFWAsyncCommand::reinit(	devAddress,
+												hostMem, 
+												completion, 
+												refcon, 
+												failOnReset );
+	
+	if( status == kIOReturnSuccess )
+	{
+		((MemberVariables*)fMembers->fSubclassMembers)->fCommitted = 0;
+	}
+	
+	return status;
 }
 
 // reinit
@@ -210,11 +221,18 @@ IOReturn IOFWWriteCommand::reinit(	UInt32 					generation,
 									FWDeviceCallback 		completion, 
 									void *					refcon )
 {
-    return IOFWAsyncCommand::reinit(	generation, 
-										devAddress,
-										hostMem, 
-										completion, 
-										refcon );
+	IOReturn status = IOFWAsyncCommand::reinit(	generation, 
+												devAddress,
+												hostMem, 
+												completion, 
+												refcon );
+	
+	if( status == kIOReturnSuccess )
+	{
+		((MemberVariables*)fMembers->fSubclassMembers)->fCommitted = 0;
+	}
+	
+	return status;
 }
 
 // execute
@@ -249,6 +267,18 @@ IOReturn IOFWWriteCommand::execute()
 		fPackSize = maxPack;
 	}
 
+	// hand multi-packet writes to the window engine, local writes complete
+	// synchronously so there is nothing to overlap
+	
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	if( members && 
+		members->fWindowSize > 1 && 
+		fSize > fPackSize &&
+		fNodeID != fControl->getLocalNodeID() )
+	{
+		return executeWindow();
+	}
+
     // Do this when we're in execute, not before,
     // so that Reset handling knows which commands are waiting a response.
     fTrans = fControl->allocTrans( this );
@@ -289,7 +319,9 @@ IOReturn IOFWWriteCommand::execute()
     else 
 	{
 		//IOLog("IOFWWriteCommand::execute: Out of tLabels?\n");
-        result = kIOFireWireOutOfTLabels;
+        // wait for a label to this node to free up, we are restarted from the pendingQ
+        result = fControl->waitForTrans( this );
+        fStatus = kIOFireWirePending;
     }
 
 	// complete could release us so protect fStatus with retain and release
@@ -338,3 +370,460 @@ void IOFWWriteCommand::gotPacket( int rcode, const void* data, int size )
         complete( kIOReturnSuccess );
     }
 }
+
+#pragma mark -
+
+// setWindowSize
+//
+//
+
+IOReturn IOFWWriteCommand::setWindowSize( UInt32 packets )
+{
+	if( fStatus == kIOReturnBusy || fStatus == kIOFireWirePending )
+		return fStatus;
+
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	if( packets == 0 )
+	{
+		packets = 1;
+	}
+	
+	if( packets > kFWCmdMaxWindowPackets )
+	{
+		packets = kFWCmdMaxWindowPackets;
+	}
+	
+	if( packets != members->fWindowSize )
+	{
+		// window commands are recreated on the next windowed execute
+		
+		destroyWindowCommands();
+		members->fWindowSize = packets;
+	}
+	
+	return kIOReturnSuccess;
+}
+
+// getBytesCommitted
+//
+//
+
+IOByteCount IOFWWriteCommand::getBytesCommitted( void ) const
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	if( members->fCommitted > fBytesTransferred )
+	{
+		return members->fCommitted;
+	}
+	
+	return fBytesTransferred;
+}
+
+// createWindowCommands
+//
+//
+
+bool IOFWWriteCommand::createWindowCommands( void )
+{
+	bool success = true;
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	if( members->fWindowCmds != NULL )
+	{
+		return true;
+	}
+	
+	UInt32 count = members->fWindowSize;
+	
+	members->fWindowCmds = (IOFWWriteCommand**)IOMalloc( sizeof(IOFWWriteCommand*) * count );
+	if( members->fWindowCmds == NULL )
+		success = false;
+	
+	if( success )
+	{
+		bzero( members->fWindowCmds, sizeof(IOFWWriteCommand*) * count );
+		members->fWindowCmdCount = count;
+		
+		members->fWindowOffsets = (IOByteCount*)IOMalloc( sizeof(IOByteCount) * count );
+		if( members->fWindowOffsets == NULL )
+			success = false;
+	}
+	
+	for( UInt32 i = 0; success && i < count; i++ )
+	{
+		IOFWWriteCommand * cmd = OSTypeAlloc( IOFWWriteCommand );
+		if( cmd == NULL )
+		{
+			success = false;
+			break;
+		}
+		
+		members->fWindowCmds[i] = cmd;
+		
+		if( fDevice )
+		{
+			success = cmd->initAll( fDevice, FWAddress(fAddressHi, fAddressLo), fMemDesc, windowPacketCompletion, this, fFailOnReset );
+		}
+		else
+		{
+			success = cmd->initAll( fControl, fGeneration, FWAddress(fAddressHi, fAddressLo, fNodeID), fMemDesc, windowPacketCompletion, this );
+		}
+	}
+	
+	if( !success )
+	{
+		destroyWindowCommands();
+	}
+	
+	return success;
+}
+
+// destroyWindowCommands
+//
+//
+
+void IOFWWriteCommand::destroyWindowCommands( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	if( members->fWindowCmds != NULL )
+	{
+		for( UInt32 i = 0; i < members->fWindowCmdCount; i++ )
+		{
+			if( members->fWindowCmds[i] != NULL )
+			{
+				members->fWindowCmds[i]->release();
+				members->fWindowCmds[i] = NULL;
+			}
+		}
+		
+		IOFree( members->fWindowCmds, sizeof(IOFWWriteCommand*) * members->fWindowCmdCount );
+		members->fWindowCmds = NULL;
+	}
+	
+	if( members->fWindowOffsets != NULL )
+	{
+		IOFree( members->fWindowOffsets, sizeof(IOByteCount) * members->fWindowCmdCount );
+		members->fWindowOffsets = NULL;
+	}
+	
+	members->fWindowCmdCount = 0;
+}
+
+// executeWindow
+//
+// keep up to fWindowSize single packet writes outstanding, each with its own tLabel
+
+IOReturn IOFWWriteCommand::executeWindow( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+
+	// the packets carry their own timeouts and retries
+	removeFromQ();
+	
+	if( !createWindowCommands() )
+	{
+		IOReturn status;
+		
+		retain();
+		complete( kIOReturnNoMemory );
+		status = fStatus;
+		release();
+		
+		return status;
+	}
+	
+	members->fStartOffset = fBytesTransferred;
+	members->fNextOffset = fBytesTransferred;
+	members->fEndOffset = fBytesTransferred + fSize;
+	members->fErrorOffset = members->fEndOffset;
+	members->fStartAddressLo = fAddressLo;
+	members->fInFlight = 0;
+	members->fWindowStatus = kIOReturnSuccess;
+	members->fWindowSerial = false;
+	members->fFilling = false;
+	members->fWindowActive = true;
+	
+	// a resumed write has already committed everything before fBytesTransferred
+	if( members->fCommitted < fBytesTransferred )
+	{
+		members->fCommitted = fBytesTransferred;
+	}
+	
+	// complete could release us so protect fStatus with retain and release
+	retain();
+	fillWindow();
+	IOReturn status = fStatus;
+	release();
+	
+	return status;
+}
+
+// fillWindow
+//
+//
+
+void IOFWWriteCommand::fillWindow( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	// packets that fail synchronously complete back into this loop
+	members->fFilling = true;
+	
+	while( members->fWindowStatus == kIOReturnSuccess && 
+		   members->fNextOffset < members->fEndOffset &&
+		   members->fInFlight < members->fWindowCmdCount )
+	{
+		UInt32 slot;
+		bool held = false;
+		
+		for( slot = 0; slot < members->fWindowCmdCount; slot++ )
+		{
+			IOFWWriteCommand * cmd = members->fWindowCmds[slot];
+			
+			if( members->fWindowOrdered && cmd->Busy() )
+			{
+				// don't let a new packet overtake one the target is bouncing
+				int ack = cmd->getAckCode();
+				if( (ack == kFWAckBusyX) || (ack == kFWAckBusyA) || (ack == kFWAckBusyB) )
+				{
+					held = true;
+					members->fWindowSerial = true;
+				}
+			}
+		}
+		
+		// a target that busies once is likely to again, so once it has we wait for
+		// everything outstanding to drain before each packet
+		if( held || (members->fWindowSerial && members->fInFlight > 0) )
+		{
+			break;
+		}
+		
+		for( slot = 0; slot < members->fWindowCmdCount; slot++ )
+		{
+			if( !members->fWindowCmds[slot]->Busy() )
+				break;
+		}
+		
+		if( slot == members->fWindowCmdCount )
+		{
+			break;
+		}
+		
+		IOFWWriteCommand * cmd = members->fWindowCmds[slot];
+		
+		int transfer = members->fEndOffset - members->fNextOffset;
+		if( transfer > fMaxPack )
+		{
+			transfer = fMaxPack;
+		}
+		
+		int maxPack = (1 << fControl->maxPackLog(fWrite, fNodeID));
+		if( maxPack < transfer )
+		{
+			transfer = maxPack;
+		}
+		
+		IOByteCount offset = members->fNextOffset;
+		UInt32 addressLo = members->fStartAddressLo + (offset - members->fStartOffset);
+		
+		IOReturn status;
+		if( fDevice )
+		{
+			status = cmd->reinit( FWAddress(fAddressHi, addressLo), fMemDesc, windowPacketCompletion, this, fFailOnReset );
+		}
+		else
+		{
+			status = cmd->reinit( fGeneration, FWAddress(fAddressHi, addressLo, fNodeID), fMemDesc, windowPacketCompletion, this );
+		}
+		
+		if( status != kIOReturnSuccess )
+		{
+			members->fWindowStatus = status;
+			if( offset < members->fErrorOffset )
+				members->fErrorOffset = offset;
+			break;
+		}
+		
+		// reinit latched the device's current generation, keep ours so a packet
+		// issued after a reset fails instead of landing in the new generation
+		if( fDevice && fFailOnReset )
+		{
+			cmd->setGeneration( fGeneration );
+		}
+		
+		// the packet sends from our descriptor at its own offset
+		cmd->fBytesTransferred = offset;
+		cmd->fSize = transfer;
+		cmd->fMaxPack = fMaxPack;
+		cmd->setMaxSpeed( fMembers->fMaxSpeed );
+		cmd->setRetries( fMaxRetries );
+		cmd->setTimeout( fTimeout );
+		cmd->setForceBlockRequests( fMembers->fForceBlockRequests );
+		cmd->setDeferredNotify( members->fDeferredNotify );
+		cmd->setFastRetryOnBusy( members->fFastRetryOnBusy );
+		
+		members->fWindowOffsets[slot] = offset;
+		members->fNextOffset += transfer;
+		members->fInFlight++;
+		
+		cmd->submit();
+	}
+	
+	members->fFilling = false;
+	
+	if( members->fWindowActive && 
+		members->fInFlight == 0 &&
+		(members->fNextOffset >= members->fEndOffset || members->fWindowStatus != kIOReturnSuccess) )
+	{
+		finishWindow();
+	}
+}
+
+// windowPacketCompletion
+//
+//
+
+void IOFWWriteCommand::windowPacketCompletion( void * refcon, IOReturn status, IOFireWireNub * device, IOFWCommand * fwCmd )
+{
+	IOFWWriteCommand * me = (IOFWWriteCommand*)refcon;
+	
+	me->retain();
+	me->windowPacketComplete( (IOFWWriteCommand*)fwCmd, status );
+	me->release();
+}
+
+// windowPacketComplete
+//
+//
+
+void IOFWWriteCommand::windowPacketComplete( IOFWWriteCommand * cmd, IOReturn status )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	members->fInFlight--;
+	
+	setAckCode( cmd->getAckCode() );
+	setResponseCode( cmd->getResponseCode() );
+	setResponseSpeed( cmd->getResponseSpeed() );
+	
+	UInt32 slot;
+	for( slot = 0; slot < members->fWindowCmdCount; slot++ )
+	{
+		if( members->fWindowCmds[slot] == cmd )
+			break;
+	}
+	
+	// a single packet write only advances fBytesTransferred once the target accepts it
+	if( slot < members->fWindowCmdCount )
+	{
+		members->fCommitted += (cmd->fBytesTransferred - members->fWindowOffsets[slot]);
+	}
+	
+	if( status != kIOReturnSuccess )
+	{
+		if( cmd->fBytesTransferred < members->fErrorOffset )
+		{
+			members->fErrorOffset = cmd->fBytesTransferred;
+		}
+		
+		if( members->fWindowStatus == kIOReturnSuccess )
+		{
+			members->fWindowStatus = status;
+			
+			if( members->fWindowOrdered )
+			{
+				// nothing behind the failed packet may land
+				bool filling = members->fFilling;
+				members->fFilling = true;
+				for( UInt32 i = 0; i < members->fWindowCmdCount; i++ )
+				{
+					if( members->fWindowCmds[i]->Busy() )
+					{
+						members->fWindowCmds[i]->cancel( kIOReturnAborted );
+					}
+				}
+				members->fFilling = filling;
+			}
+		}
+	}
+	
+	if( !members->fFilling )
+	{
+		fillWindow();
+	}
+}
+
+// settleWindow
+//
+// report the contiguous prefix known to be committed
+
+void IOFWWriteCommand::settleWindow( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	IOByteCount done = members->fNextOffset;
+	if( members->fErrorOffset < done )
+	{
+		done = members->fErrorOffset;
+	}
+	
+	fSize -= (done - fBytesTransferred);
+	fAddressLo += (done - fBytesTransferred);
+	fBytesTransferred = done;
+	
+	members->fWindowActive = false;
+}
+
+// finishWindow
+//
+//
+
+void IOFWWriteCommand::finishWindow( void )
+{
+	MemberVariables * members = (MemberVariables*)fMembers->fSubclassMembers;
+	
+	settleWindow();
+	
+	complete( members->fWindowStatus );
+}
+
+// complete
+//
+//
+
+IOReturn IOFWWriteCommand::complete( IOReturn status )
+{
+	MemberVariables * members = NULL;
+	if( fMembers )
+	{
+		members = (MemberVariables*)fMembers->fSubclassMembers;
+	}
+	
+	if( members && members->fWindowActive )
+	{
+		// cancelled with packets outstanding, abort them before completing
+		
+		if( members->fWindowStatus == kIOReturnSuccess )
+		{
+			members->fWindowStatus = status;
+		}
+		
+		members->fFilling = true;
+		for( UInt32 i = 0; i < members->fWindowCmdCount; i++ )
+		{
+			if( members->fWindowCmds[i]->Busy() )
+			{
+				members->fWindowCmds[i]->cancel( kIOReturnAborted );
+			}
+		}
+		members->fFilling = false;
+		
+		settleWindow();
+	}
+	
+	return IOFWAsyncCommand::complete( status );
+}
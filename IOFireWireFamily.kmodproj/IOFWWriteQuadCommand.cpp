@@ -453,7 +453,9 @@ IOReturn IOFWWriteQuadCommand::execute()
     else 
 	{
 //        IOLog("IOFWReadCommand::execute: Out of tLabels?\n");
-        result = kIOFireWireOutOfTLabels;
+        // wait for a label to this node to free up, we are restarted from the pendingQ
+        result = fControl->waitForTrans( this );
+        fStatus = kIOFireWirePending;
     }
 
 	// complete could release us so protect fStatus with retain and release
@@ -54,6 +54,8 @@
 #import "IOFireWireLocalNode.h"
 #import "IOFWQEventSource.h"
 #import "IOFireWireIRM.h"
+#import "IOFireWireROMStore.h"
+#import "IOFWAsyncCommandPool.h"
 #include <IOKit/firewire/IOFWUtils.h>
 
 // system
@@ -63,6 +65,7 @@
 #import <IOKit/IOMessage.h>
 #import <IOKit/IOTimerEventSource.h>
 #import <IOKit/IOKitKeysPrivate.h>
+#import <libkern/OSAtomic.h>
 
 // bsd
 #include <sys/sysctl.h>
@@ -159,6 +162,10 @@ FireWireGlobals::~FireWireGlobals ( void )
 // from the 1394a spec
 #define kRepeatResetDelay			2000
 
+// 100 mSec window for unit directory changes to be published together
+// in one ROM update and one bus reset
+#define kROMPublicationWindow		100
+
 // 3000 mSec delay before pruning last device 
 // should generally equal kNormalDevicePruneDelay + kRepeatResetDelay
 #define kOnlyNodeDevicePruneDelay	3000
@@ -175,6 +182,13 @@ FireWireGlobals::~FireWireGlobals ( void )
 // the maximum amount of time we will allow a device to exist undiscovered
 #define kDeviceMaximuPruneTime		45000
 
+// devices remembered as rejecting block ROM reads, the oldest is forgotten past this
+#define kROMQuadReadGUIDsMax		32
+
+// every this many ROM reads of a remembered device a block read is tried again,
+// a success forgets the device
+#define kROMQuadReadRetryInterval	8
+
 ///////////////////////////////////////////////////////////////////////////////////
 
 #define kFireWireGenerationID		"FireWire Generation ID"
@@ -183,6 +197,13 @@ FireWireGlobals::~FireWireGlobals ( void )
 
 #define FWAddressToID(addr) (addr & 63)
 
+// an entry of fROMQuadReadGUIDs
+struct FWROMQuadReadGUID
+{
+	CSRNodeUniqueID		guid;
+	UInt32				reads;		// ROM reads since the device was added or last retried
+};
+
 enum requestRefConBits 
 {
     kRequestLabel = kFWAsynchTTotal-1,	// 6 bits
@@ -653,6 +674,13 @@ bool IOFireWireController::init( IOFireWireLink *fwim )
 		if( fSpaceIterator == NULL )
 			success = false;
 	}
+
+	if( success )
+	{	
+		fUnindexedAddresses = OSArray::withCapacity( 2 );	// physical address spaces
+		if( fUnindexedAddresses == NULL )
+			success = false;
+	}
 	
 	if( success )
 	{	
@@ -712,7 +740,11 @@ bool IOFireWireController::init( IOFireWireLink *fwim )
 	
 	if( success )
 	{				
-		fLastTrans = kMaxPendingTransfers-1;
+		bzero( fNodeTrans, sizeof(fNodeTrans) );
+		bzero( fTLabelsInUse, sizeof(fTLabelsInUse) );
+		bzero( fTLabelsReserved, sizeof(fTLabelsReserved) );
+		fHopCountSequence = 1;	// nothing built yet
+		bzero( fNextTLabel, sizeof(fNextTLabel) );
 		fDevicePruneDelay = kNormalDevicePruneDelay;
 
 		UInt32 bad = OSSwapHostToBigInt32(0xdeadbabe);
@@ -743,6 +775,38 @@ bool IOFireWireController::init( IOFireWireLink *fwim )
 			success = false;
 	}
 
+	if( success )
+	{
+		fROMQuadReadGUIDs = OSData::withCapacity( kROMQuadReadGUIDsMax * sizeof(FWROMQuadReadGUID) );
+		if( fROMQuadReadGUIDs == NULL )
+			success = false;
+	}
+
+	if( success )
+	{
+		fROMStore = IOFireWireROMStore::create();
+		if( fROMStore == NULL )
+			success = false;
+		else
+			setProperty( "ROMStore", fROMStore );
+	}
+
+	if( success )
+	{
+		fCommandPool = IOFWAsyncCommandPool::create( this );
+		if( fCommandPool == NULL )
+			success = false;
+		else
+			setProperty( "CommandPool", fCommandPool );
+	}
+
+	if( success )
+	{
+		fROMPublicationCmd = createDelayedCmd( 1000 * kROMPublicationWindow, publishROM, NULL );
+		if( fROMPublicationCmd == NULL )
+			success = false;
+	}
+
 	//
 	// create the bus power manager
 	//
@@ -820,6 +884,15 @@ void IOFireWireController::free()
 		fROMAddrSpace = NULL;
 	}
 
+	for( UInt32 node = 0; node < kFWMaxNodesPerBus; node++ )
+	{
+		if( fNodeTrans[node] != NULL )
+		{
+			IOFree( fNodeTrans[node], sizeof(AsyncPendingTrans) * kMaxPendingTransfers );
+			fNodeTrans[node] = NULL;
+		}
+	}
+
     if( fRootDir != NULL )
     {
 	    fRootDir->release();
@@ -843,6 +916,12 @@ void IOFireWireController::free()
         fBusResetStateChangeCmd->release();
 		fBusResetStateChangeCmd = NULL;
 	}
+
+    if( fROMPublicationCmd != NULL )
+	{
+        fROMPublicationCmd->release();
+		fROMPublicationCmd = NULL;
+	}
 	
     if( fSpaceIterator != NULL ) 
 	{
@@ -856,6 +935,26 @@ void IOFireWireController::free()
 		fLocalAddresses = NULL;
 	}
 
+    if( fUnindexedAddresses != NULL )
+	{
+        fUnindexedAddresses->release();
+		fUnindexedAddresses = NULL;
+	}
+
+	if( fPseudoAddressBitmap != NULL )
+	{
+		IOFree( fPseudoAddressBitmap, sizeof(UInt64) * kFWPseudoAddressWords );
+		fPseudoAddressBitmap = NULL;
+	}
+
+	if( fSpaceIndex != NULL )
+	{
+		IOFree( fSpaceIndex, sizeof(IOFWAddressSpaceIndexEntry) * fSpaceIndexCapacity );
+		fSpaceIndex = NULL;
+		fSpaceIndexCount = 0;
+		fSpaceIndexCapacity = 0;
+	}
+
 	if( fPHYPacketListenersIterator != NULL ) 
 	{
         fPHYPacketListenersIterator->release();
@@ -905,6 +1004,12 @@ void IOFireWireController::free()
 		fIRMAllocationsAllocated = NULL;
 	}
 	
+	if( fIsochReallocObjects != NULL )
+	{
+		fIsochReallocObjects->release();
+		fIsochReallocObjects = NULL;
+	}
+	
 	{
 		IOFireWireLink * fwim = fFWIM ;
 		fFWIM = NULL ;
@@ -933,6 +1038,24 @@ void IOFireWireController::free()
 		fGUIDDups->release();
 		fGUIDDups = NULL;
 	}
+
+	if( fROMQuadReadGUIDs != NULL )
+	{
+		fROMQuadReadGUIDs->release();
+		fROMQuadReadGUIDs = NULL;
+	}
+
+	if( fROMStore != NULL )
+	{
+		fROMStore->release();
+		fROMStore = NULL;
+	}
+
+	if( fCommandPool != NULL )
+	{
+		fCommandPool->release();
+		fCommandPool = NULL;
+	}
 	
 	
 	
@@ -1161,6 +1284,9 @@ void IOFireWireController::stop( IOService * provider )
     
 	// tear down security state change notification
 	freeSecurity();
+
+	if( fROMPublicationCmd->Busy() )
+		fROMPublicationCmd->cancel( kIOReturnAborted );
 		    
     PMstop();
 
@@ -1356,6 +1482,10 @@ IOReturn IOFireWireController::setPowerState( unsigned long powerStateOrdinal,
 			fBusResetStateChangeCmd->cancel( kIOReturnAborted );
 			fBusResetState = kResetStateResetting;
 		}
+
+		// waking up publishes the ROM anyway
+		if( fROMPublicationCmd->Busy() )
+			fROMPublicationCmd->cancel( kIOReturnAborted );
 		
 		fBusResetScheduled = false;
 		
@@ -1947,6 +2077,11 @@ void IOFireWireController::processBusReset( void )
 
 	IOFWGetAbsoluteTime(&fResetTime);	// Update even if we're already processing a reset
 
+	// time the scan from the most recent reset, an unfinished scan is never published
+	bzero( fScanTimes, sizeof(fScanTimes) );
+	bzero( fScanCPU, sizeof(fScanCPU) );
+	fScanTimes[kFWScanTimeReset] = getScanClock();
+
 	// we got our bus reset, cancel any reset work in progress
 	fBusResetScheduled = false;
 
@@ -2026,25 +2161,10 @@ void IOFireWireController::suspendBus( void )
 	
 	// Invalidate current topology and speed map
 	bzero( fSpeedVector, sizeof(fSpeedVector) );
+	invalidateHopCounts();
 	
 	// Zap all outstanding async requests
-	for( i=0; i<kMaxPendingTransfers; i++ ) 
-	{
-		AsyncPendingTrans *t = &fTrans[i];
-		if( t->fHandler ) 
-		{
-			IOFWAsyncCommand * cmd = t->fHandler;
-			cmd->gotPacket(kFWResponseBusResetError, NULL, 0);
-		}
-		else if( t->fAltHandler )
-		{
-			IOFWAsyncPHYCommand * cmd = OSDynamicCast( IOFWAsyncPHYCommand, t->fAltHandler );
-			if( cmd )
-			{
-				cmd->gotPacket( kFWResponseBusResetError );
-			}
-		}
-	}
+	failAllTrans();
 
 	// Clear out the old firewire plane
 	if( fNodes[fRootNodeID] ) 
@@ -2088,6 +2208,8 @@ void IOFireWireController::processSelfIDs(UInt32 *IDs, int numIDs, UInt32 *ownID
 
 	FWKLOG(( "IOFireWireController::processSelfIDs entered\n" ));
 	FWTrace_Start(kFWTController, kTPControllerProcessSelfIDs, (uintptr_t)fFWIM, 0, 0, 0);
+
+	UInt64 scan_clock = getScanClock();
 	
 #if (DEBUGGING_LEVEL > 0)
 for(i=0; i<numIDs; i++)
@@ -2247,7 +2369,9 @@ for(i=0; i<numOwnIDs; i++)
     setProperty(gFireWireSelfIDs, prop);
     prop->release();
     
+	UInt64 topology_clock = getScanClock();
     buildTopology(false);
+	fScanCPU[kFWScanCPUBuildTopology] += getScanClock() - topology_clock;
 	
 #if (DEBUGGING_LEVEL > 0)
     for(i=0; i<numIDs; i++) {
@@ -2297,6 +2421,9 @@ for(i=0; i<numOwnIDs; i++)
     fDelayedStateChangeCmd->reinit(1000 * kScanBusDelay, delayedStateChange, NULL);
     fDelayedStateChangeCmd->submit();
 	
+	fScanTimes[kFWScanTimeSelfIDs] = getScanClock();
+	fScanCPU[kFWScanCPUProcessSelfIDs] += fScanTimes[kFWScanTimeSelfIDs] - scan_clock;
+	
 	FWTrace_End(kFWTController, kTPControllerProcessSelfIDs, (uintptr_t)fFWIM, 0, 0, 0);
 	FWKLOG(( "IOFireWireController::processSelfIDs exited\n" ));
 }
@@ -2494,6 +2621,9 @@ void IOFireWireController::startBusScan()
 	FWTrace( kFWTController, kTPControllerStartBusScan, (uintptr_t)fFWIM, 0, 0, 0 );
 	FWKLOG(( "IOFireWireController::startBusScan entered\n" ));
 
+	UInt64 scan_clock = getScanClock();
+	fScanTimes[kFWScanTimeScanStart] = scan_clock;
+
 	OSObject * existProp = fFWIM->getProperty( "FWDSLimit" );
 	
 	if( existProp )
@@ -2508,7 +2638,8 @@ void IOFireWireController::startBusScan()
     // Send global resume packet
 	fFWIM->sendPHYPacket(((fLocalNodeID & 0x3f) << kFWPhyPacketPhyIDPhase) | 0x003c0000);
 
-    // Tell all active isochronous channels to re-allocate bandwidth
+    // Tell all active isochronous channels and IRM allocations to re-allocate bandwidth.
+    // the base class handlers queue themselves and are restored together below
     IOFWIsochChannel *found;
     fAllocChannelIterator->reset();
     while( (found = (IOFWIsochChannel *)fAllocChannelIterator->getNextObject()) ) 
@@ -2523,6 +2654,8 @@ void IOFireWireController::startBusScan()
         irmAllocationfound->handleBusReset(fBusGeneration);
     }
 	
+	startIsochRealloc();
+	
     fNumROMReads = fRootNodeID+1;
     for(i=0; i<=fRootNodeID; i++) {
         UInt16 nodeID;
@@ -2629,6 +2762,8 @@ void IOFireWireController::startBusScan()
         finishedBusScan();
     }
 	
+	fScanCPU[kFWScanCPUStartBusScan] += getScanClock() - scan_clock;
+	
 	FWKLOG(( "IOFireWireController::startBusScan exited\n" ));	
 }
 
@@ -2640,7 +2775,11 @@ void IOFireWireController::readROMGlue(void *refcon, IOReturn status,
 			IOFireWireNub *device, IOFWCommand *fwCmd)
 {
     IOFWNodeScan *scan = (IOFWNodeScan *)refcon;
-    scan->fControl->readDeviceROM(scan, status);
+	IOFireWireController * control = scan->fControl;	// scan may be freed by readDeviceROM
+	
+	UInt64 scan_clock = control->getScanClock();
+    control->readDeviceROM(scan, status);
+	control->fScanCPU[kFWScanCPUReadDeviceROM] += control->getScanClock() - scan_clock;
 }
 
 // readDeviceROM
@@ -2960,6 +3099,8 @@ void IOFireWireController::updateDevice(IOFWNodeScan *scan )
 {
 	FWTrace( kFWTController, kTPControllerUpdateDevice, (uintptr_t)fFWIM, (uintptr_t)(scan->fCmd), scan->fAddr.nodeID, 0 );
 	
+	UInt64 scan_clock = getScanClock();
+	
 	// See if this is a bus manager
 	UInt32 bib_quad = OSSwapBigToHostInt32( scan->fBuf[2] );
 	if( !fBusMgr )
@@ -3143,6 +3284,7 @@ void IOFireWireController::updateDevice(IOFWNodeScan *scan )
 	if (newDevice)
 		newDevice->release();
 	
+	fScanCPU[kFWScanCPUUpdateDevice] += getScanClock() - scan_clock;
 }
 
 
@@ -3197,6 +3339,8 @@ void IOFireWireController::finishedBusScan()
 {
 	FWTrace_Start( kFWTController, kTPControllerFinishedBusScan, (uintptr_t)fFWIM, 0, 0, 0 );
 	
+	UInt64 scan_clock = getScanClock();
+	
     // These magic numbers come from P1394a, draft 4, table C-2.
     // This works for cables up to 4.5 meters and PHYs with
     // PHY delay up to 144 nanoseconds.  Note that P1394a PHYs
@@ -3485,6 +3629,10 @@ void IOFireWireController::finishedBusScan()
         cmd->cancel(kIOReturnTimeout);
     }
 
+	fScanTimes[kFWScanTimeScanDone] = getScanClock();
+	fScanCPU[kFWScanCPUFinishedBusScan] += fScanTimes[kFWScanTimeScanDone] - scan_clock;
+	publishScanTiming();
+
 	FWKLOG(( "IOFireWireController::finishedBusScan exited\n" ));
 	FWTrace_End( kFWTController, kTPControllerFinishedBusScan, (uintptr_t)fFWIM, 0, 0, 0 );
 }
@@ -3833,6 +3981,9 @@ void IOFireWireController::buildTopology(bool doFWPlane)
 	// We never speed scan the local node which means we'll never clear it otherwise.
 	setNodeSpeed(fLocalNodeID, fLocalNodeID, (FWSpeed(fLocalNodeID, fLocalNodeID) & ~kFWSpeedUnknownMask));		
 
+	// hop counts only change with the self IDs, work them all out once per generation
+	buildHopCounts();
+
 #if (DEBUGGING_LEVEL > 0)
 	IOLog("MaxDepth:%d LocalNodeID:%x\n", maxDepth, fLocalNodeID);
 	IOLog("FireWire Speed map:\n");
@@ -3878,6 +4029,8 @@ void IOFireWireController::updatePlane()
 {
 	FWTrace( kFWTController, kTPControllerUpdatePlane, (uintptr_t)fFWIM, 0, 0, 0 );
 	
+	UInt64 scan_clock = getScanClock();
+	
     OSIterator *childIterator;
 	 bool foundTDM = false;
 	 
@@ -3936,6 +4089,115 @@ void IOFireWireController::updatePlane()
 	FWKLOG(("IOFireWireController::updatePlane reset generation to '%s'\n", busGenerationStr));
 	
 	fUseHalfSizePackets = fRequestedHalfSizePackets;
+	
+	fScanTimes[kFWScanTimePlaneDone] = getScanClock();
+	fScanCPU[kFWScanCPUUpdatePlane] += fScanTimes[kFWScanTimePlaneDone] - scan_clock;
+	publishScanTiming();
+}
+
+// getScanClock
+//
+// uptime in nanoseconds
+
+UInt64 IOFireWireController::getScanClock( void )
+{
+	UInt64 nanos;
+	absolutetime_to_nanoseconds( mach_absolute_time(), &nanos );
+	
+	return nanos;
+}
+
+// publishScanTiming
+//
+// wall time between milestones and time spent in each routine, in nanoseconds.
+// only the loopback benchmark asks for it, a real bus never pays for the property
+
+void IOFireWireController::publishScanTiming( void )
+{
+	if( !fPublishScanTiming )
+		return;
+	
+	static const char * milestone_keys[kFWScanTimeCount] =
+	{
+		NULL,
+		"ResetToSelfIDs",
+		"SelfIDsToScanStart",
+		"ScanStartToScanDone",
+		"ScanDoneToPlaneDone"
+	};
+	
+	static const char * cpu_keys[kFWScanCPUCount] =
+	{
+		"ProcessSelfIDs",
+		"BuildTopology",
+		"StartBusScan",
+		"ReadDeviceROM",
+		"UpdateDevice",
+		"FinishedBusScan",
+		"UpdatePlane"
+	};
+	
+	OSDictionary * timing = OSDictionary::withCapacity( 16 );
+	OSDictionary * cpu = OSDictionary::withCapacity( kFWScanCPUCount );
+	if( timing && cpu )
+	{
+		OSNumber * number = OSNumber::withNumber( fBusGeneration, 32 );
+		if( number )
+		{
+			timing->setObject( "Generation", number );
+			number->release();
+		}
+		
+		number = OSNumber::withNumber( fRootNodeID + 1, 32 );
+		if( number )
+		{
+			timing->setObject( "Nodes", number );
+			number->release();
+		}
+		
+		for( int i = 1; i < kFWScanTimeCount; i++ )
+		{
+			// later milestones are zero until we get there
+			if( fScanTimes[i] == 0 || fScanTimes[i-1] == 0 )
+				continue;
+			
+			number = OSNumber::withNumber( fScanTimes[i] - fScanTimes[i-1], 64 );
+			if( number )
+			{
+				timing->setObject( milestone_keys[i], number );
+				number->release();
+			}
+		}
+		
+		if( fScanTimes[kFWScanTimeScanDone] != 0 )
+		{
+			number = OSNumber::withNumber( fScanTimes[kFWScanTimeScanDone] - fScanTimes[kFWScanTimeReset], 64 );
+			if( number )
+			{
+				timing->setObject( "ResetToScanDone", number );
+				number->release();
+			}
+		}
+		
+		for( int i = 0; i < kFWScanCPUCount; i++ )
+		{
+			number = OSNumber::withNumber( fScanCPU[i], 64 );
+			if( number )
+			{
+				cpu->setObject( cpu_keys[i], number );
+				number->release();
+			}
+		}
+		
+		timing->setObject( "CPU", cpu );
+		setProperty( "BusScanTiming", timing );
+	}
+	
+	if( cpu )
+		cpu->release();
+	
+	if( timing )
+		timing->release();
 }
 
 // terminateDevice
@@ -4448,7 +4710,8 @@ IOLocalConfigDirectory * IOFireWireController::getRootDir() const
 
 // AddUnitDirectory
 //
-//
+// the directory is only added to the root directory here. it goes out in the ROM,
+// with a bus reset, once the publication window closes, after this has returned
 
 IOReturn IOFireWireController::AddUnitDirectory(IOLocalConfigDirectory *unitDir)
 {
@@ -4462,14 +4725,12 @@ IOReturn IOFireWireController::AddUnitDirectory(IOLocalConfigDirectory *unitDir)
 		return kIOReturnOffline ;
 	}
     
-	getRootDir()->addEntry(kConfigUnitDirectoryKey, unitDir);
-
-    res = UpdateROM();
+	res = getRootDir()->addEntry(kConfigUnitDirectoryKey, unitDir);
     if(res == kIOReturnSuccess)
 	{
-		FWTrace(kFWTResetBusAction, kTPResetAddUnitDirectory, (uintptr_t)fFWIM, 0, 0, 0 );
-        res = resetBus();
+		scheduleROMPublication();
     }
+	
 	openGate();
     
 	return res;
@@ -4477,7 +4738,7 @@ IOReturn IOFireWireController::AddUnitDirectory(IOLocalConfigDirectory *unitDir)
 
 // RemoveUnitDirectory
 //
-//
+// like AddUnitDirectory, the ROM without the directory is published later
 
 IOReturn IOFireWireController::RemoveUnitDirectory(IOLocalConfigDirectory *unitDir)
 {
@@ -4485,13 +4746,10 @@ IOReturn IOFireWireController::RemoveUnitDirectory(IOLocalConfigDirectory *unitD
     
 	closeGate();
     
-	getRootDir()->removeSubDir(unitDir);
-
-    res = UpdateROM();
+	res = getRootDir()->removeSubDir(unitDir);
     if(res == kIOReturnSuccess)
 	{
-		FWTrace(kFWTResetBusAction, kTPResetRemoveUnitDirectory, (uintptr_t)fFWIM, 0, 0, 0 );
-		res = resetBus();
+		scheduleROMPublication();
     }
 	
 	openGate();
@@ -4499,6 +4757,43 @@ IOReturn IOFireWireController::RemoveUnitDirectory(IOLocalConfigDirectory *unitD
 	return res;
 }
 
+// scheduleROMPublication
+//
+// the first change opens the window, the ones that follow inside it ride along
+
+void IOFireWireController::scheduleROMPublication( void )
+{
+	fROMPublicationChanges++;
+	
+	if( !fROMPublicationCmd->Busy() )
+	{
+		fROMPublicationCmd->reinit( 1000 * kROMPublicationWindow, publishROM, NULL );
+		fROMPublicationCmd->submit();
+	}
+}
+
+// publishROM
+//
+// one ROM update and one bus reset for every directory change made in the window
+
+void IOFireWireController::publishROM( void *refcon, IOReturn status,
+									   IOFireWireBus *bus, IOFWBusCommand *fwCmd )
+{
+	IOFireWireController * me = (IOFireWireController *)bus;
+	
+	if( status != kIOReturnTimeout || me->fBusState == kAsleep )
+		return;
+	
+	FWTrace(kFWTResetBusAction, kTPResetPublishROM, (uintptr_t)me->fFWIM, me->fROMPublicationChanges, 0, 0 );
+	
+	IOReturn res = me->UpdateROM();
+	if( res == kIOReturnSuccess )
+		res = me->resetBus();
+	
+	if( res != kIOReturnSuccess )
+		IOLog( "IOFireWireController::publishROM - failed to publish %u directory changes, 0x%08x\n", (uint32_t)me->fROMPublicationChanges, res );
+}
+
 // UpdateROM()
 //
 //   Instantiate the local Config ROM.
@@ -4514,6 +4809,11 @@ IOReturn IOFireWireController::UpdateROM()
     UInt32					generation;
     IOFireWireLocalNode *	localNode;
 
+    // everything waiting in the publication window goes out with this update
+	fROMPublicationChanges = 0;
+	if( fROMPublicationCmd->Busy() )
+		fROMPublicationCmd->cancel( kIOReturnAborted );
+	
     // Increment the 4 bit generation field, make sure it is at least two.
 	UInt32 bib_quad = OSSwapBigToHostInt32( fROMHeader[2] );
     generation = bib_quad & kFWBIBGeneration;
@@ -4591,98 +4891,307 @@ AsyncPendingTrans *IOFireWireController::allocTrans(IOFWAsyncCommand *cmd)
 
 AsyncPendingTrans *IOFireWireController::allocTrans( IOFWAsyncCommand * cmd, IOFWCommand * altcmd )
 {
-    unsigned int i;
-    unsigned int tran;
-
-    tran = fLastTrans;
-    for(i=0; i<kMaxPendingTransfers; i++) {
-        AsyncPendingTrans *t;
-        tran++;
-        if(tran >= kMaxPendingTransfers)
-            tran = 0;
-        t = &fTrans[tran];
-        if(!t->fInUse) {
-            t->fHandler = cmd;
-			t->fAltHandler = altcmd;
-            t->fInUse = true;
-            t->fTCode = tran;
-            fLastTrans = tran;
-            return t;
-        }
-    }
+	UInt32 node = transNodeIndex( cmd );
+	AsyncPendingTrans * pool = fTrans;
 	
-	// Print only if its a first time
-	if ( fOutOfTLabels == 0 && fOutOfTLabelsThreshold == 0 )
-		IOLog("IOFireWireController:: Out of Transaction Labels\n");
-		
-	// Out of TLabels counter (Information Only)
-	fOutOfTLabels++;
+	if( node != kFWBroadcastNodeID )
+	{
+		pool = fNodeTrans[node];
+		if( pool == NULL )
+		{
+			// first transaction to this phy id, make its pool
+			pool = (AsyncPendingTrans*)IOMalloc( sizeof(AsyncPendingTrans) * kMaxPendingTransfers );
+			if( pool == NULL )
+				return NULL;
+			
+			bzero( pool, sizeof(AsyncPendingTrans) * kMaxPendingTransfers );
+			fNodeTrans[node] = pool;
+		}
+	}
+	
+	// a label freed while we were waiting was kept for us
+	if( fTLabelsReserved[node] )
+	{
+		AsyncPendingTrans * reserved = takeReservedTrans( node, cmd, altcmd );
+		if( reserved )
+			return reserved;
+	}
+	
+	UInt64 freeLabels = ~fTLabelsInUse[node];
+	if( freeLabels == 0 )
+		return NULL;
 	
-    return NULL;
+	// rotate through the labels so a label is not reused right after it is freed
+	UInt64 ahead = freeLabels & (~0ULL << fNextTLabel[node]);
+	if( ahead )
+		freeLabels = ahead;
+	
+	UInt32 tran = __builtin_ctzll( freeLabels );
+	fTLabelsInUse[node] |= (1ULL << tran);
+	fNextTLabel[node] = (tran + 1) & (kMaxPendingTransfers - 1);
+	
+	AsyncPendingTrans * t = &pool[tran];
+	t->fHandler = cmd;
+	t->fAltHandler = altcmd;
+	t->fInUse = true;
+	t->fTCode = tran;
+	t->fNodeIndex = node;
+	
+	return t;
 }
 
 // freeTrans
 //
-//
+// the label goes straight to the oldest command waiting on this destination, it stays
+// marked in use so nothing that runs before the waiter can take it back
 
 void IOFireWireController::freeTrans(AsyncPendingTrans *trans)
 {
+	UInt32 node = trans->fNodeIndex;
+	
     // No lock needed - can't have two users of a tcode.
     trans->fHandler = NULL;
 	trans->fAltHandler = NULL;
     trans->fInUse = false;
+	
+	IOFWCommand * waiter = fTLabelWaitQ.fHead;
+	while( waiter )
+	{
+		IOFWCommand * next = waiter->getNext();
+		IOFWAsyncCommand * async_waiter = OSDynamicCast( IOFWAsyncCommand, waiter );
+		if( transNodeIndex( async_waiter ) == node )
+		{
+			// keyed the way the waiter will ask for it in allocTrans
+			trans->fHandler = async_waiter;
+			trans->fAltHandler = async_waiter ? NULL : waiter;
+			fTLabelsReserved[node] |= (1ULL << trans->fTCode);
+			
+			waiter->removeFromQ();
+			
+			IOFWCommand * tail = fPendingQ.fTail;
+			if( tail == NULL )
+				waiter->setHead( fPendingQ );
+			else
+				waiter->insertAfter( *tail );
+			
+			return;
+		}
+		waiter = next;
+	}
+	
+	fTLabelsInUse[node] &= ~(1ULL << trans->fTCode);
 }
 
-// asyncRead
-//
+// takeReservedTrans
 //
+// the label freeTrans kept for this command, if there is one
 
-IOReturn IOFireWireController::asyncRead(	UInt32 				generation, 
-											UInt16 				nodeID, 
-											UInt16 				addrHi, 
-											UInt32 				addrLo,
-											int 				speed, 
-											int 				label, 
-											int 				size, 
-											IOFWAsyncCommand *	cmd)
+AsyncPendingTrans * IOFireWireController::takeReservedTrans( UInt32 node, IOFWAsyncCommand * cmd, IOFWCommand * altcmd )
 {
-	return asyncRead(	generation,
-						nodeID,
-						addrHi,
-						addrLo,
-						speed,
-						label,
-						size,
-						cmd,
-						kIOFWReadFlagsNone );
+	AsyncPendingTrans * pool = (node == kFWBroadcastNodeID) ? fTrans : fNodeTrans[node];
+	
+	UInt64 reserved = fTLabelsReserved[node];
+	while( reserved )
+	{
+		UInt32 tran = __builtin_ctzll( reserved );
+		reserved &= reserved - 1;
+		
+		AsyncPendingTrans * t = &pool[tran];
+		if( cmd ? (t->fHandler == cmd) : (t->fAltHandler == altcmd) )
+		{
+			fTLabelsReserved[node] &= ~(1ULL << tran);
+			
+			t->fHandler = cmd;
+			t->fAltHandler = altcmd;
+			t->fInUse = true;
+			
+			return t;
+		}
+	}
+	
+	return NULL;
 }
 
-// asyncRead
+// releaseReservedTrans
 //
+// a command that completes before it gets to use the label kept for it passes the
+// label on, to the next waiter or back to the pool
+
+void IOFireWireController::releaseReservedTrans( IOFWAsyncCommand * cmd, IOFWCommand * altcmd )
+{
+	UInt32 node = transNodeIndex( cmd );
+	if( fTLabelsReserved[node] == 0 )
+		return;
+	
+	AsyncPendingTrans * t = takeReservedTrans( node, cmd, altcmd );
+	if( t )
+		freeTrans( t );
+}
+
+// findTrans
 //
+// look up the outstanding transaction a response from nodeID with tLabel belongs to
 
-// Route packet sending to FWIM if checks out OK
-IOReturn IOFireWireController::asyncRead(	UInt32 				generation, 
-											UInt16 				nodeID, 
-											UInt16 				addrHi, 
-											UInt32 				addrLo,
-											int 				speed, 
-											int 				label, 
-											int 				size, 
-											IOFWAsyncCommand *	cmd,
-											IOFWReadFlags		flags )
+AsyncPendingTrans * IOFireWireController::findTrans( UInt16 nodeID, UInt32 tLabel )
 {
-	FWTrace_Start(kFWTController, kTPControllerAsyncRead, (uintptr_t)fFWIM, (uintptr_t)cmd, (uintptr_t)((nodeID << 16) | addrHi), addrLo );
+	UInt32 node = nodeID & kFWMaxNodesPerBus;
 	
-    if( !checkGeneration(generation) ) 
-	{
-		FWTrace_End(kFWTController, kTPControllerAsyncRead, (uintptr_t)fFWIM, (uintptr_t)cmd, kIOFireWireBusReset, 1 );
-        return kIOFireWireBusReset;
-    }
+	if( tLabel >= kMaxPendingTransfers || !(fTLabelsInUse[node] & (1ULL << tLabel)) )
+		return NULL;
 	
-    // Check if local node
+	// nothing has been sent with a reserved label yet
+	if( fTLabelsReserved[node] & (1ULL << tLabel) )
+		return NULL;
+	
+	if( node == kFWBroadcastNodeID )
+		return &fTrans[tLabel];
+	
+	return &fNodeTrans[node][tLabel];
+}
 
-    if( nodeID == fLocalNodeID ) 
+// transNodeIndex
+//
+// which label pool a command draws from
+
+UInt32 IOFireWireController::transNodeIndex( IOFWAsyncCommand * cmd )
+{
+	if( cmd == NULL )
+		return kFWBroadcastNodeID;
+	
+	// broadcast and unresolved node ids all land in the shared pool
+	return cmd->getAddress().nodeID & kFWMaxNodesPerBus;
+}
+
+// failAllTrans
+//
+// complete every outstanding transaction with a bus reset error
+
+void IOFireWireController::failAllTrans( void )
+{
+	for( UInt32 node = 0; node <= kFWMaxNodesPerBus; node++ )
+	{
+		// node ids are about to change, so a waiter may not come back to the pool its
+		// label was kept in. drop reservations, the waiters just allocate again
+		UInt64 reserved = fTLabelsReserved[node];
+		while( reserved )
+		{
+			UInt32 tran = __builtin_ctzll( reserved );
+			reserved &= reserved - 1;
+			
+			AsyncPendingTrans * t = (node == kFWBroadcastNodeID) ? &fTrans[tran] : &fNodeTrans[node][tran];
+			t->fHandler = NULL;
+			t->fAltHandler = NULL;
+			fTLabelsInUse[node] &= ~(1ULL << tran);
+		}
+		fTLabelsReserved[node] = 0;
+		
+		// completing a command can free and reallocate labels, walk a snapshot
+		UInt64 inUse = fTLabelsInUse[node];
+		while( inUse )
+		{
+			UInt32 tran = __builtin_ctzll( inUse );
+			inUse &= inUse - 1;
+			
+			// freed during this walk and kept for a waiter that hasn't sent anything
+			if( fTLabelsReserved[node] & (1ULL << tran) )
+				continue;
+			
+			AsyncPendingTrans * t = (node == kFWBroadcastNodeID) ? &fTrans[tran] : &fNodeTrans[node][tran];
+			if( t->fHandler ) 
+			{
+				IOFWAsyncCommand * cmd = t->fHandler;
+				cmd->gotPacket(kFWResponseBusResetError, NULL, 0);
+			}
+			else if( t->fAltHandler )
+			{
+				IOFWAsyncPHYCommand * cmd = OSDynamicCast( IOFWAsyncPHYCommand, t->fAltHandler );
+				if( cmd )
+				{
+					cmd->gotPacket( kFWResponseBusResetError );
+				}
+			}
+		}
+	}
+}
+
+// waitForTrans
+//
+//
+
+IOReturn IOFireWireController::waitForTrans( IOFWCommand * cmd )
+{
+	// Print only if its a first time
+	if ( fOutOfTLabels == 0 && fOutOfTLabelsThreshold == 0 )
+		IOLog("IOFireWireController:: Out of Transaction Labels\n");
+		
+	// Out of TLabels counter (Information Only)
+	fOutOfTLabels++;
+	
+	// nothing has been sent, so park it until a label frees up. the timeout queue
+	// still times it out at its deadline and fails it on a bus reset.
+	cmd->removeFromQ();
+	
+	IOFWCommand * tail = fTLabelWaitQ.fTail;
+	if( tail == NULL )
+		cmd->setHead( fTLabelWaitQ );
+	else
+		cmd->insertAfter( *tail );
+	
+	fTimeoutQ.arm();
+	
+	return kIOReturnSuccess;
+}
+
+// asyncRead
+//
+//
+
+IOReturn IOFireWireController::asyncRead(	UInt32 				generation, 
+											UInt16 				nodeID, 
+											UInt16 				addrHi, 
+											UInt32 				addrLo,
+											int 				speed, 
+											int 				label, 
+											int 				size, 
+											IOFWAsyncCommand *	cmd)
+{
+	return asyncRead(	generation,
+						nodeID,
+						addrHi,
+						addrLo,
+						speed,
+						label,
+						size,
+						cmd,
+						kIOFWReadFlagsNone );
+}
+
+// asyncRead
+//
+//
+
+// Route packet sending to FWIM if checks out OK
+IOReturn IOFireWireController::asyncRead(	UInt32 				generation, 
+											UInt16 				nodeID, 
+											UInt16 				addrHi, 
+											UInt32 				addrLo,
+											int 				speed, 
+											int 				label, 
+											int 				size, 
+											IOFWAsyncCommand *	cmd,
+											IOFWReadFlags		flags )
+{
+	FWTrace_Start(kFWTController, kTPControllerAsyncRead, (uintptr_t)fFWIM, (uintptr_t)cmd, (uintptr_t)((nodeID << 16) | addrHi), addrLo );
+	
+    if( !checkGeneration(generation) ) 
+	{
+		FWTrace_End(kFWTController, kTPControllerAsyncRead, (uintptr_t)fFWIM, (uintptr_t)cmd, kIOFireWireBusReset, 1 );
+        return kIOFireWireBusReset;
+    }
+	
+    // Check if local node
+
+    if( nodeID == fLocalNodeID ) 
 	{
         UInt32 rcode;
         IOMemoryDescriptor *buf;
@@ -5128,6 +5637,7 @@ kprintf("Received packet 0x%x size %d\n", data, size);
     UInt32	quad0;
     UInt16	sourceID;
     UInt16	destID;
+    AsyncPendingTrans * trans;
 
     // Get first quad.
     quad0 = *data;
@@ -5167,8 +5677,9 @@ kprintf("Received packet 0x%x size %d\n", data, size);
             break;
 
         case kFWTCodeWriteResponse :
-            if(fTrans[tLabel].fHandler) {
-                IOFWAsyncCommand * cmd = fTrans[tLabel].fHandler;
+            trans = findTrans( sourceID, tLabel );
+            if(trans && trans->fHandler) {
+                IOFWAsyncCommand * cmd = trans->fHandler;
 				FWAddress commandAddress = cmd->getAddress();
 				
             	if( sourceID == commandAddress.nodeID ){
@@ -5198,37 +5709,22 @@ kprintf("Received packet 0x%x size %d\n", data, size);
                      kFWAsynchDestinationOffsetHighPhase, data[2]);
 #endif
             {
+                IOFWRcvHeader header;
+                UInt32 quad;
                 UInt32 ret;
-                FWAddress addr((data[1] & kFWAsynchDestinationOffsetHigh) >>  kFWAsynchDestinationOffsetHighPhase, data[2]);
-                IOMemoryDescriptor *buf = NULL;
-				IOByteCount offset;
-                
-				ret = doReadSpace(sourceID, speed, addr, 4,
-                                    &buf, &offset, NULL, (IOFWRequestRefCon)(tLabel | kRequestIsQuad));
 				
-				FWTrace(kFWTController, kTPControllerProcessRcvPacketRQ, (uintptr_t)fFWIM, ret, ((addr.nodeID << 16) | addr.addressHi), addr.addressLo);
+				decodeRcvHeader( data, &header );
+				ret = dispatchReadQuadRequest( &header, speed, &quad );
+				
+				FWTrace(kFWTController, kTPControllerProcessRcvPacketRQ, (uintptr_t)fFWIM, ret, ((header.fAddress.nodeID << 16) | header.fAddress.addressHi), header.fAddress.addressLo);
 				
                 if(ret == kFWResponsePending)
                     break;
                 
-				if( NULL != buf ) 
-				{
-					UInt32 quad = OSSwapHostToBigInt32(0xdeadbeef);
-						
-					buf->readBytes( offset, &quad, 4 );
-					
-					if ( destID != 0xffff )	// we should not respond to broadcast reads
-						fFWIM->asyncReadQuadResponse(sourceID, speed, tLabel, ret, quad );
-					else
-						DebugLog("Skipped asyncReadQuadResponse because destID=0x%x\n", destID);
-                }
-                else 
-				{
-                    if ( destID != 0xffff )	// we should not respond to broadcast reads
-						fFWIM->asyncReadQuadResponse(sourceID, speed, tLabel, ret, OSSwapHostToBigInt32(0xdeadbeef));
-					else
-						DebugLog("Skipped asyncReadQuadResponse because destID=0x%x\n", destID);
-                }
+				if ( destID != 0xffff )	// we should not respond to broadcast reads
+					fFWIM->asyncReadQuadResponse(sourceID, speed, tLabel, ret, quad );
+				else
+					DebugLog("Skipped asyncReadQuadResponse because destID=0x%x\n", destID);
             }
             break;
 
@@ -5269,8 +5765,9 @@ kprintf("Received packet 0x%x size %d\n", data, size);
             break;
 
         case kFWTCodeReadQuadletResponse :
-            if(fTrans[tLabel].fHandler) {
-                IOFWAsyncCommand * cmd = fTrans[tLabel].fHandler;
+            trans = findTrans( sourceID, tLabel );
+            if(trans && trans->fHandler) {
+                IOFWAsyncCommand * cmd = trans->fHandler;
 				FWAddress commandAddress = cmd->getAddress();
 				
             	if( sourceID == commandAddress.nodeID )
@@ -5299,9 +5796,10 @@ kprintf("Received packet 0x%x size %d\n", data, size);
 
         case kFWTCodeReadBlockResponse :
         case kFWTCodeLockResponse :
-            if(fTrans[tLabel].fHandler) {
+            trans = findTrans( sourceID, tLabel );
+            if(trans && trans->fHandler) {
             	
-				IOFWAsyncCommand * cmd = fTrans[tLabel].fHandler;
+				IOFWAsyncCommand * cmd = trans->fHandler;
 				FWAddress commandAddress = cmd->getAddress();
 				
             	if( sourceID == commandAddress.nodeID )
@@ -5353,6 +5851,130 @@ kprintf("Received packet 0x%x size %d\n", data, size);
     }	
 }
 
+// processRcvPackets
+//
+// dispatch a batch of received async packets under one gate hold. headers are decoded
+// up front and write and read quadlet requests are answered together once each run of
+// them is done. packets are still handled in the order received, peers expect their
+// requests to take effect in order. writes go straight to dispatchWriteRequest rather than
+// through processWriteRequest, so each one is traced here the same way.
+
+void IOFireWireController::processRcvPackets( IOFWRcvPacket * packets, UInt32 count )
+{
+	IOFWRcvHeader		headers[kFWRcvPacketBatchMax];
+	IOFWAsyncResponse	responses[kFWRcvPacketBatchMax];
+	
+	closeGate();
+	
+	FWTrace(kFWTController, kTPControllerProcessRcvPackets, (uintptr_t)fFWIM, count, 0, 0);
+	
+	while( count )
+	{
+		UInt32 batch = (count < kFWRcvPacketBatchMax) ? count : kFWRcvPacketBatchMax;
+		UInt32 pending = 0;
+		
+		for( UInt32 i = 0; i < batch; i++ )
+		{
+			decodeRcvHeader( packets[i].fData, &headers[i] );
+		}
+		
+		for( UInt32 i = 0; i < batch; i++ )
+		{
+			IOFWRcvHeader * header = &headers[i];
+			UInt32 * data = packets[i].fData;
+			IOFWSpeed speed = packets[i].fSpeed;
+			UInt32 quad = 0;
+			UInt32 ret;
+			
+			switch( header->fTCode )
+			{
+				case kFWTCodeWriteQuadlet:
+					ret = dispatchWriteRequest( header, &data[3], 4, speed );
+					FWTrace(kFWTController, kTPControllerProcessWriteRequest, (uintptr_t)fFWIM, header->fSourceID, ret, header->fTLabel);
+					break;
+				
+				case kFWTCodeWriteBlock:
+					ret = dispatchWriteRequest( header, &data[4], (data[3] & kFWAsynchDataLength) >> kFWAsynchDataLengthPhase, speed );
+					FWTrace(kFWTController, kTPControllerProcessWriteRequest, (uintptr_t)fFWIM, header->fSourceID, ret, header->fTLabel);
+					break;
+				
+				case kFWTCodeReadQuadlet:
+					ret = dispatchReadQuadRequest( header, speed, &quad );
+					FWTrace(kFWTController, kTPControllerProcessRcvPacketRQ, (uintptr_t)fFWIM, ret, ((header->fAddress.nodeID << 16) | header->fAddress.addressHi), header->fAddress.addressLo);
+					break;
+				
+				case kFWTCodeWriteResponse:
+				case kFWTCodeReadQuadletResponse:
+				case kFWTCodeReadBlockResponse:
+				case kFWTCodeLockResponse:
+					// responses to our own requests, nothing goes back to the peer
+					processRcvPacket( data, packets[i].fQuads, speed );
+					continue;
+				
+				default:
+					// block reads and locks answer for themselves, send what is queued first
+					// so the peer sees its responses in order
+					sendAsyncResponses( responses, pending );
+					pending = 0;
+					
+					processRcvPacket( data, packets[i].fQuads, speed );
+					continue;
+			}
+			
+			// only reads are ever left pending, and we should not respond to broadcast requests
+			if( ret != kFWResponsePending && header->fDestID != 0xffff )
+			{
+				IOFWAsyncResponse * response = &responses[pending++];
+				
+				response->fTCode = (header->fTCode == kFWTCodeReadQuadlet) ? kFWTCodeReadQuadletResponse : kFWTCodeWriteResponse;
+				response->fNodeID = header->fSourceID;
+				response->fSpeed = speed;
+				response->fLabel = header->fTLabel;
+				response->fRCode = ret;
+				response->fAddrHi = header->fAddress.addressHi;
+				response->fQuad = quad;
+			}
+		}
+		
+		sendAsyncResponses( responses, pending );
+		
+		packets += batch;
+		count -= batch;
+	}
+	
+	openGate();
+}
+
+// decodeRcvHeader
+//
+//
+
+void IOFireWireController::decodeRcvHeader( const UInt32 * data, IOFWRcvHeader * header )
+{
+	header->fTCode = (data[0] & kFWPacketTCode) >> kFWPacketTCodePhase;
+	header->fTLabel = (data[0] & kFWAsynchTLabel) >> kFWAsynchTLabelPhase;
+	header->fSourceID = (data[1] & kFWAsynchSourceID) >> kFWAsynchSourceIDPhase;
+	header->fDestID = (data[0] & kFWAsynchDestinationID) >> kFWAsynchDestinationIDPhase;
+	header->fAddress = FWAddress( (data[1] & kFWAsynchDestinationOffsetHigh) >> kFWAsynchDestinationOffsetHighPhase, data[2] );
+}
+
+// sendAsyncResponses
+//
+//
+
+void IOFireWireController::sendAsyncResponses( IOFWAsyncResponse * responses, UInt32 count )
+{
+	if( count == 0 )
+		return;
+	
+	if( count == 1 && responses[0].fTCode == kFWTCodeWriteResponse )
+		fFWIM->asyncWriteResponse( responses[0].fNodeID, responses[0].fSpeed, responses[0].fLabel, responses[0].fRCode, responses[0].fAddrHi );
+	else if( count == 1 )
+		fFWIM->asyncReadQuadResponse( responses[0].fNodeID, responses[0].fSpeed, responses[0].fLabel, responses[0].fRCode, responses[0].fQuad );
+	else
+		fFWIM->asyncResponses( responses, count );
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // async request receive
 //
@@ -5453,8 +6075,9 @@ IOFireWireController::getAddressSpace(FWAddress address)
     closeGate();
     
 	IOFWAddressSpace * found;
-    fSpaceIterator->reset();
-    while( (found = (IOFWAddressSpace *) fSpaceIterator->getNextObject())) {
+	IOFWAddressSpaceLookup lookup;
+	startAddressSpaceLookup( address, &lookup );
+    while( (found = nextAddressSpace( &lookup )) ) {
         if(found->contains(address))
             break;
     }
@@ -5609,8 +6232,6 @@ IOFireWireController::freeAllAsyncStreamReceiver()
 IOReturn IOFireWireController::allocAddress(IOFWAddressSpace *space)
 {
     /*
-     * Lots of scope for optimizations here, perhaps building a hash table for
-     * addresses etc.
      * Drivers may want to override this if their hardware can match addresses
      * without CPU intervention.
      */
@@ -5619,18 +6240,30 @@ IOReturn IOFireWireController::allocAddress(IOFWAddressSpace *space)
 	closeGate();
  
 	// enforce exclusivity
-	IOFWAddressSpace * found;
-    fSpaceIterator->reset();
-    while( (found = (IOFWAddressSpace *) fSpaceIterator->getNextObject())) 
-	{
-		// if either of the conflicting address spaces wants to be exclusive
-		if( space->isExclusive() || found->isExclusive() )
+	// only fixed range spaces can intersect, so only the overlapping index entries need checking
+	FWAddress base;
+	UInt32 length;
+	if( space->getAddressRange( &base, &length ) )
+	{
+		// intersects() checks the first byte even of an empty space
+		UInt64 start = ((UInt64)base.addressHi << 32) | base.addressLo;
+		UInt64 end = start + ((length > 0) ? length : 1);
+		
+		SInt32 i = (SInt32)findSpaceIndexPosition( end - 1 ) - 1;
+		for( ; i >= 0 && fSpaceIndex[i].fMaxEnd > start; i-- )
 		{
-			// check if they intersect
-			if( found->intersects( space ) )
+			IOFWAddressSpace * found = fSpaceIndex[i].fSpace;
+			
+			// if either of the conflicting address spaces wants to be exclusive
+			if( space->isExclusive() || found->isExclusive() )
 			{
-				// we have a problem
-				result = kIOReturnExclusiveAccess;
+				// check if they intersect
+				if( fSpaceIndex[i].fEnd > start && found->intersects( space ) )
+				{
+					// we have a problem
+					result = kIOReturnExclusiveAccess;
+					break;
+				}
 			}
 		}
 	}
@@ -5643,6 +6276,13 @@ IOReturn IOFireWireController::allocAddress(IOFWAddressSpace *space)
 			result = kIOReturnSuccess;
     }
 	
+	if( result == kIOReturnSuccess )
+	{
+		result = indexAddressSpace( space );
+		if( result != kIOReturnSuccess )
+			fLocalAddresses->removeObject( space );
+	}
+	
 	openGate();
     
 	return result;
@@ -5656,127 +6296,441 @@ void IOFireWireController::freeAddress(IOFWAddressSpace *space)
 {
     closeGate();
 	
+	unindexAddressSpace( space );
 	fLocalAddresses->removeObject(space);
 	
 	openGate();
 }
 
-// allocatePseudoAddress
-//
+// findSpaceIndexPosition
 //
+// returns the number of index entries starting at or below address
 
-IOReturn IOFireWireController::allocatePseudoAddress(FWAddress *addr, UInt32 lenDummy)
+UInt32 IOFireWireController::findSpaceIndexPosition( UInt64 address )
 {
-    unsigned int i, len;
-    UInt8 * data;
-    UInt8 used = 1;
-    
-    closeGate();
-    
-    if( fAllocatedAddresses == NULL ) 
-    {
-        fAllocatedAddresses = OSData::withCapacity(4);	// SBP2 + some spare
-        fAllocatedAddresses->appendBytes(&used, 1);	// Physical always allocated
-    }
-    
-    if( !fAllocatedAddresses )
-    {   
-        openGate();
-        return kIOReturnNoMemory;
-    }
-    
-    len = fAllocatedAddresses->getLength();
-    data = (UInt8*)fAllocatedAddresses->getBytesNoCopy();
-    for( i=0; i<len; i++ ) 
-    {
-        if( data[i] == 0 ) 
-        {
-            data[i] = 1;
-            addr->addressHi = i;
-            addr->addressLo = 0;
-        
-            openGate();
-            return kIOReturnSuccess;
-        }
-    }
-    
-    if( len >= 0xfffe )
-    {
-        openGate();
-		return kIOReturnNoMemory;
-    }
-    
-    if( fAllocatedAddresses->appendBytes(&used, 1)) 
-    {
-        addr->addressHi = len;
-        addr->addressLo = 0;
-    
-        openGate();
-        return kIOReturnSuccess;
-    }
-
-    openGate();
-    return kIOReturnNoMemory;      
+	UInt32 low = 0;
+	UInt32 high = fSpaceIndexCount;
+	
+	while( low < high )
+	{
+		UInt32 mid = (low + high) / 2;
+		if( fSpaceIndex[mid].fStart <= address )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	
+	return low;
 }
 
-// freePseudoAddress
+// updateSpaceIndexMaxEnd
 //
 //
 
-void IOFireWireController::freePseudoAddress(FWAddress addr, UInt32 lenDummy)
+void IOFireWireController::updateSpaceIndexMaxEnd( UInt32 from )
 {
-    unsigned int len;
-    UInt8 * data;
-    
-    closeGate();
-    
-    assert( fAllocatedAddresses != NULL);
-    
-    len = fAllocatedAddresses->getLength();
-    assert(addr.addressHi < len);
-    data = (UInt8*)fAllocatedAddresses->getBytesNoCopy();
-    assert(data[addr.addressHi]);
-    data[addr.addressHi] = 0;
-    
-    openGate();
+	UInt64 max_end = (from > 0) ? fSpaceIndex[from - 1].fMaxEnd : 0;
+	
+	for( UInt32 i = from; i < fSpaceIndexCount; i++ )
+	{
+		if( fSpaceIndex[i].fEnd > max_end )
+			max_end = fSpaceIndex[i].fEnd;
+		
+		fSpaceIndex[i].fMaxEnd = max_end;
+	}
 }
 
-#if 0
-IOReturn MyTestingFWMultiIsochReceiveListenerCallback(void *refcon, IOFireWireMultiIsochReceivePacket *pPacket)
+// indexAddressSpace
+//
+//
+
+IOReturn IOFireWireController::indexAddressSpace( IOFWAddressSpace * space )
 {
-	DebugLog("AY_DEBUG: MyTestingFWMultiIsochReceiveListenerCallback\n");
+	FWAddress base;
+	UInt32 length;
 	
-	pPacket->clientDone();
+	fSpaceIndexGeneration++;
+	
+	if( !space->getAddressRange( &base, &length ) )
+	{
+		// no fixed range, this space gets asked about every address
+		if( !fUnindexedAddresses->setObject( space ) )
+			return kIOReturnNoMemory;
+		
+		return kIOReturnSuccess;
+	}
+	
+	if( fSpaceIndexCount == fSpaceIndexCapacity )
+	{
+		UInt32 capacity = (fSpaceIndexCapacity == 0) ? 16 : (fSpaceIndexCapacity * 2);
+		IOFWAddressSpaceIndexEntry * index = (IOFWAddressSpaceIndexEntry*)IOMalloc( sizeof(IOFWAddressSpaceIndexEntry) * capacity );
+		if( index == NULL )
+			return kIOReturnNoMemory;
+		
+		if( fSpaceIndex != NULL )
+		{
+			bcopy( fSpaceIndex, index, sizeof(IOFWAddressSpaceIndexEntry) * fSpaceIndexCount );
+			IOFree( fSpaceIndex, sizeof(IOFWAddressSpaceIndexEntry) * fSpaceIndexCapacity );
+		}
+		
+		fSpaceIndex = index;
+		fSpaceIndexCapacity = capacity;
+	}
+	
+	UInt64 start = ((UInt64)base.addressHi << 32) | base.addressLo;
+	UInt64 end = start + length;
+	
+	// contains() never matches past the end of the addressHi the space lives in
+	UInt64 hi_end = ((UInt64)base.addressHi + 1) << 32;
+	if( end > hi_end )
+		end = hi_end;
+	
+	UInt32 position = findSpaceIndexPosition( start );
+	bcopy( &fSpaceIndex[position], &fSpaceIndex[position + 1], sizeof(IOFWAddressSpaceIndexEntry) * (fSpaceIndexCount - position) );
+	
+	fSpaceIndex[position].fStart = start;
+	fSpaceIndex[position].fEnd = end;
+	fSpaceIndex[position].fSpace = space;
+	fSpaceIndexCount++;
+	
+	updateSpaceIndexMaxEnd( position );
 	
 	return kIOReturnSuccess;
 }
-#endif
 
-// processWriteRequest
+// unindexAddressSpace
+//
 //
-// process quad and block writes.
 
-void IOFireWireController::processWriteRequest(UInt16 sourceID, UInt32 tLabel,
-			UInt32 *hdr, void *buf, int len, IOFWSpeed speed)
+void IOFireWireController::unindexAddressSpace( IOFWAddressSpace * space )
 {
-    UInt32 ret = kFWResponseAddressError;
-    FWAddress addr((hdr[1] & kFWAsynchDestinationOffsetHigh) >> kFWAsynchDestinationOffsetHighPhase, hdr[2]);
-    IOFWAddressSpace * found;
+	fSpaceIndexGeneration++;
 	
-#if 0
-	// Special Andy Debug code to set/clear MultiIsochReceiver channels remotely via FireBug qwrite!
-	if  ((addr.addressHi == 0xFFFF) && (addr.addressLo == 0xF0000A00) && (len == 4))
+	FWAddress base;
+	UInt32 length;
+	if( !space->getAddressRange( &base, &length ) )
 	{
-		UInt32 add_chan = OSSwapBigToHostInt32(*((UInt32*) buf));
-		DebugLog("Got quadlet-write to special MultiIsochReceiver channel-add address: add_chan=%d\n",add_chan);
-		if (fFWIM)
+		unsigned int index = fUnindexedAddresses->getNextIndexOfObject( space, 0 );
+		if( index != (unsigned int)-1 )
+			fUnindexedAddresses->removeObject( index );
+		
+		return;
+	}
+	
+	// several spaces can share a start address, walk back from the last one
+	UInt64 start = ((UInt64)base.addressHi << 32) | base.addressLo;
+	SInt32 i = (SInt32)findSpaceIndexPosition( start ) - 1;
+	for( ; i >= 0 && fSpaceIndex[i].fStart == start; i-- )
+	{
+		if( fSpaceIndex[i].fSpace == space )
 		{
-			IOReturn result;
-			IOFireWireMultiIsochReceiveListener *pListener = createMultiIsochReceiveListener(add_chan,MyTestingFWMultiIsochReceiveListenerCallback,this);
-			if (pListener)
-			{
-				result = pListener->Activate();
-				if (result != kIOReturnSuccess)
+			fSpaceIndexCount--;
+			bcopy( &fSpaceIndex[i + 1], &fSpaceIndex[i], sizeof(IOFWAddressSpaceIndexEntry) * (fSpaceIndexCount - i) );
+			updateSpaceIndexMaxEnd( i );
+			break;
+		}
+	}
+}
+
+// startAddressSpaceLookup
+//
+//
+
+void IOFireWireController::startAddressSpaceLookup( FWAddress addr, IOFWAddressSpaceLookup * lookup )
+{
+	lookup->fAddress = ((UInt64)addr.addressHi << 32) | addr.addressLo;
+	lookup->fIndexed = (SInt32)findSpaceIndexPosition( lookup->fAddress ) - 1;
+	lookup->fUnindexed = 0;
+	lookup->fGeneration = fSpaceIndexGeneration;
+}
+
+// nextAddressSpace
+//
+// returns the next address space whose range covers the lookup address, fixed range spaces first.
+// like the iterator this replaces, the lookup ends if spaces are added or removed under it.
+
+IOFWAddressSpace * IOFireWireController::nextAddressSpace( IOFWAddressSpaceLookup * lookup )
+{
+	if( lookup->fGeneration != fSpaceIndexGeneration )
+		return NULL;
+	
+	while( lookup->fIndexed >= 0 )
+	{
+		IOFWAddressSpaceIndexEntry * entry = &fSpaceIndex[lookup->fIndexed--];
+		
+		// nothing at or below this entry reaches the address
+		if( entry->fMaxEnd <= lookup->fAddress )
+		{
+			lookup->fIndexed = -1;
+			break;
+		}
+		
+		if( entry->fEnd > lookup->fAddress )
+			return entry->fSpace;
+	}
+	
+	if( lookup->fUnindexed < fUnindexedAddresses->getCount() )
+		return (IOFWAddressSpace *)fUnindexedAddresses->getObject( lookup->fUnindexed++ );
+	
+	return NULL;
+}
+
+// allocatePseudoAddress
+//
+//
+
+IOReturn IOFireWireController::allocatePseudoAddress(FWAddress *addr, UInt32 lenDummy)
+{
+	IOReturn status = kIOReturnSuccess;
+	
+    closeGate();
+    
+	status = createPseudoAddressBitmap();
+	
+	UInt32 addressHi = kFWPseudoAddressHiLimit;
+	if( status == kIOReturnSuccess )
+	{
+		// next fit, so a freshly freed addressHi is not handed straight back out
+		addressHi = findFreePseudoAddress( fPseudoAddressHint );
+		if( addressHi >= kFWPseudoAddressHiLimit )
+			status = kIOReturnNoMemory;
+	}
+	
+	if( status == kIOReturnSuccess )
+	{
+		markPseudoAddress( addressHi, true );
+		fPseudoAddressHint = addressHi + 1;
+		
+		addr->addressHi = addressHi;
+		addr->addressLo = 0;
+	}
+	
+	openGate();
+	
+	return status;
+}
+
+// freePseudoAddress
+//
+//
+
+void IOFireWireController::freePseudoAddress(FWAddress addr, UInt32 lenDummy)
+{
+    closeGate();
+    
+    assert( fPseudoAddressBitmap != NULL );
+    assert( addr.addressHi < kFWPseudoAddressHiLimit );
+    assert( fPseudoAddressBitmap[addr.addressHi / 64] & (1ULL << (addr.addressHi % 64)) );
+	
+	markPseudoAddress( addr.addressHi, false );
+    
+    openGate();
+}
+
+// allocatePseudoAddressRange
+//
+//
+
+IOReturn IOFireWireController::allocatePseudoAddressRange( FWAddress * addr, UInt32 count )
+{
+	IOReturn status = kIOReturnSuccess;
+	
+	if( count == 0 || count >= kFWPseudoAddressHiLimit )
+		return kIOReturnBadArgument;
+	
+	closeGate();
+	
+	status = createPseudoAddressBitmap();
+	
+	if( status == kIOReturnSuccess )
+	{
+		UInt32 start = 0;
+		UInt32 run = 0;
+		
+		status = kIOReturnNoMemory;
+		
+		// first fit, skipping whole words that are full
+		for( UInt32 i = 1; i < kFWPseudoAddressHiLimit; i++ )
+		{
+			UInt32 word = i / 64;
+			
+			if( (i % 64) == 0 && fPseudoAddressBitmap[word] == ~0ULL )
+			{
+				run = 0;
+				i += 63;
+				continue;
+			}
+			
+			if( fPseudoAddressBitmap[word] & (1ULL << (i % 64)) )
+			{
+				run = 0;
+				continue;
+			}
+			
+			if( run == 0 )
+				start = i;
+			
+			if( ++run == count )
+			{
+				for( UInt32 j = start; j < start + count; j++ )
+					markPseudoAddress( j, true );
+				
+				addr->addressHi = start;
+				addr->addressLo = 0;
+				
+				status = kIOReturnSuccess;
+				break;
+			}
+		}
+	}
+	
+	openGate();
+	
+	return status;
+}
+
+// freePseudoAddressRange
+//
+//
+
+void IOFireWireController::freePseudoAddressRange( FWAddress addr, UInt32 count )
+{
+	closeGate();
+	
+	assert( fPseudoAddressBitmap != NULL );
+	assert( addr.addressHi + count <= kFWPseudoAddressHiLimit );
+	
+	for( UInt32 i = addr.addressHi; i < addr.addressHi + count; i++ )
+		markPseudoAddress( i, false );
+	
+	openGate();
+}
+
+// createPseudoAddressBitmap
+//
+//
+
+IOReturn IOFireWireController::createPseudoAddressBitmap( void )
+{
+	if( fPseudoAddressBitmap != NULL )
+		return kIOReturnSuccess;
+	
+	fPseudoAddressBitmap = (UInt64*)IOMalloc( sizeof(UInt64) * kFWPseudoAddressWords );
+	if( fPseudoAddressBitmap == NULL )
+		return kIOReturnNoMemory;
+	
+	bzero( fPseudoAddressBitmap, sizeof(UInt64) * kFWPseudoAddressWords );
+	bzero( fPseudoAddressFull, sizeof(fPseudoAddressFull) );
+	
+	// Physical always allocated
+	markPseudoAddress( 0, true );
+	
+	// the tail of the last word is past the limit, never hand it out
+	for( UInt32 i = kFWPseudoAddressHiLimit; i < kFWPseudoAddressWords * 64; i++ )
+		markPseudoAddress( i, true );
+	
+	fPseudoAddressHint = 1;
+	
+	return kIOReturnSuccess;
+}
+
+// markPseudoAddress
+//
+//
+
+void IOFireWireController::markPseudoAddress( UInt32 addressHi, bool used )
+{
+	UInt32 word = addressHi / 64;
+	
+	if( used )
+	{
+		fPseudoAddressBitmap[word] |= (1ULL << (addressHi % 64));
+		if( fPseudoAddressBitmap[word] == ~0ULL )
+			fPseudoAddressFull[word / 64] |= (1ULL << (word % 64));
+	}
+	else
+	{
+		fPseudoAddressBitmap[word] &= ~(1ULL << (addressHi % 64));
+		fPseudoAddressFull[word / 64] &= ~(1ULL << (word % 64));
+	}
+}
+
+// findFreePseudoAddress
+//
+// returns the first free addressHi at or after from, wrapping around once,
+// or kFWPseudoAddressHiLimit if there are none
+
+UInt32 IOFireWireController::findFreePseudoAddress( UInt32 from )
+{
+	if( from >= kFWPseudoAddressHiLimit )
+		from = 0;
+	
+	for( UInt32 pass = 0; pass < 2; pass++ )
+	{
+		UInt32 word = from / 64;
+		
+		UInt64 free_bits = ~fPseudoAddressBitmap[word] & (~0ULL << (from % 64));
+		if( free_bits )
+			return (word * 64) + __builtin_ctzll( free_bits );
+		
+		// use the full word summary to find the next word with a free bit
+		for( UInt32 next = word + 1; next < kFWPseudoAddressWords; )
+		{
+			UInt64 not_full = ~fPseudoAddressFull[next / 64] & (~0ULL << (next % 64));
+			if( not_full )
+			{
+				UInt32 free_word = ((next / 64) * 64) + __builtin_ctzll( not_full );
+				return (free_word * 64) + __builtin_ctzll( ~fPseudoAddressBitmap[free_word] );
+			}
+			
+			next = ((next / 64) + 1) * 64;
+		}
+		
+		from = 0;
+	}
+	
+	return kFWPseudoAddressHiLimit;
+}
+
+#if 0
+IOReturn MyTestingFWMultiIsochReceiveListenerCallback(void *refcon, IOFireWireMultiIsochReceivePacket *pPacket)
+{
+	DebugLog("AY_DEBUG: MyTestingFWMultiIsochReceiveListenerCallback\n");
+	
+	pPacket->clientDone();
+	
+	return kIOReturnSuccess;
+}
+#endif
+
+// processWriteRequest
+//
+// process quad and block writes.
+
+void IOFireWireController::processWriteRequest(UInt16 sourceID, UInt32 tLabel,
+			UInt32 *hdr, void *buf, int len, IOFWSpeed speed)
+{
+    UInt32 ret;
+    IOFWRcvHeader header;
+	
+	decodeRcvHeader( hdr, &header );
+	
+#if 0
+    FWAddress addr = header.fAddress;
+
+	// Special Andy Debug code to set/clear MultiIsochReceiver channels remotely via FireBug qwrite!
+	if  ((addr.addressHi == 0xFFFF) && (addr.addressLo == 0xF0000A00) && (len == 4))
+	{
+		UInt32 add_chan = OSSwapBigToHostInt32(*((UInt32*) buf));
+		DebugLog("Got quadlet-write to special MultiIsochReceiver channel-add address: add_chan=%d\n",add_chan);
+		if (fFWIM)
+		{
+			IOReturn result;
+			IOFireWireMultiIsochReceiveListener *pListener = createMultiIsochReceiveListener(add_chan,MyTestingFWMultiIsochReceiveListenerCallback,this);
+			if (pListener)
+			{
+				result = pListener->Activate();
+				if (result != kIOReturnSuccess)
 					DebugLog("AY_DEBUG: pListener->Activate failed!\n");
 
 			}
@@ -5801,19 +6755,57 @@ void IOFireWireController::processWriteRequest(UInt16 sourceID, UInt32 tLabel,
 	}
 #endif	
 	
-    fSpaceIterator->reset();
-    while( (found = (IOFWAddressSpace *) fSpaceIterator->getNextObject())) {
-        ret = found->doWrite(sourceID, speed, addr, len, buf, (IOFWRequestRefCon)tLabel);
+	ret = dispatchWriteRequest( &header, buf, len, speed );
+	
+	FWTrace(kFWTController, kTPControllerProcessWriteRequest, (uintptr_t)fFWIM, sourceID, ret, tLabel);
+	
+    if ( header.fDestID != 0xffff )	// we should not respond to broadcast writes
+		fFWIM->asyncWriteResponse(sourceID, speed, tLabel, ret, header.fAddress.addressHi);
+	else
+		DebugLog("Skipped asyncWriteResponse because destID=0x%x\n", header.fDestID);
+}
+
+// dispatchWriteRequest
+//
+// hand a quad or block write to the first address space that takes it, return the rcode
+
+UInt32 IOFireWireController::dispatchWriteRequest( const IOFWRcvHeader * header, void * buf, int len, IOFWSpeed speed )
+{
+    UInt32 ret = kFWResponseAddressError;
+    IOFWAddressSpace * found;
+	
+	IOFWAddressSpaceLookup lookup;
+	startAddressSpaceLookup( header->fAddress, &lookup );
+    while( (found = nextAddressSpace( &lookup )) ) {
+        ret = found->doWrite(header->fSourceID, speed, header->fAddress, len, buf, (IOFWRequestRefCon)header->fTLabel);
         if(ret != kFWResponseAddressError)
             break;
     }
 	
-	FWTrace(kFWTController, kTPControllerProcessWriteRequest, (uintptr_t)fFWIM, sourceID, ret, tLabel);
+	return ret;
+}
+
+// dispatchReadQuadRequest
+//
+// read a quad for a peer, return the rcode. the quad is only meaningful if the
+// rcode is not kFWResponsePending.
+
+UInt32 IOFireWireController::dispatchReadQuadRequest( const IOFWRcvHeader * header, IOFWSpeed &speed, UInt32 * quad )
+{
+	UInt32 ret;
+	FWAddress addr = header->fAddress;
+	IOMemoryDescriptor *buf = NULL;
+	IOByteCount offset;
 	
-    if ( ((hdr[0] & kFWAsynchDestinationID) >> kFWAsynchDestinationIDPhase) != 0xffff )	// we should not respond to broadcast writes
-		fFWIM->asyncWriteResponse(sourceID, speed, tLabel, ret, addr.addressHi);
-	else
-		DebugLog("Skipped asyncWriteResponse because destID=0x%x\n", (uint32_t)((hdr[0] & kFWAsynchDestinationID) >> kFWAsynchDestinationIDPhase));
+	ret = doReadSpace(header->fSourceID, speed, addr, 4,
+						&buf, &offset, NULL, (IOFWRequestRefCon)(header->fTLabel | kRequestIsQuad));
+	
+	*quad = OSSwapHostToBigInt32(0xdeadbeef);
+	
+	if( ret != kFWResponsePending && NULL != buf )
+		buf->readBytes( offset, quad, 4 );
+	
+	return ret;
 }
 
 // processLockRequest
@@ -5855,8 +6847,9 @@ UInt32 IOFireWireController::doReadSpace(UInt16 nodeID, IOFWSpeed &speed, FWAddr
 {
     IOFWAddressSpace * found;
     UInt32 ret = kFWResponseAddressError;
-    fSpaceIterator->reset();
-    while( (found = (IOFWAddressSpace *) fSpaceIterator->getNextObject())) {
+	IOFWAddressSpaceLookup lookup;
+	startAddressSpaceLookup( addr, &lookup );
+    while( (found = nextAddressSpace( &lookup )) ) {
         ret = found->doRead(nodeID, speed, addr, len, buf, offset,
                             refcon);
         if(ret != kFWResponseAddressError)
@@ -5887,8 +6880,9 @@ UInt32 IOFireWireController::doWriteSpace(UInt16 nodeID, IOFWSpeed &speed, FWAdd
 {
     IOFWAddressSpace * found;
     UInt32 ret = kFWResponseAddressError;
-    fSpaceIterator->reset();
-    while( (found = (IOFWAddressSpace *) fSpaceIterator->getNextObject())) {
+	IOFWAddressSpaceLookup lookup;
+	startAddressSpaceLookup( addr, &lookup );
+    while( (found = nextAddressSpace( &lookup )) ) {
         ret = found->doWrite(nodeID, speed, addr, len, buf, refcon);
         if(ret != kFWResponseAddressError)
             break;
@@ -5906,8 +6900,9 @@ UInt32 IOFireWireController::doLockSpace(UInt16 nodeID, IOFWSpeed &speed, FWAddr
 {
     IOFWAddressSpace * found;
     UInt32 ret = kFWResponseAddressError;
-    fSpaceIterator->reset();
-    while( (found = (IOFWAddressSpace *) fSpaceIterator->getNextObject())) {
+	IOFWAddressSpaceLookup lookup;
+	startAddressSpaceLookup( addr, &lookup );
+    while( (found = nextAddressSpace( &lookup )) ) {
         ret = found->doLock(nodeID, speed, addr, inLen, newVal, outLen, oldVal, type, refcon);
         if(ret != kFWResponseAddressError)
             break;
@@ -6251,175 +7246,228 @@ void IOFireWireController::removeIRMAllocation(IOFireWireIRMAllocation *irmAlloc
 //
 IOReturn IOFireWireController::allocateIRMBandwidthInGeneration(UInt32 bandwidthUnits, UInt32 generation)
 {
-	IOReturn res;
-	UInt32 irmGeneration;
-	UInt16 irmNodeID;
-	IOFWCompareAndSwapCommand * fLockCmd;
-	FWAddress addr;
-	UInt32 expectedOldVal, newVal; 
-	UInt32 actualOldVal;
-	bool lockSuccessful;
-	UInt32 retries = 2; 
-	
-	// Get the current IRM and Generation
-	getIRMNodeID(irmGeneration, irmNodeID);
-	
-	// Check the current generation 
-	if (irmGeneration != generation)
-		return kIOFireWireBusReset;
+	return updateIRMResources( 0, bandwidthUnits, generation, true );
+}
+
+// releaseIRMBandwidthInGeneration
+//
+//
+IOReturn IOFireWireController::releaseIRMBandwidthInGeneration(UInt32 bandwidthUnits, UInt32 generation)
+{
+	return updateIRMResources( 0, bandwidthUnits, generation, false );
+}
+
+// allocateIRMChannelInGeneration
+//
+//
+IOReturn IOFireWireController::allocateIRMChannelInGeneration(UInt8 isochChannel, UInt32 generation)
+{
+	if( isochChannel >= 64 )
+		return kIOReturnBadArgument;
 	
-	// Initialize the address for the current IRM's bandwidth available register
-	addr.nodeID = irmNodeID;
-	addr.addressHi = 0xFFFF;
-	addr.addressLo = 0xF0000220;
+	return updateIRMResources( 1ULL << isochChannel, 0, generation, true );
+}
+
+// releaseIRMChannelInGeneration
+//
+//
+IOReturn IOFireWireController::releaseIRMChannelInGeneration(UInt8 isochChannel, UInt32 generation)
+{
+	if( isochChannel >= 64 )
+		return kIOReturnBadArgument;
 	
-	// Start with the default, no-bandwidth allocated value for the old val!
-	expectedOldVal = OSSwapHostToBigInt32(0x00001333);	
+	return updateIRMResources( 1ULL << isochChannel, 0, generation, false );
+}
+
+// allocateIRMResourcesInGeneration
+//
+//
+IOReturn IOFireWireController::allocateIRMResourcesInGeneration(UInt64 channels, UInt32 bandwidthUnits, UInt32 generation)
+{
+	return updateIRMResources( channels, bandwidthUnits, generation, true );
+}
+
+// releaseIRMResourcesInGeneration
+//
+//
+IOReturn IOFireWireController::releaseIRMResourcesInGeneration(UInt64 channels, UInt32 bandwidthUnits, UInt32 generation)
+{
+	return updateIRMResources( channels, bandwidthUnits, generation, false );
+}
+
+// updateIRMResources
+//
+// takes or gives back everything asked for with one compare/swap per IRM register
+// when the snapshot predicts the register right. if an allocation fails part way the
+// registers already locked are given back. a bus reset needs no undoing, the IRM
+// starts over with every resource free.
+
+IOReturn IOFireWireController::updateIRMResources( UInt64 channels, UInt32 bandwidthUnits, UInt32 generation, bool allocate )
+{
+	IOReturn res = kIOReturnSuccess;
+	UInt32 irmGeneration;
+	UInt16 irmNodeID;
+	IOFWCompareAndSwapCommand * lockCmd;
+	UInt32 amounts[kFWIRMRegisterCount];
+	UInt32 locked = 0;
+	UInt32 reg;
+	
+	// Get the current IRM and Generation
+	getIRMNodeID(irmGeneration, irmNodeID);
+	
+	// Check the current generation 
+	if (irmGeneration != generation)
+		return kIOFireWireBusReset;
+	
+	// channel n is bit 31 - n of the register holding it
+	amounts[kFWIRMChannels31_0] = 0;
+	amounts[kFWIRMChannels63_32] = 0;
+	for( UInt32 channel = 0; channel < 64; channel++ )
+	{
+		if( channels & (1ULL << channel) )
+			amounts[channel / 32] |= 1 << (31 - (channel % 32));
+	}
+	amounts[kFWIRMBandwidth] = bandwidthUnits;
+	
+	if( amounts[kFWIRMChannels31_0] == 0 && amounts[kFWIRMChannels63_32] == 0 && bandwidthUnits == 0 )
+		return kIOReturnSuccess;
 	
 	// Create a compare/swap command
-	fLockCmd = OSTypeAlloc( IOFWCompareAndSwapCommand );
-	if (!fLockCmd)
+	lockCmd = OSTypeAlloc( IOFWCompareAndSwapCommand );
+	if (!lockCmd)
 		return kIOReturnNoMemory;
 	
 	// Pre-initialize the compare/swap command. Reinit will take place before use!
-	if (!fLockCmd->initAll(this,generation,addr, NULL, NULL,0,NULL,NULL))
+	if (!lockCmd->initAll(this,generation,FWAddress(0xFFFF, kCSRBandwidthAvailable, irmNodeID), NULL, NULL,0,NULL,NULL))
 	{
-		fLockCmd->release();
+		lockCmd->release();
 		return kIOReturnError;
 	}
 	
-	while (retries > 0)
+	for( reg = 0; reg < kFWIRMRegisterCount; reg++ )
 	{
-		// Make sure, in the request, we don't set the newVal to a negative number
-		if (bandwidthUnits > OSSwapBigToHostInt32(expectedOldVal))
+		if( amounts[reg] == 0 )
+			continue;
+		
+		IOReturn status = lockIRMRegister( lockCmd, generation, irmNodeID, reg, amounts[reg], allocate );
+		if( status == kIOReturnSuccess )
 		{
-			res = kIOFireWireIsochBandwidthNotAvailable;
-			break;
+			locked |= (1 << reg);
+			continue;
 		}
 		
-		// Calculate the new val for the compare/swap command
-		newVal = OSSwapHostToBigInt32(OSSwapBigToHostInt32(expectedOldVal) - bandwidthUnits);
-		
-		// Reinitialize the compare/swap command. If this fails, bail out of the retry loop!
-		res = fLockCmd->reinit(generation,addr, &expectedOldVal, &newVal,1,NULL,NULL); 
-		if (res != kIOReturnSuccess)
-			break;
-		
-		// Submit the compare/swap command. Will not return until complete
-		res = fLockCmd->submit();
-		
-		// Check results, including actualOldVal
-		if (res == kIOReturnSuccess)
-			lockSuccessful = fLockCmd->locked(&actualOldVal);
-		else
-			lockSuccessful = false;
-		
-		DebugLog("allocateIRMBandwidthInGeneration: res = 0x%08X, expectedOldVal = 0x%08X, newVal = 0x%08X, lockSuccessful = %d, actualOldVal = 0x%08X\n",
-			  res, OSSwapBigToHostInt32(expectedOldVal),OSSwapBigToHostInt32(newVal),lockSuccessful,OSSwapBigToHostInt32(actualOldVal));
-		
-		// If we got a bus reset (i.e. wrong generation), no point on retrying
-		if (res == kIOFireWireBusReset)
-			break;
+		if( res == kIOReturnSuccess )
+			res = status;
 		
-		// If we succeeded, we don't need to retry	
-		else if (lockSuccessful)
+		// a release keeps going, there is nothing to gain by holding on to the rest
+		if( allocate || status == kIOFireWireBusReset )
 			break;
-		
-		else
+	}
+	
+	if( allocate && res != kIOReturnSuccess && res != kIOFireWireBusReset )
+	{
+		for( reg = kFWIRMRegisterCount; reg-- > 0; )
 		{
-			// Decrement the retry count
-			retries -= 1;
-			
-			// If we don't have an error, but we're here, it's because
-			// the compare-swap didn't succeed. Set an error code, in case we're
-			// out of retries.
-			if (res == kIOReturnSuccess)
-				res = kIOFireWireIsochBandwidthNotAvailable;
-			
-			// Change our expected old value for the retry.	
-			expectedOldVal = actualOldVal;
+			if( locked & (1 << reg) )
+				lockIRMRegister( lockCmd, generation, irmNodeID, reg, amounts[reg], false );
 		}
 	}
 	
 	// Release the lock command
-	fLockCmd->release();
+	lockCmd->release();
 	
 	return res;
 }
 
-// releaseIRMBandwidthInGeneration
-//
+// lockIRMRegister
 //
-IOReturn IOFireWireController::releaseIRMBandwidthInGeneration(UInt32 bandwidthUnits, UInt32 generation)
+// compare/swap one IRM register, expecting the value last seen in it this generation.
+// channel amounts are masks of register bits, in host order.
+
+IOReturn IOFireWireController::lockIRMRegister( IOFWCompareAndSwapCommand * cmd, UInt32 generation, UInt16 irmNodeID, UInt32 reg, UInt32 amount, bool allocate )
 {
-	IOReturn res;
-	UInt32 irmGeneration;
-	UInt16 irmNodeID;
-	IOFWCompareAndSwapCommand * fLockCmd;
-	FWAddress addr;
-	UInt32 expectedOldVal, newVal; 
-	UInt32 actualOldVal;
-	bool lockSuccessful;
-	UInt32 retries = 2; 
-	
-	// Get the current IRM and Generation
-	getIRMNodeID(irmGeneration, irmNodeID);
+	static const UInt32 sRegisterAddress[kFWIRMRegisterCount] = { kCSRChannelsAvailable31_0, kCSRChannelsAvailable63_32, kCSRBandwidthAvailable };
 	
-	// Check the current generation 
-	if (irmGeneration != generation)
-		return kIOFireWireBusReset;
-	
-	// Initialize the address for the current IRM's bandwidth available register
-	addr.nodeID = irmNodeID;
-	addr.addressHi = 0xFFFF;
-	addr.addressLo = kCSRBandwidthAvailable;
-	
-	// Start with the default, no-bandwidth available value for the old val!
-	expectedOldVal = OSSwapHostToBigInt32(0);	
+	IOReturn res = kIOReturnSuccess;
+	FWAddress addr( 0xFFFF, sRegisterAddress[reg], irmNodeID );
+	UInt32 guess;
+	UInt32 expectedOldVal, newVal;
+	UInt32 actualOldVal = 0;
+	bool lockSuccessful;
+	bool predicted = true;
+	UInt32 retries = 2;
 	
-	// Create a compare/swap command
-	fLockCmd = OSTypeAlloc( IOFWCompareAndSwapCommand );
-	if (!fLockCmd)
-		return kIOReturnNoMemory;
+	// Without a snapshot, allocations expect nothing allocated and releases expect everything allocated
+	if( reg == kFWIRMBandwidth )
+		guess = OSSwapHostToBigInt32( allocate ? 0x00001333 : 0 );
+	else
+		guess = OSSwapHostToBigInt32( allocate ? 0xFFFFFFFF : 0 );
 	
-	// Pre-initialize the compare/swap command. Reinit will take place before use!
-	if (!fLockCmd->initAll(this,generation,addr, NULL, NULL,0,NULL,NULL))
-	{
-		fLockCmd->release();
-		return kIOReturnError;
-	}
+	expectedOldVal = getIRMSnapshot( generation, reg, guess );
 	
 	while (retries > 0)
 	{
-
-#if 0		
-		// Make sure, in the request, we don't set an illegally large value
-		if ((bandwidthUnits + OSSwapBigToHostInt32(expectedOldVal)) > 0x00001333 )
+		UInt32 oldVal = OSSwapBigToHostInt32( expectedOldVal );
+		IOReturn unavailable = kIOReturnSuccess;
+		
+		if( reg == kFWIRMBandwidth && allocate )
 		{
-			res = kIOReturnNoResources;
-			break;
+			// Make sure, in the request, we don't set the newVal to a negative number
+			if( amount > oldVal )
+				unavailable = kIOFireWireIsochBandwidthNotAvailable;
+			newVal = oldVal - amount;
+		}
+		else if( reg == kFWIRMBandwidth )
+		{
+			newVal = oldVal + amount;
+		}
+		else if( allocate )
+		{
+			// Make sure the channels are not already allocated
+			if( (oldVal & amount) != amount )
+				unavailable = kIOFireWireChannelNotAvailable;
+			newVal = oldVal & ~amount;
+		}
+		else
+		{
+			// Make sure the channels are not already free
+			if( (oldVal & amount) != 0 )
+				unavailable = kIOReturnNoResources;
+			newVal = oldVal | amount;
+		}
+		
+		if( unavailable != kIOReturnSuccess )
+		{
+			// the snapshot may be stale, only the IRM's own answer is final
+			if( !predicted )
+			{
+				res = unavailable;
+				break;
+			}
+			
+			expectedOldVal = guess;
+			predicted = false;
+			continue;
 		}
-#endif
 		
-		// Calculate the new val for the compare/swap command
-		newVal = OSSwapHostToBigInt32(OSSwapBigToHostInt32(expectedOldVal) + bandwidthUnits);
+		newVal = OSSwapHostToBigInt32( newVal );
 		
 		// Reinitialize the compare/swap command. If this fails, bail out of the retry loop!
-		res = fLockCmd->reinit(generation,addr, &expectedOldVal, &newVal,1,NULL,NULL); 
+		res = cmd->reinit(generation,addr, &expectedOldVal, &newVal,1,NULL,NULL); 
 		if (res != kIOReturnSuccess)
 			break;
 		
 		// Submit the compare/swap command. Will not return until complete
-		res = fLockCmd->submit();
+		res = cmd->submit();
 		
 		// Check results, including actualOldVal
 		if (res == kIOReturnSuccess)
-			lockSuccessful = fLockCmd->locked(&actualOldVal);
+			lockSuccessful = cmd->locked(&actualOldVal);
 		else
 			lockSuccessful = false;
 		
-		DebugLog("releaseIRMBandwidthInGeneration: res = 0x%08X, expectedOldVal = 0x%08X, newVal = 0x%08X, lockSuccessful = %d, actualOldVal = 0x%08X\n",
-		res, OSSwapBigToHostInt32(expectedOldVal),OSSwapBigToHostInt32(newVal),lockSuccessful,OSSwapBigToHostInt32(actualOldVal));
+		DebugLog("lockIRMRegister: reg = %d, res = 0x%08X, expectedOldVal = 0x%08X, newVal = 0x%08X, lockSuccessful = %d, actualOldVal = 0x%08X\n",
+			  reg, res, OSSwapBigToHostInt32(expectedOldVal),OSSwapBigToHostInt32(newVal),lockSuccessful,OSSwapBigToHostInt32(actualOldVal));
 		
 		// If we got a bus reset (i.e. wrong generation), no point on retrying
 		if (res == kIOFireWireBusReset)
@@ -6427,7 +7475,10 @@ IOReturn IOFireWireController::releaseIRMBandwidthInGeneration(UInt32 bandwidthU
 		
 		// If we succeeded, we don't need to retry	
 		else if (lockSuccessful)
+		{
+			setIRMSnapshot( generation, reg, newVal );
 			break;
+		}
 		
 		else
 		{
@@ -6436,247 +7487,402 @@ IOReturn IOFireWireController::releaseIRMBandwidthInGeneration(UInt32 bandwidthU
 			
 			// If we don't have an error, but we're here, it's because
 			// the compare-swap didn't succeed. Set an error code, in case we're
-			// out of retries.
+			// out of retries, and expect what the IRM really holds next time.
 			if (res == kIOReturnSuccess)
-				res = kIOReturnNoResources;
-			
-			// Change our expected old value for the retry.	
-			expectedOldVal = actualOldVal;
+			{
+				if( !allocate )
+					res = kIOReturnNoResources;
+				else if( reg == kFWIRMBandwidth )
+					res = kIOFireWireIsochBandwidthNotAvailable;
+				else
+					res = kIOFireWireChannelNotAvailable;
+				
+				setIRMSnapshot( generation, reg, actualOldVal );
+				expectedOldVal = actualOldVal;
+				predicted = false;
+			}
 		}
 	}
 	
-	// Release the lock command
-	fLockCmd->release();
-	
 	return res;
 }
 
-// allocateIRMChannelInGeneration
+// getIRMSnapshot
 //
-//
-IOReturn IOFireWireController::allocateIRMChannelInGeneration(UInt8 isochChannel, UInt32 generation)
+// the last value seen in an IRM register this generation, or the guess if there is none
+
+UInt32 IOFireWireController::getIRMSnapshot( UInt32 generation, UInt32 reg, UInt32 guess )
 {
-	IOReturn res;
-	UInt32 irmGeneration;
-	UInt16 irmNodeID;
-	IOFWCompareAndSwapCommand * fLockCmd;
-	FWAddress addr;
-	UInt32 newValMask;
-	UInt32 expectedOldVal, newVal; 
-	UInt32 actualOldVal;
-	bool lockSuccessful;
-	UInt32 retries = 2; 
+	closeGate();
 	
-	// Get the current IRM and Generation
-	getIRMNodeID(irmGeneration, irmNodeID);
+	if( fIRMSnapshotGeneration == generation && (fIRMSnapshotValid & (1 << reg)) )
+		guess = fIRMSnapshot[reg];
 	
-	// Check the current generation 
-	if (irmGeneration != generation)
-		return kIOFireWireBusReset;
+	openGate();
 	
-	// Initialize the address for the current IRM's bandwidth available register
-	addr.nodeID = irmNodeID;
-	addr.addressHi = 0xFFFF;
+	return guess;
+}
+
+// setIRMSnapshot
+//
+//
+
+void IOFireWireController::setIRMSnapshot( UInt32 generation, UInt32 reg, UInt32 value )
+{
+	closeGate();
 	
-	if( isochChannel < 32 )
+	// values from a generation that is already over are of no use
+	if( generation == fBusGeneration )
 	{
-		addr.addressLo = kCSRChannelsAvailable31_0;
-		newValMask = OSSwapHostToBigInt32(~(1<<(31 - isochChannel)));
+		if( fIRMSnapshotGeneration != generation )
+		{
+			fIRMSnapshotGeneration = generation;
+			fIRMSnapshotValid = 0;
+		}
+		
+		fIRMSnapshot[reg] = value;
+		fIRMSnapshotValid |= (1 << reg);
 	}
-	else if( isochChannel < 64 )
+	
+	openGate();
+}
+
+#pragma mark -
+
+// IsochReallocEntry
+//
+// a channel or IRM allocation being restored after a bus reset, only one of the two is set
+
+struct IsochReallocEntry
+{
+	IOFWIsochChannel *			fChannel;
+	IOFireWireIRMAllocation *	fAllocation;
+	UInt64						fChannels;
+	UInt32						fBandwidth;
+	IOReturn					fStatus;
+	bool						fLost;
+};
+
+// IsochReallocThreadInfo
+//
+// what the reallocation thread needs to know about the reset it was started for
+
+struct IsochReallocThreadInfo
+{
+	IOFireWireController *	fControl;
+	OSArray *				fObjects;
+	UInt32					fGeneration;
+	UInt64					fResetTime;
+};
+
+// queueIsochRealloc
+//
+// called on the workloop by the base class handleBusReset of channels and IRM allocations.
+// a subclass that overrides handleBusReset without calling through is left out of the pass.
+
+void IOFireWireController::queueIsochRealloc( OSObject * object )
+{
+	if( fIsochReallocObjects == NULL )
 	{
-		addr.addressLo = kCSRChannelsAvailable63_32;
-		newValMask = OSSwapHostToBigInt32(~(1 << (63 - isochChannel)));
+		fIsochReallocObjects = OSArray::withCapacity( fAllocatedChannels->getCount() + fIRMAllocations->getCount() );
+		if( fIsochReallocObjects == NULL )
+		{
+			return;
+		}
 	}
-	else
-		return kIOReturnBadArgument;
 	
-	// Start with the default, no channels allocated value for the old val!
-	expectedOldVal = OSSwapHostToBigInt32(0xFFFFFFFF);	
-	
-	// Create a compare/swap command
-	fLockCmd = OSTypeAlloc( IOFWCompareAndSwapCommand );
-	if (!fLockCmd)
-		return kIOReturnNoMemory;
+	fIsochReallocObjects->setObject( object );
+}
+
+// startIsochRealloc
+//
+// hands every channel and IRM allocation queued since the reset to a single thread
+// that restores them in one pass. called on the workloop.
+
+void IOFireWireController::startIsochRealloc( void )
+{
+	OSArray * objects = fIsochReallocObjects;
+	fIsochReallocObjects = NULL;
 	
-	// Pre-initialize the compare/swap command. Reinit will take place before use!
-	if (!fLockCmd->initAll(this,generation,addr, NULL, NULL,0,NULL,NULL))
+	if( objects == NULL )
 	{
-		fLockCmd->release();
-		return kIOReturnError;
+		return;
 	}
 	
-	while (retries > 0)
+	IsochReallocThreadInfo * threadInfo = (IsochReallocThreadInfo *)IOMalloc( sizeof(IsochReallocThreadInfo) );
+	if( threadInfo == NULL )
 	{
-		// Make sure the channel is not already allocated
-		if ((expectedOldVal & ~newValMask) == 0)
-		{
-			res = kIOFireWireChannelNotAvailable;
-			break;
-		}
-		
-		// Calculate the new val for the compare/swap command
-		newVal = expectedOldVal & newValMask;
-		
-		// Reinitialize the compare/swap command. If this fails, bail out of the retry loop!
-		res = fLockCmd->reinit(generation,addr, &expectedOldVal, &newVal,1,NULL,NULL); 
-		if (res != kIOReturnSuccess)
-			break;
-		
-		// Submit the compare/swap command. Will not return until complete
-		res = fLockCmd->submit();
-		
-		// Check results, including actualOldVal
-		if (res == kIOReturnSuccess)
-			lockSuccessful = fLockCmd->locked(&actualOldVal);
-		else
-			lockSuccessful = false;
-		
-		DebugLog("allocateIRMChannelInGeneration: res = 0x%08X, expectedOldVal = 0x%08X, newVal = 0x%08X, lockSuccessful = %d, actualOldVal = 0x%08X\n",
-		res, OSSwapBigToHostInt32(expectedOldVal),OSSwapBigToHostInt32(newVal),lockSuccessful,OSSwapBigToHostInt32(actualOldVal));
-		
-		// If we got a bus reset (i.e. wrong generation), no point on retrying
-		if (res == kIOFireWireBusReset)
-			break;
-		
-		// If we succeeded, we don't need to retry	
-		else if (lockSuccessful)
-			break;
-		
-		else
-		{
-			// Decrement the retry count
-			retries -= 1;
-			
-			// If we don't have an error, but we're here, it's because
-			// the compare-swap didn't succeed. Set an error code, in case we're
-			// out of retries.
-			if (res == kIOReturnSuccess)
-				res = kIOFireWireChannelNotAvailable;
-			
-			// Change our expected old value for the retry.	
-			expectedOldVal = actualOldVal;
-		}
+		objects->release();
+		return;
 	}
 	
-	// Release the lock command
-	fLockCmd->release();
+	threadInfo->fControl = this;
+	threadInfo->fObjects = objects;
+	threadInfo->fGeneration = fBusGeneration;
+	threadInfo->fResetTime = fScanTimes[kFWScanTimeReset];
 	
-	return res;
+	retain();	// retain ourself for the thread to use
+	
+	thread_t		thread;
+	if( kernel_thread_start((thread_continue_t)isochReallocThreadFunc, threadInfo, &thread ) == KERN_SUCCESS )
+	{
+		thread_deallocate(thread);
+	}
+	else
+	{
+		objects->release();
+		IOFree( threadInfo, sizeof(IsochReallocThreadInfo) );
+		release();
+	}
 }
 
-// releaseIRMChannelInGeneration
+// isochReallocThreadFunc
 //
 //
-IOReturn IOFireWireController::releaseIRMChannelInGeneration(UInt8 isochChannel, UInt32 generation)
+
+void IOFireWireController::isochReallocThreadFunc( void * arg )
 {
-	IOReturn res;
-	UInt32 irmGeneration;
-	UInt16 irmNodeID;
-	IOFWCompareAndSwapCommand * fLockCmd;
-	FWAddress addr;
-	UInt32 newValMask;
-	UInt32 expectedOldVal, newVal; 
-	UInt32 actualOldVal;
-	bool lockSuccessful;
-	UInt32 retries = 2; 
+	IsochReallocThreadInfo * threadInfo = (IsochReallocThreadInfo *)arg;
+	IOFireWireController * control = threadInfo->fControl;
 	
-	// Get the current IRM and Generation
-	getIRMNodeID(irmGeneration, irmNodeID);
-	
-	// Check the current generation 
-	if (irmGeneration != generation)
-		return kIOFireWireBusReset;
+	control->reallocIsochResources( threadInfo->fObjects, threadInfo->fGeneration, threadInfo->fResetTime );
 	
-	// Initialize the address for the current IRM's bandwidth available register
-	addr.nodeID = irmNodeID;
-	addr.addressHi = 0xFFFF;
+	threadInfo->fObjects->release();
+	IOFree( threadInfo, sizeof(IsochReallocThreadInfo) );
+	control->release();		// retain occurred in startIsochRealloc
+}
+
+// reallocIsochResources
+//
+// each object stays locked from when we read what it held until its outcome is recorded,
+// so nothing is released underneath us. unless another node took resources first the IRM
+// has room for the lot, which is then taken with one compare/swap per register. otherwise
+// they are restored one at a time, smallest bandwidth first so a shortage costs as few
+// of them as it can. failures are reported once every lock is dropped, clients are free
+// to touch their other allocations from the callbacks. cannot be called on the workloop.
+
+void IOFireWireController::reallocIsochResources( OSArray * objects, UInt32 generation, UInt64 resetTime )
+{
+	UInt64 startTime = getScanClock();
+	UInt32 count = objects->getCount();
+	UInt32 pending = 0;
+	UInt32 channels = 0;
+	UInt32 failures = 0;
+	UInt64 allChannels = 0;
+	UInt32 allBandwidth = 0;
+	bool overlap = false;
+	bool batched = false;
+	IOReturn status = kIOReturnError;
+	UInt32 i;
 	
-	if( isochChannel < 32 )
+	IsochReallocEntry * entries = (IsochReallocEntry *)IOMalloc( count * sizeof(IsochReallocEntry) );
+	if( entries == NULL )
 	{
-		addr.addressLo = kCSRChannelsAvailable31_0;
-		newValMask = OSSwapHostToBigInt32(1<<(31 - isochChannel));
+		DebugLog( "IOFireWireController<%p>::reallocIsochResources() - no memory to reallocate %d objects\n", this, count );
+		return;
 	}
-	else if( isochChannel < 64 )
+	
+	//
+	// collect everything still held from an earlier generation, each comes back locked
+	//
+	
+	for( i = 0; i < count; i++ )
 	{
-		addr.addressLo = kCSRChannelsAvailable63_32;
-		newValMask = OSSwapHostToBigInt32(1 << (63 - isochChannel));
+		IsochReallocEntry * entry = &entries[pending];
+		OSObject * object = objects->getObject( i );
+		bool held = false;
+		
+		entry->fChannel = OSDynamicCast( IOFWIsochChannel, object );
+		entry->fAllocation = OSDynamicCast( IOFireWireIRMAllocation, object );
+		entry->fStatus = kIOReturnSuccess;
+		entry->fLost = false;
+		
+		if( entry->fChannel )
+		{
+			held = entry->fChannel->beginRealloc( generation, &entry->fChannels, &entry->fBandwidth );
+		}
+		else if( entry->fAllocation )
+		{
+			held = entry->fAllocation->beginRealloc( generation, &entry->fChannels, &entry->fBandwidth );
+		}
+		
+		if( held )
+		{
+			pending++;
+		}
 	}
-	else
-		return kIOReturnBadArgument;
 	
-	// Start with the default, all channels allocated value for the old val!
-	expectedOldVal = OSSwapHostToBigInt32(0x00000000);	
-	
-	// Create a compare/swap command
-	fLockCmd = OSTypeAlloc( IOFWCompareAndSwapCommand );
-	if (!fLockCmd)
-		return kIOReturnNoMemory;
+	//
+	// smallest first, insertion sort keeps the collection order among equals
+	//
 	
-	// Pre-initialize the compare/swap command. Reinit will take place before use!
-	if (!fLockCmd->initAll(this,generation,addr, NULL, NULL,0,NULL,NULL))
+	for( i = 1; i < pending; i++ )
 	{
-		fLockCmd->release();
-		return kIOReturnError;
+		IsochReallocEntry entry = entries[i];
+		UInt32 j = i;
+		
+		while( j > 0 && entries[j-1].fBandwidth > entry.fBandwidth )
+		{
+			entries[j] = entries[j-1];
+			j--;
+		}
+		
+		entries[j] = entry;
 	}
 	
-	while (retries > 0)
+	for( i = 0; i < pending; i++ )
 	{
-		// Make sure the channel is not already free
-		if ((expectedOldVal & newValMask) == newValMask)
+		// two claims on one channel can't both be restored, leave it to the one at a time pass
+		if( allChannels & entries[i].fChannels )
 		{
-			res = kIOReturnNoResources;
-			break;
+			overlap = true;
 		}
 		
-		// Calculate the new val for the compare/swap command
-		newVal = expectedOldVal | newValMask;
+		allChannels |= entries[i].fChannels;
+		allBandwidth += entries[i].fBandwidth;
 		
-		// Reinitialize the compare/swap command. If this fails, bail out of the retry loop!
-		res = fLockCmd->reinit(generation,addr, &expectedOldVal, &newVal,1,NULL,NULL); 
-		if (res != kIOReturnSuccess)
-			break;
+		if( entries[i].fChannel )
+		{
+			channels++;
+		}
+	}
+	
+	//
+	// everything at once, then one at a time if the IRM is short
+	//
+	
+	if( pending != 0 && !overlap )
+	{
+		status = allocateIRMResourcesInGeneration( allChannels, allBandwidth, generation );
+		batched = (status == kIOReturnSuccess);
+	}
+	
+	for( i = 0; i < pending; i++ )
+	{
+		IsochReallocEntry * entry = &entries[i];
 		
-		// Submit the compare/swap command. Will not return until complete
-		res = fLockCmd->submit();
+		if( batched || status == kIOFireWireBusReset )
+		{
+			entry->fStatus = status;
+		}
+		else
+		{
+			entry->fStatus = allocateIRMResourcesInGeneration( entry->fChannels, entry->fBandwidth, generation );
+			
+			// the rest would only find the generation over too
+			if( entry->fStatus == kIOFireWireBusReset )
+			{
+				status = kIOFireWireBusReset;
+			}
+		}
+	}
+	
+	//
+	// record the outcomes, dropping each lock
+	//
+	
+	for( i = 0; i < pending; i++ )
+	{
+		IsochReallocEntry * entry = &entries[i];
 		
-		// Check results, including actualOldVal
-		if (res == kIOReturnSuccess)
-			lockSuccessful = fLockCmd->locked(&actualOldVal);
+		if( entry->fChannel )
+		{
+			entry->fLost = entry->fChannel->endRealloc( generation, entry->fStatus );
+		}
 		else
-			lockSuccessful = false;
+		{
+			entry->fLost = entry->fAllocation->endRealloc( generation, entry->fStatus );
+		}
+	}
+	
+	UInt64 doneTime = getScanClock();
+	
+	//
+	// tell the owners of anything that couldn't be restored
+	//
+	
+	for( i = 0; i < pending; i++ )
+	{
+		IsochReallocEntry * entry = &entries[i];
 		
-		DebugLog("releaseIRMChannelInGeneration: res = 0x%08X, expectedOldVal = 0x%08X, newVal = 0x%08X, lockSuccessful = %d, actualOldVal = 0x%08X\n",
-		res, OSSwapBigToHostInt32(expectedOldVal),OSSwapBigToHostInt32(newVal),lockSuccessful,OSSwapBigToHostInt32(actualOldVal));
+		if( !entry->fLost )
+		{
+			continue;
+		}
 		
-		// If we got a bus reset (i.e. wrong generation), no point on retrying
-		if (res == kIOFireWireBusReset)
-			break;
+		failures++;
 		
-		// If we succeeded, we don't need to retry	
-		else if (lockSuccessful)
-			break;
+		DebugLog( "IOFireWireController<%p>::reallocIsochResources() - lost channels 0x%016llx, bandwidth %d, status 0x%08x\n", this, entry->fChannels, (uint32_t)entry->fBandwidth, entry->fStatus );
 		
+		if( entry->fChannel )
+		{
+			entry->fChannel->reallocFailed();
+		}
 		else
 		{
-			// Decrement the retry count
-			retries -= 1;
-			
-			// If we don't have an error, but we're here, it's because
-			// the compare-swap didn't succeed. Set an error code, in case we're
-			// out of retries.
-			if (res == kIOReturnSuccess)
-				res = kIOReturnNoResources;
-			
-			// Change our expected old value for the retry.	
-			expectedOldVal = actualOldVal;
+			entry->fAllocation->reallocFailed();
 		}
 	}
 	
-	// Release the lock command
-	fLockCmd->release();
+	IOFree( entries, count * sizeof(IsochReallocEntry) );
 	
-	return res;
+	FWTrace( kFWTController, kTPControllerIsochRealloc, (uintptr_t)fFWIM, generation, pending, failures );
+	
+	if( pending != 0 )
+	{
+		publishIsochReallocTiming( generation, channels, pending - channels, failures, batched, resetTime, startTime, doneTime );
+	}
+}
+
+// publishIsochReallocTiming
+//
+// what the last reallocation pass restored and how long it took, in nanoseconds
+
+void IOFireWireController::publishIsochReallocTiming( UInt32 generation, UInt32 channels, UInt32 allocations, UInt32 failures,
+													  bool batched, UInt64 resetTime, UInt64 startTime, UInt64 doneTime )
+{
+	static const char * keys[] =
+	{
+		"Generation",
+		"Channels",
+		"Allocations",
+		"Failures",
+		"ResetToRealloc",
+		"Realloc",
+		"ResetToReallocDone"
+	};
+	
+	UInt64 values[] =
+	{
+		generation,
+		channels,
+		allocations,
+		failures,
+		startTime - resetTime,
+		doneTime - startTime,
+		doneTime - resetTime
+	};
+	
+	UInt32 count = sizeof(values) / sizeof(values[0]);
+	
+	OSDictionary * timing = OSDictionary::withCapacity( count + 1 );
+	if( timing )
+	{
+		for( UInt32 i = 0; i < count; i++ )
+		{
+			OSNumber * number = OSNumber::withNumber( values[i], 64 );
+			if( number )
+			{
+				timing->setObject( keys[i], number );
+				number->release();
+			}
+		}
+		
+		timing->setObject( "Batched", batched ? kOSBooleanTrue : kOSBooleanFalse );
+		
+		setProperty( "IsochReallocTiming", timing );
+		timing->release();
+	}
 }
 
 // createIRMAllocation
@@ -6902,31 +8108,232 @@ IOReturn IOFireWireController::getBusCycleTime(UInt32 &busTime, UInt32 &cycleTim
 
 UInt32 IOFireWireController::hopCount(UInt16 nodeAAddress, UInt16 nodeBAddress )
 {	
+	UInt32 hops = 0xFFFFFFFF;
+	
 	nodeAAddress &= kFWMaxNodesPerBus;
 	nodeBAddress &= kFWMaxNodesPerBus;
 	
-	UInt16 lowNode = nodeAAddress > nodeBAddress ? nodeBAddress : nodeAAddress;
+	if( !readHopCount( nodeAAddress, nodeBAddress, &hops ) )
+	{
+		// asked before buildTopology got to it, build the table now
+		closeGate();
+		
+		if( fHopCountSequence & 1 )
+			buildHopCounts();
+		
+		openGate();
+		
+		if( !readHopCount( nodeAAddress, nodeBAddress, &hops ) )
+			hops = 0xFFFFFFFF;	// this seems like the best thing to return here, impossibly large
+	}
+	
+	return hops;
+}
+
+// readHopCount
+//
+// lock free read of the hop count table, fails if it is stale or changed under us
+
+bool IOFireWireController::readHopCount( UInt16 nodeA, UInt16 nodeB, UInt32 * hops )
+{
+	if( nodeA >= kFWMaxNodesPerBus || nodeB >= kFWMaxNodesPerBus )
+		return false;
+	
+	UInt32 sequence = fHopCountSequence;
+	if( sequence & 1 )
+		return false;
+	
+	OSMemoryBarrier();
+	
+	if( nodeA < nodeB )
+		*hops = fHopCounts[nodeA + ((nodeB * (nodeB + 1))/2)];
+	else
+		*hops = fHopCounts[nodeB + ((nodeA * (nodeA + 1))/2)];
+	
+	OSMemoryBarrier();
+	
+	return (fHopCountSequence == sequence);
+}
+
+// getHopCounts
+//
+//
+
+IOReturn IOFireWireController::getHopCounts( UInt16 nodeID, UInt8 * hops, UInt32 count, UInt32 * generation )
+{
+	nodeID &= kFWMaxNodesPerBus;
+	
+	if( nodeID >= kFWMaxNodesPerBus || count > kFWMaxNodesPerBus )
+		return kIOReturnBadArgument;
+	
+	// a rebuild only happens once per bus reset, so a few retries always get a consistent copy
+	for( UInt32 tries = 0; tries < 4; tries++ )
+	{
+		UInt32 sequence = fHopCountSequence;
+		if( sequence & 1 )
+			return kIOReturnNotReady;
+		
+		OSMemoryBarrier();
+		
+		for( UInt32 i = 0; i < count; i++ )
+		{
+			if( nodeID < i )
+				hops[i] = fHopCounts[nodeID + ((i * (i + 1))/2)];
+			else
+				hops[i] = fHopCounts[i + ((nodeID * (nodeID + 1))/2)];
+		}
+		
+		if( generation )
+			*generation = fHopCountGeneration;
+		
+		OSMemoryBarrier();
+		
+		if( fHopCountSequence == sequence )
+			return kIOReturnSuccess;
+	}
+	
+	return kIOReturnNotReady;
+}
+
+// setROMQuadReadsOnly
+//
+// the list is kept oldest first, when it's full the oldest device is forgotten
+
+void IOFireWireController::setROMQuadReadsOnly( CSRNodeUniqueID guid )
+{
+	if( guid == 0 )
+		return;
+	
+	closeGate();
+	
+	FWROMQuadReadGUID * entries = (FWROMQuadReadGUID *)fROMQuadReadGUIDs->getBytesNoCopy();
+	UInt32 count = fROMQuadReadGUIDs->getLength() / sizeof(FWROMQuadReadGUID);
+	UInt32 i;
+	
+	for( i = 0; i < count; i++ )
+	{
+		if( entries[i].guid == guid )
+			break;
+	}
 	
+	if( i < count )
+	{
+		// a retried block read failed again
+		entries[i].reads = 0;
+	}
+	else
+	{
+		FWKLOG(( "IOFireWireController::setROMQuadReadsOnly GUID %08x %08x\n", (unsigned int)(guid >> 32), (unsigned int)(guid & 0xffffffff) ));
+		
+		FWROMQuadReadGUID entry = { guid, 0 };
+		
+		if( count < kROMQuadReadGUIDsMax )
+		{
+			fROMQuadReadGUIDs->appendBytes( &entry, sizeof(FWROMQuadReadGUID) );
+		}
+		else
+		{
+			bcopy( &entries[1], &entries[0], (count - 1) * sizeof(FWROMQuadReadGUID) );
+			entries[count - 1] = entry;
+		}
+	}
+	
+	openGate();
+}
+
+// clearROMQuadReadsOnly
+//
+//
+
+void IOFireWireController::clearROMQuadReadsOnly( CSRNodeUniqueID guid )
+{
+	closeGate();
+	
+	FWROMQuadReadGUID * entries = (FWROMQuadReadGUID *)fROMQuadReadGUIDs->getBytesNoCopy();
+	UInt32 count = fROMQuadReadGUIDs->getLength() / sizeof(FWROMQuadReadGUID);
+	
+	for( UInt32 i = 0; i < count; i++ )
+	{
+		if( entries[i].guid == guid )
+		{
+			FWKLOG(( "IOFireWireController::clearROMQuadReadsOnly GUID %08x %08x\n", (unsigned int)(guid >> 32), (unsigned int)(guid & 0xffffffff) ));
+			
+			bcopy( &entries[i + 1], &entries[i], (count - i - 1) * sizeof(FWROMQuadReadGUID) );
+			fROMQuadReadGUIDs->setLength( (count - 1) * sizeof(FWROMQuadReadGUID) );
+			break;
+		}
+	}
+	
+	openGate();
+}
+
+// getROMQuadReadsOnly
+//
+// every kROMQuadReadRetryInterval reads of a remembered device we say no,
+// so a device that only failed once gets to use block reads again
+
+bool IOFireWireController::getROMQuadReadsOnly( CSRNodeUniqueID guid )
+{
+	bool found = false;
+	
+	closeGate();
+	
+	FWROMQuadReadGUID * entries = (FWROMQuadReadGUID *)fROMQuadReadGUIDs->getBytesNoCopy();
+	UInt32 count = fROMQuadReadGUIDs->getLength() / sizeof(FWROMQuadReadGUID);
+	
+	for( UInt32 i = 0; i < count; i++ )
+	{
+		if( entries[i].guid == guid )
+		{
+			entries[i].reads++;
+			found = (entries[i].reads < kROMQuadReadRetryInterval);
+			if( !found )
+				entries[i].reads = 0;
+			break;
+		}
+	}
+	
+	openGate();
+	
+	return found;
+}
+
+// invalidateHopCounts
+//
+//
+
+void IOFireWireController::invalidateHopCounts( void )
+{
+	if( !(fHopCountSequence & 1) )
+	{
+		fHopCountSequence++;
+		OSMemoryBarrier();
+	}
+}
+
+// buildHopCounts
+//
+// walk the self IDs once and fill in the hop count between every pair of nodes
+
+void IOFireWireController::buildHopCounts( void )
+{
     struct FWNodeScan
     {
         int nodeID;
         int childrenRemaining;
     };
 	
-    FWNodeScan scanList[fRootNodeID];
+    FWNodeScan scanList[kFWMaxNodesPerBus];
     FWNodeScan *level;
 	level = scanList;
 	
-	const unsigned int maxNodes = fRootNodeID+1;
-	UInt8 hopArray[maxNodes*(maxNodes+1)];
-	bzero(hopArray, sizeof(hopArray));
+	invalidateHopCounts();
 	
-	closeGate();
+	bzero( fHopCounts, sizeof(fHopCounts) );
 	
 	// this is the same basic algorithm used in buildTopology
     int i;
-	// stop once we've found the lower node because there's enough info in the hop count table at that point
-	for( i = fRootNodeID; i >= lowNode; i-- )
+	for( i = fRootNodeID; i >= 0; i-- )
 	{
 		// Add node to bottom of tree
 		level->nodeID = i;
@@ -6938,12 +8345,14 @@ UInt32 IOFireWireController::hopCount(UInt16 nodeAAddress, UInt16 nodeBAddress )
 			parentNodeNum = (level-1)->nodeID;
 			for (scanNodeNum = i + 1; scanNodeNum <= fRootNodeID; scanNodeNum++)
 			{
-				UInt8 hops = hopArray[(maxNodes + 1)*parentNodeNum + scanNodeNum];
+				// i is below every node we've already scanned, so it is always the low index
+				UInt8 hops;
+				if( parentNodeNum < scanNodeNum )
+					hops = fHopCounts[parentNodeNum + ((scanNodeNum * (scanNodeNum + 1))/2)];
+				else
+					hops = fHopCounts[scanNodeNum + ((parentNodeNum * (parentNodeNum + 1))/2)];
 				
-				// fill out entire table so we don't have to use extra math to use a triangular matrix
-				hopArray[(maxNodes + 1)*i + scanNodeNum] = hops + 1;
-				hopArray[(maxNodes + 1)*scanNodeNum + i] = hops + 1;
-				//IOLog("Calc Hops %d-%d: %d dervied from %d-%d:%d\n", i, scanNodeNum, hops+1, parentNodeNum, scanNodeNum, hops);
+				fHopCounts[i + ((scanNodeNum * (scanNodeNum + 1))/2)] = hops + 1;
 			}
 		}
 		
@@ -6956,8 +8365,9 @@ UInt32 IOFireWireController::hopCount(UInt16 nodeAAddress, UInt16 nodeBAddress )
 				level--;
 				if(level < scanList) 
 				{
+					// leave the table marked stale
 					ErrorLog("FireWire: SelfIDs don't build a proper tree for hop counts (missing selfIDS?)!!\n");
-					return 0xFFFFFFFF;	// this seems like the best thing to return here, impossibly large
+					return;
 				}
 				// One less child to scan.
 				level->childrenRemaining--;
@@ -6966,11 +8376,11 @@ UInt32 IOFireWireController::hopCount(UInt16 nodeAAddress, UInt16 nodeBAddress )
 			level++;
 		}
 	}
-
-	openGate();
 	
-	// since both sides of matrix are filled in, no special math is necessary
-	return hopArray[(maxNodes + 1)*nodeAAddress + nodeBAddress];
+	fHopCountGeneration = fBusGeneration;
+	
+	OSMemoryBarrier();
+	fHopCountSequence++;
 }
 
 // hopCount
@@ -59,6 +59,8 @@ class IOFireWireLink;
 class IOFireWireSBP2ORB;
 class IOFireWireSBP2Login;
 class IOFireWireROMCache;
+class IOFireWireROMStore;
+class IOFWAsyncCommandPool;
 class IOFireWireLocalNode;
 class IOFWWorkLoop;
 class IOFireWireIRM;
@@ -254,11 +256,90 @@ enum
 	kFWDebugIgnoreNodeNone					= 0xFFFFFFFF
 };
 
+// bus scan milestones, published in the BusScanTiming property
+enum
+{
+	kFWScanTimeReset						= 0,	// processBusReset
+	kFWScanTimeSelfIDs						= 1,	// self IDs processed and topology built
+	kFWScanTimeScanStart					= 2,	// startBusScan, after the scan delay
+	kFWScanTimeScanDone						= 3,	// finishedBusScan, every ROM read and device updated
+	kFWScanTimePlaneDone					= 4,	// updatePlane, after the prune delay
+	kFWScanTimeCount						= 5
+};
+
+// time spent in each bus scan routine, inclusive of the routines it calls
+enum
+{
+	kFWScanCPUProcessSelfIDs				= 0,
+	kFWScanCPUBuildTopology					= 1,
+	kFWScanCPUStartBusScan					= 2,
+	kFWScanCPUReadDeviceROM					= 3,
+	kFWScanCPUUpdateDevice					= 4,
+	kFWScanCPUFinishedBusScan				= 5,
+	kFWScanCPUUpdatePlane					= 6,
+	kFWScanCPUCount							= 7
+};
+
+// the IRM registers a resource allocation locks, in the order it locks them
+enum
+{
+	kFWIRMChannels31_0						= 0,
+	kFWIRMChannels63_32						= 1,
+	kFWIRMBandwidth							= 2,
+	kFWIRMRegisterCount						= 3
+};
+
 struct AsyncPendingTrans {
     IOFWAsyncCommand *	fHandler;
     IOFWCommand *		fAltHandler;
     int			fTCode;
     bool		fInUse;
+    UInt8		fNodeIndex;		// which per-destination label pool this came from
+};
+
+// one fixed range address space in the controller's sorted dispatch index
+struct IOFWAddressSpaceIndexEntry {
+    UInt64				fStart;		// 48 bit address of the first byte
+    UInt64				fEnd;		// 48 bit address one past the last byte
+    UInt64				fMaxEnd;	// largest fEnd of this and every earlier entry
+    IOFWAddressSpace *	fSpace;
+};
+
+// cursor over the address spaces that may answer an address
+struct IOFWAddressSpaceLookup {
+    UInt64				fAddress;
+    SInt32				fIndexed;	// next index entry to check, walking down
+    UInt32				fUnindexed;	// next fUnindexedAddresses entry to check
+    UInt32				fGeneration;
+};
+
+#define kFWRcvPacketBatchMax	16		// packets decoded and answered together
+
+// one received async packet, as handed to processRcvPackets
+struct IOFWRcvPacket {
+    UInt32 *			fData;
+    int					fQuads;
+    IOFWSpeed			fSpeed;
+};
+
+// the fields of a received packet header the controller dispatches on
+struct IOFWRcvHeader {
+    UInt32				fTCode;
+    UInt32				fTLabel;
+    UInt16				fSourceID;
+    UInt16				fDestID;
+    FWAddress			fAddress;	// requests only
+};
+
+// a write or read quadlet response queued while a batch of packets is processed
+struct IOFWAsyncResponse {
+    UInt32				fTCode;		// kFWTCodeWriteResponse or kFWTCodeReadQuadletResponse
+    UInt16				fNodeID;
+    int					fSpeed;
+    int					fLabel;
+    int					fRCode;
+    UInt16				fAddrHi;	// write responses
+    UInt32				fQuad;		// read quadlet responses
 };
 
 struct IOFWNodeScan {
@@ -321,6 +402,10 @@ public:
 
 #define kMaxPendingTransfers kFWAsynchTTotal
 
+// pseudo address spaces get an addressHi below this, addressHi 0 is the physical range
+#define kFWPseudoAddressHiLimit		0xfffe
+#define kFWPseudoAddressWords		((kFWPseudoAddressHiLimit + 63) / 64)
+
 class IOFireWireController;
 
 #pragma mark -
@@ -422,11 +507,56 @@ protected:
 		kDisablePhysicalAccess 	= (1 << 0)
 	};
 		
+    // commands waiting to time out are kept on a hierarchical timing wheel. each level
+    // has kTimeoutWheelSlots slots, one tick apart at level 0 and each a whole turn of
+    // the level below above that. a command sits on the lowest level whose higher tick
+    // bits match the wheel's current tick, and drops down a level each time its slot
+    // comes around. adding, cancelling and expiring a command are all constant time.
+    
+	enum
+	{
+		kTimeoutWheelLevels		= 4,
+		kTimeoutWheelSlotBits	= 6,
+		kTimeoutWheelSlots		= (1 << kTimeoutWheelSlotBits),
+		kTimeoutWheelTick		= 1000		// microseconds
+	};
+	
+    struct timeoutQ;
+    
+    struct timeoutSlot: public IOFWCmdQ
+    {
+        timeoutQ *fWheel;
+        UInt32 fLevel;
+        UInt32 fIndex;
+        virtual void headChanged(IOFWCommand *oldHead);
+    };
+    
+    // the queue itself holds the commands that have expired and are waiting to be cancelled
     struct timeoutQ: public IOFWCmdQ
     {
         IOTimerEventSource *fTimer;
-        virtual void headChanged(IOFWCommand *oldHead);
+        timeoutSlot fSlots[kTimeoutWheelLevels][kTimeoutWheelSlots];
+        UInt64 fOccupied[kTimeoutWheelLevels];		// bit per non-empty slot
+        UInt64 fTickLength;							// absolute time units per tick
+        UInt64 fCurrentTick;						// every slot up to here has been processed
+        UInt64 fArmedTick;							// when fTimer will fire, 0 if it won't
+        IOFWCmdQ *fWaiters;							// commands parked for a tLabel, they keep their deadlines
+        
+        void init(IOTimerEventSource *timer, IOFWCmdQ *waiters);
+        bool contains(IOFWCmdQ *queue) const;
+        void add(IOFWCommand *cmd);
+        bool expire();
+        void arm();
         void busReset();
+        
+        UInt64 currentTick() const;
+        bool nextEvent(UInt64 *tick, UInt32 *level) const;
+        void advance(UInt64 tick);
+        void place(IOFWCommand *cmd);
+        void append(IOFWCmdQ &queue, IOFWCommand *cmd);
+        UInt64 deadlineTick(IOFWCommand *cmd) const;
+        bool nextWaiter(UInt64 *tick) const;
+        void expireWaiters();
     };
 	
     struct pendingQ: public IOFWCmdQ
@@ -463,10 +593,12 @@ protected:
 	friend class IOFWAsyncStreamListener;
 	friend class IOFireWireLocalNode;
 	friend class IOFireWireIRMAllocation;
+	friend class IOFWIsochChannel;
 	friend class IOFWUserVectorCommand;
 	friend class IOFWAsyncPHYCommand;
 	friend class IOFWUserPHYPacketListener;
 	friend class IOFWAsyncStreamReceiver;	
+	friend class IOFireWireLoopbackBenchmark;
 	
 #if FIRELOGCORE
 	friend class IOFireLog;
@@ -484,6 +616,7 @@ protected:
 	OSSet *						fIRMAllocations;	// Need to be informed of bus resets
     OSIterator *				fIRMAllocationsIterator;	// Iterator over channels
 	OSSet *						fIRMAllocationsAllocated;	// Need to be informed of bus resets
+	OSArray *					fIsochReallocObjects;		// queued by handleBusReset for startIsochRealloc
 
     // Bus management variables (although we aren't a FireWire Bus Manager...)
     AbsoluteTime				fResetTime;		// Time of last reset
@@ -500,6 +633,13 @@ protected:
     //UInt8						fSpeedCodes[(kFWMaxNodesPerBus+1)*kFWMaxNodesPerBus];
     UInt8						fSpeedVector[((kFWMaxNodesPerBus+1)*kFWMaxNodesPerBus)/2];
 						// Max speed between two nodes
+    UInt8						fHopCounts[((kFWMaxNodesPerBus+1)*kFWMaxNodesPerBus)/2];
+						// Hops between two nodes, laid out like fSpeedVector
+    volatile UInt32				fHopCountSequence;		// odd while fHopCounts is stale or being rebuilt
+    UInt32						fHopCountGeneration;	// bus generation fHopCounts was built for
+    UInt64						fScanTimes[kFWScanTimeCount];	// uptime in ns of each milestone of the last reset
+    UInt64						fScanCPU[kFWScanCPUCount];		// ns spent in each routine since the last reset
+    bool						fPublishScanTiming;				// set by the loopback benchmark, publishes BusScanTiming
     busState					fBusState;		// Which state are we in?
     int							fNumROMReads;		// Number of device ROMs we are still reading
     // SelfIDs
@@ -520,7 +660,6 @@ protected:
 
     // Array for outstanding requests (up to 64)
     AsyncPendingTrans			fTrans[kMaxPendingTransfers];
-    int							fLastTrans;
 
     // queue for executing commands that may timeout
     timeoutQ					fTimeoutQ;
@@ -547,7 +686,10 @@ protected:
     void *						fFireLogPublisher;
 #endif
 
-    OSData *					fAllocatedAddresses;
+    // one bit per pseudo addressHi, and one bit per bitmap word that has no free bits
+    UInt64 *					fPseudoAddressBitmap;
+    UInt64						fPseudoAddressFull[(kFWPseudoAddressWords + 63) / 64];
+    UInt32						fPseudoAddressHint;
 
 	UInt32						fDevicePruneDelay;
 	
@@ -565,6 +707,14 @@ protected:
 
 	IOFWNodeScan *					fScans[kFWMaxNodesPerBus];
 	IOFireWireDuplicateGUIDList	*	fGUIDDups;
+	OSData *						fROMQuadReadGUIDs;		// FWROMQuadReadGUIDs of devices that reject block ROM reads
+	IOFireWireROMStore *			fROMStore;				// ROMs of devices that come and go, by GUID
+	IOFWAsyncCommandPool *			fCommandPool;			// idle read and write commands for reuse
+	IOFWDelayCommand *				fROMPublicationCmd;		// publishes directory changes made in its window
+	UInt32							fROMPublicationChanges;
+	UInt32							fIRMSnapshot[kFWIRMRegisterCount];	// last value seen in each IRM register, bus order
+	UInt32							fIRMSnapshotValid;		// one bit per register
+	UInt32							fIRMSnapshotGeneration;	// generation the snapshot was taken in
 	
 	bool						fDelegateCycleMaster;
 	bool						fBadIRMsKnown;
@@ -607,6 +757,24 @@ protected:
 
 	IONotifier *				fConsoleLockNotifier;
 	IOFireWireLocalNode *       fLocalNode;
+
+	// tLabels only need to be unique per destination, so each phy ID gets its own
+	// pool of kMaxPendingTransfers. fTrans is the pool for broadcast and PHY packets.
+	AsyncPendingTrans *			fNodeTrans[kFWMaxNodesPerBus];
+	UInt64						fTLabelsInUse[kFWMaxNodesPerBus+1];
+	UInt64						fTLabelsReserved[kFWMaxNodesPerBus+1];	// in use, but held for a waiter that hasn't run yet
+	UInt8						fNextTLabel[kFWMaxNodesPerBus+1];
+	
+	// queue for commands waiting for a tLabel to their destination
+	IOFWCmdQ					fTLabelWaitQ;
+
+	// local address spaces with a fixed range, sorted by start address,
+	// and the ones that have to be asked about every address
+	IOFWAddressSpaceIndexEntry *	fSpaceIndex;
+	UInt32						fSpaceIndexCount;
+	UInt32						fSpaceIndexCapacity;
+	UInt32						fSpaceIndexGeneration;
+	OSArray *					fUnindexedAddresses;
     
 /*! @struct ExpansionData
     @discussion This structure will be used to expand the capablilties of the class in the future.
@@ -632,6 +800,8 @@ protected:
     virtual void processLockRequest(UInt16 sourceID, UInt32 tlabel,
 				UInt32 *hdr, void *buf, int len, IOFWSpeed speed);
 
+    void processRcvPackets( IOFWRcvPacket * packets, UInt32 count );
+
     // Process read from a local address, return rcode
     virtual UInt32 doReadSpace(UInt16 nodeID, IOFWSpeed &speed, FWAddress addr, UInt32 len,
                                       IOMemoryDescriptor **buf, IOByteCount * offset, IODMACommand **dma_command,
@@ -682,12 +852,16 @@ public:
     virtual AsyncPendingTrans *allocTrans(IOFWAsyncCommand *cmd=NULL);
     virtual void freeTrans(AsyncPendingTrans *trans);
 
+	// Park a command that could not get a tLabel until one to its destination is freed
+	IOReturn waitForTrans( IOFWCommand * cmd );
+
     // Really public methods
 
     virtual IOReturn getCycleTime(UInt32 &cycleTime);
     virtual IOReturn getBusCycleTime(UInt32 &busTime, UInt32 &cycleTime);
     
     // Methods to manipulate the local Config ROM
+    // changes are published together in a later ROM update and bus reset, not before these return
     virtual IOReturn AddUnitDirectory(IOLocalConfigDirectory *unitDir);
     virtual IOReturn RemoveUnitDirectory(IOLocalConfigDirectory *unitDir);
 
@@ -844,6 +1018,9 @@ protected:
 	virtual void doBusReset( void );
 	static void resetStateChange( void *refcon, IOReturn status,
 								   IOFireWireBus *bus, IOFWBusCommand *fwCmd);
+	static void publishROM( void *refcon, IOReturn status,
+							IOFireWireBus *bus, IOFWBusCommand *fwCmd );
+	void scheduleROMPublication( void );
 
 public:
 	virtual IOReturn disableSoftwareBusResets( void );
@@ -863,6 +1040,28 @@ protected:
 
     virtual IOReturn allocatePseudoAddress(FWAddress *addr, UInt32 lenDummy);
     virtual void freePseudoAddress(FWAddress addr, UInt32 lenDummy);
+
+	IOReturn createPseudoAddressBitmap( void );
+	void markPseudoAddress( UInt32 addressHi, bool used );
+	UInt32 findFreePseudoAddress( UInt32 from );
+
+public:
+
+/*! @function allocatePseudoAddressRange
+	@abstract Reserves count contiguous addressHi values for pseudo address spaces.
+	@discussion Each reserved addressHi can then be used with IOFWPseudoAddressSpace::initFixed.
+	@param addr Returns the first reserved address, addressLo is always zero.
+	@param count Number of addressHi values to reserve.
+	@result kIOReturnSuccess, or kIOReturnNoMemory if no large enough run is free. */
+	IOReturn allocatePseudoAddressRange( FWAddress * addr, UInt32 count );
+
+/*! @function freePseudoAddressRange
+	@abstract Releases a range reserved with allocatePseudoAddressRange.
+	@param addr The first address returned by allocatePseudoAddressRange.
+	@param count Number of addressHi values that were reserved. */
+	void freePseudoAddressRange( FWAddress addr, UInt32 count );
+
+protected:
 	
 	virtual IORegistryEntry * createDummyRegistryEntry( IOFWNodeScan *scan );
 
@@ -886,9 +1085,59 @@ protected:
 
 	virtual UInt32 countNodeIDChildren( UInt16 nodeID, int hub_port = 0, int * hubChildRemainder = NULL, bool * hubParentFlag = NULL );
 
+	void buildHopCounts( void );
+	void invalidateHopCounts( void );
+	bool readHopCount( UInt16 nodeA, UInt16 nodeB, UInt32 * hops );
+
+	UInt64 getScanClock( void );
+	void publishScanTiming( void );
+
 public:
 	virtual UInt32 hopCount(UInt16 nodeAAddress, UInt16 nodeBAddress );
 	virtual UInt32 hopCount(UInt16 nodeAAddress );
+
+/*! @function getHopCounts
+	@abstract Copies the hop counts from one node to every node on the bus without taking the gate.
+	@param nodeID The node to measure from.
+	@param hops Returns the hop count to node n in hops[n].
+	@param count Number of entries in hops, at most kFWMaxNodesPerBus.
+	@param generation Returns the bus generation the counts are valid for.
+	@result kIOReturnSuccess, or kIOReturnNotReady if the bus has not finished building its topology. */
+	IOReturn getHopCounts( UInt16 nodeID, UInt8 * hops, UInt32 count, UInt32 * generation );
+
+/*! @function setROMQuadReadsOnly
+	@abstract Remembers that the device with this GUID rejects block reads of its config ROM.
+	@discussion The record outlives the device object, so the device is read a quad at a time
+	if it is unplugged and reattached. Only the most recent 32 devices are remembered.
+	Must be called outside the workloop gate.
+	@param guid The unique ID of the device. */
+	void setROMQuadReadsOnly( CSRNodeUniqueID guid );
+
+/*! @function clearROMQuadReadsOnly
+	@abstract Forgets that the device with this GUID rejected block reads of its config ROM.
+	@discussion Called when a block read of the ROM succeeds. Must be called outside the workloop gate.
+	@param guid The unique ID of the device. */
+	void clearROMQuadReadsOnly( CSRNodeUniqueID guid );
+
+/*! @function getROMQuadReadsOnly
+	@abstract Checks whether the device with this GUID has been seen rejecting block ROM reads.
+	@discussion Every eighth check of a remembered device returns false so block reads are
+	tried again. If that read succeeds the caller clears the record with clearROMQuadReadsOnly.
+	@param guid The unique ID of the device.
+	@result true if config ROM reads from this device should use quadlet requests. */
+	bool getROMQuadReadsOnly( CSRNodeUniqueID guid );
+
+/*! @function getROMStore
+	@abstract Returns the store of config ROMs kept across device departures.
+	@result The controller's ROM store. Not retained. */
+	IOFireWireROMStore * getROMStore( void )
+		{ return fROMStore; };
+
+/*! @function getCommandPool
+	@abstract Returns the pool of idle read and write commands.
+	@result The controller's command pool. Not retained. */
+	IOFWAsyncCommandPool * getCommandPool( void )
+		{ return fCommandPool; };
 	
 	virtual IOFireWirePowerManager * getBusPowerManager( void );
 
@@ -970,6 +1219,14 @@ public:
 	// Release IRM channel if the specified generation is the current FireWire generation.
 	IOReturn releaseIRMChannelInGeneration(UInt8 isochChannel, UInt32 generation) ;
 	
+	// Allocate a set of IRM channels, bit n for channel n, together with bandwidth if the specified
+	// generation is the current FireWire generation. Either all of it is allocated or none of it.
+	IOReturn allocateIRMResourcesInGeneration(UInt64 channels, UInt32 bandwidthUnits, UInt32 generation) ;
+	
+	// Release a set of IRM channels, bit n for channel n, together with bandwidth if the specified
+	// generation is the current FireWire generation.
+	IOReturn releaseIRMResourcesInGeneration(UInt64 channels, UInt32 bandwidthUnits, UInt32 generation) ;
+	
 	// Create an IOFireWireIRMAllocation object which can be used to allocate isoch resources that are automatically reallocated after bus-resets!
 	IOFireWireIRMAllocation *createIRMAllocation(Boolean releaseIRMResourcesOnFree = true, 
 												IOFireWireIRMAllocation::AllocationLostNotificationProc allocationLostProc = NULL,
@@ -1032,6 +1289,35 @@ public:
 	
 private:
 	AsyncPendingTrans * allocTrans( IOFWAsyncCommand * cmd, IOFWCommand * altcmd );
+	AsyncPendingTrans * findTrans( UInt16 nodeID, UInt32 tLabel );
+	AsyncPendingTrans * takeReservedTrans( UInt32 node, IOFWAsyncCommand * cmd, IOFWCommand * altcmd );
+	void releaseReservedTrans( IOFWAsyncCommand * cmd, IOFWCommand * altcmd );
+	UInt32 transNodeIndex( IOFWAsyncCommand * cmd );
+	void failAllTrans( void );
+
+	IOReturn indexAddressSpace( IOFWAddressSpace * space );
+	void unindexAddressSpace( IOFWAddressSpace * space );
+	UInt32 findSpaceIndexPosition( UInt64 address );
+	void updateSpaceIndexMaxEnd( UInt32 from );
+	void startAddressSpaceLookup( FWAddress addr, IOFWAddressSpaceLookup * lookup );
+	IOFWAddressSpace * nextAddressSpace( IOFWAddressSpaceLookup * lookup );
+
+	IOReturn updateIRMResources( UInt64 channels, UInt32 bandwidthUnits, UInt32 generation, bool allocate );
+	IOReturn lockIRMRegister( IOFWCompareAndSwapCommand * cmd, UInt32 generation, UInt16 irmNodeID, UInt32 reg, UInt32 amount, bool allocate );
+	UInt32 getIRMSnapshot( UInt32 generation, UInt32 reg, UInt32 guess );
+	void setIRMSnapshot( UInt32 generation, UInt32 reg, UInt32 value );
+
+	void queueIsochRealloc( OSObject * object );
+	void startIsochRealloc( void );
+	static void isochReallocThreadFunc( void * arg );
+	void reallocIsochResources( OSArray * objects, UInt32 generation, UInt64 resetTime );
+	void publishIsochReallocTiming( UInt32 generation, UInt32 channels, UInt32 allocations, UInt32 failures,
+									bool batched, UInt64 resetTime, UInt64 startTime, UInt64 doneTime );
+
+	void decodeRcvHeader( const UInt32 * data, IOFWRcvHeader * header );
+	UInt32 dispatchWriteRequest( const IOFWRcvHeader * header, void * buf, int len, IOFWSpeed speed );
+	UInt32 dispatchReadQuadRequest( const IOFWRcvHeader * header, IOFWSpeed &speed, UInt32 * quad );
+	void sendAsyncResponses( IOFWAsyncResponse * responses, UInt32 count );
 
 public:
 
@@ -46,6 +46,7 @@
 #import <IOKit/firewire/IOConfigDirectory.h>
 #import "IORemoteConfigDirectory.h"
 #import "IOFireWireROMCache.h"
+#import "IOFireWireROMStore.h"
 #import <IOKit/firewire/IOFWSimpleContiguousPhysicalAddressSpace.h>
 
 #include <IOKit/firewire/IOFWUtils.h>
@@ -282,6 +283,7 @@ struct RomScan
 {
     IOFireWireDevice *		fDevice;
     UInt32 					fROMGeneration;
+    OSArray *				fDirectories;		// parsed directories from the ROM store, or NULL
 };
 
 // IOFireWireUnitInfo
@@ -572,6 +574,14 @@ void IOFireWireDevice::free()
     
 	if( fDeviceROM )
 	{
+		// drivers may have read further into the ROM since it was stored
+		if( fControl )
+		{
+			fDeviceROM->lock();
+			fControl->getROMStore()->extendROM( fUniqueID, fDeviceROM->getBytesNoCopy(), fDeviceROM->getLength() );
+			fDeviceROM->unlock();
+		}
+		
 		fDeviceROM->setROMState( IOFireWireROMCache::kROMStateInvalid );
         fDeviceROM->release();
 		fDeviceROM = NULL;
@@ -783,10 +793,27 @@ void IOFireWireDevice::setNodeROM(UInt32 gen, UInt16 localID, const IOFWNodeScan
     }
     
 	//
-	// create new ROM cache
+	// create new ROM cache, seeded with the whole ROM if we have seen this
+	// bus info block before
 	//
 	
-	rom = IOFireWireROMCache::withOwnerAndBytes( this, info->fBuf, newROMSize, fGeneration );
+	OSData *	storedROM = NULL;
+	OSObject *	storedDirectories = NULL;
+	
+	if( newROMSize == 20 )
+	{
+		fControl->getROMStore()->copyROM( fUniqueID, info->fBuf, newROMSize, &storedROM, &storedDirectories );
+	}
+	
+	if( storedROM != NULL )
+	{
+		rom = IOFireWireROMCache::withOwnerAndBytes( this, storedROM->getBytesNoCopy(), storedROM->getLength(), fGeneration );
+		storedROM->release();
+	}
+	else
+	{
+		rom = IOFireWireROMCache::withOwnerAndBytes( this, info->fBuf, newROMSize, fGeneration );
+	}
     setProperty( gFireWireROM, rom );
 
 	// release and invalidate the old one if necessary
@@ -810,6 +837,11 @@ void IOFireWireDevice::setNodeROM(UInt32 gen, UInt16 localID, const IOFWNodeScan
 		{
 			romScan->fROMGeneration = fROMGeneration;
 			romScan->fDevice = this;
+			romScan->fDirectories = OSDynamicCast( OSArray, storedDirectories );
+			if( romScan->fDirectories != NULL )
+			{
+				storedDirectories = NULL;	// the thread releases it
+			}
             retain();	// retain ourself for the thread to use.
 			
 			thread_t thread;
@@ -834,6 +866,11 @@ void IOFireWireDevice::setNodeROM(UInt32 gen, UInt16 localID, const IOFWNodeScan
 		}
 	}
 	
+	if( storedDirectories != NULL )
+	{
+		storedDirectories->release();
+	}
+	
 			
 	FWKLOG(( "IOFireWireDevice@%p::setNodeROM exited\n", this ));	
 }
@@ -861,6 +898,12 @@ void IOFireWireDevice::readROMThreadFunc( void *refcon )
 	device->processROM( romScan );
 	
 	IORecursiveLockUnlock(device->fROMLock);
+	
+	if( romScan->fDirectories != NULL )
+	{
+		romScan->fDirectories->release();
+	}
+	
 	IOFree(romScan, sizeof(RomScan));
     device->release();
 	//IOLog( "IOFireWireDevice::readROMThreadFunc %p exited\n", romScan );
@@ -937,6 +980,32 @@ void IOFireWireDevice::processROM( RomScan *romScan )
 	}
 	
 	if( status == kIOReturnSuccess )
+	{
+		unitSet = OSSet::withCapacity(2);
+		if( unitSet == NULL )
+			status = kIOReturnNoMemory;
+	}
+	
+	//
+	// a ROM seeded from the ROM store comes with its directories already parsed
+	//
+	
+	bool restored = false;
+	
+	if( status == kIOReturnSuccess && romScan->fDirectories != NULL )
+	{
+		if( restoreStoredDirectories( rom, romScan->fDirectories, rootPropTable, unitSet ) == kIOReturnSuccess )
+		{
+			restored = true;
+		}
+		else
+		{
+			rootPropTable->flushCollection();
+			unitSet->flushCollection();
+		}
+	}
+	
+	if( status == kIOReturnSuccess && !restored )
 	{
 		status = readRootDirectory( directory, rootPropTable );
 	}
@@ -945,16 +1014,26 @@ void IOFireWireDevice::processROM( RomScan *romScan )
 	// look for unit directories
 	//
 	
-	if( status == kIOReturnSuccess )
+	if( status == kIOReturnSuccess && !restored )
 	{
-		unitSet = OSSet::withCapacity(2);
-		if( unitSet == NULL )
-			status = kIOReturnNoMemory;
+		status = readUnitDirectories( directory, unitSet );
 	}
 	
-	if( status == kIOReturnSuccess )
+	//
+	// remember the ROM and what we found in it for the next time this device appears
+	//
+	
+	if( status == kIOReturnSuccess && !restored )
 	{
-		status = readUnitDirectories( directory, unitSet );
+		OSArray * stored = createStoredDirectories( rootPropTable, unitSet );
+		if( stored != NULL )
+		{
+			rom->lock();
+			fControl->getROMStore()->setROM( fUniqueID, rom->getBytesNoCopy(), rom->getLength(), stored );
+			rom->unlock();
+			
+			stored->release();
+		}
 	}
 	
 	//
@@ -1065,6 +1144,172 @@ void IOFireWireDevice::processROM( RomScan *romScan )
 	FWKLOG(( "IOFireWireDevice@%p::processROM generation %ld exited\n", this, generation ));
 }
 
+// createStoredDirectories
+//
+// copy the parsed root and unit directories into a form that outlives this device
+// and its ROM cache. unit directories are kept as their offsets into the ROM.
+
+OSArray * IOFireWireDevice::createStoredDirectories( OSDictionary * rootPropTable, OSSet * unitSet )
+{
+	bool success = true;
+	
+	OSArray * stored = OSArray::withCapacity( unitSet->getCount() + 1 );
+	if( stored == NULL )
+		return NULL;
+	
+	OSDictionary * root = OSDictionary::withDictionary( rootPropTable );
+	if( root != NULL )
+	{
+		stored->setObject( root );
+		root->release();
+	}
+	else
+	{
+		success = false;
+	}
+	
+	OSIterator * iterator = NULL;
+	if( success )
+	{
+		iterator = OSCollectionIterator::withCollection( unitSet );
+		if( iterator == NULL )
+			success = false;
+	}
+	
+	IOFireWireUnitInfo * info = NULL;
+	while( success && (info = (IOFireWireUnitInfo *) iterator->getNextObject()) )
+	{
+		IORemoteConfigDirectory * directory = OSDynamicCast( IORemoteConfigDirectory, info->getDirectory() );
+		if( directory == NULL )
+		{
+			success = false;
+			break;
+		}
+		
+		OSDictionary * unit = OSDictionary::withCapacity( 6 );
+		OSDictionary * propTable = OSDictionary::withDictionary( info->getPropTable() );
+		OSNumber * start = OSNumber::withNumber( directory->getStart(), 32 );
+		OSNumber * type = OSNumber::withNumber( directory->getType(), 32 );
+		OSNumber * lun = OSNumber::withNumber( info->getSBP2LUN(), 32 );
+		OSNumber * mao = OSNumber::withNumber( info->getSBP2MAO(), 32 );
+		OSNumber * revision = OSNumber::withNumber( info->getSBP2Revision(), 32 );
+		
+		if( unit && propTable && start && type && lun && mao && revision )
+		{
+			unit->setObject( "PropTable", propTable );
+			unit->setObject( "Start", start );
+			unit->setObject( "Type", type );
+			unit->setObject( "SBP2LUN", lun );
+			unit->setObject( "SBP2MAO", mao );
+			unit->setObject( "SBP2Revision", revision );
+			
+			stored->setObject( unit );
+		}
+		else
+		{
+			success = false;
+		}
+		
+		if( unit )
+			unit->release();
+		if( propTable )
+			propTable->release();
+		if( start )
+			start->release();
+		if( type )
+			type->release();
+		if( lun )
+			lun->release();
+		if( mao )
+			mao->release();
+		if( revision )
+			revision->release();
+	}
+	
+	if( iterator != NULL )
+	{
+		iterator->release();
+	}
+	
+	if( !success )
+	{
+		stored->release();
+		stored = NULL;
+	}
+	
+	return stored;
+}
+
+// restoreStoredDirectories
+//
+// rebuild the root prop table and unit infos saved by createStoredDirectories
+// against a new ROM cache
+
+IOReturn IOFireWireDevice::restoreStoredDirectories( IOFireWireROMCache * rom, OSArray * stored, OSDictionary * rootPropTable, OSSet * unitSet )
+{
+	IOReturn status = kIOReturnSuccess;
+	
+	OSDictionary * root = OSDynamicCast( OSDictionary, stored->getObject( 0 ) );
+	if( root == NULL || !rootPropTable->merge( root ) )
+	{
+		status = kIOReturnError;
+	}
+	
+	for( unsigned int i = 1; status == kIOReturnSuccess && i < stored->getCount(); i++ )
+	{
+		OSDictionary * unit = OSDynamicCast( OSDictionary, stored->getObject( i ) );
+		if( unit == NULL )
+		{
+			status = kIOReturnError;
+			break;
+		}
+		
+		OSDictionary * storedPropTable = OSDynamicCast( OSDictionary, unit->getObject( "PropTable" ) );
+		OSNumber * start = OSDynamicCast( OSNumber, unit->getObject( "Start" ) );
+		OSNumber * type = OSDynamicCast( OSNumber, unit->getObject( "Type" ) );
+		OSNumber * lun = OSDynamicCast( OSNumber, unit->getObject( "SBP2LUN" ) );
+		OSNumber * mao = OSDynamicCast( OSNumber, unit->getObject( "SBP2MAO" ) );
+		OSNumber * revision = OSDynamicCast( OSNumber, unit->getObject( "SBP2Revision" ) );
+		
+		if( !storedPropTable || !start || !type || !lun || !mao || !revision )
+		{
+			status = kIOReturnError;
+			break;
+		}
+		
+		// preprocessDirectories and the unit itself modify the prop table, so each gets its own
+		OSDictionary * propTable = OSDictionary::withDictionary( storedPropTable );
+		IOConfigDirectory * directory = IORemoteConfigDirectory::withOwnerOffset( rom, start->unsigned32BitValue(), type->unsigned32BitValue() );
+		IOFireWireUnitInfo * info = IOFireWireUnitInfo::create();
+		
+		if( propTable && directory && info )
+		{
+			info->setDirectory( directory );
+			info->setPropTable( propTable );
+			info->setSBP2Revision( revision->unsigned32BitValue() );
+			info->setSBP2LUN( lun->unsigned32BitValue() );
+			info->setSBP2MAO( mao->unsigned32BitValue() );
+			
+			unitSet->setObject( info );
+		}
+		else
+		{
+			status = kIOReturnNoMemory;
+		}
+		
+		if( info )
+			info->release();
+		if( directory )
+			directory->release();
+		if( propTable )
+			propTable->release();
+	}
+	
+	FWKLOG(( "IOFireWireDevice@%p::restoreStoredDirectories returned status = 0x%08lx\n", this, (UInt32)status ));
+	
+	return status;
+}
+
 // preprocessDirectories
 //
 //
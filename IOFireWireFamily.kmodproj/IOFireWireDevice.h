@@ -153,6 +153,8 @@ protected:
     static	void terminateDevice(void *arg);
     
     void	processROM(RomScan *romScan);
+    OSArray *	createStoredDirectories( OSDictionary * rootPropTable, OSSet * unitSet );
+    IOReturn	restoreStoredDirectories( IOFireWireROMCache * rom, OSArray * stored, OSDictionary * rootPropTable, OSSet * unitSet );
     
     virtual void free();
     
@@ -319,20 +319,14 @@ OSMetaClassDefineReservedUnused(IOFireWireIRMAllocation, 5);
 OSMetaClassDefineReservedUnused(IOFireWireIRMAllocation, 6);
 OSMetaClassDefineReservedUnused(IOFireWireIRMAllocation, 7);
 
-// IRMAllocationThreadInfo
+// channelMask
 //
-// A little struct for keeping track of our this pointer and generation
-// when transitioning to a second thread during bandwidth reallocation.
+// the channel set for allocateIRMResourcesInGeneration, channel 64 means none
 
-struct IRMAllocationThreadInfo
+static UInt64 channelMask( UInt8 isochChannel )
 {
-    IOFireWireIRMAllocation * fIRMAllocation;
-    UInt32 fGeneration;
-	IOFireWireController * fControl;
-	IORecursiveLock * fLock;
-	UInt8 fIsochChannel;
-	UInt32 fBandwidthUnits;
-};
+	return (isochChannel < 64) ? (1ULL << isochChannel) : 0;
+}
 
 // IOFireWireIRMAllocation::init
 //
@@ -415,12 +409,7 @@ void IOFireWireIRMAllocation::free( void )
 	if (isAllocated)
 	{
 		if (fReleaseIRMResourcesOnFree)
-		{
-			if (fBandwidthUnits > 0)
-				fControl->releaseIRMBandwidthInGeneration(fBandwidthUnits,fAllocationGeneration);
-			if (fIsochChannel < 64)
-				fControl->releaseIRMChannelInGeneration(fIsochChannel,fAllocationGeneration);
-		}
+			fControl->releaseIRMResourcesInGeneration(channelMask(fIsochChannel),fBandwidthUnits,fAllocationGeneration);
 		// Note: we already removed this allocation from the controller's array! Don't need to do it here!
 	}
 	
@@ -451,24 +440,8 @@ IOReturn IOFireWireIRMAllocation::allocateIsochResources(UInt8 isochChannel, UIn
 		// Get the current generation
 		fControl->getIRMNodeID(irmGeneration, irmNodeID);
 		
-		res = kIOReturnSuccess;
-		
-		if (isochChannel < 64)
-		{
-			// Attempt to allocate isoch channel
-			res = fControl->allocateIRMChannelInGeneration(isochChannel,irmGeneration);
-		}
-		
-		if ((res == kIOReturnSuccess) && (bandwidthUnits > 0))
-		{
-			// Attempt to allocate isoch bandwidth
-			res = fControl->allocateIRMBandwidthInGeneration(bandwidthUnits,irmGeneration);
-			if (res != kIOReturnSuccess) 
-			{
-				// Need to free the isoch channel (note: will fail if generation has changed)
-				fControl->releaseIRMChannelInGeneration(isochChannel,irmGeneration);
-			}
-		}
+		// Attempt to allocate isoch channel and bandwidth, the controller gives back the channel if the bandwidth isn't there
+		res = fControl->allocateIRMResourcesInGeneration(channelMask(isochChannel),bandwidthUnits,irmGeneration);
 		
 		if (res == kIOReturnSuccess)
 		{
@@ -502,10 +475,7 @@ IOReturn IOFireWireIRMAllocation::deallocateIsochResources(void)
 
 	if (isAllocated)
 	{
-		if (fBandwidthUnits > 0)
-			fControl->releaseIRMBandwidthInGeneration(fBandwidthUnits,fAllocationGeneration);
-		if (fIsochChannel < 64)
-			fControl->releaseIRMChannelInGeneration(fIsochChannel,fAllocationGeneration);
+		fControl->releaseIRMResourcesInGeneration(channelMask(fIsochChannel),fBandwidthUnits,fAllocationGeneration);
 	
 		// Unregister this object with the controller
 		fControl->removeIRMAllocation(this);
@@ -569,25 +539,8 @@ void IOFireWireIRMAllocation::handleBusReset(UInt32 generation)
 		return;
 	}
 	
-	// Spawn a thread to do the reallocation
-	IRMAllocationThreadInfo * threadInfo = (IRMAllocationThreadInfo *)IOMalloc( sizeof(IRMAllocationThreadInfo) );
-	if( threadInfo ) 
-	{
-		threadInfo->fGeneration = generation;
-		threadInfo->fIRMAllocation = this;
-		threadInfo->fControl = fControl;
-		threadInfo->fLock = fLock;
-		threadInfo->fIsochChannel = fIsochChannel; 
-		threadInfo->fBandwidthUnits = fBandwidthUnits;
-
-		retain();	// retain ourself for the thread to use
-
-		thread_t		thread;
-		if( kernel_thread_start((thread_continue_t)threadFunc, threadInfo, &thread ) == KERN_SUCCESS )
-		{
-			thread_deallocate(thread);
-		}
-	}
+	// The controller reallocates everything queued for this reset in one pass
+	fControl->queueIsochRealloc( this );
 	
 	// Unlock the lock
 	IORecursiveLockUnlock(fLock);
@@ -626,57 +579,61 @@ void IOFireWireIRMAllocation::failedToRealloc(void)
 	fAllocationGeneration = 0xFFFFFFFF;
 }
 
-// IOFireWireIRMAllocation::threadFunc
-//
+// IOFireWireIRMAllocation::beginRealloc
 //
-void IOFireWireIRMAllocation::threadFunc( void * arg )
+// Takes the lock and reports the resources to reallocate. Returns false, unlocked,
+// if the allocation has been released or was already reallocated in this generation.
+bool IOFireWireIRMAllocation::beginRealloc(UInt32 generation, UInt64 *pChannels, UInt32 *pBandwidthUnits)
 {
-	IOReturn res = kIOReturnSuccess;
-    IRMAllocationThreadInfo * threadInfo = (IRMAllocationThreadInfo *)arg;
-    IOFireWireIRMAllocation *pIRMAllocation = threadInfo->fIRMAllocation;
-	IORecursiveLock * fLock = threadInfo->fLock;
-	UInt32 generation = threadInfo->fGeneration;
 	UInt32 irmGeneration;
 	UInt16 irmNodeID;
 	
 	// Take the lock
 	IORecursiveLockLock(fLock);
-
+	
 	// Get the current generation
-	threadInfo->fControl->getIRMNodeID(irmGeneration, irmNodeID);
+	fControl->getIRMNodeID(irmGeneration, irmNodeID);
 	
-	if ((irmGeneration == generation) && (pIRMAllocation->getAllocationGeneration() != 0xFFFFFFFF))
+	if (!isAllocated || (fAllocationGeneration == 0xFFFFFFFF) || (fAllocationGeneration == generation) || (irmGeneration != generation))
 	{
-		if (threadInfo->fIsochChannel < 64)
-		{
-			// Attempt to reallocate isoch channel
-			res = threadInfo->fControl->allocateIRMChannelInGeneration(threadInfo->fIsochChannel,generation);
-		}
-		
-		if ((res == kIOReturnSuccess) && (threadInfo->fBandwidthUnits > 0))
-		{
-			// Attempt to reallocate isoch bandwidth
-			res = threadInfo->fControl->allocateIRMBandwidthInGeneration(threadInfo->fBandwidthUnits,generation);
-			if (res != kIOReturnSuccess) 
-			{
-				// Need to free the isoch channel (note: will fail if generation has changed)
-				threadInfo->fControl->releaseIRMChannelInGeneration(threadInfo->fIsochChannel,generation);
-			}
-		}
-
-		if ((res != kIOReturnSuccess) && (res != kIOFireWireBusReset))
-		{
-			// We failed to reallocate (and not due to a bus-reset).
-			pIRMAllocation->failedToRealloc();
-		}
+		IORecursiveLockUnlock(fLock);
+		return false;
 	}
 	
+	*pChannels = channelMask(fIsochChannel);
+	*pBandwidthUnits = fBandwidthUnits;
+	
+	return true;
+}
+
+// IOFireWireIRMAllocation::endRealloc
+//
+// Records the outcome and drops the lock taken by beginRealloc. Returns true
+// if the resources were lost and reallocFailed should be called.
+bool IOFireWireIRMAllocation::endRealloc(UInt32 generation, IOReturn status)
+{
+	// Later releases must be made in the generation the resources are now held in
+	if (status == kIOReturnSuccess)
+		fAllocationGeneration = generation;
+	
 	// Unlock the lock
 	IORecursiveLockUnlock(fLock);
 	
-	// clean up thread info
-	IOFree( threadInfo, sizeof(threadInfo) );
-    pIRMAllocation->release();		// retain occurred in handleBusReset
+	return (status != kIOReturnSuccess) && (status != kIOFireWireBusReset);
+}
+
+// IOFireWireIRMAllocation::reallocFailed
+//
+// Called without the lock held once the controller knows the resources are gone.
+void IOFireWireIRMAllocation::reallocFailed(void)
+{
+	// Take the lock
+	IORecursiveLockLock(fLock);
+	
+	// The client may have deallocated in the meantime
+	if (isAllocated)
+		failedToRealloc();
 	
-	FWTrace( kFWTIsoch, kTPIsochIRMThreadFunc, (uintptr_t)(threadInfo->fControl->getLink()), threadInfo->fIsochChannel, threadInfo->fBandwidthUnits, res );
+	// Unlock the lock
+	IORecursiveLockUnlock(fLock);
 }
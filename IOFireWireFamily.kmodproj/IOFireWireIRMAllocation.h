@@ -84,12 +84,18 @@ protected:
 		// Free the allocation object (and release IRM resources if needed)
 		virtual void free( void );
 
-		// Controller will call this to notify about bus-reset complete.
+		// Controller will call this to notify about bus-reset complete. Queues the
+		// allocation for the controller's reallocation pass.
 		virtual void handleBusReset(UInt32 generation);
 	
 		virtual void failedToRealloc(void);
 		virtual UInt32 getAllocationGeneration(void);
-		static void threadFunc( void * arg );
+
+		// Controller's reallocation pass. beginRealloc returns with the lock held
+		// when there is something to restore, endRealloc drops it.
+		bool beginRealloc(UInt32 generation, UInt64 *pChannels, UInt32 *pBandwidthUnits);
+		bool endRealloc(UInt32 generation, IOReturn status);
+		void reallocFailed(void);
 
 private:
 	
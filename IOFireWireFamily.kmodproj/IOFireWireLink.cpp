@@ -40,7 +40,7 @@
 OSDefineMetaClass( IOFireWireLink, IOService )
 OSDefineAbstractStructors(IOFireWireLink, IOService)
 
-OSMetaClassDefineReservedUnused(IOFireWireLink, 0);
+OSMetaClassDefineReservedUsed(IOFireWireLink, 0);
 OSMetaClassDefineReservedUnused(IOFireWireLink, 1);
 OSMetaClassDefineReservedUnused(IOFireWireLink, 2);
 OSMetaClassDefineReservedUnused(IOFireWireLink, 3);
@@ -194,3 +194,29 @@ UInt32 IOFireWireLink::setLinkMode( UInt32 arg1, UInt32 arg2 )
 {
 	return 0;
 }
+
+// asyncResponses
+//
+// links that can queue several response packets at once override this, as the loopback
+// link does. others send the batch a response at a time
+
+IOReturn IOFireWireLink::asyncResponses( IOFWAsyncResponse * responses, UInt32 count )
+{
+	IOReturn status = kIOReturnSuccess;
+	
+	for( UInt32 i = 0; i < count; i++ )
+	{
+		IOFWAsyncResponse * response = &responses[i];
+		IOReturn result;
+		
+		if( response->fTCode == kFWTCodeReadQuadletResponse )
+			result = asyncReadQuadResponse( response->fNodeID, response->fSpeed, response->fLabel, response->fRCode, response->fQuad );
+		else
+			result = asyncWriteResponse( response->fNodeID, response->fSpeed, response->fLabel, response->fRCode, response->fAddrHi );
+		
+		if( result != kIOReturnSuccess )
+			status = result;
+	}
+	
+	return status;
+}
@@ -88,6 +88,8 @@ class IOFireWireLink : public IOService
 		{ fControl->processSelfIDs(IDs, numIDs, ownIDs, numOwnIDs); };
 		void processRcvPacket(UInt32 *data, int numQuads, IOFWSpeed speed )
 			{ fControl->processRcvPacket(data, numQuads, speed ); };
+		void processRcvPackets( IOFWRcvPacket * packets, UInt32 count )
+			{ fControl->processRcvPackets( packets, count ); };
 		void processCycle64Int()
 		{ fControl->processCycle64Int(); };
 		virtual IOFireWireController * createController();
@@ -246,9 +248,12 @@ class IOFireWireLink : public IOService
 
 		virtual IOPMPowerState * getPowerStateTable( unsigned long * numberOfStates ) = 0;
 	
+		// Send a batch of write and read quadlet responses, by default one at a time
+		virtual IOReturn				asyncResponses( IOFWAsyncResponse * responses, UInt32 count );
+	
 	private:
 	
-		OSMetaClassDeclareReservedUnused(IOFireWireLink, 0);
+		OSMetaClassDeclareReservedUsed(IOFireWireLink, 0);
 		OSMetaClassDeclareReservedUnused(IOFireWireLink, 1);
 		OSMetaClassDeclareReservedUnused(IOFireWireLink, 2);
 		OSMetaClassDeclareReservedUnused(IOFireWireLink, 3);
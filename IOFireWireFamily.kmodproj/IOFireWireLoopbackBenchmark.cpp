@@ -0,0 +1,1770 @@
+/*
+ * Copyright (c) 1998-2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  IOFireWireLoopbackBenchmark.cpp
+ *  IOFireWireFamily
+ *
+ */
+
+#import "IOFireWireLoopbackBenchmark.h"
+#import "IOFireWireLoopbackLink.h"
+#import "FWDebugging.h"
+
+// public
+#import <IOKit/firewire/IOFireWireController.h>
+#import <IOKit/firewire/IOFireWireDevice.h>
+#import <IOKit/firewire/IOConfigDirectory.h>
+#import <IOKit/firewire/IOFWAddressSpace.h>
+#import <IOKit/firewire/IOFWSyncer.h>
+#import <IOKit/firewire/IOFWUtils.h>
+
+// system
+#import <IOKit/IOBufferMemoryDescriptor.h>
+#import <libkern/libkern.h>
+#import <libkern/c++/OSArray.h>
+#import <libkern/c++/OSNumber.h>
+#import <libkern/c++/OSString.h>
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors( IOFireWireLoopbackBenchmark, OSObject )
+
+#define kBenchmarkDefaultIterations		1000
+#define kBenchmarkMaxPayload			2048
+#define kBenchmarkDefaultResets			3
+#define kBenchmarkScanTimeout			10000	// milliseconds
+#define kBenchmarkScanPoll				5
+#define kBenchmarkDefaultTimeout		50		// milliseconds
+#define kBenchmarkMaxTimeout			60000	// milliseconds
+#define kBenchmarkMaxTimeouts			100000
+
+static const UInt32 sDefaultSizes[] = { 4, 64, 512, 2048 };
+static const UInt32 sDefaultSpeeds[] = { kFWSpeed100MBit, kFWSpeed200MBit, kFWSpeed400MBit };
+static const UInt32 sDefaultConcurrency[] = { 1, 4, 16 };
+static const UInt32 sDefaultWindowSizes[] = { 4096, 16384, 65536 };
+static const UInt32 sDefaultWindows[] = { 1, 2, 4, 8, 16, 32 };
+static const UInt32 sDefaultNodeCounts[] = { 2, 4, 8, 16, 17, 32, 63 };
+static const UInt32 sDefaultEntryCounts[] = { 8, 32, 64, 128, kLoopbackMaxVendorEntries };
+static const UInt32 sDefaultROMQuads[] = { 5, 16, 64, kLoopbackROMQuads };
+static const UInt32 sDefaultTimeoutCounts[] = { 100, 1000, 10000 };
+static const UInt32 sDefaultPseudoAddressCounts[] = { 100, 1000, 10000 };
+static const UInt32 sDefaultBatchResponses[] = { 0, 1 };
+
+static const char * sCommandNames[] =
+{
+	"ReadQuad",
+	"Read",
+	"WriteQuad",
+	"Write",
+	"CompareAndSwap"
+};
+
+static const char * sTopologyNames[] =
+{
+	"Chain",
+	"Star",
+	"Tree"
+};
+
+// create
+//
+//
+
+IOFireWireLoopbackBenchmark * IOFireWireLoopbackBenchmark::create( IOFireWireLoopbackLink * link, UInt32 kind, OSDictionary * params )
+{
+	IOFireWireLoopbackBenchmark * me = OSTypeAlloc( IOFireWireLoopbackBenchmark );
+	if( me && !me->init( link, kind, params ) )
+	{
+		me->release();
+		me = NULL;
+	}
+
+	return me;
+}
+
+// init
+//
+//
+
+bool IOFireWireLoopbackBenchmark::init( IOFireWireLoopbackLink * link, UInt32 kind, OSDictionary * params )
+{
+	if( !super::init() )
+		return false;
+
+	fLink = link;
+	fLink->retain();
+	fControl = fLink->getController();
+	fKind = kind;
+
+	fResults = OSArray::withCapacity( 16 );
+	if( fResults == NULL )
+		return false;
+
+	if( fKind == kLoopbackBenchmarkBusReset )
+	{
+		fResets = kBenchmarkDefaultResets;
+
+		OSNumber * number = params ? OSDynamicCast( OSNumber, params->getObject( "Resets" ) ) : NULL;
+		if( number && number->unsigned32BitValue() > 0 )
+			fResets = number->unsigned32BitValue();
+
+		fTopologies = params ? OSDynamicCast( OSArray, params->getObject( "Topologies" ) ) : NULL;
+		if( fTopologies )
+		{
+			fTopologies->retain();
+		}
+		else
+		{
+			fTopologies = OSArray::withCapacity( 3 );
+			for( UInt32 i = 0; fTopologies && i < sizeof(sTopologyNames) / sizeof(char*); i++ )
+			{
+				OSString * name = OSString::withCString( sTopologyNames[i] );
+				if( name )
+				{
+					fTopologies->setObject( name );
+					name->release();
+				}
+			}
+		}
+
+		fNodeCounts = copyArrayParam( params, "NodeCounts", sDefaultNodeCounts, sizeof(sDefaultNodeCounts) / sizeof(UInt32) );
+
+		return (fTopologies && fNodeCounts);
+	}
+
+	fIterations = kBenchmarkDefaultIterations;
+	fNodeID = kFWLocalBusAddress;
+
+	OSNumber * number = params ? OSDynamicCast( OSNumber, params->getObject( "Iterations" ) ) : NULL;
+	if( number && number->unsigned32BitValue() > 0 )
+		fIterations = number->unsigned32BitValue();
+
+	number = params ? OSDynamicCast( OSNumber, params->getObject( "Node" ) ) : NULL;
+	if( number )
+		fNodeID |= (number->unsigned32BitValue() & kFWMaxNodesPerBus);
+
+	if( fKind == kLoopbackBenchmarkConfigDirectory )
+	{
+		fEntryCounts = copyArrayParam( params, "EntryCounts", sDefaultEntryCounts, sizeof(sDefaultEntryCounts) / sizeof(UInt32) );
+		
+		return (fEntryCounts != NULL);
+	}
+
+	if( fKind == kLoopbackBenchmarkCRC )
+	{
+		fSizes = copyArrayParam( params, "Quads", sDefaultROMQuads, sizeof(sDefaultROMQuads) / sizeof(UInt32) );
+		
+		return (fSizes != NULL);
+	}
+
+	if( fKind == kLoopbackBenchmarkPseudoAddress )
+	{
+		fSizes = copyArrayParam( params, "Counts", sDefaultPseudoAddressCounts, sizeof(sDefaultPseudoAddressCounts) / sizeof(UInt32) );
+		
+		return (fSizes != NULL);
+	}
+
+	if( fKind == kLoopbackBenchmarkTimeout )
+	{
+		fTimeout = kBenchmarkDefaultTimeout;
+
+		number = params ? OSDynamicCast( OSNumber, params->getObject( "Timeout" ) ) : NULL;
+		if( number && number->unsigned32BitValue() > 0 && number->unsigned32BitValue() <= kBenchmarkMaxTimeout )
+			fTimeout = number->unsigned32BitValue();
+
+		fSizes = copyArrayParam( params, "Counts", sDefaultTimeoutCounts, sizeof(sDefaultTimeoutCounts) / sizeof(UInt32) );
+		if( fSizes == NULL )
+			return false;
+
+		// room for the lateness of every command in the largest run
+		fIterations = 0;
+		for( UInt32 n = 0; n < fSizes->getCount(); n++ )
+		{
+			OSNumber * count = OSDynamicCast( OSNumber, fSizes->getObject( n ) );
+			if( count && count->unsigned32BitValue() <= kBenchmarkMaxTimeouts && count->unsigned32BitValue() > fIterations )
+				fIterations = count->unsigned32BitValue();
+		}
+
+		if( fIterations == 0 )
+			return false;
+
+		fLatencies = (UInt64*)IOMalloc( sizeof(UInt64) * fIterations );
+
+		return (fLatencies != NULL);
+	}
+
+	if( fKind == kLoopbackBenchmarkRequest )
+	{
+		fSizes = copyArrayParam( params, "Sizes", sDefaultSizes, sizeof(sDefaultSizes) / sizeof(UInt32) );
+		fConcurrency = copyArrayParam( params, "Concurrency", sDefaultConcurrency, sizeof(sDefaultConcurrency) / sizeof(UInt32) );
+		fBatchResponses = copyArrayParam( params, "BatchResponses", sDefaultBatchResponses, sizeof(sDefaultBatchResponses) / sizeof(UInt32) );
+
+		return (fSizes && fConcurrency && fBatchResponses);
+	}
+
+	fSpeeds = copyArrayParam( params, "Speeds", sDefaultSpeeds, sizeof(sDefaultSpeeds) / sizeof(UInt32) );
+	fLatencies = (UInt64*)IOMalloc( sizeof(UInt64) * fIterations );
+
+	if( fKind == kLoopbackBenchmarkWindow )
+	{
+		fSizes = copyArrayParam( params, "Sizes", sDefaultWindowSizes, sizeof(sDefaultWindowSizes) / sizeof(UInt32) );
+		fWindows = copyArrayParam( params, "Windows", sDefaultWindows, sizeof(sDefaultWindows) / sizeof(UInt32) );
+		
+		return (fSizes && fSpeeds && fWindows && fLatencies);
+	}
+
+	fSizes = copyArrayParam( params, "Sizes", sDefaultSizes, sizeof(sDefaultSizes) / sizeof(UInt32) );
+	fConcurrency = copyArrayParam( params, "Concurrency", sDefaultConcurrency, sizeof(sDefaultConcurrency) / sizeof(UInt32) );
+
+	return (fSizes && fSpeeds && fConcurrency && fLatencies);
+}
+
+// free
+//
+//
+
+void IOFireWireLoopbackBenchmark::free( void )
+{
+	destroySlots();
+
+	if( fLatencies )
+	{
+		IOFree( fLatencies, sizeof(UInt64) * fIterations );
+		fLatencies = NULL;
+	}
+
+	if( fSizes )
+	{
+		fSizes->release();
+		fSizes = NULL;
+	}
+
+	if( fSpeeds )
+	{
+		fSpeeds->release();
+		fSpeeds = NULL;
+	}
+
+	if( fConcurrency )
+	{
+		fConcurrency->release();
+		fConcurrency = NULL;
+	}
+
+	if( fWindows )
+	{
+		fWindows->release();
+		fWindows = NULL;
+	}
+
+	if( fBatchResponses )
+	{
+		fBatchResponses->release();
+		fBatchResponses = NULL;
+	}
+
+	if( fTopologies )
+	{
+		fTopologies->release();
+		fTopologies = NULL;
+	}
+
+	if( fNodeCounts )
+	{
+		fNodeCounts->release();
+		fNodeCounts = NULL;
+	}
+
+	if( fEntryCounts )
+	{
+		fEntryCounts->release();
+		fEntryCounts = NULL;
+	}
+
+	if( fResults )
+	{
+		fResults->release();
+		fResults = NULL;
+	}
+
+	if( fLink )
+	{
+		fLink->release();
+		fLink = NULL;
+	}
+
+	super::free();
+}
+
+// createDefaultArray
+//
+//
+
+OSArray * IOFireWireLoopbackBenchmark::createDefaultArray( const UInt32 * values, UInt32 count )
+{
+	OSArray * array = OSArray::withCapacity( count );
+	if( array == NULL )
+		return NULL;
+
+	for( UInt32 i = 0; i < count; i++ )
+	{
+		OSNumber * number = OSNumber::withNumber( values[i], 32 );
+		if( number )
+		{
+			array->setObject( number );
+			number->release();
+		}
+	}
+
+	return array;
+}
+
+// copyArrayParam
+//
+// the caller's array if there is one, otherwise the defaults
+
+OSArray * IOFireWireLoopbackBenchmark::copyArrayParam( OSDictionary * params, const char * key, const UInt32 * values, UInt32 count )
+{
+	OSArray * array = params ? OSDynamicCast( OSArray, params->getObject( key ) ) : NULL;
+	if( array )
+	{
+		array->retain();
+		return array;
+	}
+
+	return createDefaultArray( values, count );
+}
+
+// setNumber
+//
+//
+
+void IOFireWireLoopbackBenchmark::setNumber( OSDictionary * dict, const char * key, UInt64 value )
+{
+	OSNumber * number = OSNumber::withNumber( value, 64 );
+	if( number )
+	{
+		dict->setObject( key, number );
+		number->release();
+	}
+}
+
+// compareLatencies
+//
+//
+
+int IOFireWireLoopbackBenchmark::compareLatencies( const void * a, const void * b )
+{
+	UInt64 left = *(const UInt64*)a;
+	UInt64 right = *(const UInt64*)b;
+
+	return (left < right) ? -1 : ((left > right) ? 1 : 0);
+}
+
+#pragma mark -
+
+// run
+//
+//
+
+IOReturn IOFireWireLoopbackBenchmark::run( void )
+{
+	if( fKind == kLoopbackBenchmarkBusReset )
+		return runBusResets();
+
+	if( fKind == kLoopbackBenchmarkConfigDirectory )
+		return runConfigDirectories();
+
+	if( fKind == kLoopbackBenchmarkCRC )
+		return runCRCs();
+
+	if( fKind == kLoopbackBenchmarkTimeout )
+		return runTimeouts();
+
+	if( fKind == kLoopbackBenchmarkWindow )
+		return runWindows();
+
+	if( fKind == kLoopbackBenchmarkPseudoAddress )
+		return runPseudoAddresses();
+
+	if( fKind == kLoopbackBenchmarkRequest )
+		return runRequests();
+
+	return runAsync();
+}
+
+// runAsync
+//
+// each combination that makes sense for the command type is run once
+
+IOReturn IOFireWireLoopbackBenchmark::runAsync( void )
+{
+	IOReturn status = kIOReturnSuccess;
+
+	for( UInt32 type = 0; type < kBenchmarkCommandCount && status == kIOReturnSuccess; type++ )
+	{
+		bool block = (type == kBenchmarkRead) || (type == kBenchmarkWrite);
+		UInt32 size_count = block ? fSizes->getCount() : 1;
+
+		for( UInt32 s = 0; s < size_count && status == kIOReturnSuccess; s++ )
+		{
+			UInt32 size = 4;
+			if( type == kBenchmarkCompareAndSwap )
+			{
+				size = 8;
+			}
+			else if( block )
+			{
+				OSNumber * number = OSDynamicCast( OSNumber, fSizes->getObject( s ) );
+				size = number ? number->unsigned32BitValue() : 0;
+				size = (size + 3) & ~3;
+				if( size == 0 || size > kBenchmarkMaxPayload )
+					continue;
+			}
+
+			for( UInt32 sp = 0; sp < fSpeeds->getCount() && status == kIOReturnSuccess; sp++ )
+			{
+				OSNumber * speed = OSDynamicCast( OSNumber, fSpeeds->getObject( sp ) );
+				if( speed == NULL || speed->unsigned32BitValue() > kFWSpeed400MBit )
+					continue;
+
+				for( UInt32 c = 0; c < fConcurrency->getCount() && status == kIOReturnSuccess; c++ )
+				{
+					OSNumber * concurrency = OSDynamicCast( OSNumber, fConcurrency->getObject( c ) );
+					if( concurrency == NULL || concurrency->unsigned32BitValue() == 0 )
+						continue;
+
+					UInt32 slots = concurrency->unsigned32BitValue();
+					if( slots > kLoopbackBenchmarkMaxSlots )
+						slots = kLoopbackBenchmarkMaxSlots;
+
+					status = runOne( type, size, speed->unsigned32BitValue(), slots );
+				}
+			}
+		}
+	}
+
+	return status;
+}
+
+// runWindows
+//
+// every window size is run against every size and speed, one read in flight
+
+IOReturn IOFireWireLoopbackBenchmark::runWindows( void )
+{
+	IOReturn status = kIOReturnSuccess;
+
+	for( UInt32 s = 0; s < fSizes->getCount() && status == kIOReturnSuccess; s++ )
+	{
+		OSNumber * number = OSDynamicCast( OSNumber, fSizes->getObject( s ) );
+		UInt32 size = number ? number->unsigned32BitValue() : 0;
+		size = (size + 3) & ~3;
+		if( size == 0 || size > kLoopbackNodeMemorySize )
+			continue;
+
+		for( UInt32 sp = 0; sp < fSpeeds->getCount() && status == kIOReturnSuccess; sp++ )
+		{
+			OSNumber * speed = OSDynamicCast( OSNumber, fSpeeds->getObject( sp ) );
+			if( speed == NULL || speed->unsigned32BitValue() > kFWSpeed400MBit )
+				continue;
+
+			for( UInt32 w = 0; w < fWindows->getCount() && status == kIOReturnSuccess; w++ )
+			{
+				OSNumber * window = OSDynamicCast( OSNumber, fWindows->getObject( w ) );
+				if( window == NULL || window->unsigned32BitValue() == 0 || window->unsigned32BitValue() > kFWCmdMaxWindowPackets )
+					continue;
+
+				fWindow = window->unsigned32BitValue();
+				status = runOne( kBenchmarkRead, size, speed->unsigned32BitValue(), 1 );
+			}
+		}
+	}
+
+	fWindow = 0;
+
+	return status;
+}
+
+// runOne
+//
+// keeps concurrency commands in flight until iterations have completed
+
+IOReturn IOFireWireLoopbackBenchmark::runOne( UInt32 type, UInt32 size, int speed, UInt32 concurrency )
+{
+	if( concurrency > fIterations )
+		concurrency = fIterations;
+
+	fType = type;
+	fSize = size;
+	fSpeed = speed;
+	fSlotCount = concurrency;
+	fIssued = 0;
+	fCompleted = 0;
+	fErrors = 0;
+
+	if( !createSlots() )
+	{
+		destroySlots();
+		return kIOReturnNoMemory;
+	}
+
+	fSyncer = IOFWSyncer::create();
+	if( fSyncer == NULL )
+	{
+		destroySlots();
+		return kIOReturnNoMemory;
+	}
+
+	UInt64 start_event_time = fLink->getEventTime();
+	UInt32 start_packets = fLink->getPacketCount();
+	UInt64 submit_time = 0;
+
+	fControl->closeGate();
+
+	fGeneration = fControl->getGeneration();
+	fOutstanding = fSlotCount;
+
+	UInt64 start = fLink->now();
+
+	for( UInt32 i = 0; i < fSlotCount; i++ )
+	{
+		if( submitSlot( &fSlots[i] ) != kIOReturnSuccess )
+			fOutstanding--;
+	}
+
+	submit_time = fLink->now() - start;
+
+	if( fOutstanding == 0 )
+		fSyncer->signal();
+
+	fControl->openGate();
+
+	fSyncer->wait();
+
+	UInt64 elapsed = fLink->now() - start;
+	UInt64 busy = submit_time + (fLink->getEventTime() - start_event_time);
+	UInt32 packets = fLink->getPacketCount() - start_packets;
+
+	fSyncer = NULL;
+	destroySlots();
+
+	//
+	// summarize
+	//
+
+	OSDictionary * result = OSDictionary::withCapacity( 12 );
+	if( result == NULL )
+		return kIOReturnNoMemory;
+
+	OSString * name = OSString::withCString( sCommandNames[type] );
+	if( name )
+	{
+		result->setObject( "Command", name );
+		name->release();
+	}
+
+	UInt32 good = fCompleted - fErrors;
+
+	setNumber( result, "Size", size );
+	setNumber( result, "Speed", speed );
+	setNumber( result, "Concurrency", concurrency );
+	if( fKind == kLoopbackBenchmarkWindow )
+		setNumber( result, "Window", fWindow );
+	setNumber( result, "Operations", fCompleted );
+	setNumber( result, "Errors", fErrors );
+	setNumber( result, "Packets", packets );
+
+	if( elapsed > 0 )
+	{
+		setNumber( result, "OpsPerSecond", ((UInt64)good * 1000000000ULL) / elapsed );
+		setNumber( result, "BytesPerSecond", ((UInt64)good * size * 1000000000ULL) / elapsed );
+	}
+
+	if( fCompleted > 0 )
+	{
+		qsort( fLatencies, fCompleted, sizeof(UInt64), compareLatencies );
+		setNumber( result, "LatencyP50", fLatencies[(fCompleted - 1) / 2] );
+		setNumber( result, "LatencyP99", fLatencies[((fCompleted - 1) * 99) / 100] );
+	}
+
+	if( packets > 0 )
+		setNumber( result, "TimePerPacket", busy / packets );
+
+	fResults->setObject( result );
+	result->release();
+
+	return kIOReturnSuccess;
+}
+
+#pragma mark -
+
+// createSlots
+//
+// each slot works on its own part of the node's memory
+
+bool IOFireWireLoopbackBenchmark::createSlots( void )
+{
+	bzero( fSlots, sizeof(fSlots) );
+
+	for( UInt32 i = 0; i < fSlotCount; i++ )
+	{
+		BenchmarkSlot * slot = &fSlots[i];
+		slot->fBenchmark = this;
+		slot->fAddressLo = (i * kBenchmarkMaxPayload) % kLoopbackNodeMemorySize;
+
+		switch( fType )
+		{
+			case kBenchmarkReadQuad:
+				slot->fCommand = OSTypeAlloc( IOFWReadQuadCommand );
+				break;
+
+			case kBenchmarkRead:
+				slot->fCommand = OSTypeAlloc( IOFWReadCommand );
+				break;
+
+			case kBenchmarkWriteQuad:
+				slot->fCommand = OSTypeAlloc( IOFWWriteQuadCommand );
+				break;
+
+			case kBenchmarkWrite:
+				slot->fCommand = OSTypeAlloc( IOFWWriteCommand );
+				break;
+
+			case kBenchmarkCompareAndSwap:
+				slot->fCommand = OSTypeAlloc( IOFWCompareAndSwapCommand );
+				break;
+		}
+
+		if( slot->fCommand == NULL )
+			return false;
+
+		FWAddress address( 0, slot->fAddressLo, fNodeID );
+		bool success = false;
+
+		switch( fType )
+		{
+			case kBenchmarkReadQuad:
+				success = ((IOFWReadQuadCommand*)slot->fCommand)->initAll( fControl, fControl->getGeneration(), address,
+																		   slot->fQuads, 1, slotCompletion, slot );
+				break;
+
+			case kBenchmarkWriteQuad:
+				success = ((IOFWWriteQuadCommand*)slot->fCommand)->initAll( fControl, fControl->getGeneration(), address,
+																			slot->fQuads, 1, slotCompletion, slot );
+				break;
+
+			case kBenchmarkCompareAndSwap:
+				success = ((IOFWCompareAndSwapCommand*)slot->fCommand)->initAll( fControl, fControl->getGeneration(), address,
+																				 &slot->fQuads[0], &slot->fQuads[1], 1, slotCompletion, slot );
+				break;
+
+			case kBenchmarkRead:
+			case kBenchmarkWrite:
+				slot->fBuffer = IOBufferMemoryDescriptor::withCapacity( fSize, kIODirectionOutIn, true );
+				if( slot->fBuffer == NULL )
+					break;
+
+				slot->fBuffer->setLength( fSize );
+				if( fType == kBenchmarkRead )
+				{
+					success = ((IOFWReadCommand*)slot->fCommand)->initAll( fControl, fControl->getGeneration(), address,
+																		   slot->fBuffer, slotCompletion, slot );
+					if( success && fWindow > 1 )
+						success = (((IOFWReadCommand*)slot->fCommand)->setWindowSize( fWindow ) == kIOReturnSuccess);
+				}
+				else
+					success = ((IOFWWriteCommand*)slot->fCommand)->initAll( fControl, fControl->getGeneration(), address,
+																			slot->fBuffer, slotCompletion, slot );
+				break;
+		}
+
+		if( !success )
+		{
+			slot->fCommand->release();
+			slot->fCommand = NULL;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// destroySlots
+//
+//
+
+void IOFireWireLoopbackBenchmark::destroySlots( void )
+{
+	for( UInt32 i = 0; i < kLoopbackBenchmarkMaxSlots; i++ )
+	{
+		BenchmarkSlot * slot = &fSlots[i];
+
+		if( slot->fCommand )
+		{
+			slot->fCommand->release();
+			slot->fCommand = NULL;
+		}
+
+		if( slot->fBuffer )
+		{
+			slot->fBuffer->release();
+			slot->fBuffer = NULL;
+		}
+	}
+}
+
+// submitSlot
+//
+// called with the gate held
+
+IOReturn IOFireWireLoopbackBenchmark::submitSlot( BenchmarkSlot * slot )
+{
+	FWAddress address( 0, slot->fAddressLo, fNodeID );
+	IOReturn status = kIOReturnSuccess;
+
+	switch( fType )
+	{
+		case kBenchmarkReadQuad:
+			status = ((IOFWReadQuadCommand*)slot->fCommand)->reinit( fGeneration, address, slot->fQuads, 1, slotCompletion, slot );
+			break;
+
+		case kBenchmarkRead:
+			status = ((IOFWReadCommand*)slot->fCommand)->reinit( fGeneration, address, slot->fBuffer, slotCompletion, slot );
+			break;
+
+		case kBenchmarkWriteQuad:
+			slot->fQuads[0] = fIssued;
+			status = ((IOFWWriteQuadCommand*)slot->fCommand)->reinit( fGeneration, address, slot->fQuads, 1, slotCompletion, slot );
+			break;
+
+		case kBenchmarkWrite:
+			status = ((IOFWWriteCommand*)slot->fCommand)->reinit( fGeneration, address, slot->fBuffer, slotCompletion, slot );
+			break;
+
+		case kBenchmarkCompareAndSwap:
+			// whatever the outcome the node does the same amount of work
+			slot->fQuads[0] = 0;
+			slot->fQuads[1] = fIssued;
+			status = ((IOFWCompareAndSwapCommand*)slot->fCommand)->reinit( fGeneration, address, &slot->fQuads[0], &slot->fQuads[1], 1, slotCompletion, slot );
+			break;
+	}
+
+	if( status != kIOReturnSuccess )
+		return status;
+
+	// reinit recomputes the packet size from the topology, clip it to what the run's speed allows
+	slot->fCommand->setMaxSpeed( fSpeed );
+	if( fType == kBenchmarkRead || fType == kBenchmarkWrite )
+		slot->fCommand->setMaxPacket( 512 << fSpeed );
+
+	fIssued++;
+	slot->fStart = fLink->now();
+
+	// from here on errors are reported through the completion routine
+	slot->fCommand->submit();
+
+	return kIOReturnSuccess;
+}
+
+// slotCompletion
+//
+//
+
+void IOFireWireLoopbackBenchmark::slotCompletion( void * refcon, IOReturn status, IOFireWireNub * device, IOFWCommand * fwCmd )
+{
+	BenchmarkSlot * slot = (BenchmarkSlot*)refcon;
+	slot->fBenchmark->slotComplete( slot, status );
+}
+
+// slotComplete
+//
+// on the workloop, resubmit until enough have been issued
+
+void IOFireWireLoopbackBenchmark::slotComplete( BenchmarkSlot * slot, IOReturn status )
+{
+	if( fCompleted < fIterations )
+		fLatencies[fCompleted] = fLink->now() - slot->fStart;
+
+	fCompleted++;
+	if( status != kIOReturnSuccess )
+		fErrors++;
+
+	if( fIssued < fIterations )
+	{
+		if( submitSlot( slot ) == kIOReturnSuccess )
+			return;
+
+		// a failed reinit never reaches the completion routine
+		DebugLog( "IOFireWireLoopbackBenchmark::slotComplete - failed to resubmit %s\n", sCommandNames[fType] );
+	}
+
+	fOutstanding--;
+	if( fOutstanding == 0 )
+	{
+		fSyncer->signal();
+	}
+}
+
+#pragma mark -
+
+// runBusResets
+//
+// the simulated bus is put back the way it was when we're done, and the controller
+// stops publishing its scan timing
+
+IOReturn IOFireWireLoopbackBenchmark::runBusResets( void )
+{
+	IOReturn status = kIOReturnSuccess;
+	UInt32 original_topology = fLink->getTopology();
+	UInt32 original_nodes = fLink->getNodeCount();
+
+	fControl->closeGate();
+	fControl->fPublishScanTiming = true;
+	fControl->openGate();
+
+	for( UInt32 t = 0; t < fTopologies->getCount() && status == kIOReturnSuccess; t++ )
+	{
+		OSString * name = OSDynamicCast( OSString, fTopologies->getObject( t ) );
+		if( name == NULL )
+			continue;
+
+		UInt32 topology;
+		for( topology = 0; topology < sizeof(sTopologyNames) / sizeof(char*); topology++ )
+		{
+			if( name->isEqualTo( sTopologyNames[topology] ) )
+				break;
+		}
+
+		if( topology == sizeof(sTopologyNames) / sizeof(char*) )
+			continue;
+
+		for( UInt32 n = 0; n < fNodeCounts->getCount() && status == kIOReturnSuccess; n++ )
+		{
+			OSNumber * count = OSDynamicCast( OSNumber, fNodeCounts->getObject( n ) );
+			if( count == NULL || count->unsigned32BitValue() < 2 || count->unsigned32BitValue() > (kLoopbackMaxNodes + 1) )
+				continue;
+
+			if( topology == IOFireWireLoopbackLink::kLoopbackTopologyChain && count->unsigned32BitValue() > (kLoopbackMaxChainNodes + 1) )
+				continue;
+
+			for( UInt32 run = 0; run < fResets && status == kIOReturnSuccess; run++ )
+			{
+				status = runBusReset( topology, count->unsigned32BitValue(), run );
+			}
+		}
+	}
+
+	fLink->setTopology( original_topology, original_nodes );
+
+	fControl->closeGate();
+	fControl->fPublishScanTiming = false;
+	fControl->removeProperty( "BusScanTiming" );
+	fControl->openGate();
+
+	return status;
+}
+
+// runBusReset
+//
+// resets the bus into the given shape and waits for the controller to finish scanning it
+
+IOReturn IOFireWireLoopbackBenchmark::runBusReset( UInt32 topology, UInt32 nodes, UInt32 run )
+{
+	UInt32 generation = fControl->getGeneration();
+
+	IOReturn status = fLink->setTopology( topology, nodes - 1 );
+	if( status != kIOReturnSuccess )
+		return status;
+
+	// a gap count change costs a second reset, the scan that finishes is the one we want
+	OSDictionary * timing = NULL;
+	for( UInt32 waited = 0; timing == NULL && waited < kBenchmarkScanTimeout; waited += kBenchmarkScanPoll )
+	{
+		IOSleep( kBenchmarkScanPoll );
+
+		OSObject * prop = fControl->copyProperty( "BusScanTiming" );
+		OSDictionary * dict = OSDynamicCast( OSDictionary, prop );
+		OSNumber * scan_generation = dict ? OSDynamicCast( OSNumber, dict->getObject( "Generation" ) ) : NULL;
+		OSNumber * scan_nodes = dict ? OSDynamicCast( OSNumber, dict->getObject( "Nodes" ) ) : NULL;
+
+		if( scan_generation && scan_nodes &&
+			(SInt32)(scan_generation->unsigned32BitValue() - generation) > 0 &&
+			scan_nodes->unsigned32BitValue() == nodes )
+		{
+			timing = OSDictionary::withDictionary( dict );
+		}
+
+		if( prop )
+			prop->release();
+	}
+
+	if( timing == NULL )
+	{
+		IOLog( "IOFireWireLoopbackBenchmark::runBusReset - timed out scanning a %s of %u nodes\n", sTopologyNames[topology], (uint32_t)nodes );
+		return kIOReturnTimeout;
+	}
+
+	OSString * name = OSString::withCString( sTopologyNames[topology] );
+	if( name )
+	{
+		timing->setObject( "Topology", name );
+		name->release();
+	}
+
+	setNumber( timing, "Run", run );
+
+	fResults->setObject( timing );
+	timing->release();
+
+	return kIOReturnSuccess;
+}
+
+#pragma mark -
+
+// runConfigDirectories
+//
+// the simulated nodes get their original ROMs back when we're done
+
+IOReturn IOFireWireLoopbackBenchmark::runConfigDirectories( void )
+{
+	IOReturn status = kIOReturnSuccess;
+	UInt32 original_entries = fLink->getVendorEntries();
+
+	for( UInt32 n = 0; n < fEntryCounts->getCount() && status == kIOReturnSuccess; n++ )
+	{
+		OSNumber * count = OSDynamicCast( OSNumber, fEntryCounts->getObject( n ) );
+		if( count == NULL || count->unsigned32BitValue() == 0 || count->unsigned32BitValue() > kLoopbackMaxVendorEntries )
+			continue;
+
+		status = runConfigDirectory( count->unsigned32BitValue() );
+	}
+
+	fLink->setVendorEntries( original_entries );
+
+	return status;
+}
+
+// runConfigDirectory
+//
+// a fresh directory object for each size, so its first lookup pays for building the index
+
+IOReturn IOFireWireLoopbackBenchmark::runConfigDirectory( UInt32 entries )
+{
+	IOReturn status = fLink->setVendorEntries( entries );
+	if( status != kIOReturnSuccess )
+		return status;
+
+	IOFireWireDevice * device = copyNodeDevice();
+	if( device == NULL )
+	{
+		IOLog( "IOFireWireLoopbackBenchmark::runConfigDirectory - no device for node %u\n", (uint32_t)(fNodeID & kFWMaxNodesPerBus) );
+		return kIOReturnNoDevice;
+	}
+
+	IOConfigDirectory * directory = copyNodeDirectory( device, entries );
+	device->release();
+
+	if( directory == NULL )
+	{
+		IOLog( "IOFireWireLoopbackBenchmark::runConfigDirectory - timed out reading a directory of %u entries\n", (uint32_t)entries );
+		return kIOReturnTimeout;
+	}
+
+	// the offset entries are at the end of the directory, keyed from 0
+	UInt32 keys = (entries < 64) ? entries : 64;
+
+	UInt64 first = timeLookups( directory, 1, 1 );
+	UInt64 indexed = timeLookups( directory, keys, fIterations );
+
+	directory->setKeyIndexEnabled( false );
+	UInt64 linear = timeLookups( directory, keys, fIterations );
+	directory->setKeyIndexEnabled( true );
+
+	directory->release();
+
+	OSDictionary * result = OSDictionary::withCapacity( 6 );
+	if( result == NULL )
+		return kIOReturnNoMemory;
+
+	UInt64 lookups = (UInt64)keys * fIterations;
+
+	setNumber( result, "Entries", entries );
+	setNumber( result, "Lookups", lookups );
+	setNumber( result, "FirstLookup", first );
+	setNumber( result, "IndexedLookup", indexed / lookups );
+	setNumber( result, "LinearLookup", linear / lookups );
+
+	fResults->setObject( result );
+	result->release();
+
+	return kIOReturnSuccess;
+}
+
+// copyNodeDevice
+//
+// the device for the target node, found by the GUID the link gave it
+
+IOFireWireDevice * IOFireWireLoopbackBenchmark::copyNodeDevice( void )
+{
+	UInt32 phy = fNodeID & kFWMaxNodesPerBus;
+	if( phy >= fLink->getNodeCount() )
+		return NULL;
+
+	CSRNodeUniqueID guid = fLink->getNodeGUID( phy );
+	IOFireWireDevice * device = NULL;
+
+	fControl->closeGate();
+
+	OSIterator * iterator = fControl->getClientIterator();
+	if( iterator )
+	{
+		OSObject * child;
+		while( device == NULL && (child = iterator->getNextObject()) )
+		{
+			IOFireWireDevice * found = OSDynamicCast( IOFireWireDevice, child );
+			if( found && found->getUniqueID() == guid )
+			{
+				device = found;
+				device->retain();
+			}
+		}
+
+		iterator->release();
+	}
+
+	fControl->openGate();
+
+	return device;
+}
+
+// copyNodeDirectory
+//
+// waits for the device to pick up the ROM built for this many entries
+
+IOConfigDirectory * IOFireWireLoopbackBenchmark::copyNodeDirectory( IOFireWireDevice * device, UInt32 entries )
+{
+	IOConfigDirectory * directory = NULL;
+
+	for( UInt32 waited = 0; directory == NULL && waited < kBenchmarkScanTimeout; waited += kBenchmarkScanPoll )
+	{
+		IOSleep( kBenchmarkScanPoll );
+
+		IOConfigDirectory * root = NULL;
+
+		fControl->closeGate();
+		device->getConfigDirectoryRef( root );
+		fControl->openGate();
+
+		if( root == NULL )
+			continue;
+
+		IOConfigDirectory * found = NULL;
+		if( root->getKeyValue( kConfigNodeDependentInfoKey, found ) == kIOReturnSuccess )
+		{
+			if( found->getNumEntries() == (int)entries )
+				directory = found;
+			else
+				found->release();
+		}
+
+		root->release();
+	}
+
+	return directory;
+}
+
+// timeLookups
+//
+// nanoseconds to look up the offset entries with keys below keys, passes times
+
+UInt64 IOFireWireLoopbackBenchmark::timeLookups( IOConfigDirectory * directory, UInt32 keys, UInt32 passes )
+{
+	UInt64 start = fLink->now();
+
+	for( UInt32 pass = 0; pass < passes; pass++ )
+	{
+		for( UInt32 key = 0; key < keys; key++ )
+		{
+			FWAddress address;
+			directory->getKeyOffset( key, address );
+		}
+	}
+
+	return fLink->now() - start;
+}
+
+#pragma mark -
+
+// runCRCs
+//
+// the same pseudo random ROM image for every size, bus order like a real one
+
+IOReturn IOFireWireLoopbackBenchmark::runCRCs( void )
+{
+	IOReturn status = kIOReturnSuccess;
+
+	UInt32 * buffer = (UInt32*)IOMalloc( kLoopbackROMQuads * sizeof(UInt32) );
+	if( buffer == NULL )
+		return kIOReturnNoMemory;
+
+	UInt32 random = 1;
+	for( UInt32 i = 0; i < kLoopbackROMQuads; i++ )
+	{
+		random = (random * 1103515245) + 12345;
+		buffer[i] = OSSwapHostToBigInt32( random );
+	}
+
+	for( UInt32 n = 0; n < fSizes->getCount() && status == kIOReturnSuccess; n++ )
+	{
+		OSNumber * quads = OSDynamicCast( OSNumber, fSizes->getObject( n ) );
+		if( quads == NULL || quads->unsigned32BitValue() == 0 || quads->unsigned32BitValue() > kLoopbackROMQuads )
+			continue;
+
+		status = runCRC( buffer, quads->unsigned32BitValue() );
+	}
+
+	IOFree( buffer, kLoopbackROMQuads * sizeof(UInt32) );
+
+	return status;
+}
+
+// runCRC
+//
+// the quad at a time check picks up from the first half's CRC, which is only zero
+// for a length of 1
+
+IOReturn IOFireWireLoopbackBenchmark::runCRC( UInt32 * buffer, UInt32 quads )
+{
+	UInt32 mismatches = 0;
+	UInt32 update_mismatches = 0;
+	for( UInt32 length = 1; length <= quads; length++ )
+	{
+		UInt16 reference = FWComputeCRC16Reference( buffer, length );
+		if( FWComputeCRC16( buffer, length ) != reference )
+			mismatches++;
+
+		UInt16 crc = FWComputeCRC16( buffer, length / 2 );
+		for( UInt32 i = length / 2; i < length; i++ )
+		{
+			crc = FWUpdateCRC16( crc, buffer[i] );
+		}
+
+		if( crc != reference )
+			update_mismatches++;
+	}
+
+	if( mismatches )
+		IOLog( "IOFireWireLoopbackBenchmark::runCRC - table CRC disagrees with the reference %u times in %u quads\n", (uint32_t)mismatches, (uint32_t)quads );
+
+	if( update_mismatches )
+		IOLog( "IOFireWireLoopbackBenchmark::runCRC - updated CRC disagrees with the reference %u times in %u quads\n", (uint32_t)update_mismatches, (uint32_t)quads );
+
+	// sum the results so the loops can't be thrown away
+	UInt32 sum = 0;
+
+	UInt64 start = fLink->now();
+	for( UInt32 i = 0; i < fIterations; i++ )
+	{
+		sum += FWComputeCRC16( buffer, quads );
+	}
+	UInt64 table = fLink->now() - start;
+
+	start = fLink->now();
+	for( UInt32 i = 0; i < fIterations; i++ )
+	{
+		sum += FWComputeCRC16Reference( buffer, quads );
+	}
+	UInt64 reference = fLink->now() - start;
+
+	OSDictionary * result = OSDictionary::withCapacity( 7 );
+	if( result == NULL )
+		return kIOReturnNoMemory;
+
+	setNumber( result, "Quads", quads );
+	setNumber( result, "Iterations", fIterations );
+	setNumber( result, "Mismatches", mismatches );
+	setNumber( result, "UpdateMismatches", update_mismatches );
+	setNumber( result, "TableCRC", table / fIterations );
+	setNumber( result, "ReferenceCRC", reference / fIterations );
+	setNumber( result, "Checksum", sum );
+
+	fResults->setObject( result );
+	result->release();
+
+	return (mismatches == 0 && update_mismatches == 0) ? kIOReturnSuccess : kIOReturnInternalError;
+}
+
+#pragma mark -
+
+// runTimeouts
+//
+//
+
+IOReturn IOFireWireLoopbackBenchmark::runTimeouts( void )
+{
+	IOReturn status = kIOReturnSuccess;
+
+	for( UInt32 n = 0; n < fSizes->getCount() && status == kIOReturnSuccess; n++ )
+	{
+		OSNumber * count = OSDynamicCast( OSNumber, fSizes->getObject( n ) );
+		if( count == NULL || count->unsigned32BitValue() == 0 || count->unsigned32BitValue() > fIterations )
+			continue;
+
+		status = runTimeout( count->unsigned32BitValue() );
+	}
+
+	return status;
+}
+
+// runTimeout
+//
+// every command is queued before any can expire, the gate keeps the timer off until we're done
+
+IOReturn IOFireWireLoopbackBenchmark::runTimeout( UInt32 count )
+{
+	IOReturn status = kIOReturnSuccess;
+
+	IOFWBenchmarkTimeoutCommand ** commands = (IOFWBenchmarkTimeoutCommand**)IOMalloc( sizeof(IOFWBenchmarkTimeoutCommand*) * count );
+	if( commands == NULL )
+		return kIOReturnNoMemory;
+
+	bzero( commands, sizeof(IOFWBenchmarkTimeoutCommand*) * count );
+
+	// timeouts spread pseudo randomly over fTimeout to twice that
+	UInt32 random = 1;
+	for( UInt32 i = 0; i < count && status == kIOReturnSuccess; i++ )
+	{
+		random = (random * 1103515245) + 12345;
+		UInt32 timeout = (fTimeout * 1000) + ((random >> 8) % (fTimeout * 1000));
+
+		commands[i] = OSTypeAlloc( IOFWBenchmarkTimeoutCommand );
+		if( commands[i] == NULL )
+		{
+			status = kIOReturnNoMemory;
+		}
+		else if( !commands[i]->init( fControl, this, timeout ) )
+		{
+			commands[i]->release();
+			commands[i] = NULL;
+			status = kIOReturnNoMemory;
+		}
+	}
+
+	if( status == kIOReturnSuccess )
+	{
+		fSyncer = IOFWSyncer::create();
+		if( fSyncer == NULL )
+			status = kIOReturnNoMemory;
+	}
+
+	UInt64 add_time = 0;
+	UInt64 cancel_time = 0;
+	UInt32 cancels = 0;
+
+	if( status == kIOReturnSuccess )
+	{
+		fCompleted = 0;
+		fCancelled = 0;
+		fExpired = 0;
+		fErrors = 0;
+		fOutstanding = count;
+
+		fControl->closeGate();
+
+		UInt64 start = fLink->now();
+
+		for( UInt32 i = 0; i < count; i++ )
+		{
+			commands[i]->submit();
+		}
+
+		add_time = fLink->now() - start;
+
+		start = fLink->now();
+
+		for( UInt32 i = 1; i < count; i += 2 )
+		{
+			commands[i]->cancel( kIOReturnAborted );
+			cancels++;
+		}
+
+		cancel_time = fLink->now() - start;
+
+		fControl->openGate();
+
+		fSyncer->wait();
+		fSyncer = NULL;
+	}
+
+	for( UInt32 i = 0; i < count; i++ )
+	{
+		if( commands[i] )
+			commands[i]->release();
+	}
+
+	IOFree( commands, sizeof(IOFWBenchmarkTimeoutCommand*) * count );
+
+	if( status != kIOReturnSuccess )
+		return status;
+
+	//
+	// summarize
+	//
+
+	OSDictionary * result = OSDictionary::withCapacity( 9 );
+	if( result == NULL )
+		return kIOReturnNoMemory;
+
+	setNumber( result, "Count", count );
+	setNumber( result, "Cancelled", fCancelled );
+	setNumber( result, "Expired", fExpired );
+	setNumber( result, "Errors", fErrors );
+	setNumber( result, "AddTime", add_time / count );
+
+	if( cancels > 0 )
+		setNumber( result, "CancelTime", cancel_time / cancels );
+
+	if( fExpired > 0 )
+	{
+		qsort( fLatencies, fExpired, sizeof(UInt64), compareLatencies );
+		setNumber( result, "LatenessP50", fLatencies[(fExpired - 1) / 2] );
+		setNumber( result, "LatenessP99", fLatencies[((fExpired - 1) * 99) / 100] );
+		setNumber( result, "LatenessMax", fLatencies[fExpired - 1] );
+	}
+
+	fResults->setObject( result );
+	result->release();
+
+	return kIOReturnSuccess;
+}
+
+// timeoutComplete
+//
+// on the workloop, or on the benchmark thread with the gate held for the cancels
+
+void IOFireWireLoopbackBenchmark::timeoutComplete( IOFWBenchmarkTimeoutCommand * cmd, IOReturn status )
+{
+	UInt64 now = fLink->now();
+
+	fCompleted++;
+
+	if( status == kIOReturnTimeout )
+	{
+		UInt64 deadline;
+		absolutetime_to_nanoseconds( cmd->getDeadline(), &deadline );
+
+		if( now < deadline )
+			fErrors++;
+		else
+			fLatencies[fExpired++] = now - deadline;
+	}
+	else if( status == kIOReturnAborted )
+	{
+		fCancelled++;
+	}
+	else
+	{
+		fErrors++;
+	}
+
+	fOutstanding--;
+	if( fOutstanding == 0 )
+	{
+		fSyncer->signal();
+	}
+}
+
+#pragma mark -
+
+// runPseudoAddresses
+//
+//
+
+IOReturn IOFireWireLoopbackBenchmark::runPseudoAddresses( void )
+{
+	IOReturn status = kIOReturnSuccess;
+
+	for( UInt32 n = 0; n < fSizes->getCount() && status == kIOReturnSuccess; n++ )
+	{
+		OSNumber * count = OSDynamicCast( OSNumber, fSizes->getObject( n ) );
+		if( count == NULL || count->unsigned32BitValue() == 0 || count->unsigned32BitValue() >= kFWPseudoAddressHiLimit )
+			continue;
+
+		status = runPseudoAddress( count->unsigned32BitValue() );
+	}
+
+	return status;
+}
+
+// runPseudoAddress
+//
+// a bitmap of our own catches the allocator handing out an addressHi twice
+
+IOReturn IOFireWireLoopbackBenchmark::runPseudoAddress( UInt32 count )
+{
+	UInt32 live_count = 0;
+	UInt32 churn = 0;
+	UInt32 errors = 0;
+	UInt32 random = 1;
+
+	FWAddress * live = (FWAddress*)IOMalloc( sizeof(FWAddress) * count );
+	UInt64 * used = (UInt64*)IOMalloc( sizeof(UInt64) * kFWPseudoAddressWords );
+	if( live == NULL || used == NULL )
+	{
+		if( live )
+			IOFree( live, sizeof(FWAddress) * count );
+		if( used )
+			IOFree( used, sizeof(UInt64) * kFWPseudoAddressWords );
+		return kIOReturnNoMemory;
+	}
+
+	bzero( used, sizeof(UInt64) * kFWPseudoAddressWords );
+
+	//
+	// fill up to count
+	//
+
+	UInt64 start = fLink->now();
+
+	while( live_count < count )
+	{
+		FWAddress address;
+		if( fControl->allocatePseudoAddress( &address, 0 ) != kIOReturnSuccess )
+		{
+			errors++;
+			break;
+		}
+
+		live[live_count++] = address;
+	}
+
+	UInt64 allocate_time = fLink->now() - start;
+
+	for( UInt32 i = 0; i < live_count; i++ )
+	{
+		UInt32 hi = live[i].addressHi;
+		if( used[hi / 64] & (1ULL << (hi % 64)) )
+			errors++;
+		used[hi / 64] |= (1ULL << (hi % 64));
+	}
+
+	//
+	// churn at count live
+	//
+
+	UInt64 churn_time = 0;
+	for( churn = 0; churn < fIterations && live_count == count; churn++ )
+	{
+		random = (random * 1103515245) + 12345;
+		UInt32 victim = (random >> 8) % live_count;
+		UInt32 hi = live[victim].addressHi;
+
+		start = fLink->now();
+		fControl->freePseudoAddress( live[victim], 0 );
+		IOReturn status = fControl->allocatePseudoAddress( &live[victim], 0 );
+		churn_time += fLink->now() - start;
+
+		used[hi / 64] &= ~(1ULL << (hi % 64));
+
+		if( status != kIOReturnSuccess )
+		{
+			errors++;
+			live[victim] = live[--live_count];
+			break;
+		}
+
+		hi = live[victim].addressHi;
+		if( used[hi / 64] & (1ULL << (hi % 64)) )
+			errors++;
+		used[hi / 64] |= (1ULL << (hi % 64));
+	}
+
+	//
+	// and give everything back
+	//
+
+	start = fLink->now();
+
+	for( UInt32 i = 0; i < live_count; i++ )
+	{
+		fControl->freePseudoAddress( live[i], 0 );
+	}
+
+	UInt64 free_time = fLink->now() - start;
+
+	IOFree( live, sizeof(FWAddress) * count );
+	IOFree( used, sizeof(UInt64) * kFWPseudoAddressWords );
+
+	//
+	// summarize
+	//
+
+	OSDictionary * result = OSDictionary::withCapacity( 6 );
+	if( result == NULL )
+		return kIOReturnNoMemory;
+
+	setNumber( result, "Count", count );
+	setNumber( result, "Churn", churn );
+	setNumber( result, "Errors", errors );
+
+	if( live_count > 0 )
+	{
+		setNumber( result, "AllocateTime", allocate_time / live_count );
+		setNumber( result, "FreeTime", free_time / live_count );
+	}
+
+	if( churn > 0 )
+		setNumber( result, "ChurnTime", churn_time / churn );
+
+	fResults->setObject( result );
+	result->release();
+
+	return kIOReturnSuccess;
+}
+
+#pragma mark -
+
+// runRequests
+//
+//
+
+IOReturn IOFireWireLoopbackBenchmark::runRequests( void )
+{
+	IOReturn status = kIOReturnSuccess;
+
+	for( UInt32 s = 0; s < fSizes->getCount() && status == kIOReturnSuccess; s++ )
+	{
+		OSNumber * size = OSDynamicCast( OSNumber, fSizes->getObject( s ) );
+		if( size == NULL || size->unsigned32BitValue() == 0 || size->unsigned32BitValue() > kBenchmarkMaxPayload ||
+			(size->unsigned32BitValue() & 3) )
+			continue;
+
+		for( UInt32 c = 0; c < fConcurrency->getCount() && status == kIOReturnSuccess; c++ )
+		{
+			OSNumber * concurrency = OSDynamicCast( OSNumber, fConcurrency->getObject( c ) );
+			if( concurrency == NULL || concurrency->unsigned32BitValue() == 0 || concurrency->unsigned32BitValue() > kLoopbackBenchmarkMaxSlots )
+				continue;
+
+			for( UInt32 b = 0; b < fBatchResponses->getCount() && status == kIOReturnSuccess; b++ )
+			{
+				OSNumber * batch = OSDynamicCast( OSNumber, fBatchResponses->getObject( b ) );
+				if( batch == NULL )
+					continue;
+
+				status = runRequest( size->unsigned32BitValue(), concurrency->unsigned32BitValue(), batch->unsigned32BitValue() != 0 );
+			}
+		}
+	}
+
+	return status;
+}
+
+// runRequest
+//
+// the responses drive the run from the workloop, we just wait for the last of them. a bus
+// reset loses the requests in flight, so the wait gives up eventually. batch picks whether
+// the link takes the controller's batches of responses at once or one at a time
+
+IOReturn IOFireWireLoopbackBenchmark::runRequest( UInt32 size, UInt32 concurrency, bool batch )
+{
+	UInt32 phy = fNodeID & kFWMaxNodesPerBus;
+	if( phy >= fLink->getNodeCount() )
+		return kIOReturnNoDevice;
+
+	if( concurrency > fIterations )
+		concurrency = fIterations;
+
+	fRequestBuffer = IOBufferMemoryDescriptor::withCapacity( size, kIODirectionOutIn, true );
+	if( fRequestBuffer == NULL )
+		return kIOReturnNoMemory;
+
+	fRequestBuffer->setLength( size );
+
+	IOFWPseudoAddressSpace * space = IOFWPseudoAddressSpace::simpleRW( fControl, &fRequestAddress, fRequestBuffer );
+	if( space == NULL || space->activate() != kIOReturnSuccess )
+	{
+		if( space )
+			space->release();
+		fRequestBuffer->release();
+		fRequestBuffer = NULL;
+		return kIOReturnNoMemory;
+	}
+
+	fSize = size;
+	fIssued = 0;
+	fCompleted = 0;
+	fErrors = 0;
+	fOutstanding = 0;
+
+	fControl->closeGate();
+
+	fLink->setNodeResponseHandler( requestResponse, this );
+	fLink->setBatchResponses( batch );
+
+	UInt32 start_transmits = fLink->getResponseTransmits();
+	UInt64 start = fLink->now();
+	fEnd = start;
+
+	for( UInt32 i = 0; i < concurrency; i++ )
+	{
+		if( submitRequest() == kIOReturnSuccess )
+			fOutstanding++;
+	}
+
+	fControl->openGate();
+
+	bool done = false;
+	for( UInt32 waited = 0; !done && waited < kBenchmarkScanTimeout; waited++ )
+	{
+		IOSleep( 1 );
+
+		fControl->closeGate();
+		done = (fOutstanding == 0);
+		fControl->openGate();
+	}
+
+	fControl->closeGate();
+	fLink->setNodeResponseHandler( NULL, NULL );
+	fLink->setBatchResponses( true );
+	UInt32 transmits = fLink->getResponseTransmits() - start_transmits;
+	fControl->openGate();
+
+	space->deactivate();
+	space->release();
+
+	fRequestBuffer->release();
+	fRequestBuffer = NULL;
+
+	if( !done )
+	{
+		IOLog( "IOFireWireLoopbackBenchmark::runRequest - timed out waiting for %u responses\n", (uint32_t)fOutstanding );
+		return kIOReturnTimeout;
+	}
+
+	//
+	// summarize
+	//
+
+	OSDictionary * result = OSDictionary::withCapacity( 8 );
+	if( result == NULL )
+		return kIOReturnNoMemory;
+
+	UInt64 elapsed = fEnd - start;
+
+	setNumber( result, "Size", size );
+	setNumber( result, "Concurrency", concurrency );
+	setNumber( result, "BatchResponses", batch ? 1 : 0 );
+	setNumber( result, "Requests", fCompleted );
+	setNumber( result, "Errors", fErrors );
+	setNumber( result, "ResponseTransmits", transmits );
+
+	if( elapsed > 0 )
+		setNumber( result, "RequestsPerSecond", ((UInt64)fCompleted * 1000000000ULL) / elapsed );
+
+	if( fCompleted > 0 )
+		setNumber( result, "TimePerRequest", elapsed / fCompleted );
+
+	fResults->setObject( result );
+	result->release();
+
+	return kIOReturnSuccess;
+}
+
+// submitRequest
+//
+// called with the gate held, the payload is whatever is in the address space already
+
+IOReturn IOFireWireLoopbackBenchmark::submitRequest( void )
+{
+	int tCode = (fSize == 4) ? kFWTCodeWriteQuadlet : kFWTCodeWriteBlock;
+
+	IOReturn status = fLink->sendNodeRequest( fNodeID & kFWMaxNodesPerBus, tCode, fRequestAddress.addressHi, fRequestAddress.addressLo,
+											  fRequestBuffer->getBytesNoCopy(), fSize, 0 );
+	if( status == kIOReturnSuccess )
+		fIssued++;
+
+	return status;
+}
+
+// requestResponse
+//
+// on the workloop, send another until enough have been issued
+
+void IOFireWireLoopbackBenchmark::requestResponse( void * refcon, UInt32 phy, int rcode )
+{
+	IOFireWireLoopbackBenchmark * me = (IOFireWireLoopbackBenchmark*)refcon;
+
+	me->fCompleted++;
+	if( rcode != kFWResponseComplete )
+		me->fErrors++;
+
+	if( me->fIssued < me->fIterations && me->submitRequest() == kIOReturnSuccess )
+		return;
+
+	if( me->fOutstanding > 0 )
+		me->fOutstanding--;
+
+	if( me->fOutstanding == 0 )
+		me->fEnd = me->fLink->now();
+}
+
+#pragma mark -
+
+OSDefineMetaClassAndStructors( IOFWBenchmarkTimeoutCommand, IOFWCommand )
+
+// init
+//
+//
+
+bool IOFWBenchmarkTimeoutCommand::init( IOFireWireController * control, IOFireWireLoopbackBenchmark * benchmark, UInt32 timeout )
+{
+	if( !initWithController( control ) )
+		return false;
+
+	fBenchmark = benchmark;
+	setTimeout( timeout );
+
+	return true;
+}
+
+// execute
+//
+// nothing is sent, the command just waits on the timeout queue
+
+IOReturn IOFWBenchmarkTimeoutCommand::execute( void )
+{
+	return kIOReturnBusy;
+}
+
+// complete
+//
+//
+
+IOReturn IOFWBenchmarkTimeoutCommand::complete( IOReturn status )
+{
+	status = IOFWCommand::complete( status );
+
+	fBenchmark->timeoutComplete( this, status );
+
+	return status;
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 1998-2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  IOFireWireLoopbackBenchmark.h
+ *  IOFireWireFamily
+ *
+ */
+
+#ifndef _IOKIT_IOFIREWIRELOOPBACKBENCHMARK_H
+#define _IOKIT_IOFIREWIRELOOPBACKBENCHMARK_H
+
+#import <libkern/c++/OSObject.h>
+#import <IOKit/firewire/IOFWCommand.h>
+
+class IOFireWireLoopbackLink;
+class IOFireWireController;
+class IOFWSyncer;
+class IOBufferMemoryDescriptor;
+class IOFireWireDevice;
+class IOConfigDirectory;
+
+// IOFireWireLoopbackBenchmark
+//
+// Drives the async commands through the controller against the simulated nodes of
+// an IOFireWireLoopbackLink, sweeping command type, payload size, speed and the
+// number of commands kept in flight. Each run is summarized in a dictionary:
+//	Command, Size, Speed, Concurrency		what was run
+//	Operations, Errors, Packets				how much of it
+//	OpsPerSecond, BytesPerSecond			throughput over the wall time of the run
+//	LatencyP50, LatencyP99					submit to completion, in nanoseconds
+//	TimePerPacket							wall time spent submitting and in link event
+//											processing, per request packet, in nanoseconds.
+//											not CPU time, preemption and interrupts count
+//
+// Parameters, all optional:
+//	Iterations		operations per run
+//	Node			phy id of the simulated node to target
+//	Sizes			array of block payload sizes, the quad and lock commands
+//					always use 4 and 8 bytes
+//	Speeds			array of kFWSpeed values
+//	Concurrency		array of commands in flight
+//
+// The window benchmark runs one block read at a time, each split into packets of the
+// run's speed and kept up to Window packets in flight with IOFWReadCommand::setWindowSize.
+// A window of 1 is the stop and wait read. Each run is summarized as above with Window
+// added and Concurrency always 1. Parameters, all optional:
+//	Iterations		reads per run
+//	Node			phy id of the simulated node to target
+//	Sizes			array of read sizes, up to kLoopbackNodeMemorySize
+//	Speeds			array of kFWSpeed values
+//	Windows			array of packets in flight, 1 to kFWCmdMaxWindowPackets
+//
+// The bus reset benchmark instead reshapes the simulated bus and times each reset
+// through to the end of the bus scan, returning the controller's BusScanTiming for
+// every run along with its Topology and Run number. Parameters, all optional:
+//	Topologies		array of "Chain", "Star" and "Tree"
+//	NodeCounts		array of bus sizes including the local node, 2 to 63,
+//					a Chain skips sizes over 17
+//	Resets			runs of each topology and size
+//
+// The config directory benchmark gives the simulated nodes node dependent info
+// directories of each size in turn and, once the IOFireWireDevice of the target node
+// has read its ROM again, looks up every offset entry in the directory with the key
+// index and then with it disabled. Each size is summarized as:
+//	Entries, Lookups						directory size and lookups timed each way
+//	FirstLookup								the first lookup, which builds the index
+//	IndexedLookup, LinearLookup				mean time per lookup, in nanoseconds
+// Parameters, all optional:
+//	Node			phy id of the simulated node whose directory is read
+//	Iterations		passes over the keys of each directory
+//	EntryCounts		array of directory sizes, 1 to kLoopbackMaxVendorEntries
+//
+// The CRC benchmark checks the table driven config ROM CRC against the reference one
+// for every length up to each size, then times both. Each length is also checked
+// finishing a quad at a time with FWUpdateCRC16, starting from the CRC of its first
+// half so the update sees a nonzero initial CRC. Each size is summarized as:
+//	Quads, Iterations						block size and how many times each CRC ran
+//	Mismatches								lengths where the two disagreed, always 0
+//	UpdateMismatches						lengths where the quad at a time CRC disagreed, always 0
+//	TableCRC, ReferenceCRC					mean time per block, in nanoseconds
+//	Checksum								sum of every CRC, keeps the loops honest
+// Parameters, all optional:
+//	Iterations		CRCs of each size with each implementation
+//	Quads			array of block sizes in quadlets, 1 to kLoopbackROMQuads
+//
+// The timeout benchmark puts commands that never get a response on the controller's
+// timeout queue all at once, with deadlines spread over a window, cancels every other
+// one and lets the rest time out. Each count is summarized as:
+//	Count, Cancelled, Expired, Errors		commands submitted and how they completed,
+//											Errors counts those that expired early
+//	AddTime, CancelTime						mean time to queue and to cancel a command,
+//											in nanoseconds
+//	LatenessP50, LatenessP99, LatenessMax	how long after its deadline a command expired,
+//											in nanoseconds
+// Parameters, all optional:
+//	Counts			array of how many commands to have waiting at once
+//	Timeout			shortest timeout, in milliseconds, the longest is twice this
+//
+// The pseudo address benchmark allocates addressHi values from the controller until
+// each count is live, then frees a random one and allocates another, and finally frees
+// them all. Each count is summarized as:
+//	Count, Churn							live addressHis and free/allocate pairs timed
+//	AllocateTime, ChurnTime, FreeTime		mean time per allocate, per pair and per free,
+//											in nanoseconds
+//	Errors									allocations that failed or handed out an
+//											addressHi that was still live, always 0
+// Parameters, all optional:
+//	Iterations		free/allocate pairs at each count
+//	Counts			array of how many addressHis to have live at once
+//
+// The node request benchmark has a simulated node write into a pseudo address space on
+// the local node, keeping each concurrency's worth of requests waiting on the controller's
+// responses. Each run is summarized as:
+//	Size, Concurrency						payload size and requests in flight
+//	BatchResponses							1 if the link took each batch of responses at once
+//	Requests, Errors						responses received and those that weren't complete
+//	ResponseTransmits						times the link was handed responses to send
+//	RequestsPerSecond, TimePerRequest		over the wall time of the run, in nanoseconds
+// Parameters, all optional:
+//	Iterations		requests per run
+//	Node			phy id of the simulated node sending the requests
+//	Sizes			array of payload sizes, 4 is a quadlet write
+//	Concurrency		array of requests in flight, up to kLoopbackBenchmarkMaxSlots
+//	BatchResponses	array of 0 and 1, runs without and with asyncResponses batching
+
+#define kLoopbackBenchmarkMaxSlots		64		// one per transaction label
+
+class IOFireWireLoopbackBenchmark;
+
+// IOFWBenchmarkTimeoutCommand
+//
+// a command that sends nothing and so only ever completes by timing out or being cancelled
+
+class IOFWBenchmarkTimeoutCommand : public IOFWCommand
+{
+    OSDeclareDefaultStructors(IOFWBenchmarkTimeoutCommand)
+
+protected:
+
+	IOFireWireLoopbackBenchmark *	fBenchmark;
+
+	virtual IOReturn execute( void );
+	virtual IOReturn complete( IOReturn status );
+
+public:
+
+	virtual bool init( IOFireWireController * control, IOFireWireLoopbackBenchmark * benchmark, UInt32 timeout );
+};
+
+class IOFireWireLoopbackBenchmark : public OSObject
+{
+    OSDeclareDefaultStructors(IOFireWireLoopbackBenchmark)
+
+public:
+
+	enum
+	{
+		kLoopbackBenchmarkAsync,
+		kLoopbackBenchmarkBusReset,
+		kLoopbackBenchmarkConfigDirectory,
+		kLoopbackBenchmarkCRC,
+		kLoopbackBenchmarkTimeout,
+		kLoopbackBenchmarkWindow,
+		kLoopbackBenchmarkPseudoAddress,
+		kLoopbackBenchmarkRequest
+	};
+
+protected:
+
+	enum
+	{
+		kBenchmarkReadQuad,
+		kBenchmarkRead,
+		kBenchmarkWriteQuad,
+		kBenchmarkWrite,
+		kBenchmarkCompareAndSwap,
+		kBenchmarkCommandCount
+	};
+
+	struct BenchmarkSlot
+	{
+		IOFireWireLoopbackBenchmark *	fBenchmark;
+		IOFWAsyncCommand *				fCommand;
+		IOBufferMemoryDescriptor *		fBuffer;
+		UInt32							fQuads[2];
+		UInt32							fAddressLo;
+		UInt64							fStart;
+	};
+
+	IOFireWireLoopbackLink *	fLink;
+	IOFireWireController *		fControl;
+	UInt32						fKind;
+
+	UInt32						fIterations;
+	UInt16						fNodeID;
+	OSArray *					fSizes;
+	OSArray *					fSpeeds;
+	OSArray *					fConcurrency;
+
+	OSArray *					fTopologies;
+	OSArray *					fNodeCounts;
+	UInt32						fResets;
+
+	OSArray *					fEntryCounts;
+
+	UInt32						fTimeout;
+
+	OSArray *					fWindows;
+
+	OSArray *					fBatchResponses;
+
+	// state of the current run, touched on the workloop only
+	UInt32						fType;
+	UInt32						fSize;
+	int							fSpeed;
+	UInt32						fWindow;
+	UInt32						fGeneration;
+	BenchmarkSlot				fSlots[kLoopbackBenchmarkMaxSlots];
+	UInt32						fSlotCount;
+	UInt32						fIssued;
+	UInt32						fCompleted;
+	UInt32						fErrors;
+	UInt32						fOutstanding;
+	UInt32						fCancelled;
+	UInt32						fExpired;
+	UInt64 *					fLatencies;
+	IOFWSyncer *				fSyncer;
+	IOBufferMemoryDescriptor *	fRequestBuffer;
+	FWAddress					fRequestAddress;
+	UInt64						fEnd;
+
+	OSArray *					fResults;
+
+	virtual void free( void );
+
+	static OSArray * createDefaultArray( const UInt32 * values, UInt32 count );
+	static OSArray * copyArrayParam( OSDictionary * params, const char * key, const UInt32 * values, UInt32 count );
+	static void setNumber( OSDictionary * dict, const char * key, UInt64 value );
+	static int compareLatencies( const void * a, const void * b );
+
+	bool createSlots( void );
+	void destroySlots( void );
+	IOReturn submitSlot( BenchmarkSlot * slot );
+	void slotComplete( BenchmarkSlot * slot, IOReturn status );
+	static void slotCompletion( void * refcon, IOReturn status, IOFireWireNub * device, IOFWCommand * fwCmd );
+
+	IOReturn runOne( UInt32 type, UInt32 size, int speed, UInt32 concurrency );
+
+	IOReturn runAsync( void );
+	IOReturn runWindows( void );
+	IOReturn runBusResets( void );
+	IOReturn runBusReset( UInt32 topology, UInt32 nodes, UInt32 run );
+
+	IOFireWireDevice * copyNodeDevice( void );
+	IOConfigDirectory * copyNodeDirectory( IOFireWireDevice * device, UInt32 entries );
+	UInt64 timeLookups( IOConfigDirectory * directory, UInt32 keys, UInt32 passes );
+	IOReturn runConfigDirectories( void );
+	IOReturn runConfigDirectory( UInt32 entries );
+
+	IOReturn runCRCs( void );
+	IOReturn runCRC( UInt32 * buffer, UInt32 quads );
+
+	IOReturn runTimeouts( void );
+	IOReturn runTimeout( UInt32 count );
+	void timeoutComplete( IOFWBenchmarkTimeoutCommand * cmd, IOReturn status );
+
+	IOReturn runPseudoAddresses( void );
+	IOReturn runPseudoAddress( UInt32 count );
+
+	IOReturn runRequests( void );
+	IOReturn runRequest( UInt32 size, UInt32 concurrency, bool batch );
+	IOReturn submitRequest( void );
+	static void requestResponse( void * refcon, UInt32 phy, int rcode );
+
+	friend class IOFWBenchmarkTimeoutCommand;
+
+public:
+
+	static IOFireWireLoopbackBenchmark * create( IOFireWireLoopbackLink * link, UInt32 kind, OSDictionary * params );
+
+	virtual bool init( IOFireWireLoopbackLink * link, UInt32 kind, OSDictionary * params );
+
+	// runs the whole sweep, blocking, from a thread that is not the workloop
+	IOReturn run( void );
+
+	OSArray * getResults( void )
+		{ return fResults; };
+
+	IOFireWireLoopbackLink * getLink( void )
+		{ return fLink; };
+
+	UInt32 getKind( void )
+		{ return fKind; };
+};
+
+#endif /* ! _IOKIT_IOFIREWIRELOOPBACKBENCHMARK_H */
@@ -0,0 +1,2252 @@
+/*
+ * Copyright (c) 1998-2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  IOFireWireLoopbackLink.cpp
+ *  IOFireWireFamily
+ *
+ */
+
+#import "IOFireWireLoopbackLink.h"
+#import "IOFireWireLoopbackBenchmark.h"
+#import "FWDebugging.h"
+
+// public
+#import <IOKit/firewire/IOFWCommand.h>
+#import <IOKit/firewire/IOFWUtils.h>
+#import <IOKit/firewire/IOFWWorkLoop.h>
+
+// system
+#import <IOKit/IOUserClient.h>
+#import <IOKit/IOTimerEventSource.h>
+#import <IOKit/IOMemoryDescriptor.h>
+#import <IOKit/pwr_mgt/RootDomain.h>
+
+#define super IOFireWireLink
+
+OSDefineMetaClassAndStructors( IOFireWireLoopbackLink, IOFireWireLink )
+
+#define kLoopbackDefaultNodes			2
+#define kLoopbackDefaultGUIDBase		0x0000000000010000ULL
+#define kLoopbackMaxSendLog				11						// 2048 byte payloads
+#define kLoopbackMaxRec					0xA						// 2048 byte payloads
+#define kLoopbackCyclesPerSecond		8000
+#define kLoopbackNSPerCycle				125000
+#define kLoopbackCycleOffsetsPerCycle	3072
+#define kLoopbackDCLMaxSteps			256						// DCLs run looking for a packet each cycle
+
+static IOPMPowerState sLoopbackPowerStates[] =
+{
+	{ kIOPMPowerStateVersion1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ kIOPMPowerStateVersion1, 0, 0, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ kIOPMPowerStateVersion1, kIOPMDeviceUsable, kIOPMPowerOn, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+// readBusOrder
+//
+// read a big endian value of width 4 or 8 bytes
+
+static inline UInt64 readBusOrder( const UInt8 * bytes, int width )
+{
+	UInt64 value = 0;
+	for( int i = 0; i < width; i++ )
+		value = (value << 8) | bytes[i];
+
+	return value;
+}
+
+// writeBusOrder
+//
+//
+
+static inline void writeBusOrder( UInt8 * bytes, int width, UInt64 value )
+{
+	for( int i = width - 1; i >= 0; i-- )
+	{
+		bytes[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+// readLittleEndian
+//
+//
+
+static inline UInt64 readLittleEndian( const UInt8 * bytes, int width )
+{
+	UInt64 value = 0;
+	for( int i = width - 1; i >= 0; i-- )
+		value = (value << 8) | bytes[i];
+
+	return value;
+}
+
+// writeLittleEndian
+//
+//
+
+static inline void writeLittleEndian( UInt8 * bytes, int width, UInt64 value )
+{
+	for( int i = 0; i < width; i++ )
+	{
+		bytes[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+#pragma mark -
+
+// probe
+//
+// only run when asked for on the boot-args
+
+IOService * IOFireWireLoopbackLink::probe( IOService * provider, SInt32 * score )
+{
+	UInt32 nodes = 0;
+
+	if( !PE_parse_boot_argn( "fwloopback", &nodes, sizeof(nodes) ) )
+		return NULL;
+
+	return super::probe( provider, score );
+}
+
+// start
+//
+//
+
+bool IOFireWireLoopbackLink::start( IOService * provider )
+{
+	if( !super::start( provider ) )
+		return false;
+
+	UInt32 nodes = 0;
+	PE_parse_boot_argn( "fwloopback", &nodes, sizeof(nodes) );
+	if( nodes == 0 )
+		nodes = getNumberProperty( "LoopbackNodes", kLoopbackDefaultNodes );
+	if( nodes > kLoopbackMaxNodes )
+		nodes = kLoopbackMaxNodes;
+
+	fLatencyNS = getNumberProperty( "LoopbackLatency", 0 ) * 1000;
+	fBusyPercent = getNumberProperty( "LoopbackBusyPercent", 0 );
+	fUnifiedWrites = (getNumberProperty( "LoopbackUnifiedWrites", 0 ) != 0);
+	fBatchResponses = true;
+	fUnitSpecID = getNumberProperty( "LoopbackUnitSpecID", 0 ) & 0x00ffffff;
+	fUnitSWVersion = getNumberProperty( "LoopbackUnitSWVersion", 0 ) & 0x00ffffff;
+	fVendorEntries = getNumberProperty( "LoopbackVendorEntries", 0 );
+	if( fVendorEntries > kLoopbackMaxVendorEntries )
+		fVendorEntries = kLoopbackMaxVendorEntries;
+
+	fTopology = kLoopbackTopologyChain;
+	OSString * topology = OSDynamicCast( OSString, getProperty( "LoopbackTopology" ) );
+	if( topology && topology->isEqualTo( "Star" ) )
+		fTopology = kLoopbackTopologyStar;
+	else if( topology && topology->isEqualTo( "Tree" ) )
+		fTopology = kLoopbackTopologyTree;
+
+	if( fTopology == kLoopbackTopologyChain && nodes > kLoopbackMaxChainNodes )
+		nodes = kLoopbackMaxChainNodes;
+
+	fHubPorts = getNumberProperty( "LoopbackHubPorts", kLoopbackDefaultHubPorts );
+	if( fHubPorts < 3 )
+		fHubPorts = 3;
+	if( fHubPorts > kLoopbackMaxPorts )
+		fHubPorts = kLoopbackMaxPorts;
+
+	fGUID = kLoopbackDefaultGUIDBase;
+	OSNumber * guid_number = OSDynamicCast( OSNumber, getProperty( "LoopbackGUIDBase" ) );
+	if( guid_number )
+		fGUID = guid_number->unsigned64BitValue();
+
+	fGapCount = 0x3f;
+	fContender = true;
+	fRandom = 1;
+	fStartTime = now();
+
+	// every node the bus can be resized to, memory is allocated on first use
+	fNodes = (LoopbackNode*)IOMalloc( sizeof(LoopbackNode) * kLoopbackMaxNodes );
+	if( fNodes == NULL )
+		return false;
+
+	bzero( fNodes, sizeof(LoopbackNode) * kLoopbackMaxNodes );
+	fNodeCount = nodes;
+
+	for( UInt32 i = 0; i < kLoopbackMaxNodes; i++ )
+	{
+		LoopbackNode * node = &fNodes[i];
+
+		node->fGUID = fGUID + 1 + i;
+		buildNodeROM( node );
+	}
+
+	fWorkLoop = createWorkLoop();
+	if( fWorkLoop == NULL )
+		return false;
+
+	fEventTimer = IOTimerEventSource::timerEventSource( this, eventTimerFired );
+	if( fEventTimer == NULL )
+		return false;
+
+	if( fWorkLoop->addEventSource( fEventTimer ) != kIOReturnSuccess )
+		return false;
+
+	fIsochPrograms = OSArray::withCapacity( 4 );
+	if( fIsochPrograms == NULL )
+		return false;
+
+	fIsochTimer = IOTimerEventSource::timerEventSource( this, isochTimerFired );
+	if( fIsochTimer == NULL )
+		return false;
+
+	if( fWorkLoop->addEventSource( fIsochTimer ) != kIOReturnSuccess )
+		return false;
+
+	fControl = createController();
+	if( fControl == NULL )
+		return false;
+
+	if( !fControl->attach( this ) )
+		return false;
+
+	if( !fControl->start( this ) )
+	{
+		fControl->detach( this );
+		return false;
+	}
+
+	DebugLog( "IOFireWireLoopbackLink::start - %u simulated nodes\n", (uint32_t)fNodeCount );
+
+	return true;
+}
+
+// stop
+//
+//
+
+void IOFireWireLoopbackLink::stop( IOService * provider )
+{
+	fInterruptsEnabled = false;
+
+	if( fEventTimer )
+		fEventTimer->cancelTimeout();
+
+	if( fIsochTimer )
+		fIsochTimer->cancelTimeout();
+
+	flushEvents( false );
+
+	super::stop( provider );
+}
+
+// free
+//
+//
+
+void IOFireWireLoopbackLink::free( void )
+{
+	flushEvents( false );
+
+	if( fControl )
+	{
+		fControl->release();
+		fControl = NULL;
+	}
+
+	if( fEventTimer )
+	{
+		if( fWorkLoop )
+			fWorkLoop->removeEventSource( fEventTimer );
+
+		fEventTimer->release();
+		fEventTimer = NULL;
+	}
+
+	if( fIsochTimer )
+	{
+		if( fWorkLoop )
+			fWorkLoop->removeEventSource( fIsochTimer );
+
+		fIsochTimer->release();
+		fIsochTimer = NULL;
+	}
+
+	if( fIsochPrograms )
+	{
+		fIsochPrograms->release();
+		fIsochPrograms = NULL;
+	}
+
+	if( fWorkLoop )
+	{
+		fWorkLoop->release();
+		fWorkLoop = NULL;
+	}
+
+	if( fNodes )
+	{
+		for( UInt32 i = 0; i < kLoopbackMaxNodes; i++ )
+		{
+			if( fNodes[i].fMemory )
+				IOFree( fNodes[i].fMemory, kLoopbackNodeMemorySize );
+		}
+
+		IOFree( fNodes, sizeof(LoopbackNode) * kLoopbackMaxNodes );
+		fNodes = NULL;
+		fNodeCount = 0;
+	}
+
+	super::free();
+}
+
+// setProperties
+//
+// starts a benchmark run on its own thread, the commands can't be waited on from here.
+// only administrators get to tie up a kernel thread and the workloop
+
+IOReturn IOFireWireLoopbackLink::setProperties( OSObject * properties )
+{
+	OSDictionary * dict = OSDynamicCast( OSDictionary, properties );
+	if( dict == NULL )
+		return kIOReturnUnsupported;
+
+	if( IOUserClient::clientHasPrivilege( current_task(), kIOClientPrivilegeAdministrator ) != kIOReturnSuccess )
+		return kIOReturnNotPrivileged;
+
+	UInt32 kind = IOFireWireLoopbackBenchmark::kLoopbackBenchmarkAsync;
+	OSDictionary * params = OSDynamicCast( OSDictionary, dict->getObject( "LoopbackBenchmark" ) );
+	if( params == NULL )
+	{
+		kind = IOFireWireLoopbackBenchmark::kLoopbackBenchmarkBusReset;
+		params = OSDynamicCast( OSDictionary, dict->getObject( "LoopbackResetBenchmark" ) );
+	}
+
+	if( params == NULL )
+	{
+		kind = IOFireWireLoopbackBenchmark::kLoopbackBenchmarkConfigDirectory;
+		params = OSDynamicCast( OSDictionary, dict->getObject( "LoopbackDirectoryBenchmark" ) );
+	}
+
+	if( params == NULL )
+	{
+		kind = IOFireWireLoopbackBenchmark::kLoopbackBenchmarkCRC;
+		params = OSDynamicCast( OSDictionary, dict->getObject( "LoopbackCRCBenchmark" ) );
+	}
+
+	if( params == NULL )
+	{
+		kind = IOFireWireLoopbackBenchmark::kLoopbackBenchmarkTimeout;
+		params = OSDynamicCast( OSDictionary, dict->getObject( "LoopbackTimeoutBenchmark" ) );
+	}
+
+	if( params == NULL )
+	{
+		kind = IOFireWireLoopbackBenchmark::kLoopbackBenchmarkWindow;
+		params = OSDynamicCast( OSDictionary, dict->getObject( "LoopbackWindowBenchmark" ) );
+	}
+
+	if( params == NULL )
+	{
+		kind = IOFireWireLoopbackBenchmark::kLoopbackBenchmarkPseudoAddress;
+		params = OSDynamicCast( OSDictionary, dict->getObject( "LoopbackPseudoAddressBenchmark" ) );
+	}
+
+	if( params == NULL )
+	{
+		kind = IOFireWireLoopbackBenchmark::kLoopbackBenchmarkRequest;
+		params = OSDynamicCast( OSDictionary, dict->getObject( "LoopbackRequestBenchmark" ) );
+	}
+
+	if( params == NULL )
+		return kIOReturnUnsupported;
+
+	if( fControl == NULL )
+		return kIOReturnNoDevice;
+
+	fControl->closeGate();
+
+	IOReturn status = kIOReturnSuccess;
+	if( fBenchmarkRunning )
+		status = kIOReturnBusy;
+
+	IOFireWireLoopbackBenchmark * benchmark = NULL;
+	if( status == kIOReturnSuccess )
+	{
+		benchmark = IOFireWireLoopbackBenchmark::create( this, kind, params );
+		if( benchmark == NULL )
+			status = kIOReturnNoMemory;
+	}
+
+	if( status == kIOReturnSuccess )
+	{
+		thread_t thread;
+		if( kernel_thread_start( (thread_continue_t)benchmarkThread, benchmark, &thread ) == KERN_SUCCESS )
+		{
+			fBenchmarkRunning = true;
+			removeProperty( benchmarkResultsKey( kind ) );
+			thread_deallocate( thread );
+		}
+		else
+		{
+			benchmark->release();
+			status = kIOReturnNoResources;
+		}
+	}
+
+	fControl->openGate();
+
+	return status;
+}
+
+// benchmarkResultsKey
+//
+//
+
+const char * IOFireWireLoopbackLink::benchmarkResultsKey( UInt32 kind )
+{
+	if( kind == IOFireWireLoopbackBenchmark::kLoopbackBenchmarkBusReset )
+		return "LoopbackResetBenchmarkResults";
+
+	if( kind == IOFireWireLoopbackBenchmark::kLoopbackBenchmarkConfigDirectory )
+		return "LoopbackDirectoryBenchmarkResults";
+
+	if( kind == IOFireWireLoopbackBenchmark::kLoopbackBenchmarkCRC )
+		return "LoopbackCRCBenchmarkResults";
+
+	if( kind == IOFireWireLoopbackBenchmark::kLoopbackBenchmarkTimeout )
+		return "LoopbackTimeoutBenchmarkResults";
+
+	if( kind == IOFireWireLoopbackBenchmark::kLoopbackBenchmarkWindow )
+		return "LoopbackWindowBenchmarkResults";
+
+	if( kind == IOFireWireLoopbackBenchmark::kLoopbackBenchmarkPseudoAddress )
+		return "LoopbackPseudoAddressBenchmarkResults";
+
+	if( kind == IOFireWireLoopbackBenchmark::kLoopbackBenchmarkRequest )
+		return "LoopbackRequestBenchmarkResults";
+
+	return "LoopbackBenchmarkResults";
+}
+
+// benchmarkThread
+//
+// the benchmark holds a reference on the link until it is released here
+
+void IOFireWireLoopbackLink::benchmarkThread( void * arg )
+{
+	IOFireWireLoopbackBenchmark * benchmark = (IOFireWireLoopbackBenchmark*)arg;
+	IOFireWireLoopbackLink * me = benchmark->getLink();
+
+	IOReturn status = benchmark->run();
+	if( status != kIOReturnSuccess )
+		IOLog( "IOFireWireLoopbackLink::benchmarkThread - benchmark failed 0x%08x\n", status );
+
+	me->fControl->closeGate();
+	me->setProperty( benchmarkResultsKey( benchmark->getKind() ), benchmark->getResults() );
+	me->fBenchmarkRunning = false;
+	me->fControl->openGate();
+
+	benchmark->release();
+}
+
+// getNumberProperty
+//
+//
+
+UInt32 IOFireWireLoopbackLink::getNumberProperty( const char * key, UInt32 defaultValue )
+{
+	OSNumber * number = OSDynamicCast( OSNumber, getProperty( key ) );
+	if( number == NULL )
+		return defaultValue;
+
+	return number->unsigned32BitValue();
+}
+
+// buildNodeROM
+//
+// bus info block, a root directory, optionally one unit directory and optionally a
+// node dependent info directory of fVendorEntries entries. that directory is for timing
+// key lookups, its immediate entries come first and the offset entries, keys 0 through
+// 63 at most, are at the end where a scan for them finds them last
+
+void IOFireWireLoopbackLink::buildNodeROM( LoopbackNode * node )
+{
+	UInt32 * rom = node->fROM;
+	UInt32 vendor = (node->fGUID >> 40) & 0x00ffffff;
+	bool unit = (fUnitSpecID != 0) || (fUnitSWVersion != 0);
+	UInt32 quads = 0;
+
+	// bus info block
+	quads++;	// header filled in last
+	rom[quads++] = OSSwapHostToBigInt32( kFWBIBBusName );
+	rom[quads++] = OSSwapHostToBigInt32( (100 << kFWBIBCycClkAccPhase) |
+										 (kLoopbackMaxRec << kFWBIBMaxRecPhase) |
+										 (kFWSpeed400MBit << kFWBIBLinkSpeedPhase) );
+	rom[quads++] = OSSwapHostToBigInt32( node->fGUID >> 32 );
+	rom[quads++] = OSSwapHostToBigInt32( node->fGUID & 0xffffffff );
+
+	// root directory
+	UInt32 root = quads++;
+	rom[quads++] = OSSwapHostToBigInt32( (kConfigModuleVendorIdKey << kConfigEntryKeyValuePhase) | vendor );
+	rom[quads++] = OSSwapHostToBigInt32( (kConfigNodeCapabilitiesKey << kConfigEntryKeyValuePhase) | 0x0083c0 );
+	rom[quads++] = OSSwapHostToBigInt32( (kConfigModelIdKey << kConfigEntryKeyValuePhase) | 0x000001 );
+	
+	// the directory entries are the last in the root directory, their offsets are filled in below
+	UInt32 unit_entry = 0;
+	if( unit )
+		unit_entry = quads++;
+	
+	UInt32 vendor_entry = 0;
+	if( fVendorEntries )
+		vendor_entry = quads++;
+	
+	UInt32 root_end = quads;
+
+	if( unit )
+	{
+		UInt32 unit_dir = quads++;
+		rom[quads++] = OSSwapHostToBigInt32( (kConfigUnitSpecIdKey << kConfigEntryKeyValuePhase) | fUnitSpecID );
+		rom[quads++] = OSSwapHostToBigInt32( (kConfigUnitSwVersionKey << kConfigEntryKeyValuePhase) | fUnitSWVersion );
+		rom[unit_dir] = OSSwapHostToBigInt32( ((quads - unit_dir - 1) << kConfigLeafDirLengthPhase) |
+											  FWComputeCRC16( &rom[unit_dir + 1], quads - unit_dir - 1 ) );
+		
+		rom[unit_entry] = OSSwapHostToBigInt32( (((kConfigDirectoryKeyType << kConfigEntryKeyTypePhase) | kConfigUnitDirectoryKey) << kConfigEntryKeyValuePhase) |
+												(unit_dir - unit_entry) );
+	}
+
+	if( fVendorEntries )
+	{
+		UInt32 offsets = (fVendorEntries < 64) ? fVendorEntries : 64;
+		UInt32 vendor_dir = quads++;
+		for( UInt32 i = 0; i < fVendorEntries; i++ )
+		{
+			if( i < fVendorEntries - offsets )
+			{
+				rom[quads++] = OSSwapHostToBigInt32( ((i & 0x3f) << kConfigEntryKeyValuePhase) | i );
+			}
+			else
+			{
+				UInt32 key = i - (fVendorEntries - offsets);
+				rom[quads++] = OSSwapHostToBigInt32( (((kConfigOffsetKeyType << kConfigEntryKeyTypePhase) | key) << kConfigEntryKeyValuePhase) | 
+													 (key * sizeof(UInt32)) );
+			}
+		}
+		rom[vendor_dir] = OSSwapHostToBigInt32( ((quads - vendor_dir - 1) << kConfigLeafDirLengthPhase) |
+												FWComputeCRC16( &rom[vendor_dir + 1], quads - vendor_dir - 1 ) );
+		
+		rom[vendor_entry] = OSSwapHostToBigInt32( (((kConfigDirectoryKeyType << kConfigEntryKeyTypePhase) | kConfigNodeDependentInfoKey) << kConfigEntryKeyValuePhase) |
+												  (vendor_dir - vendor_entry) );
+	}
+
+	rom[root] = OSSwapHostToBigInt32( ((root_end - root - 1) << kConfigLeafDirLengthPhase) |
+									  FWComputeCRC16( &rom[root + 1], root_end - root - 1 ) );
+
+	rom[0] = OSSwapHostToBigInt32( (4 << kConfigBusInfoBlockLengthPhase) |
+								   ((quads - 1) << kConfigROMCRCLengthPhase) |
+								   FWComputeCRC16( &rom[1], quads - 1 ) );
+
+	node->fROMQuads = quads;
+}
+
+// buildSelfIDs
+//
+// the local node is the root, with the first simulated node on its only port. each
+// simulated node has its parent on port 0 and up to fanout children on the ports after
+// it. self IDs come out children first in port order, which is how phy ids are numbered
+
+void IOFireWireLoopbackLink::buildSelfIDs( void )
+{
+	UInt32 fanout = 1;
+	if( fTopology == kLoopbackTopologyStar )
+	{
+		// one hub with everybody on it, until it runs out of ports and its children become hubs
+		fanout = (fNodeCount > 1) ? (fNodeCount - 1) : 1;
+		if( fanout > kLoopbackMaxPorts - 1 )
+			fanout = kLoopbackMaxPorts - 1;
+	}
+	else if( fTopology == kLoopbackTopologyTree )
+	{
+		fanout = fHubPorts - 1;
+	}
+
+	// nodes are numbered breadth first in the tree, position maps phy id to that number
+	UInt8 position[kLoopbackMaxNodes];
+	UInt32 next_phy = 0;
+	if( fNodeCount > 0 )
+		assignPhys( 0, fanout, &next_phy, position );
+
+	fSelfIDCount = 0;
+
+	for( UInt32 phy = 0; phy < fNodeCount; phy++ )
+	{
+		UInt32 first_child = (position[phy] * fanout) + 1;
+		UInt32 children = 0;
+		if( first_child < fNodeCount )
+			children = ((fNodeCount - first_child) < fanout) ? (fNodeCount - first_child) : fanout;
+
+		// hubs have all their ports whether they are used or not
+		UInt32 ports = (children > 0 && fanout > 1) ? (fanout + 1) : 2;
+
+		fSelfIDCount += buildNodeSelfIDs( phy, ports, children, &fSelfIDs[2 * fSelfIDCount] );
+	}
+
+	UInt32 id = (kFWSelfIDPacketID << kFWPhyPacketIDPhase) |
+				(fNodeCount << kFWSelfIDPhyIDPhase) |
+				kFWSelfID0L |
+				(fGapCount << kFWSelfID0GapCntPhase) |
+				(kFWSpeed400MBit << kFWSelfID0SPPhase) |
+				(kFWSelfIDSelfPowered15W << kFWSelfID0PwrPhase) |
+				((fNodeCount > 0 ? kFWSelfIDPortStatusChild : kFWSelfIDPortStatusNotConnected) << kFWSelfID0P0Phase) |
+				(kFWSelfIDPortStatusNotConnected << kFWSelfID0P1Phase) |
+				(kFWSelfIDPortStatusNotPresent << kFWSelfID0P2Phase);
+
+	if( fContender )
+		id |= kFWSelfID0C;
+
+	fOwnIDs[0] = OSSwapHostToBigInt32( id );
+	fOwnIDs[1] = OSSwapHostToBigInt32( ~id );
+}
+
+// assignPhys
+//
+// children first, in port order
+
+void IOFireWireLoopbackLink::assignPhys( UInt32 position, UInt32 fanout, UInt32 * nextPhy, UInt8 * positions )
+{
+	for( UInt32 i = 1; i <= fanout; i++ )
+	{
+		UInt32 child = (position * fanout) + i;
+		if( child >= fNodeCount )
+			break;
+
+		assignPhys( child, fanout, nextPhy, positions );
+	}
+
+	positions[(*nextPhy)++] = position;
+}
+
+// buildNodeSelfIDs
+//
+// port 0 is the parent, the next children ports are children and the rest are unconnected.
+// ports past the first three go in extended self ID packets, returns the number of packets
+
+UInt32 IOFireWireLoopbackLink::buildNodeSelfIDs( UInt32 phy, UInt32 ports, UInt32 children, UInt32 * ids )
+{
+	UInt32 packets = 0;
+	UInt32 port = 0;
+
+	while( port < ports )
+	{
+		UInt32 id = (kFWSelfIDPacketID << kFWPhyPacketIDPhase) | (phy << kFWSelfIDPhyIDPhase);
+		UInt32 packet_ports;
+		UInt32 phase;
+
+		if( packets == 0 )
+		{
+			id |= kFWSelfID0L |
+				  (fGapCount << kFWSelfID0GapCntPhase) |
+				  (kFWSpeed400MBit << kFWSelfID0SPPhase) |
+				  (kFWSelfIDNoPower << kFWSelfID0PwrPhase);
+			packet_ports = 3;
+			phase = kFWSelfID0P0Phase;
+		}
+		else
+		{
+			id |= kFWSelfIDPacketType | ((packets - 1) << kFWSelfIDNNPhase);
+			packet_ports = 8;
+			phase = kFWSelfIDNPaPhase;
+		}
+
+		for( UInt32 i = 0; i < packet_ports; i++, port++, phase -= 2 )
+		{
+			UInt32 status = kFWSelfIDPortStatusNotPresent;
+			if( port == 0 )
+				status = kFWSelfIDPortStatusParent;
+			else if( port <= children )
+				status = kFWSelfIDPortStatusChild;
+			else if( port < ports )
+				status = kFWSelfIDPortStatusNotConnected;
+
+			id |= status << phase;
+		}
+
+		if( port < ports )
+			id |= kFWSelfIDMore;
+
+		ids[2 * packets] = OSSwapHostToBigInt32( id );
+		ids[2 * packets + 1] = OSSwapHostToBigInt32( ~id );
+		packets++;
+	}
+
+	return packets;
+}
+
+// setTopology
+//
+// resizes and reshapes the simulated bus, the change is seen after the bus reset it causes.
+// a chain longer than 16 hops isn't a legal bus
+
+IOReturn IOFireWireLoopbackLink::setTopology( UInt32 topology, UInt32 nodes )
+{
+	if( topology > kLoopbackTopologyTree || nodes > kLoopbackMaxNodes )
+		return kIOReturnBadArgument;
+
+	if( topology == kLoopbackTopologyChain && nodes > kLoopbackMaxChainNodes )
+		return kIOReturnBadArgument;
+
+	fControl->closeGate();
+
+	fTopology = topology;
+	fNodeCount = nodes;
+	resetBus();
+
+	fControl->openGate();
+
+	return kIOReturnSuccess;
+}
+
+// setVendorEntries
+//
+// rebuilds every node's ROM, the reset gets the controller to read them again
+
+IOReturn IOFireWireLoopbackLink::setVendorEntries( UInt32 entries )
+{
+	if( entries > kLoopbackMaxVendorEntries )
+		return kIOReturnBadArgument;
+
+	fControl->closeGate();
+
+	fVendorEntries = entries;
+	for( UInt32 i = 0; i < kLoopbackMaxNodes; i++ )
+	{
+		buildNodeROM( &fNodes[i] );
+	}
+
+	resetBus();
+
+	fControl->openGate();
+
+	return kIOReturnSuccess;
+}
+
+#pragma mark -
+
+// setLinkPowerState
+//
+//
+
+IOReturn IOFireWireLoopbackLink::setLinkPowerState( unsigned long powerStateOrdinal )
+{
+	return IOPMAckImplied;
+}
+
+// getPowerStateTable
+//
+//
+
+IOPMPowerState * IOFireWireLoopbackLink::getPowerStateTable( unsigned long * numberOfStates )
+{
+	*numberOfStates = sizeof(sLoopbackPowerStates) / sizeof(IOPMPowerState);
+	return sLoopbackPowerStates;
+}
+
+// enableAllInterrupts
+//
+// nothing is delivered to the controller until it asks for it
+
+void IOFireWireLoopbackLink::enableAllInterrupts( void )
+{
+	fInterruptsEnabled = true;
+	armEventTimer();
+}
+
+// handleInterrupts
+//
+//
+
+void IOFireWireLoopbackLink::handleInterrupts( IOInterruptEventSource *, int count )
+{
+	processEvents();
+}
+
+// setContender
+//
+//
+
+IOReturn IOFireWireLoopbackLink::setContender( bool state )
+{
+	fContender = state;
+	return kIOReturnSuccess;
+}
+
+// setRootHoldOff
+//
+// we are always root
+
+IOReturn IOFireWireLoopbackLink::setRootHoldOff( bool state )
+{
+	return kIOReturnSuccess;
+}
+
+// setCycleMaster
+//
+//
+
+IOReturn IOFireWireLoopbackLink::setCycleMaster( bool state )
+{
+	return kIOReturnSuccess;
+}
+
+// sendPHYPacket
+//
+// only gap count changes mean anything to the simulated bus
+
+IOReturn IOFireWireLoopbackLink::sendPHYPacket( UInt32 quad )
+{
+	if( ((quad & kFWPhyPacketID) >> kFWPhyPacketIDPhase) == kFWConfigurationPacketID )
+	{
+		if( quad & kFWPhyConfigurationT )
+			fGapCount = (quad & kFWPhyConfigurationGapCnt) >> kFWPhyConfigurationGapCntPhase;
+	}
+
+	return kIOReturnSuccess;
+}
+
+// asyncPHYPacket
+//
+//
+
+IOReturn IOFireWireLoopbackLink::asyncPHYPacket( UInt32 data, UInt32 data2, IOFWAsyncPHYCommand * cmd )
+{
+	sendPHYPacket( data );
+
+	return queueAck( cmd, kFWAckComplete );
+}
+
+// resetBus
+//
+//
+
+IOReturn IOFireWireLoopbackLink::resetBus( bool useIBR )
+{
+	if( !fBusResetPending )
+	{
+		LoopbackEvent * event = allocEvent( kLoopbackEventBusReset, 0 );
+		if( event == NULL )
+			return kIOReturnNoMemory;
+
+		fBusResetPending = true;
+		queueEvent( event, 0 );
+	}
+
+	return kIOReturnSuccess;
+}
+
+#pragma mark -
+
+// nodeForID
+//
+//
+
+IOFireWireLoopbackLink::LoopbackNode * IOFireWireLoopbackLink::nodeForID( UInt16 nodeID )
+{
+	if( (nodeID & kFWAddressBusID) != kFWLocalBusAddress )
+		return NULL;
+
+	UInt32 phy = nodeID & kFWMaxNodesPerBus;
+	if( phy >= fNodeCount )
+		return NULL;
+
+	return &fNodes[phy];
+}
+
+// nodeIsBusy
+//
+// deterministic, so a run with the same settings sees the same busy acks
+
+bool IOFireWireLoopbackLink::nodeIsBusy( void )
+{
+	if( fBusyPercent == 0 )
+		return false;
+
+	fRandom = (fRandom * 1103515245) + 12345;
+
+	return (((fRandom >> 16) % 100) < fBusyPercent);
+}
+
+// nodeMemory
+//
+// reads of memory that was never written see zeros
+
+UInt8 * IOFireWireLoopbackLink::nodeMemory( LoopbackNode * node )
+{
+	if( node->fMemory == NULL )
+	{
+		node->fMemory = (UInt8*)IOMalloc( kLoopbackNodeMemorySize );
+		if( node->fMemory )
+			bzero( node->fMemory, kLoopbackNodeMemorySize );
+	}
+
+	return node->fMemory;
+}
+
+// readNode
+//
+//
+
+UInt32 IOFireWireLoopbackLink::readNode( LoopbackNode * node, UInt16 addrHi, UInt32 addrLo, UInt32 * buffer, int size )
+{
+	if( addrHi == kCSRRegisterSpaceBaseAddressHi && addrLo >= kConfigROMBaseAddress )
+	{
+		UInt32 offset = addrLo - kConfigROMBaseAddress;
+
+		if( (offset & 3) || (offset + size) > (node->fROMQuads * sizeof(UInt32)) )
+			return kFWResponseAddressError;
+
+		bcopy( (UInt8*)node->fROM + offset, buffer, size );
+		return kFWResponseComplete;
+	}
+
+	if( addrHi == 0 && addrLo < kLoopbackNodeMemorySize && size <= (int)(kLoopbackNodeMemorySize - addrLo) )
+	{
+		if( node->fMemory )
+			bcopy( node->fMemory + addrLo, buffer, size );
+		else
+			bzero( buffer, size );
+
+		return kFWResponseComplete;
+	}
+
+	return kFWResponseAddressError;
+}
+
+// writeNode
+//
+//
+
+UInt32 IOFireWireLoopbackLink::writeNode( LoopbackNode * node, UInt16 addrHi, UInt32 addrLo, IOMemoryDescriptor * buf, IOByteCount offset, int size )
+{
+	if( addrHi == 0 && addrLo < kLoopbackNodeMemorySize && size <= (int)(kLoopbackNodeMemorySize - addrLo) )
+	{
+		UInt8 * memory = nodeMemory( node );
+		if( memory == NULL )
+			return kFWResponseConflictError;
+
+		buf->readBytes( offset, memory + addrLo, size );
+		return kFWResponseComplete;
+	}
+
+	return kFWResponseAddressError;
+}
+
+// lockNode
+//
+// the IEEE 1394 lock transactions, on quadlet or octlet aligned node memory
+
+UInt32 IOFireWireLoopbackLink::lockNode( LoopbackNode * node, UInt16 addrHi, UInt32 addrLo, int type, const UInt32 * operands, int size, UInt32 * oldValue, int * oldSize )
+{
+	bool has_arg = (type != kFWExtendedTCodeFetchAdd) && (type != kFWExtendedTCodeLittleAdd);
+	int width = has_arg ? (size / 2) : size;
+
+	if( width != 4 && width != 8 )
+		return kFWResponseTypeError;
+
+	if( addrHi != 0 || (addrLo & (width - 1)) || addrLo > (kLoopbackNodeMemorySize - width) )
+		return kFWResponseAddressError;
+
+	UInt8 * memory = nodeMemory( node );
+	if( memory == NULL )
+		return kFWResponseConflictError;
+
+	memory += addrLo;
+	const UInt8 * arg_bytes = (const UInt8*)operands;
+	const UInt8 * data_bytes = has_arg ? (arg_bytes + width) : arg_bytes;
+
+	bcopy( memory, oldValue, width );
+	*oldSize = width;
+
+	UInt64 old = readBusOrder( memory, width );
+	UInt64 arg = has_arg ? readBusOrder( arg_bytes, width ) : 0;
+	UInt64 data = readBusOrder( data_bytes, width );
+	UInt64 value;
+
+	switch( type )
+	{
+		case kFWExtendedTCodeMaskSwap:
+			value = (data & arg) | (old & ~arg);
+			break;
+
+		case kFWExtendedTCodeCompareSwap:
+			value = (old == arg) ? data : old;
+			break;
+
+		case kFWExtendedTCodeFetchAdd:
+			value = old + data;
+			break;
+
+		case kFWExtendedTCodeLittleAdd:
+			writeLittleEndian( memory, width, readLittleEndian( memory, width ) + readLittleEndian( data_bytes, width ) );
+			return kFWResponseComplete;
+
+		case kFWExtendedTCodeBoundedAdd:
+			value = (old != arg) ? (old + data) : old;
+			break;
+
+		case kFWExtendedTCodeWrapAdd:
+			value = (old != arg) ? (old + data) : data;
+			break;
+
+		default:
+			*oldSize = 0;
+			return kFWResponseTypeError;
+	}
+
+	writeBusOrder( memory, width, value );
+
+	return kFWResponseComplete;
+}
+
+// sendNodeRequest
+//
+// a request from a simulated node to the local node, it arrives after the link's latency.
+// called with the gate held, the payload is in bus order
+
+IOReturn IOFireWireLoopbackLink::sendNodeRequest( UInt32 phy, int tCode, UInt16 addrHi, UInt32 addrLo,
+												  const void * payload, int size, int extendedTCode )
+{
+	if( phy >= fNodeCount || size < 0 || size > (1 << kLoopbackMaxSendLog) )
+		return kIOReturnBadArgument;
+
+	UInt32 header_quads = 4;
+	UInt32 payload_quads = 0;
+
+	switch( tCode )
+	{
+		case kFWTCodeReadQuadlet:
+			header_quads = 3;
+			break;
+
+		case kFWTCodeWriteQuadlet:
+			if( size != 4 )
+				return kIOReturnBadArgument;
+			header_quads = 3;
+			payload_quads = 1;
+			break;
+
+		case kFWTCodeReadBlock:
+			break;
+
+		case kFWTCodeWriteBlock:
+		case kFWTCodeLock:
+			payload_quads = (size + 3) / 4;
+			break;
+
+		default:
+			return kIOReturnBadArgument;
+	}
+
+	LoopbackNode * node = &fNodes[phy];
+	if( node->fLabelsInUse == ~0ULL )
+		return kIOReturnNoResources;
+
+	LoopbackEvent * event = allocEvent( kLoopbackEventPacket, header_quads + payload_quads );
+	if( event == NULL )
+		return kIOReturnNoMemory;
+
+	UInt32 label = node->fNextLabel;
+	while( node->fLabelsInUse & (1ULL << label) )
+		label = (label + 1) % kFWAsynchTTotal;
+
+	node->fLabelsInUse |= (1ULL << label);
+	node->fNextLabel = (label + 1) % kFWAsynchTTotal;
+	node->fRequests++;
+
+	event->fPacket[0] = (getNodeID() << kFWAsynchDestinationIDPhase) |
+						(label << kFWAsynchTLabelPhase) |
+						(tCode << kFWPacketTCodePhase);
+	event->fPacket[1] = ((kFWLocalBusAddress | phy) << kFWAsynchSourceIDPhase) |
+						(addrHi << kFWAsynchDestinationOffsetHighPhase);
+	event->fPacket[2] = addrLo;
+
+	if( header_quads == 4 )
+		event->fPacket[3] = (size << kFWAsynchDataLengthPhase) | (extendedTCode << kFWAsynchExtendedTCodePhase);
+
+	if( payload_quads )
+		bcopy( payload, &event->fPacket[header_quads], size );
+
+	event->fSpeed = kFWSpeed400MBit;
+	queueEvent( event, fLatencyNS );
+
+	return kIOReturnSuccess;
+}
+
+// setNodeResponseHandler
+//
+// called with the gate held, the handler runs on the workloop for every response
+
+void IOFireWireLoopbackLink::setNodeResponseHandler( NodeResponseHandler handler, void * refcon )
+{
+	fResponseHandler = handler;
+	fResponseRefCon = refcon;
+}
+
+// nodeResponse
+//
+// responses for labels we didn't send, or lost to a bus reset, are dropped
+
+void IOFireWireLoopbackLink::nodeResponse( UInt16 nodeID, int label, int rcode )
+{
+	LoopbackNode * node = nodeForID( nodeID );
+	if( node == NULL || !(node->fLabelsInUse & (1ULL << label)) )
+		return;
+
+	node->fLabelsInUse &= ~(1ULL << label);
+	node->fResponses++;
+	if( rcode != kFWResponseComplete )
+		node->fErrors++;
+
+	if( fResponseHandler )
+		(*fResponseHandler)( fResponseRefCon, (UInt32)(node - fNodes), rcode );
+}
+
+#pragma mark -
+
+// asyncRead
+//
+//
+
+IOReturn IOFireWireLoopbackLink::asyncRead( UInt16 nodeID, UInt16 addrHi, UInt32 addrLo,
+											int speed, int label, int size, IOFWAsyncCommand * cmd,
+											IOFWReadFlags flags )
+{
+	fPacketCount++;
+
+	LoopbackNode * node = nodeForID( nodeID );
+	if( node == NULL )
+	{
+		return queueAck( cmd, kFWAckTimeout );
+	}
+
+	if( nodeIsBusy() )
+	{
+		return queueAck( cmd, kFWAckBusyX );
+	}
+
+	bool quad = (size == 4) && !(flags & kIOFWReadBlockRequest);
+	UInt32 header_quads = quad ? 3 : 4;
+
+	// nothing is queued until the response is allocated, a failed request must not be acked
+	LoopbackEvent * event = allocEvent( kLoopbackEventPacket, header_quads + ((size + 3) / 4) );
+	if( event == NULL )
+		return kIOReturnNoMemory;
+
+	if( queueAck( cmd, kFWAckPending ) != kIOReturnSuccess )
+	{
+		freeEvent( event );
+		return kIOReturnNoMemory;
+	}
+
+	UInt32 rcode = readNode( node, addrHi, addrLo, &event->fPacket[header_quads], size );
+	int tCode = quad ? kFWTCodeReadQuadletResponse : kFWTCodeReadBlockResponse;
+
+	event->fPacket[0] = (getNodeID() << kFWAsynchDestinationIDPhase) |
+						(label << kFWAsynchTLabelPhase) |
+						(tCode << kFWPacketTCodePhase);
+	event->fPacket[1] = (nodeID << kFWAsynchSourceIDPhase) | (rcode << kFWAsynchRCodePhase);
+	event->fPacket[2] = 0;
+
+	if( quad )
+	{
+		if( rcode != kFWResponseComplete )
+			event->fPacket[3] = 0;
+	}
+	else
+	{
+		event->fPacket[3] = ((rcode == kFWResponseComplete ? size : 0) << kFWAsynchDataLengthPhase);
+		if( rcode != kFWResponseComplete )
+			event->fQuads = header_quads;
+	}
+
+	event->fSpeed = (IOFWSpeed)speed;
+	queueEvent( event, fLatencyNS );
+
+	return kIOReturnSuccess;
+}
+
+// asyncWrite
+//
+//
+
+IOReturn IOFireWireLoopbackLink::asyncWrite( UInt16 nodeID, UInt16 addrHi, UInt32 addrLo,
+											 int speed, int label, IOMemoryDescriptor * buf, IOByteCount offset,
+											 int size, IOFWAsyncCommand * cmd, IOFWWriteFlags flags )
+{
+	fPacketCount++;
+
+	LoopbackNode * node = nodeForID( nodeID );
+	if( node == NULL )
+	{
+		return queueAck( cmd, kFWAckTimeout );
+	}
+
+	if( nodeIsBusy() )
+	{
+		return queueAck( cmd, kFWAckBusyX );
+	}
+
+	UInt32 rcode = writeNode( node, addrHi, addrLo, buf, offset, size );
+
+	if( fUnifiedWrites && rcode == kFWResponseComplete )
+	{
+		// the ack still goes out after the data would have crossed the bus
+		LoopbackEvent * event = allocEvent( kLoopbackEventAck, 0 );
+		if( event == NULL )
+			return kIOReturnNoMemory;
+
+		cmd->retain();
+		event->fCommand = cmd;
+		event->fAck = kFWAckComplete;
+		queueEvent( event, fLatencyNS );
+
+		return kIOReturnSuccess;
+	}
+
+	LoopbackEvent * event = allocEvent( kLoopbackEventPacket, 3 );
+	if( event == NULL )
+		return kIOReturnNoMemory;
+
+	if( queueAck( cmd, kFWAckPending ) != kIOReturnSuccess )
+	{
+		freeEvent( event );
+		return kIOReturnNoMemory;
+	}
+
+	event->fPacket[0] = (getNodeID() << kFWAsynchDestinationIDPhase) |
+						(label << kFWAsynchTLabelPhase) |
+						(kFWTCodeWriteResponse << kFWPacketTCodePhase);
+	event->fPacket[1] = (nodeID << kFWAsynchSourceIDPhase) | (rcode << kFWAsynchRCodePhase);
+	event->fPacket[2] = 0;
+	event->fSpeed = (IOFWSpeed)speed;
+	queueEvent( event, fLatencyNS );
+
+	return kIOReturnSuccess;
+}
+
+// asyncLock
+//
+//
+
+IOReturn IOFireWireLoopbackLink::asyncLock( UInt16 destID, UInt16 addrHi, UInt32 addrLo,
+											int speed, int label, int type, IOMemoryDescriptor * buf,
+											IOByteCount offset, int length, IOFWAsyncCommand * cmd )
+{
+	fPacketCount++;
+
+	LoopbackNode * node = nodeForID( destID );
+	if( node == NULL )
+	{
+		return queueAck( cmd, kFWAckTimeout );
+	}
+
+	if( length > 16 || (length & 3) )
+		return kIOReturnBadArgument;
+
+	if( nodeIsBusy() )
+	{
+		return queueAck( cmd, kFWAckBusyX );
+	}
+
+	UInt32 operands[4];
+	buf->readBytes( offset, operands, length );
+
+	LoopbackEvent * event = allocEvent( kLoopbackEventPacket, 4 + 2 );
+	if( event == NULL )
+		return kIOReturnNoMemory;
+
+	if( queueAck( cmd, kFWAckPending ) != kIOReturnSuccess )
+	{
+		freeEvent( event );
+		return kIOReturnNoMemory;
+	}
+
+	int old_size = 0;
+	UInt32 rcode = lockNode( node, addrHi, addrLo, type, operands, length, &event->fPacket[4], &old_size );
+	if( rcode != kFWResponseComplete )
+		old_size = 0;
+
+	event->fPacket[0] = (getNodeID() << kFWAsynchDestinationIDPhase) |
+						(label << kFWAsynchTLabelPhase) |
+						(kFWTCodeLockResponse << kFWPacketTCodePhase);
+	event->fPacket[1] = (destID << kFWAsynchSourceIDPhase) | (rcode << kFWAsynchRCodePhase);
+	event->fPacket[2] = 0;
+	event->fPacket[3] = (old_size << kFWAsynchDataLengthPhase) | (type << kFWAsynchExtendedTCodePhase);
+	event->fQuads = 4 + (old_size / 4);
+	event->fSpeed = (IOFWSpeed)speed;
+	queueEvent( event, fLatencyNS );
+
+	return kIOReturnSuccess;
+}
+
+// asyncReadQuadResponse
+//
+// responses to sendNodeRequest, the data itself goes nowhere
+
+IOReturn IOFireWireLoopbackLink::asyncReadQuadResponse( UInt16 nodeID, int speed,
+														int label, int rcode, UInt32 data )
+{
+	fResponseTransmits++;
+	nodeResponse( nodeID, label, rcode );
+
+	return kIOReturnSuccess;
+}
+
+// asyncReadResponse
+//
+//
+
+IOReturn IOFireWireLoopbackLink::asyncReadResponse( UInt16 nodeID, int speed,
+													int label, int rcode, IOMemoryDescriptor * buf,
+													IOByteCount offset, int len, IODMACommand * in_dma_command )
+{
+	fResponseTransmits++;
+	nodeResponse( nodeID, label, rcode );
+
+	return kIOReturnSuccess;
+}
+
+// asyncWriteResponse
+//
+//
+
+IOReturn IOFireWireLoopbackLink::asyncWriteResponse( UInt16 nodeID, int speed,
+													 int label, int rcode, UInt16 addrHi )
+{
+	fResponseTransmits++;
+	nodeResponse( nodeID, label, rcode );
+
+	return kIOReturnSuccess;
+}
+
+// asyncLockResponse
+//
+//
+
+IOReturn IOFireWireLoopbackLink::asyncLockResponse( UInt16 nodeID, int speed,
+													int label, int rcode, int type, void * data, int len )
+{
+	fResponseTransmits++;
+	nodeResponse( nodeID, label, rcode );
+
+	return kIOReturnSuccess;
+}
+
+// asyncResponses
+//
+// the controller's write and read quadlet responses for a batch of received requests.
+// they go out as one transmit, the way a link would chain them into one context run.
+// with batching off the base class sends them one at a time, for comparison
+
+IOReturn IOFireWireLoopbackLink::asyncResponses( IOFWAsyncResponse * responses, UInt32 count )
+{
+	if( !fBatchResponses )
+		return IOFireWireLink::asyncResponses( responses, count );
+
+	fResponseTransmits++;
+
+	for( UInt32 i = 0; i < count; i++ )
+		nodeResponse( responses[i].fNodeID, responses[i].fLabel, responses[i].fRCode );
+
+	return kIOReturnSuccess;
+}
+
+// handleAsyncTimeout
+//
+// forget any ack still queued for the command
+
+IOReturn IOFireWireLoopbackLink::handleAsyncTimeout( IOFWAsyncCommand * cmd )
+{
+	LoopbackEvent ** link = &fEvents;
+
+	while( *link )
+	{
+		LoopbackEvent * event = *link;
+		if( event->fType == kLoopbackEventAck && event->fCommand == cmd )
+		{
+			*link = event->fNext;
+			freeEvent( event );
+		}
+		else
+		{
+			link = &event->fNext;
+		}
+	}
+
+	return kIOReturnSuccess;
+}
+
+// asyncStreamTransmit
+//
+// no simulated node listens to streams, but our own isoch listeners on the channel hear it
+
+IOReturn IOFireWireLoopbackLink::asyncStreamTransmit( UInt32 channel, int speed, UInt32 sync, UInt32 tag,
+													  IOMemoryDescriptor * pmd, IOByteCount offset, int length,
+													  IOFWAsyncStreamCommand * cmd )
+{
+	if( length < 0 || length > kLoopbackIsochMaxPacket )
+		return kIOReturnBadArgument;
+
+	LoopbackEvent * event = allocEvent( kLoopbackEventStream, 1 + ((length + 3) / 4) );
+	if( event == NULL )
+		return kIOReturnNoMemory;
+
+	if( queueAck( cmd, kFWAckComplete ) != kIOReturnSuccess )
+	{
+		freeEvent( event );
+		return kIOReturnNoMemory;
+	}
+
+	event->fPacket[0] = (length << kFWIsochDataLengthPhase) |
+						((tag & 3) << kFWIsochTagPhase) |
+						((channel & 0x3f) << kFWIsochChanNumPhase) |
+						(kFWTCodeIsochronousBlock << kFWIsochTCodePhase) |
+						((sync & 0xf) << kFWIsochSyPhase);
+	pmd->readBytes( offset, &event->fPacket[1], length );
+	event->fSpeed = (IOFWSpeed)speed;
+	queueEvent( event, fLatencyNS );
+
+	return kIOReturnSuccess;
+}
+
+#pragma mark -
+
+// createDCLProgram
+//
+// kernel DCL programs only, user client programs come with a task info and NuDCL
+// programs with a leader, start conditions are ignored
+
+IODCLProgram * IOFireWireLoopbackLink::createDCLProgram( bool talking, DCLCommand * opcodes,
+														 IOFireWireController::DCLTaskInfo * info, UInt32 startEvent,
+														 UInt32 startState, UInt32 startMask )
+{
+	if( info != NULL || opcodes == NULL || (opcodes->opcode & ~kFWDCLOpFlagMask) == kDCLNuDCLLeaderOp )
+		return NULL;
+
+	return IOFireWireLoopbackDCLProgram::create( this, talking, opcodes );
+}
+
+// createDCLPool
+//
+// NuDCL pools are not simulated. a pool's program is started through createDCLProgram
+// with a NuDCL leader, which the loopback link refuses, so say so here instead of
+// handing out a pool that can never run
+
+IOFWDCLPool * IOFireWireLoopbackLink::createDCLPool( UInt32 capacity )
+{
+	ErrorLog( "IOFireWireLoopbackLink::createDCLPool - NuDCL pools are not supported on the loopback link\n" );
+	
+	return NULL;
+}
+
+// startIsochProgram
+//
+// called with the gate held, the isoch timer only runs while something is running
+
+IOReturn IOFireWireLoopbackLink::startIsochProgram( IOFireWireLoopbackDCLProgram * program )
+{
+	if( fIsochPrograms->getNextIndexOfObject( program, 0 ) != (unsigned int)-1 )
+		return kIOReturnSuccess;
+
+	if( !fIsochPrograms->setObject( program ) )
+		return kIOReturnNoMemory;
+
+	if( fIsochPrograms->getCount() == 1 )
+		fIsochTimer->setTimeoutUS( (kLoopbackIsochCyclesPerTick * kLoopbackNSPerCycle) / 1000 );
+
+	return kIOReturnSuccess;
+}
+
+// stopIsochProgram
+//
+// called with the gate held
+
+void IOFireWireLoopbackLink::stopIsochProgram( IOFireWireLoopbackDCLProgram * program )
+{
+	unsigned int index = fIsochPrograms->getNextIndexOfObject( program, 0 );
+	if( index == (unsigned int)-1 )
+		return;
+
+	fIsochPrograms->removeObject( index );
+
+	if( fIsochPrograms->getCount() == 0 )
+		fIsochTimer->cancelTimeout();
+}
+
+// isochTimerFired
+//
+// runs kLoopbackIsochCyclesPerTick cycles back to back, each talker sends one packet a cycle
+
+void IOFireWireLoopbackLink::isochTimerFired( OSObject * owner, IOTimerEventSource * sender )
+{
+	IOFireWireLoopbackLink * me = OSDynamicCast( IOFireWireLoopbackLink, owner );
+	if( me == NULL || !me->fInterruptsEnabled )
+		return;
+
+	for( UInt32 cycle = 0; cycle < kLoopbackIsochCyclesPerTick; cycle++ )
+	{
+		// programs can stop themselves, or each other, from their call procs
+		for( unsigned int i = 0; i < me->fIsochPrograms->getCount(); i++ )
+		{
+			IOFireWireLoopbackDCLProgram * program = (IOFireWireLoopbackDCLProgram*)me->fIsochPrograms->getObject( i );
+			if( !program->isTalking() )
+				continue;
+
+			program->retain();
+
+			UInt32 bytes = program->transmitPacket( me->fIsochPacket, sizeof(me->fIsochPacket) );
+			if( bytes > 0 )
+				me->deliverIsochPacket( me->fIsochPacket, bytes );
+
+			program->release();
+		}
+	}
+
+	if( me->fIsochPrograms->getCount() > 0 )
+		sender->setTimeoutUS( (kLoopbackIsochCyclesPerTick * kLoopbackNSPerCycle) / 1000 );
+}
+
+// deliverIsochPacket
+//
+// the packet starts with its isoch header in host order
+
+void IOFireWireLoopbackLink::deliverIsochPacket( const UInt32 * packet, UInt32 bytes )
+{
+	UInt32 channel = (packet[0] & kFWIsochChanNum) >> kFWIsochChanNumPhase;
+
+	for( unsigned int i = 0; i < fIsochPrograms->getCount(); i++ )
+	{
+		IOFireWireLoopbackDCLProgram * program = (IOFireWireLoopbackDCLProgram*)fIsochPrograms->getObject( i );
+		if( program->isTalking() || program->getChannel() != channel )
+			continue;
+
+		program->retain();
+		program->receivePacket( packet, bytes );
+		program->release();
+	}
+}
+
+// activateMultiIsochReceiveListener
+//
+//
+
+IOReturn IOFireWireLoopbackLink::activateMultiIsochReceiveListener( IOFireWireMultiIsochReceiveListener * pListener )
+{
+	return kIOReturnUnsupported;
+}
+
+// deactivateMultiIsochReceiveListener
+//
+//
+
+IOReturn IOFireWireLoopbackLink::deactivateMultiIsochReceiveListener( IOFireWireMultiIsochReceiveListener * pListener )
+{
+	return kIOReturnUnsupported;
+}
+
+// clientDoneWithMultiIsochReceivePacket
+//
+//
+
+void IOFireWireLoopbackLink::clientDoneWithMultiIsochReceivePacket( IOFireWireMultiIsochReceivePacket * pPacket )
+{
+}
+
+#pragma mark -
+
+// updateROM
+//
+// the simulated nodes never read our ROM
+
+IOReturn IOFireWireLoopbackLink::updateROM( const OSData * rom )
+{
+	return kIOReturnSuccess;
+}
+
+// getCycleTime
+//
+// a cycle timer that starts counting when the link starts
+
+IOReturn IOFireWireLoopbackLink::getCycleTime( UInt32 & cycleTime )
+{
+	UInt64 elapsed = now() - fStartTime;
+	UInt32 seconds = (elapsed / 1000000000ULL) & 0x7f;
+	UInt32 cycles = (elapsed % 1000000000ULL) / kLoopbackNSPerCycle;
+	UInt32 offset = ((elapsed % kLoopbackNSPerCycle) * kLoopbackCycleOffsetsPerCycle) / kLoopbackNSPerCycle;
+
+	cycleTime = (seconds << 25) | (cycles << 12) | offset;
+
+	return kIOReturnSuccess;
+}
+
+// getBusCycleTime
+//
+//
+
+IOReturn IOFireWireLoopbackLink::getBusCycleTime( UInt32 & busTime, UInt32 & cycleTime )
+{
+	getCycleTime( cycleTime );
+	busTime = fBusTime + (UInt32)((now() - fStartTime) / 1000000000ULL);
+
+	return kIOReturnSuccess;
+}
+
+// setBusTime
+//
+//
+
+IOReturn IOFireWireLoopbackLink::setBusTime( UInt32 busTime )
+{
+	fBusTime = busTime - (UInt32)((now() - fStartTime) / 1000000000ULL);
+
+	return kIOReturnSuccess;
+}
+
+// getCycleTimeAndUpTime
+//
+//
+
+IOReturn IOFireWireLoopbackLink::getCycleTimeAndUpTime( UInt32 & cycleTime, UInt64 & uptime )
+{
+	AbsoluteTime time;
+	IOFWGetAbsoluteTime( &time );
+	uptime = *((UInt64*)&time);
+
+	return getCycleTime( cycleTime );
+}
+
+// getGUID
+//
+//
+
+CSRNodeUniqueID IOFireWireLoopbackLink::getGUID()
+{
+	return fGUID;
+}
+
+// getBusCharacteristics
+//
+//
+
+UInt32 IOFireWireLoopbackLink::getBusCharacteristics()
+{
+	return kFWBIBIrmc | kFWBIBCmc | kFWBIBIsc | kFWBIBBmc |
+		   (100 << kFWBIBCycClkAccPhase) |
+		   (kLoopbackMaxRec << kFWBIBMaxRecPhase) |
+		   (kFWSpeed400MBit << kFWBIBLinkSpeedPhase);
+}
+
+// getMaxSendLog
+//
+//
+
+UInt32 IOFireWireLoopbackLink::getMaxSendLog()
+{
+	return kLoopbackMaxSendLog;
+}
+
+// getNodeID
+//
+// we are always the highest phy id
+
+UInt16 IOFireWireLoopbackLink::getNodeID()
+{
+	return kFWLocalBusAddress | fNodeCount;
+}
+
+// getPhySpeed
+//
+//
+
+IOFWSpeed IOFireWireLoopbackLink::getPhySpeed()
+{
+	return kFWSpeed400MBit;
+}
+
+// setNodeIDPhysicalFilter
+//
+// there is no physical DMA to filter
+
+void IOFireWireLoopbackLink::setNodeIDPhysicalFilter( UInt16 nodeID, bool state )
+{
+}
+
+// setNodeFlags
+//
+//
+
+void IOFireWireLoopbackLink::setNodeFlags( UInt16 nodeID, UInt32 flags )
+{
+}
+
+// setSecurityMode
+//
+//
+
+void IOFireWireLoopbackLink::setSecurityMode( IOFWSecurityMode mode )
+{
+}
+
+// flushWaitingPackets
+//
+// nothing is ever held back
+
+void IOFireWireLoopbackLink::flushWaitingPackets( void )
+{
+}
+
+// clipMaxRec2K
+//
+// already at 2K
+
+IOReturn IOFireWireLoopbackLink::clipMaxRec2K( bool clipMaxRec )
+{
+	return kIOReturnSuccess;
+}
+
+#pragma mark -
+
+// now
+//
+//
+
+UInt64 IOFireWireLoopbackLink::now( void )
+{
+	AbsoluteTime time;
+	UInt64 nanos;
+
+	IOFWGetAbsoluteTime( &time );
+	absolutetime_to_nanoseconds( time, &nanos );
+
+	return nanos;
+}
+
+// allocEvent
+//
+//
+
+IOFireWireLoopbackLink::LoopbackEvent * IOFireWireLoopbackLink::allocEvent( UInt32 type, UInt32 quads )
+{
+	UInt32 size = sizeof(LoopbackEvent) + (quads * sizeof(UInt32));
+	LoopbackEvent * event = (LoopbackEvent*)IOMalloc( size );
+	if( event == NULL )
+		return NULL;
+
+	bzero( event, size );
+	event->fType = type;
+	event->fQuads = quads;
+	event->fAllocSize = size;
+
+	return event;
+}
+
+// freeEvent
+//
+//
+
+void IOFireWireLoopbackLink::freeEvent( LoopbackEvent * event )
+{
+	if( event->fCommand )
+		event->fCommand->release();
+
+	IOFree( event, event->fAllocSize );
+}
+
+// queueEvent
+//
+// insert in deadline order, after anything due at the same time
+
+void IOFireWireLoopbackLink::queueEvent( LoopbackEvent * event, UInt64 delay )
+{
+	event->fDeadline = now() + delay;
+
+	LoopbackEvent ** link = &fEvents;
+	while( *link && (*link)->fDeadline <= event->fDeadline )
+		link = &(*link)->fNext;
+
+	event->fNext = *link;
+	*link = event;
+
+	if( fEvents == event )
+		armEventTimer();
+}
+
+// queueAck
+//
+// acks are seen right away, before any response
+
+IOReturn IOFireWireLoopbackLink::queueAck( IOFWCommand * cmd, int ack )
+{
+	LoopbackEvent * event = allocEvent( kLoopbackEventAck, 0 );
+	if( event == NULL )
+		return kIOReturnNoMemory;
+
+	cmd->retain();
+	event->fCommand = cmd;
+	event->fAck = ack;
+
+	queueEvent( event, 0 );
+
+	return kIOReturnSuccess;
+}
+
+// flushEvents
+//
+// a bus reset loses everything in flight, the controller fails the commands itself
+
+void IOFireWireLoopbackLink::flushEvents( bool commandsOnly )
+{
+	LoopbackEvent ** link = &fEvents;
+
+	while( *link )
+	{
+		LoopbackEvent * event = *link;
+		if( !commandsOnly || event->fType != kLoopbackEventBusReset )
+		{
+			*link = event->fNext;
+			freeEvent( event );
+		}
+		else
+		{
+			link = &event->fNext;
+		}
+	}
+
+	if( !commandsOnly )
+		fBusResetPending = false;
+}
+
+// armEventTimer
+//
+//
+
+void IOFireWireLoopbackLink::armEventTimer( void )
+{
+	if( fEvents == NULL || !fInterruptsEnabled || fEventTimer == NULL )
+		return;
+
+	UInt64 time = now();
+	UInt64 delay = (fEvents->fDeadline > time) ? (fEvents->fDeadline - time) : 0;
+
+	fEventTimer->setTimeoutUS( (UInt32)(delay / 1000) );
+}
+
+// eventTimerFired
+//
+//
+
+void IOFireWireLoopbackLink::eventTimerFired( OSObject * owner, IOTimerEventSource * sender )
+{
+	IOFireWireLoopbackLink * me = OSDynamicCast( IOFireWireLoopbackLink, owner );
+	if( me )
+		me->processEvents();
+}
+
+// processEvents
+//
+// called on the workloop, delivers everything that is due
+
+void IOFireWireLoopbackLink::processEvents( void )
+{
+	if( !fInterruptsEnabled )
+		return;
+
+	UInt64 time = now();
+	UInt64 start = time;
+
+	while( fEvents && fEvents->fDeadline <= time )
+	{
+		// unlink first, delivering can queue more events or reset the bus
+		LoopbackEvent * event = fEvents;
+		fEvents = event->fNext;
+
+		switch( event->fType )
+		{
+			case kLoopbackEventPacket:
+			{
+				// hand the controller every packet due back to back in one go, like a
+				// link draining its receive context
+				LoopbackEvent *	batch[kFWRcvPacketBatchMax];
+				IOFWRcvPacket	packets[kFWRcvPacketBatchMax];
+				UInt32			count = 0;
+
+				batch[count++] = event;
+				while( count < kFWRcvPacketBatchMax && fEvents && fEvents->fDeadline <= time &&
+					   fEvents->fType == kLoopbackEventPacket )
+				{
+					batch[count++] = fEvents;
+					fEvents = fEvents->fNext;
+				}
+
+				for( UInt32 i = 0; i < count; i++ )
+				{
+					packets[i].fData = batch[i]->fPacket;
+					packets[i].fQuads = batch[i]->fQuads;
+					packets[i].fSpeed = batch[i]->fSpeed;
+				}
+
+				processRcvPackets( packets, count );
+
+				// the first is freed below with everything else
+				for( UInt32 i = 1; i < count; i++ )
+					freeEvent( batch[i] );
+				break;
+			}
+
+			case kLoopbackEventAck:
+			{
+				IOFWCommand * cmd = event->fCommand;
+
+				// the command may have been cancelled since
+				if( cmd->Busy() )
+				{
+					IOFWAsyncCommand * async_cmd = OSDynamicCast( IOFWAsyncCommand, cmd );
+					IOFWAsyncPHYCommand * phy_cmd = OSDynamicCast( IOFWAsyncPHYCommand, cmd );
+					IOFWAsyncStreamCommand * stream_cmd = OSDynamicCast( IOFWAsyncStreamCommand, cmd );
+
+					if( async_cmd )
+						async_cmd->gotAck( event->fAck );
+					else if( phy_cmd )
+						phy_cmd->gotAck( event->fAck );
+					else if( stream_cmd )
+						stream_cmd->gotAck( event->fAck );
+				}
+				break;
+			}
+
+			case kLoopbackEventBusReset:
+				processBusResetEvent();
+				break;
+
+			case kLoopbackEventStream:
+				deliverIsochPacket( event->fPacket, sizeof(UInt32) + ((event->fPacket[0] & kFWIsochDataLength) >> kFWIsochDataLengthPhase) );
+				break;
+		}
+
+		freeEvent( event );
+	}
+
+	fEventTime += now() - start;
+
+	armEventTimer();
+}
+
+// processBusResetEvent
+//
+//
+
+void IOFireWireLoopbackLink::processBusResetEvent( void )
+{
+	fBusResetPending = false;
+
+	flushEvents( true );
+
+	// requests the nodes had in flight went with everything else
+	for( UInt32 i = 0; i < kLoopbackMaxNodes; i++ )
+		fNodes[i].fLabelsInUse = 0;
+
+	processBusReset();
+
+	buildSelfIDs();
+	processSelfIDs( fSelfIDs, fSelfIDCount, fOwnIDs, 1 );
+}
+
+#pragma mark -
+
+OSDefineMetaClassAndStructors( IOFireWireLoopbackDCLProgram, IODCLProgram )
+
+// create
+//
+//
+
+IOFireWireLoopbackDCLProgram * IOFireWireLoopbackDCLProgram::create( IOFireWireLoopbackLink * link, bool talking, DCLCommand * opcodes )
+{
+	IOFireWireLoopbackDCLProgram * me = OSTypeAlloc( IOFireWireLoopbackDCLProgram );
+	if( me && !me->init( link, talking, opcodes ) )
+	{
+		me->release();
+		me = NULL;
+	}
+
+	return me;
+}
+
+// init
+//
+//
+
+bool IOFireWireLoopbackDCLProgram::init( IOFireWireLoopbackLink * link, bool talking, DCLCommand * opcodes )
+{
+	if( !IODCLProgram::init( NULL ) )
+		return false;
+
+	fLink = link;
+	fProgram = opcodes;
+	fCurrent = opcodes;
+	fTalking = talking;
+
+	return true;
+}
+
+// allocateHW
+//
+// there is no context to allocate, just remember where we're going to run
+
+IOReturn IOFireWireLoopbackDCLProgram::allocateHW( IOFWSpeed speed, UInt32 chan )
+{
+	fSpeed = speed;
+	fChannel = chan;
+
+	return kIOReturnSuccess;
+}
+
+// releaseHW
+//
+//
+
+IOReturn IOFireWireLoopbackDCLProgram::releaseHW()
+{
+	return kIOReturnSuccess;
+}
+
+// compile
+//
+// the program is interpreted as it runs
+
+IOReturn IOFireWireLoopbackDCLProgram::compile( IOFWSpeed speed, UInt32 chan )
+{
+	fSpeed = speed;
+	fChannel = chan;
+
+	return kIOReturnSuccess;
+}
+
+// notify
+//
+// buffers and jump targets are read as the program reaches them, so updates need no work
+
+IOReturn IOFireWireLoopbackDCLProgram::notify( IOFWDCLNotificationType notificationType, DCLCommand ** dclCommandList, UInt32 numDCLCommands )
+{
+	return kIOReturnSuccess;
+}
+
+// start
+//
+//
+
+IOReturn IOFireWireLoopbackDCLProgram::start()
+{
+	closeGate();
+
+	fCurrent = fProgram;
+	fTag = 0;
+	fSync = 0;
+
+	IOReturn status = fLink->startIsochProgram( this );
+	fRunning = (status == kIOReturnSuccess);
+
+	openGate();
+
+	return status;
+}
+
+// stop
+//
+//
+
+void IOFireWireLoopbackDCLProgram::stop()
+{
+	closeGate();
+
+	fRunning = false;
+	fLink->stopIsochProgram( this );
+
+	openGate();
+}
+
+// closeGate
+//
+// programs run on the link's workloop
+
+void IOFireWireLoopbackDCLProgram::closeGate()
+{
+	fLink->getWorkLoop()->closeGate();
+}
+
+// openGate
+//
+//
+
+void IOFireWireLoopbackDCLProgram::openGate()
+{
+	fLink->getWorkLoop()->openGate();
+}
+
+// synchronizeWithIO
+//
+// everything happens with the gate held, there is nothing in flight to wait for
+
+IOReturn IOFireWireLoopbackDCLProgram::synchronizeWithIO()
+{
+	return kIOReturnSuccess;
+}
+
+// runToPacket
+//
+// runs commands up to the next packet start and returns it. returns NULL for a cycle with
+// nothing to send or receive, a skip cycle, the end of the program, a stop from a call
+// proc or a loop with no packet in it
+
+DCLCommand * IOFireWireLoopbackDCLProgram::runToPacket( void )
+{
+	for( UInt32 steps = 0; fRunning && fCurrent && steps < kLoopbackDCLMaxSteps; steps++ )
+	{
+		DCLCommand * dcl = fCurrent;
+
+		switch( dcl->opcode & ~kFWDCLOpFlagMask )
+		{
+			case kDCLSendPacketStartOp:
+			case kDCLReceivePacketStartOp:
+				return dcl;
+
+			case kDCLCallProcOp:
+				fCurrent = dcl->pNextDCLCommand;
+				(*((DCLCallProc*)dcl)->proc)( dcl );
+				break;
+
+			case kDCLJumpOp:
+				fCurrent = (DCLCommand*)((DCLJump*)dcl)->pJumpDCLLabel;
+				break;
+
+			case kDCLSetTagSyncBitsOp:
+				fTag = ((DCLSetTagSyncBits*)dcl)->tagBits & 3;
+				fSync = ((DCLSetTagSyncBits*)dcl)->syncBits & 0xf;
+				fCurrent = dcl->pNextDCLCommand;
+				break;
+
+			case kDCLTimeStampOp:
+				fLink->getCycleTime( ((DCLTimeStamp*)dcl)->timeStamp );
+				fCurrent = dcl->pNextDCLCommand;
+				break;
+
+			case kDCLPtrTimeStampOp:
+				fLink->getCycleTime( *((DCLPtrTimeStamp*)dcl)->timeStampPtr );
+				fCurrent = dcl->pNextDCLCommand;
+				break;
+
+			case kDCLSkipCycleOp:
+				fCurrent = dcl->pNextDCLCommand;
+				return NULL;
+
+			default:
+				// labels, updates and the packet continuations of a packet we aren't in
+				fCurrent = dcl->pNextDCLCommand;
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+// transmitPacket
+//
+// the next packet of a talker, header first, returns its length in bytes or 0 for none
+
+UInt32 IOFireWireLoopbackDCLProgram::transmitPacket( UInt32 * packet, UInt32 maxBytes )
+{
+	DCLCommand * dcl = runToPacket();
+	if( dcl == NULL )
+		return 0;
+
+	if( (dcl->opcode & ~kFWDCLOpFlagMask) != kDCLSendPacketStartOp )
+	{
+		fCurrent = dcl->pNextDCLCommand;
+		return 0;
+	}
+
+	UInt32 bytes = sizeof(UInt32);
+
+	do
+	{
+		DCLTransferPacket * transfer = (DCLTransferPacket*)dcl;
+		UInt32 size = transfer->size;
+		if( size > maxBytes - bytes )
+			size = maxBytes - bytes;
+
+		bcopy( transfer->buffer, (UInt8*)packet + bytes, size );
+		bytes += size;
+
+		dcl = dcl->pNextDCLCommand;
+	}
+	while( dcl && (dcl->opcode & ~kFWDCLOpFlagMask) == kDCLSendPacketOp );
+
+	fCurrent = dcl;
+
+	packet[0] = ((bytes - sizeof(UInt32)) << kFWIsochDataLengthPhase) |
+				(fTag << kFWIsochTagPhase) |
+				(fChannel << kFWIsochChanNumPhase) |
+				(kFWTCodeIsochronousBlock << kFWIsochTCodePhase) |
+				(fSync << kFWIsochSyPhase);
+
+	// the call procs after the packet see it sent
+	runToPacket();
+
+	return bytes;
+}
+
+// receivePacket
+//
+// fills the listener's next packet, header first. a listener that isn't waiting on
+// a packet, because it overran or ended, drops it
+
+void IOFireWireLoopbackDCLProgram::receivePacket( const UInt32 * packet, UInt32 bytes )
+{
+	DCLCommand * dcl = runToPacket();
+	if( dcl == NULL || (dcl->opcode & ~kFWDCLOpFlagMask) != kDCLReceivePacketStartOp )
+		return;
+
+	UInt32 offset = 0;
+
+	do
+	{
+		DCLTransferPacket * transfer = (DCLTransferPacket*)dcl;
+		UInt32 size = transfer->size;
+		if( size > bytes - offset )
+			size = bytes - offset;
+
+		bcopy( (const UInt8*)packet + offset, transfer->buffer, size );
+		offset += size;
+
+		dcl = dcl->pNextDCLCommand;
+	}
+	while( dcl && (dcl->opcode & ~kFWDCLOpFlagMask) == kDCLReceivePacketOp );
+
+	fCurrent = dcl;
+
+	// the call procs after the packet see it received
+	runToPacket();
+}
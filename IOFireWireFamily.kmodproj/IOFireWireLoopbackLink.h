@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 1998-2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  IOFireWireLoopbackLink.h
+ *  IOFireWireFamily
+ *
+ */
+
+#ifndef _IOKIT_IOFIREWIRELOOPBACKLINK_H
+#define _IOKIT_IOFIREWIRELOOPBACKLINK_H
+
+#import <IOKit/firewire/IOFireWireLink.h>
+#import <IOKit/firewire/IOFWDCLProgram.h>
+
+class IOTimerEventSource;
+class IOFireWireLoopbackLink;
+
+// IOFireWireLoopbackLink
+//
+// A link with no hardware behind it. The local node is the root of a tree of
+// simulated nodes that answer async requests out of their own config ROM and
+// memory, so the controller, commands and address spaces can be exercised and
+// timed without a FireWire card. Only started when the "fwloopback" boot-arg is set.
+//
+// The simulated nodes can also send requests to the local node with sendNodeRequest,
+// the controller's responses are counted per node and passed to the response handler.
+// Isochronous traffic runs through IOFireWireLoopbackDCLProgram.
+//
+// The link is built into its own test kext, IOFireWireLoopback.kext, never into the family.
+//
+// Tunables, read from the personality at start:
+//	LoopbackNodes			number of simulated nodes (the boot-arg value overrides)
+//	LoopbackTopology		"Chain" (the default), "Star" or "Tree", a Chain is
+//							cut to kLoopbackMaxChainNodes
+//	LoopbackHubPorts		ports on each hub of a Tree
+//	LoopbackLatency			microseconds between a request and its response
+//	LoopbackBusyPercent		percentage of requests acked busy and dropped
+//	LoopbackUnifiedWrites	ack writes complete instead of pending plus a response
+//	LoopbackGUIDBase		GUID of the local node, simulated nodes count up from it
+//	LoopbackUnitSpecID		if set, each simulated node gets a unit directory
+//	LoopbackUnitSWVersion	with this spec id and software version
+//	LoopbackVendorEntries	if set, each simulated node gets a node dependent info
+//							directory of this many entries, see buildNodeROM
+//
+// Setting the LoopbackBenchmark property, to a dictionary of IOFireWireLoopbackBenchmark
+// parameters, runs the async command benchmark and publishes LoopbackBenchmarkResults.
+// LoopbackResetBenchmark does the same for the bus reset benchmark, publishing
+// LoopbackResetBenchmarkResults, and LoopbackDirectoryBenchmark for the config directory
+// lookup benchmark, publishing LoopbackDirectoryBenchmarkResults. LoopbackCRCBenchmark
+// runs the config ROM CRC benchmark, publishing LoopbackCRCBenchmarkResults, and
+// LoopbackTimeoutBenchmark the timeout queue benchmark, publishing
+// LoopbackTimeoutBenchmarkResults. LoopbackRequestBenchmark runs the node request
+// benchmark, publishing LoopbackRequestBenchmarkResults.
+
+#define kLoopbackMaxNodes			62			// with the local node, a full bus
+#define kLoopbackMaxChainNodes		16			// with the local node, the 16 hops IEEE 1394 allows
+#define kLoopbackMaxPorts			27			// the most a phy can report in its self IDs
+#define kLoopbackDefaultHubPorts	6
+#define kLoopbackROMQuads			256			// the largest general ROM
+#define kLoopbackMaxVendorEntries	240			// what fits in the ROM with everything else
+#define kLoopbackNodeMemorySize		(64*1024)	// at address 0x0000.00000000 of each node
+#define kLoopbackIsochMaxPacket		4096		// isoch payload at s400
+#define kLoopbackIsochCyclesPerTick	8			// cycles run each time the isoch timer fires
+
+// IOFireWireLoopbackDCLProgram
+//
+// Runs a kernel DCL program on the simulated bus. Every cycle each running talker sends
+// its next packet to every running listener on the same channel, and async stream packets
+// from the controller reach listeners the same way. Received packets start with the isoch
+// header quadlet in host order. Call procs run on the workloop as the program reaches
+// them. NuDCL and user client programs are not supported.
+
+class IOFireWireLoopbackDCLProgram : public IODCLProgram
+{
+    OSDeclareDefaultStructors(IOFireWireLoopbackDCLProgram)
+
+protected:
+
+	IOFireWireLoopbackLink *	fLink;
+	DCLCommand *				fProgram;
+	DCLCommand *				fCurrent;		// where the next cycle picks up
+	bool						fTalking;
+	bool						fRunning;
+	UInt32						fChannel;
+	IOFWSpeed					fSpeed;
+	UInt32						fTag;
+	UInt32						fSync;
+
+	DCLCommand * runToPacket( void );
+
+public:
+
+	static IOFireWireLoopbackDCLProgram * create( IOFireWireLoopbackLink * link, bool talking, DCLCommand * opcodes );
+	virtual bool init( IOFireWireLoopbackLink * link, bool talking, DCLCommand * opcodes );
+
+	virtual IOReturn allocateHW( IOFWSpeed speed, UInt32 chan );
+	virtual IOReturn releaseHW();
+	virtual IOReturn compile( IOFWSpeed speed, UInt32 chan );
+	virtual IOReturn notify( IOFWDCLNotificationType notificationType, DCLCommand ** dclCommandList, UInt32 numDCLCommands );
+	virtual IOReturn start();
+	virtual void stop();
+	virtual void closeGate();
+	virtual void openGate();
+	virtual IOReturn synchronizeWithIO();
+
+	bool isTalking( void ) const
+		{ return fTalking; };
+	UInt32 getChannel( void ) const
+		{ return fChannel; };
+
+	UInt32 transmitPacket( UInt32 * packet, UInt32 maxBytes );
+	void receivePacket( const UInt32 * packet, UInt32 bytes );
+};
+
+class IOFireWireLoopbackLink : public IOFireWireLink
+{
+    OSDeclareDefaultStructors(IOFireWireLoopbackLink)
+
+protected:
+
+	enum
+	{
+		kLoopbackEventPacket,		// hand a received packet to the controller
+		kLoopbackEventAck,			// deliver an ack to a command
+		kLoopbackEventBusReset,		// finish a bus reset and report self IDs
+		kLoopbackEventStream		// hand an async stream packet to the isoch listeners
+	};
+
+public:
+
+	typedef void (*NodeResponseHandler)( void * refcon, UInt32 phy, int rcode );
+
+	enum
+	{
+		kLoopbackTopologyChain,		// every node has one child
+		kLoopbackTopologyStar,		// one hub with every other node on it
+		kLoopbackTopologyTree		// hubs of fHubPorts ports, filled breadth first
+	};
+
+protected:
+
+	struct LoopbackEvent
+	{
+		LoopbackEvent *		fNext;
+		UInt64				fDeadline;		// uptime in nanoseconds
+		UInt32				fType;
+		IOFWCommand *		fCommand;		// retained, ack events only
+		int					fAck;
+		IOFWSpeed			fSpeed;
+		UInt32				fQuads;			// may shrink below the allocated size
+		UInt32				fAllocSize;
+		UInt32				fPacket[1];		// header quads in host order, payload in bus order
+	};
+
+	struct LoopbackNode
+	{
+		CSRNodeUniqueID		fGUID;
+		UInt32				fROM[kLoopbackROMQuads];	// bus order
+		UInt32				fROMQuads;
+		UInt8 *				fMemory;
+
+		// requests sent to the local node
+		UInt64				fLabelsInUse;
+		UInt32				fNextLabel;
+		UInt32				fRequests;
+		UInt32				fResponses;
+		UInt32				fErrors;		// responses that weren't complete
+	};
+
+	IOTimerEventSource *	fEventTimer;
+	LoopbackEvent *			fEvents;			// sorted by deadline
+
+	LoopbackNode *			fNodes;
+	UInt32					fNodeCount;
+
+	CSRNodeUniqueID			fGUID;
+	UInt32					fLatencyNS;
+	UInt32					fBusyPercent;
+	bool					fUnifiedWrites;
+	UInt32					fUnitSpecID;
+	UInt32					fUnitSWVersion;
+	UInt32					fVendorEntries;
+
+	UInt32					fRandom;
+	UInt32					fGapCount;
+	bool					fContender;
+	bool					fBusResetPending;
+	bool					fInterruptsEnabled;
+	UInt64					fStartTime;
+	UInt32					fBusTime;
+
+	UInt32					fTopology;
+	UInt32					fHubPorts;
+
+	NodeResponseHandler		fResponseHandler;
+	void *					fResponseRefCon;
+
+	IOTimerEventSource *	fIsochTimer;
+	OSArray *				fIsochPrograms;		// running, in start order
+	UInt32					fIsochPacket[1 + (kLoopbackIsochMaxPacket / 4)];
+
+	UInt32					fSelfIDs[kLoopbackMaxNodes*kMaxSelfIDs*2];
+	UInt32					fSelfIDCount;
+	UInt32					fOwnIDs[2];
+
+	// statistics for IOFireWireLoopbackBenchmark
+	UInt64					fEventTime;			// nanoseconds spent delivering events
+	UInt32					fPacketCount;		// request packets sent
+	UInt32					fResponseTransmits;	// responses, or batches of them, handed to transmit
+	bool					fBatchResponses;
+	bool					fBenchmarkRunning;
+
+public:
+
+	virtual IOService *	probe( IOService * provider, SInt32 * score );
+	virtual bool		start( IOService * provider );
+	virtual void		stop( IOService * provider );
+	virtual void		free( void );
+	virtual IOReturn	setProperties( OSObject * properties );
+
+	virtual IOReturn setLinkPowerState ( unsigned long powerStateOrdinal );
+	virtual IOPMPowerState * getPowerStateTable( unsigned long * numberOfStates );
+	virtual void enableAllInterrupts( void );
+	virtual void handleInterrupts( IOInterruptEventSource *, int count );
+
+	virtual IOReturn setContender( bool state );
+	virtual IOReturn setRootHoldOff( bool state );
+	virtual IOReturn setCycleMaster( bool state );
+	virtual IOReturn sendPHYPacket( UInt32 quad );
+	virtual IOReturn asyncPHYPacket( UInt32 data, UInt32 data2, IOFWAsyncPHYCommand * cmd );
+	virtual IOReturn resetBus( bool useIBR = false );
+
+	virtual IOReturn asyncRead( UInt16 nodeID, UInt16 addrHi, UInt32 addrLo,
+								int speed, int label, int size, IOFWAsyncCommand * cmd,
+								IOFWReadFlags flags );
+	virtual IOReturn asyncReadQuadResponse( UInt16 nodeID, int speed,
+											int label, int rcode, UInt32 data );
+	virtual IOReturn asyncReadResponse( UInt16 nodeID, int speed,
+										int label, int rcode, IOMemoryDescriptor * buf,
+										IOByteCount offset, int len, IODMACommand * in_dma_command );
+	virtual IOReturn asyncWrite( UInt16 nodeID, UInt16 addrHi, UInt32 addrLo,
+								 int speed, int label, IOMemoryDescriptor * buf, IOByteCount offset,
+								 int size, IOFWAsyncCommand * cmd, IOFWWriteFlags flags );
+	virtual IOReturn asyncWriteResponse( UInt16 nodeID, int speed,
+										 int label, int rcode, UInt16 addrHi );
+	virtual IOReturn asyncLock( UInt16 destID, UInt16 addrHi, UInt32 addrLo,
+								int speed, int label, int type, IOMemoryDescriptor * buf,
+								IOByteCount offset, int length, IOFWAsyncCommand * cmd );
+	virtual IOReturn asyncLockResponse( UInt16 nodeID, int speed,
+										int label, int rcode, int type, void * data, int len );
+	virtual IOReturn asyncResponses( IOFWAsyncResponse * responses, UInt32 count );
+	virtual IOReturn handleAsyncTimeout( IOFWAsyncCommand * cmd );
+	virtual IOReturn asyncStreamTransmit( UInt32 channel, int speed, UInt32 sync, UInt32 tag,
+										  IOMemoryDescriptor * pmd, IOByteCount offset, int length,
+										  IOFWAsyncStreamCommand * cmd );
+
+	virtual IODCLProgram * createDCLProgram( bool talking, DCLCommand * opcodes,
+											 IOFireWireController::DCLTaskInfo * info, UInt32 startEvent,
+											 UInt32 startState, UInt32 startMask );
+	virtual IOFWDCLPool * createDCLPool( UInt32 capacity );
+	virtual IOReturn activateMultiIsochReceiveListener( IOFireWireMultiIsochReceiveListener * pListener );
+	virtual IOReturn deactivateMultiIsochReceiveListener( IOFireWireMultiIsochReceiveListener * pListener );
+	virtual void clientDoneWithMultiIsochReceivePacket( IOFireWireMultiIsochReceivePacket * pPacket );
+
+	virtual IOReturn updateROM( const OSData * rom );
+	virtual IOReturn getCycleTime( UInt32 & cycleTime );
+	virtual IOReturn getBusCycleTime( UInt32 & busTime, UInt32 & cycleTime );
+	virtual IOReturn setBusTime( UInt32 busTime );
+	virtual IOReturn getCycleTimeAndUpTime( UInt32 & cycleTime, UInt64 & uptime );
+
+	virtual CSRNodeUniqueID getGUID();
+	virtual UInt32 getBusCharacteristics();
+	virtual UInt32 getMaxSendLog();
+	virtual UInt16 getNodeID();
+	virtual IOFWSpeed getPhySpeed();
+
+	virtual void setNodeIDPhysicalFilter( UInt16 nodeID, bool state );
+	virtual void setNodeFlags( UInt16 nodeID, UInt32 flags );
+	virtual void setSecurityMode( IOFWSecurityMode mode );
+	virtual void flushWaitingPackets( void );
+	virtual IOReturn clipMaxRec2K( bool clipMaxRec );
+
+	UInt64 now( void );
+	UInt64 getEventTime( void )
+		{ return fEventTime; };
+	UInt32 getPacketCount( void )
+		{ return fPacketCount; };
+	UInt32 getResponseTransmits( void )
+		{ return fResponseTransmits; };
+	void setBatchResponses( bool batch )
+		{ fBatchResponses = batch; };
+
+	IOReturn setTopology( UInt32 topology, UInt32 nodes );
+	UInt32 getNodeCount( void )
+		{ return fNodeCount; };
+	UInt32 getTopology( void )
+		{ return fTopology; };
+
+	IOReturn setVendorEntries( UInt32 entries );
+	UInt32 getVendorEntries( void )
+		{ return fVendorEntries; };
+	CSRNodeUniqueID getNodeGUID( UInt32 phy )
+		{ return fNodes[phy].fGUID; };
+
+	IOReturn sendNodeRequest( UInt32 phy, int tCode, UInt16 addrHi, UInt32 addrLo,
+							  const void * payload, int size, int extendedTCode );
+	void setNodeResponseHandler( NodeResponseHandler handler, void * refcon );
+	UInt32 getNodeRequests( UInt32 phy )
+		{ return fNodes[phy].fRequests; };
+	UInt32 getNodeResponses( UInt32 phy )
+		{ return fNodes[phy].fResponses; };
+	UInt32 getNodeErrors( UInt32 phy )
+		{ return fNodes[phy].fErrors; };
+
+	IOReturn startIsochProgram( IOFireWireLoopbackDCLProgram * program );
+	void stopIsochProgram( IOFireWireLoopbackDCLProgram * program );
+
+protected:
+
+	UInt32 getNumberProperty( const char * key, UInt32 defaultValue );
+	void buildNodeROM( LoopbackNode * node );
+	void buildSelfIDs( void );
+	void assignPhys( UInt32 position, UInt32 fanout, UInt32 * nextPhy, UInt8 * positions );
+	UInt32 buildNodeSelfIDs( UInt32 phy, UInt32 ports, UInt32 children, UInt32 * ids );
+
+	LoopbackNode * nodeForID( UInt16 nodeID );
+	bool nodeIsBusy( void );
+	UInt8 * nodeMemory( LoopbackNode * node );
+	UInt32 readNode( LoopbackNode * node, UInt16 addrHi, UInt32 addrLo, UInt32 * buffer, int size );
+	UInt32 writeNode( LoopbackNode * node, UInt16 addrHi, UInt32 addrLo, IOMemoryDescriptor * buf, IOByteCount offset, int size );
+	UInt32 lockNode( LoopbackNode * node, UInt16 addrHi, UInt32 addrLo, int type, const UInt32 * operands, int size, UInt32 * oldValue, int * oldSize );
+
+	LoopbackEvent * allocEvent( UInt32 type, UInt32 quads );
+	void freeEvent( LoopbackEvent * event );
+	void queueEvent( LoopbackEvent * event, UInt64 delay );
+	IOReturn queueAck( IOFWCommand * cmd, int ack );
+	void flushEvents( bool commandsOnly );
+	void armEventTimer( void );
+
+	static void eventTimerFired( OSObject * owner, IOTimerEventSource * sender );
+	void processEvents( void );
+	void processBusResetEvent( void );
+	void nodeResponse( UInt16 nodeID, int label, int rcode );
+
+	static void isochTimerFired( OSObject * owner, IOTimerEventSource * sender );
+	void deliverIsochPacket( const UInt32 * packet, UInt32 bytes );
+
+	static void benchmarkThread( void * arg );
+	static const char * benchmarkResultsKey( UInt32 kind );
+};
+
+#endif /* ! _IOKIT_IOFIREWIRELOOPBACKLINK_H */
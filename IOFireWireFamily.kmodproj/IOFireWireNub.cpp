@@ -38,6 +38,7 @@
 
 // private
 #import "IOFireWireUserClient.h"
+#import "IOFWAsyncCommandPool.h"
 
 // system
 #import <IOKit/assert.h>
@@ -373,6 +374,19 @@ IOFWReadCommand *IOFireWireNub::createReadCommand(FWAddress devAddress, IOMemory
  				bool failOnReset)
 {
     IOFWReadCommand * cmd;
+    
+    // reuse an idle command if the controller has one
+    cmd = (IOFWReadCommand*)fControl->getCommandPool()->checkoutCommand( OSTypeID(IOFWReadCommand), this );
+    if( cmd )
+    {
+        if( cmd->reinit( devAddress, hostMem, completion, refcon, failOnReset ) != kIOReturnSuccess )
+        {
+            cmd->release();
+            cmd = NULL;
+        }
+        return cmd;
+    }
+    
     cmd = OSTypeAlloc( IOFWReadCommand );
     if(cmd) {
         if(!cmd->initAll(this, devAddress,
@@ -393,6 +407,19 @@ IOFWReadQuadCommand *IOFireWireNub::createReadQuadCommand(FWAddress devAddress,
  				bool failOnReset)
 {
     IOFWReadQuadCommand * cmd;
+    
+    // reuse an idle command if the controller has one
+    cmd = (IOFWReadQuadCommand*)fControl->getCommandPool()->checkoutCommand( OSTypeID(IOFWReadQuadCommand), this );
+    if( cmd )
+    {
+        if( cmd->reinit( devAddress, quads, numQuads, completion, refcon, failOnReset ) != kIOReturnSuccess )
+        {
+            cmd->release();
+            cmd = NULL;
+        }
+        return cmd;
+    }
+    
     cmd = OSTypeAlloc( IOFWReadQuadCommand );
     if(cmd) { 
         if(!cmd->initAll(this, devAddress, quads, numQuads, 
@@ -413,6 +440,19 @@ IOFWWriteCommand *IOFireWireNub::createWriteCommand(FWAddress devAddress, IOMemo
  				bool failOnReset)
 {
     IOFWWriteCommand * cmd;
+    
+    // reuse an idle command if the controller has one
+    cmd = (IOFWWriteCommand*)fControl->getCommandPool()->checkoutCommand( OSTypeID(IOFWWriteCommand), this );
+    if( cmd )
+    {
+        if( cmd->reinit( devAddress, hostMem, completion, refcon, failOnReset ) != kIOReturnSuccess )
+        {
+            cmd->release();
+            cmd = NULL;
+        }
+        return cmd;
+    }
+    
     cmd = OSTypeAlloc( IOFWWriteCommand );
     if(cmd) 
 	{
@@ -437,6 +477,19 @@ IOFWWriteQuadCommand *IOFireWireNub::createWriteQuadCommand(FWAddress devAddress
  				bool failOnReset)
 {
     IOFWWriteQuadCommand * cmd;
+    
+    // reuse an idle command if the controller has one
+    cmd = (IOFWWriteQuadCommand*)fControl->getCommandPool()->checkoutCommand( OSTypeID(IOFWWriteQuadCommand), this );
+    if( cmd )
+    {
+        if( cmd->reinit( devAddress, quads, numQuads, completion, refcon, failOnReset ) != kIOReturnSuccess )
+        {
+            cmd->release();
+            cmd = NULL;
+        }
+        return cmd;
+    }
+    
     cmd = OSTypeAlloc( IOFWWriteQuadCommand );
     if(cmd) 
 	{
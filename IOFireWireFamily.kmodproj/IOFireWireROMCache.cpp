@@ -41,6 +41,8 @@ OSMetaClassDefineReservedUnused(IOFireWireROMCache, 7);
 #define kROMBIBSizeMinimal	4   // technically, this is the size of the ROM header
 #define kROMBIBSizeGeneral	20  // technically, this is the size of the ROM header + the BIB
 
+#define kROMReadWindowSize	4	// block reads kept in flight while extending the cache
+
 // withBytes
 //
 //
@@ -506,11 +508,18 @@ IOReturn IOFireWireROMCache::updateROMCache( UInt32 offset, UInt32 length )
 		unsigned int romLength = getLength();
 		UInt32 romEnd = (offset + length) * sizeof(UInt32);
 			
+		IOFireWireController *	control = fOwner->getController();
+		CSRNodeUniqueID			guid = fOwner->getUniqueID();
+		bool					quadReads = control->getROMQuadReadsOnly( guid );
+		bool					blockReadDone = false;
+		
 		while( romEnd > romLength && kIOReturnSuccess == status) 
 		{
 			UInt32 *				buff;
 			int 					bufLen;
-			IOFWReadQuadCommand *	cmd;
+			IOMemoryDescriptor *	desc;
+			IOFWReadCommand *		cmd;
+			bool					blockReads = false;
 		
 			FWKLOG(( "IOFireWireROMCache %p:Need to extend ROM cache from 0x%lx to 0x%lx quads\n", 
 					this, romLength/sizeof(UInt32), romEnd ));
@@ -521,19 +530,73 @@ IOReturn IOFireWireROMCache::updateROMCache( UInt32 offset, UInt32 length )
 			
 			bufLen = romEnd - romLength;
 			buff = (UInt32 *)IOMalloc(bufLen);
-			cmd = fOwner->createReadQuadCommand( FWAddress(kCSRRegisterSpaceBaseAddressHi, kFWBIBHeaderAddress+romLength),
-												buff, bufLen/sizeof(UInt32), NULL, NULL, true );
+			if( buff == NULL )
+			{
+				status = kIOReturnNoMemory;
+				break;
+			}
+			
+			desc = IOMemoryDescriptor::withAddress( buff, bufLen, kIODirectionIn );
+			if( desc == NULL )
+			{
+				IOFree( buff, bufLen );
+				status = kIOReturnNoMemory;
+				break;
+			}
+			
+			// block reads are sized to what the device allows for its ROM, and several
+			// are kept in flight so a directory costs a round trip or two instead of one per quad
+			cmd = fOwner->createReadCommand( FWAddress(kCSRRegisterSpaceBaseAddressHi, kFWBIBHeaderAddress+romLength),
+											 desc, NULL, NULL, true );
+			if( cmd == NULL )
+			{
+				desc->release();
+				IOFree( buff, bufLen );
+				status = kIOReturnNoMemory;
+				break;
+			}
+			
+			if( quadReads )
+			{
+				cmd->setMaxPacket( 4 );
+			}
+			
+			blockReads = (cmd->getMaxPacket() > 4);
+			
 			cmd->setMaxSpeed( kFWSpeed100MBit );
 			cmd->setGeneration( generation );
+			cmd->setWindowSize( kROMReadWindowSize );
 			status = cmd->submit();
+			
+			// the command drops to quads by itself when a block read draws a type error
+			if( blockReads && cmd->getMaxPacket() == 4 )
+			{
+				quadReads = true;
+				blockReads = false;
+				control->setROMQuadReadsOnly( guid );
+			}
+			
 			cmd->release();
+			desc->release();
 			
-			// 
-			// if the command fails because of a bus reset, wait until the
-			// bus is resumed or the ROM becomes invalid
-			//
-			if( status == kIOFireWireBusReset )
+			if( blockReads && !quadReads &&
+				(status == kIOFireWireResponseBase+kFWResponseTypeError || status == kIOFireWireResponseBase+kFWResponseAddressError) )
 			{
+				// some devices answer block reads of their ROM with an address error instead,
+				// read this range again a quad at a time
+				FWKLOG(( "IOFireWireROMCache %p: block read rejected 0x%x, falling back to quads\n", this, status ));
+				
+				quadReads = true;
+				control->setROMQuadReadsOnly( guid );
+				status = kIOReturnSuccess;
+			}
+			else if( status == kIOFireWireBusReset )
+			{
+				// 
+				// if the command fails because of a bus reset, wait until the
+				// bus is resumed or the ROM becomes invalid
+				//
+				
 				// on good return status the generation will be updated, but we won't have incremented
 				// the romLength so we will retry the read the next time through the loop
 			
@@ -552,6 +615,13 @@ IOReturn IOFireWireROMCache::updateROMCache( UInt32 offset, UInt32 length )
 			{
 				unsigned int newLength;
 				
+				// the device takes block reads after all, stop reading it a quad at a time
+				if( blockReads && !blockReadDone )
+				{
+					blockReadDone = true;
+					control->clearROMQuadReadsOnly( guid );
+				}
+				
 				lock();
 				
 				newLength = getLength();
@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 1998-2002 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include "FWDebugging.h"
+
+#include "IOFireWireROMStore.h"
+
+#include <libkern/c++/OSCollectionIterator.h>
+#include <libkern/c++/OSDictionary.h>
+#include <libkern/c++/OSNumber.h>
+#include <libkern/c++/OSString.h>
+#include <libkern/c++/OSSerialize.h>
+
+OSDefineMetaClassAndStructors(IOFireWireROMStore, OSObject)
+
+#define kROMStoreBIBSize	20  // the ROM header + the BIB
+
+// create
+//
+//
+
+IOFireWireROMStore * IOFireWireROMStore::create( UInt32 budget )
+{
+    IOFireWireROMStore * me = OSTypeAlloc( IOFireWireROMStore );
+
+    if( me && !me->initWithBudget( budget ) ) 
+	{
+        me->release();
+        return NULL;
+    }
+	
+    return me;
+}
+
+// initWithBudget
+//
+//
+
+bool IOFireWireROMStore::initWithBudget( UInt32 budget )
+{
+	if( !OSObject::init() )
+		return false;
+	
+	fBudget = budget;
+	
+	fLock = IOLockAlloc();
+	if( fLock == NULL )
+		return false;
+	
+	return true;
+}
+
+// free
+//
+//
+
+void IOFireWireROMStore::free( void )
+{
+	while( fHead != NULL )
+	{
+		removeEntry( fHead );
+	}
+	
+	if( fLock != NULL )
+	{
+		IOLockFree( fLock );
+		fLock = NULL;
+	}
+	
+	OSObject::free();
+}
+
+// isStorable
+//
+// only general ROMs with a nonzero ROM generation can be trusted 
+// not to have changed when their bus info block has not
+
+bool IOFireWireROMStore::isStorable( const UInt32 * bib, UInt32 bibSize )
+{
+	if( bibSize < kROMStoreBIBSize )
+		return false;
+	
+	UInt32 bib_quad = OSSwapBigToHostInt32( bib[2] );
+	UInt32 romGeneration = (bib_quad & kFWBIBGeneration) >> kFWBIBGenerationPhase;
+	
+	return (romGeneration != 0);
+}
+
+// findEntry
+//
+// called with fLock held
+
+IOFireWireROMStore::ROMStoreEntry * IOFireWireROMStore::findEntry( CSRNodeUniqueID guid )
+{
+	ROMStoreEntry * entry = fHead;
+	
+	while( entry != NULL && entry->fGUID != guid )
+	{
+		entry = entry->fNext;
+	}
+	
+	return entry;
+}
+
+// unlinkEntry
+//
+// called with fLock held
+
+void IOFireWireROMStore::unlinkEntry( ROMStoreEntry * entry )
+{
+	if( entry->fPrev )
+		entry->fPrev->fNext = entry->fNext;
+	else
+		fHead = entry->fNext;
+	
+	if( entry->fNext )
+		entry->fNext->fPrev = entry->fPrev;
+	else
+		fTail = entry->fPrev;
+	
+	entry->fNext = NULL;
+	entry->fPrev = NULL;
+}
+
+// linkEntry
+//
+// called with fLock held, makes the entry the most recently used
+
+void IOFireWireROMStore::linkEntry( ROMStoreEntry * entry )
+{
+	entry->fPrev = NULL;
+	entry->fNext = fHead;
+	
+	if( fHead )
+		fHead->fPrev = entry;
+	else
+		fTail = entry;
+	
+	fHead = entry;
+}
+
+// measureParsed
+//
+// bytes held by a tree of parsed directories, counting each object's instance size and
+// any storage it owns. keys are shared symbols and aren't counted.
+
+UInt32 IOFireWireROMStore::measureParsed( const OSObject * object, UInt32 depth )
+{
+	if( object == NULL )
+		return 0;
+	
+	UInt32 size = object->getMetaClass()->getClassSize();
+	
+	const OSData * data = OSDynamicCast( OSData, object );
+	const OSString * string = OSDynamicCast( OSString, object );
+	const OSCollection * collection = OSDynamicCast( OSCollection, object );
+	
+	if( data )
+	{
+		size += data->getCapacity();
+	}
+	else if( string )
+	{
+		size += string->getLength() + 1;
+	}
+	else if( collection && depth < kFWROMStoreMaxParsedDepth )
+	{
+		// dictionaries iterate their keys and keep a value pointer alongside each
+		const OSDictionary * dictionary = OSDynamicCast( OSDictionary, object );
+		
+		size += collection->getCapacity() * (dictionary ? 2 : 1) * sizeof(OSObject *);
+		
+		OSCollectionIterator * iterator = OSCollectionIterator::withCollection( collection );
+		if( iterator )
+		{
+			OSObject * member;
+			while( (member = iterator->getNextObject()) )
+			{
+				if( dictionary )
+					member = dictionary->getObject( (const OSSymbol *)member );
+				
+				size += measureParsed( member, depth + 1 );
+			}
+			
+			iterator->release();
+		}
+	}
+	
+	return size;
+}
+
+// removeEntry
+//
+// called with fLock held
+
+void IOFireWireROMStore::removeEntry( ROMStoreEntry * entry )
+{
+	unlinkEntry( entry );
+	
+	fCost -= entry->fCost;
+	
+	if( entry->fROM )
+		entry->fROM->release();
+	
+	if( entry->fParsed )
+		entry->fParsed->release();
+	
+	IOFree( entry, sizeof(ROMStoreEntry) );
+}
+
+// trimToBudget
+//
+// called with fLock held
+
+void IOFireWireROMStore::trimToBudget( void )
+{
+	while( fCost > fBudget && fTail != NULL )
+	{
+		FWKLOG(( "IOFireWireROMStore@%p::trimToBudget evicting GUID %08x %08x\n", this, 
+				 (unsigned int)(fTail->fGUID >> 32), (unsigned int)(fTail->fGUID & 0xffffffff) ));
+		
+		removeEntry( fTail );
+	}
+}
+
+// copyROM
+//
+//
+
+bool IOFireWireROMStore::copyROM( CSRNodeUniqueID guid, const UInt32 * bib, UInt32 bibSize, OSData ** rom, OSObject ** parsed )
+{
+	bool found = false;
+	
+	*rom = NULL;
+	*parsed = NULL;
+	
+	if( !isStorable( bib, bibSize ) )
+		return false;
+	
+	IOLockLock( fLock );
+	
+	ROMStoreEntry * entry = findEntry( guid );
+	if( entry != NULL )
+	{
+		if( bcmp( bib, entry->fROM->getBytesNoCopy(), kROMStoreBIBSize ) == 0 )
+		{
+			// the device never sees this copy, the cache it seeds grows on its own
+			*rom = OSData::withData( entry->fROM );
+			if( *rom != NULL )
+			{
+				*parsed = entry->fParsed;
+				if( *parsed != NULL )
+					(*parsed)->retain();
+				
+				unlinkEntry( entry );
+				linkEntry( entry );
+				
+				found = true;
+			}
+		}
+		else
+		{
+			// the ROM generation moved on, what we have is stale
+			removeEntry( entry );
+		}
+	}
+	
+	if( found )
+		fHits++;
+	else
+		fMisses++;
+	
+	IOLockUnlock( fLock );
+	
+	FWKLOG(( "IOFireWireROMStore@%p::copyROM GUID %08x %08x %s\n", this, 
+			 (unsigned int)(guid >> 32), (unsigned int)(guid & 0xffffffff), found ? "hit" : "miss" ));
+	
+	return found;
+}
+
+// setROM
+//
+//
+
+void IOFireWireROMStore::setROM( CSRNodeUniqueID guid, const void * bytes, UInt32 length, OSObject * parsed )
+{
+	if( !isStorable( (const UInt32 *)bytes, length ) )
+		return;
+	
+	ROMStoreEntry * newEntry = (ROMStoreEntry *)IOMalloc( sizeof(ROMStoreEntry) );
+	if( newEntry == NULL )
+		return;
+	
+	bzero( newEntry, sizeof(ROMStoreEntry) );
+	
+	newEntry->fGUID = guid;
+	newEntry->fCost = sizeof(ROMStoreEntry) + length + measureParsed( parsed, 0 );
+	newEntry->fROM = OSData::withBytes( bytes, length );
+	if( newEntry->fROM == NULL )
+	{
+		IOFree( newEntry, sizeof(ROMStoreEntry) );
+		return;
+	}
+	
+	newEntry->fParsed = parsed;
+	if( parsed != NULL )
+		parsed->retain();
+	
+	IOLockLock( fLock );
+	
+	ROMStoreEntry * entry = findEntry( guid );
+	if( entry != NULL )
+	{
+		removeEntry( entry );
+	}
+
+	linkEntry( newEntry );
+	fCost += newEntry->fCost;
+	
+	// may evict the new entry itself if it alone is over budget
+	trimToBudget();
+	
+	IOLockUnlock( fLock );
+}
+
+// extendROM
+//
+//
+
+void IOFireWireROMStore::extendROM( CSRNodeUniqueID guid, const void * bytes, UInt32 length )
+{
+	if( !isStorable( (const UInt32 *)bytes, length ) )
+		return;
+	
+	IOLockLock( fLock );
+	
+	ROMStoreEntry * entry = findEntry( guid );
+	if( entry != NULL && 
+		entry->fROM->getLength() < length && 
+		bcmp( bytes, entry->fROM->getBytesNoCopy(), kROMStoreBIBSize ) == 0 )
+	{
+		OSData * rom = OSData::withBytes( bytes, length );
+		if( rom != NULL )
+		{
+			fCost += length - entry->fROM->getLength();
+			entry->fCost += length - entry->fROM->getLength();
+			
+			entry->fROM->release();
+			entry->fROM = rom;
+			
+			trimToBudget();
+		}
+	}
+	
+	IOLockUnlock( fLock );
+}
+
+// removeROM
+//
+//
+
+void IOFireWireROMStore::removeROM( CSRNodeUniqueID guid )
+{
+	IOLockLock( fLock );
+	
+	ROMStoreEntry * entry = findEntry( guid );
+	if( entry != NULL )
+	{
+		removeEntry( entry );
+	}
+	
+	IOLockUnlock( fLock );
+}
+
+// serialize
+//
+//
+
+bool IOFireWireROMStore::serialize( OSSerialize * s ) const
+{
+	OSDictionary *	dictionary;
+	bool			ok;
+	UInt32			entries = 0;
+	
+	dictionary = OSDictionary::withCapacity( 5 );
+	if( !dictionary )
+		return false;
+	
+	IOLockLock( fLock );
+	
+	for( ROMStoreEntry * entry = fHead; entry != NULL; entry = entry->fNext )
+	{
+		entries++;
+	}
+	
+	OSNumber * number;
+	
+	number = OSNumber::withNumber( entries, 32 );
+	dictionary->setObject( "Entries", number );
+	number->release();
+	
+	number = OSNumber::withNumber( fCost, 32 );
+	dictionary->setObject( "Bytes", number );
+	number->release();
+	
+	number = OSNumber::withNumber( fBudget, 32 );
+	dictionary->setObject( "Budget", number );
+	number->release();
+	
+	number = OSNumber::withNumber( fHits, 32 );
+	dictionary->setObject( "Hits", number );
+	number->release();
+	
+	number = OSNumber::withNumber( fMisses, 32 );
+	dictionary->setObject( "Misses", number );
+	number->release();
+	
+	IOLockUnlock( fLock );
+	
+	ok = dictionary->serialize( s );
+	dictionary->release();
+	
+	return ok;
+}
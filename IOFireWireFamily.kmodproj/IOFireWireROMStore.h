@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 1998-2002 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __IOFIREWIREROMSTORE_H__
+#define __IOFIREWIREROMSTORE_H__
+
+#include <libkern/c++/OSObject.h>
+#include <IOKit/system.h>
+
+#include <libkern/c++/OSData.h>
+#include <IOKit/IOLocks.h>
+
+#include <IOKit/firewire/IOFireWireFamilyCommon.h>
+
+#define kFWROMStoreDefaultBudget	(64 * 1024)		// bytes of ROM and parsed directories kept
+#define kFWROMStoreMaxParsedDepth	8				// deepest collection nesting measured in an entry
+
+/*!
+    @class IOFireWireROMStore
+    @abstract Remembers the config ROMs of devices that have left the bus.
+    @discussion The controller keeps one store. Each entry is keyed by GUID and holds the
+	ROM bytes read so far, along with whatever the device parsed out of them. A device that
+	reappears with a bus info block identical to the stored one, ROM generation included,
+	can start from the stored ROM instead of reading it again. Each entry is charged for its
+	ROM bytes plus the measured size of its parsed directories, and entries are evicted least
+	recently used first once the store exceeds its budget. ROMs with a ROM generation of
+	zero are never stored, since they can change without the bus info block changing.
+*/
+
+class IOFireWireROMStore : public OSObject
+{
+    OSDeclareDefaultStructors(IOFireWireROMStore)
+
+protected:
+
+	struct ROMStoreEntry
+	{
+		ROMStoreEntry *		fNext;			// toward the least recently used
+		ROMStoreEntry *		fPrev;
+		CSRNodeUniqueID		fGUID;
+		OSData *			fROM;
+		OSObject *			fParsed;
+		UInt32				fCost;
+	};
+
+	IOLock *			fLock;
+	ROMStoreEntry *		fHead;				// most recently used
+	ROMStoreEntry *		fTail;
+	UInt32				fBudget;
+	UInt32				fCost;
+	UInt32				fHits;
+	UInt32				fMisses;
+
+	virtual bool initWithBudget( UInt32 budget );
+	virtual void free( void );
+
+	static bool isStorable( const UInt32 * bib, UInt32 bibSize );
+	static UInt32 measureParsed( const OSObject * object, UInt32 depth );
+
+	ROMStoreEntry * findEntry( CSRNodeUniqueID guid );
+	void unlinkEntry( ROMStoreEntry * entry );
+	void linkEntry( ROMStoreEntry * entry );
+	void removeEntry( ROMStoreEntry * entry );
+	void trimToBudget( void );
+
+public:
+
+	/*!
+        @function create
+        @abstract Creates an empty store.
+        @param budget Approximate number of bytes the store may hold.
+        @result The new store, or NULL.
+    */
+	
+	static IOFireWireROMStore * create( UInt32 budget = kFWROMStoreDefaultBudget );
+
+	/*!
+        @function copyROM
+        @abstract Looks up the stored ROM for a device.
+        @discussion A stored ROM whose bus info block differs from bib is stale and is dropped.
+        @param guid The unique ID of the device.
+        @param bib The ROM header and bus info block just read from the device, in bus order.
+        @param bibSize Size of bib in bytes.
+        @param rom On success, a retained copy of the stored ROM bytes.
+        @param parsed On success, the retained parsed directories, or NULL if none were stored.
+        @result true if the stored ROM matches.
+    */
+	
+	bool copyROM( CSRNodeUniqueID guid, const UInt32 * bib, UInt32 bibSize, OSData ** rom, OSObject ** parsed );
+
+	/*!
+        @function setROM
+        @abstract Stores a ROM and its parsed directories, replacing any entry for the same GUID.
+        @param guid The unique ID of the device.
+        @param bytes The ROM, starting with the ROM header, in bus order.
+        @param length Size of the ROM in bytes.
+        @param parsed Directories parsed from the ROM, retained by the store. May be NULL.
+    */
+	
+	void setROM( CSRNodeUniqueID guid, const void * bytes, UInt32 length, OSObject * parsed );
+
+	/*!
+        @function extendROM
+        @abstract Replaces the stored ROM bytes with a longer read of the same ROM.
+        @discussion Does nothing unless an entry for guid exists with the same bus info block
+		and fewer bytes. The parsed directories are kept.
+        @param guid The unique ID of the device.
+        @param bytes The ROM, starting with the ROM header, in bus order.
+        @param length Size of the ROM in bytes.
+    */
+	
+	void extendROM( CSRNodeUniqueID guid, const void * bytes, UInt32 length );
+
+	/*!
+        @function removeROM
+        @abstract Forgets the stored ROM for a device.
+        @param guid The unique ID of the device.
+    */
+	
+	void removeROM( CSRNodeUniqueID guid );
+
+	virtual bool serialize( OSSerialize * s ) const;
+};
+
+#endif
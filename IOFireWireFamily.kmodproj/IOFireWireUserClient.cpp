@@ -287,6 +287,7 @@
 
 #import <sys/proc.h>
 #import <IOKit/IOMessage.h>
+#import <libkern/OSAtomic.h>
 #include <IOKit/IOKitKeysPrivate.h>
 
 #if FIRELOG
@@ -303,6 +304,7 @@
 #import "IOFWUserIsochChannel.h"
 #import "IOFWUserIsochPort.h"
 #import "IOFireWireLibPriv.h"
+#import "IOFireWireLib.h"
 #import "IOFireWireLocalNode.h"
 #import "IOFWUserCommand.h"
 #import "IOFWUserObjectExporter.h"
@@ -310,6 +312,7 @@
 #import "IOFWUserAsyncStreamListener.h"
 #import "IOFWUserVectorCommand.h"
 #import "IOFWUserPHYPacketListener.h"
+#import "IOFWAsyncCommandPool.h"
 
 #if IOFIREWIREUSERCLIENTDEBUG > 0
 
@@ -486,6 +489,8 @@ IOFireWireUserClient::free()
 		fExporter = NULL ;
 	}
 	
+	releaseCompletionQueue() ;
+	
 	if ( fOwner )
 	{
 		fOwner->release() ;
@@ -503,6 +508,8 @@ IOFireWireUserClient::clientClose ()
 
 	IOReturn	result = userClose() ;
 
+	releaseCompletionQueue() ;
+
 	if ( getProvider() && fOwner->isOpen() )
 	{
 		DebugLog("IOFireWireUserClient::clientClose(): client left user client open, should call close. Closing...\n") ;
@@ -617,6 +624,52 @@ static UInt32 getSelectorObjectLookupIndex(UInt32 selector)
 	return selectorObjectLookupIndex;
 }
 
+// getSelectorObjectType
+//
+// the class externalMethod casts an exporter managed object to for selector. the handle
+// in the selector only carries a slot index, so a stale one can name whatever object
+// took over the slot
+
+static const OSMetaClass * getSelectorObjectType(UInt32 selector)
+{
+	switch (selector)
+	{
+		case kPhysicalAddrSpace_GetSegmentCount_d:
+			return OSTypeID(IOFWUserPhysicalAddressSpace);
+
+		case kIsochPort_AllocatePort_d:
+		case kIsochPort_ReleasePort_d:
+		case kIsochPort_Start_d:
+		case kIsochPort_Stop_d:
+		case kLocalIsochPort_ModifyJumpDCL_d:
+		case kLocalIsochPort_Notify_d:
+			return OSTypeID(IOFWUserLocalIsochPort);
+
+		case kIsochChannel_UserReleaseChannelComplete_d:
+			return OSTypeID(IOFWUserIsochChannel);
+
+		case kCommand_Cancel_d:
+			return OSTypeID(IOFWCommand);
+
+		case kIsochPort_SetIsochResourceFlags_d:
+			return OSTypeID(IOFWLocalIsochPort);
+
+		case kVectorCommandSubmit:
+		case kVectorCommandSetBuffers:
+			return OSTypeID(IOFWUserVectorCommand);
+
+		case kPHYPacketListenerSetPacketCallback:
+		case kPHYPacketListenerSetSkippedCallback:
+		case kPHYPacketListenerActivate:
+		case kPHYPacketListenerDeactivate:
+		case kPHYPacketListenerClientCommandIsComplete:
+			return OSTypeID(IOFWUserPHYPacketListener);
+
+		default:
+			return NULL;
+	};
+}
+
 IOReturn
 IOFireWireUserClient::externalMethod( uint32_t selector, 
 										IOExternalMethodArguments * arguments, 
@@ -635,7 +688,15 @@ IOFireWireUserClient::externalMethod( uint32_t selector,
 
 	if ( !targetObject )
 	{
-		const OSObject * userObject = fExporter->lookupObject( (UserObjectHandle)( selector >> 16 ) ) ;
+		const OSObject * userObject = fExporter->lookupObjectForIndex( (UserObjectHandle)( selector >> 16 ) ) ;
+		
+		// a stale handle names whatever now lives in its slot, don't call it through the wrong class
+		const OSMetaClass * objectType = getSelectorObjectType( actualSelector ) ;
+		if ( userObject && (objectType == NULL || !userObject->metaCast( objectType )) )
+		{
+			userObject->release() ;
+			return kIOReturnBadArgument ;
+		}
 		
 		targetObject = (IOService*)userObject ;		// "interesting code" note:
 													// when we don't have an object set in our method table,
@@ -824,6 +885,13 @@ IOFireWireUserClient::externalMethod( uint32_t selector,
 															(IOReturn)arguments->scalarInput[2]);
 			break;
 		
+		case kPseudoAddrSpace_ClientCommandsAreComplete:
+			result = ((IOFireWireUserClient*) targetObject)->
+						addressSpace_ClientCommandsAreComplete((UserObjectHandle)arguments->scalarInput[0],
+															(FWClientCommandID)arguments->scalarInput[1],
+															(IOReturn)arguments->scalarInput[2]);
+			break;
+		
 		case kPhysicalAddrSpace_Allocate:
 		{
 			UserObjectHandle outAddressSpaceHandle;
@@ -1518,7 +1586,9 @@ IOFireWireUserClient::externalMethod( uint32_t selector,
 		case kVectorCommandSubmit:
 			result = ((IOFWUserVectorCommand*)targetObject)->submit(	arguments->asyncReference, 
 																		(mach_vm_address_t)arguments->scalarInput[0], 
-																		(io_user_reference_t)arguments->scalarInput[1] );
+																		(io_user_reference_t)arguments->scalarInput[1],
+																		(UInt32)arguments->scalarInput[2],
+																		(UInt32)arguments->scalarInput[3] );
 			break;
 
 		case kVectorCommandSetBuffers:
@@ -1562,6 +1632,14 @@ IOFireWireUserClient::externalMethod( uint32_t selector,
 			((IOFWUserPHYPacketListener*)targetObject)->clientCommandIsComplete( (FWClientCommandID)arguments->scalarInput[0] );
 			result = kIOReturnSuccess;
 			break;
+
+		case kCommandCompletionQueue_Set:
+			result = ((IOFireWireUserClient*) targetObject)->setCompletionQueue(	arguments->asyncReference,
+																				(mach_vm_address_t)arguments->scalarInput[0],
+																				(io_user_reference_t)arguments->scalarInput[1],
+																				(mach_vm_address_t)arguments->scalarInput[2],
+																				(mach_vm_size_t)arguments->scalarInput[3] );
+			break;
 			
 		default:
 			// NONE OF THE ABOVE :(
@@ -1802,7 +1880,7 @@ IOFireWireUserClient::readQuad ( const ReadQuadParams* params, UInt32* outVal )
 	if( !err )
 		err = cmd->getStatus();
 
-	cmd->release();
+	IOFWAsyncCommandPool::recycleCommand( cmd );
 
 	return err;
 }
@@ -1861,7 +1939,7 @@ IOFireWireUserClient::read ( const ReadParams* params, IOByteCount* outBytesTran
 		
 	*outBytesTransferred = cmd->getBytesTransferred() ;
 
-	cmd->release();
+	IOFWAsyncCommandPool::recycleCommand( cmd );
 	mem->release();
 
 	return err;
@@ -1890,7 +1968,7 @@ IOFireWireUserClient::writeQuad( const WriteQuadParams* params)
 	if( err )
 		err = cmd->getStatus();
 	
-	cmd->release();
+	IOFWAsyncCommandPool::recycleCommand( cmd );
 
 	return err;
 }
@@ -1945,7 +2023,7 @@ IOFireWireUserClient::write( const WriteParams* params, IOByteCount* outBytesTra
 	if ( !error )
 		*outBytesTransferred = cmd->getBytesTransferred() ;
 	
-	cmd->release();
+	IOFWAsyncCommandPool::recycleCommand( cmd );
 	
 	mem->complete() ;
 	mem->release() ;
@@ -2489,6 +2567,35 @@ IOFireWireUserClient::addressSpace_ClientCommandIsComplete (
 	return result ;
 }
 
+// addressSpace_ClientCommandsAreComplete
+//
+// Retires every outstanding packet of the address space up to and including inLastCommandID
+
+IOReturn
+IOFireWireUserClient::addressSpace_ClientCommandsAreComplete (
+	UserObjectHandle		addressSpaceHandle,
+	FWClientCommandID		inLastCommandID,
+	IOReturn				inResult)
+{
+	const OSObject * object = fExporter->lookupObject( addressSpaceHandle ) ;
+	if ( !object )
+	{
+		return kIOReturnBadArgument ;
+	}
+
+	IOFWUserPseudoAddressSpace *	me	= OSDynamicCast( IOFWUserPseudoAddressSpace, object ) ;
+	if (!me)
+	{
+		object->release() ;
+		return kIOReturnBadArgument ;
+	}
+	
+	me->clientCommandsAreComplete ( inLastCommandID, inResult ) ;
+	me->release() ;
+	
+	return kIOReturnSuccess ;
+}
+
 IOReturn
 IOFireWireUserClient::setAsyncRef_Packet (
 	OSAsyncReference64		asyncRef,
@@ -3737,6 +3844,7 @@ IOFireWireUserClient::userAsyncCommand_Submit(
 	
 			cmd->setAsyncReference64( asyncRef ) ;
 			cmd->setRefCon( (mach_vm_address_t)params->refCon);
+			cmd->setQueueCompletion( (params->flags & kFWCommandInterfaceCompletionQueue) != 0 ) ;
 
 			error = cmd->submit( params, outResult ) ;
 		}
@@ -3747,6 +3855,224 @@ IOFireWireUserClient::userAsyncCommand_Submit(
 	return error ;
 }
 
+// setCompletionQueue
+//
+// maps the completion queue the library allocated, or releases the current one
+// when address is 0. asyncRef is used for the wakeup messages.
+
+IOReturn
+IOFireWireUserClient::setCompletionQueue(
+	OSAsyncReference64		asyncRef,
+	mach_vm_address_t		inCallback,
+	io_user_reference_t		inRefCon,
+	mach_vm_address_t		address,
+	mach_vm_size_t			size )
+{
+	IOReturn					status = kIOReturnSuccess ;
+	IOMemoryDescriptor *		desc = NULL ;
+	IOMemoryMap *				map = NULL ;
+	CompletionQueueHeader *		queue = NULL ;
+	UInt32						entryCount = 0 ;
+	
+	releaseCompletionQueue() ;
+	
+	if ( address == 0 )
+	{
+		return kIOReturnSuccess ;
+	}
+	
+	if ( size < sizeof(CompletionQueueHeader) + sizeof(CompletionQueueEntry) )
+	{
+		status = kIOReturnBadArgument ;
+	}
+	
+	if ( status == kIOReturnSuccess )
+	{
+		desc = IOMemoryDescriptor::withAddressRange( address, size, kIODirectionInOut, getOwningTask() ) ;
+		if ( desc == NULL )
+		{
+			status = kIOReturnNoMemory ;
+		}
+	}
+	
+	if ( status == kIOReturnSuccess )
+	{
+		status = desc->prepare() ;
+		if ( status != kIOReturnSuccess )
+		{
+			desc->release() ;
+			desc = NULL ;
+		}
+	}
+	
+	if ( status == kIOReturnSuccess )
+	{
+		map = desc->map() ;
+		if ( map == NULL )
+		{
+			status = kIOReturnVMError ;
+		}
+	}
+	
+	if ( status == kIOReturnSuccess )
+	{
+		// the entry count is read once, the library can't grow the queue under us
+		queue = (CompletionQueueHeader*)map->getVirtualAddress() ;
+		entryCount = queue->entryCount ;
+		
+		if ( (entryCount == 0) || (entryCount & (entryCount - 1)) ||
+			 (entryCount > (size - sizeof(CompletionQueueHeader)) / sizeof(CompletionQueueEntry)) )
+		{
+			status = kIOReturnBadArgument ;
+		}
+	}
+	
+	if ( status == kIOReturnSuccess )
+	{
+		super::setAsyncReference64( asyncRef, (mach_port_t) asyncRef[0], inCallback, inRefCon ) ;
+
+		fOwner->getController()->closeGate() ;
+		
+		bcopy( asyncRef, fCompletionQueueAsyncRef, sizeof(OSAsyncReference64) ) ;
+		fCompletionQueueDesc = desc ;
+		fCompletionQueueMap = map ;
+		fCompletionQueueEntryCount = entryCount ;
+		fCompletionQueueProducer = queue->producer ;
+		fCompletionQueue = queue ;
+
+		fOwner->getController()->openGate() ;
+	}
+	else
+	{
+		if ( map )
+		{
+			map->release() ;
+		}
+		
+		if ( desc )
+		{
+			desc->complete() ;
+			desc->release() ;
+		}
+	}
+	
+	return status ;
+}
+
+// releaseCompletionQueue
+//
+//
+
+void
+IOFireWireUserClient::releaseCompletionQueue()
+{
+	IOMemoryDescriptor *	desc = NULL ;
+	IOMemoryMap *			map = NULL ;
+	
+	if ( fOwner )
+	{
+		fOwner->getController()->closeGate() ;
+	}
+	
+	desc = fCompletionQueueDesc ;
+	map = fCompletionQueueMap ;
+	
+	fCompletionQueue = NULL ;
+	fCompletionQueueMap = NULL ;
+	fCompletionQueueDesc = NULL ;
+	fCompletionQueueEntryCount = 0 ;
+	
+	if ( fOwner )
+	{
+		fOwner->getController()->openGate() ;
+	}
+	
+	if ( map )
+	{
+		map->release() ;
+	}
+	
+	if ( desc )
+	{
+		desc->complete() ;
+		desc->release() ;
+	}
+}
+
+// queueCompletion
+//
+// called on the workloop by commands submitted with kFWCommandInterfaceCompletionQueue.
+// appends the completion to the shared queue and only wakes the library if it isn't
+// already draining. when the queue is full, or the completion doesn't fit in an entry,
+// it goes to the queue's callback tagged with the producer index so the library
+// delivers everything queued ahead of it first.
+
+IOReturn
+IOFireWireUserClient::queueCompletion(
+	OSAsyncReference64		asyncRef,
+	IOReturn				status,
+	io_user_reference_t		args[],
+	UInt32					numArgs )
+{
+	CompletionQueueHeader *	queue = fCompletionQueue ;
+	
+	if ( queue == NULL || asyncRef[0] == 0 )
+	{
+		return sendAsyncResult64( asyncRef, status, args, numArgs ) ;
+	}
+	
+	// the consumer index is the library's, don't trust it further than the ring size
+	UInt32 used = fCompletionQueueProducer - queue->consumer ;
+	if ( (used >= fCompletionQueueEntryCount) || (numArgs > kCompletionQueueMaxArgs) )
+	{
+		queue->overflows++ ;
+		
+		if ( numArgs + kCompletionQueueOverflowArgs > kCompletionQueueMaxArgs )
+		{
+			// no room to tag it, this one can still overtake queued entries
+			return sendAsyncResult64( asyncRef, status, args, numArgs ) ;
+		}
+		
+		io_user_reference_t overflowArgs[ kCompletionQueueMaxArgs ] ;
+		overflowArgs[0] = fCompletionQueueProducer ;
+		overflowArgs[1] = asyncRef[ kIOAsyncCalloutFuncIndex ] ;
+		overflowArgs[2] = asyncRef[ kIOAsyncCalloutRefconIndex ] ;
+		bcopy( args, &overflowArgs[ kCompletionQueueOverflowArgs ], numArgs * sizeof(io_user_reference_t) ) ;
+		
+		return sendAsyncResult64( fCompletionQueueAsyncRef, status, overflowArgs, numArgs + kCompletionQueueOverflowArgs ) ;
+	}
+	
+	CompletionQueueEntry * entry = (CompletionQueueEntry*)(queue + 1) + (fCompletionQueueProducer & (fCompletionQueueEntryCount - 1)) ;
+	entry->callback = asyncRef[ kIOAsyncCalloutFuncIndex ] ;
+	entry->refCon = asyncRef[ kIOAsyncCalloutRefconIndex ] ;
+	entry->status = status ;
+	entry->argCount = numArgs ;
+	bcopy( args, entry->args, numArgs * sizeof(io_user_reference_t) ) ;
+
+	// publish the entry before the producer index, and the producer index before
+	// looking at wakeupPending, which the library clears before it drains
+	OSMemoryBarrier() ;
+	fCompletionQueueProducer++ ;
+	queue->producer = fCompletionQueueProducer ;
+	OSMemoryBarrier() ;
+	
+	if ( queue->wakeupPending )
+	{
+		return kIOReturnSuccess ;
+	}
+	
+	queue->wakeupPending = 1 ;
+	
+	IOReturn error = sendAsyncResult64( fCompletionQueueAsyncRef, kIOReturnSuccess, NULL, 0 ) ;
+	if ( error )
+	{
+		// no wakeup is on its way, let the next completion try again
+		queue->wakeupPending = 0 ;
+	}
+	
+	return error ;
+}
+
 //
 // --- absolute address firewire commands ----------
 //
@@ -3758,7 +4084,20 @@ IOFireWireUserClient::createReadCommand(
 	FWDeviceCallback	 		completion,
 	void*					refcon ) const
 {
-	IOFWReadCommand* result = OSTypeAlloc( IOFWReadCommand );
+	// reuse an idle command if the controller has one
+	IOFWReadCommand* result = (IOFWReadCommand*)getOwner ()->getController()->getCommandPool()->checkoutCommand( OSTypeID(IOFWReadCommand), NULL ) ;
+	if ( result )
+	{
+		if ( result->reinit( generation, devAddress, hostMem, completion, refcon ) != kIOReturnSuccess )
+		{
+			result->release() ;
+			result = NULL ;
+		}
+		
+		return result ;
+	}
+	
+	result = OSTypeAlloc( IOFWReadCommand );
 	if ( result && !result->initAll( getOwner ()->getController(), generation, devAddress, hostMem, completion, refcon ) )
 	{
 		result->release() ;
@@ -3777,7 +4116,20 @@ IOFireWireUserClient::createReadQuadCommand(
 	FWDeviceCallback 		completion,
 	void *					refcon ) const
 {
-	IOFWReadQuadCommand* result = OSTypeAlloc( IOFWReadQuadCommand );
+	// reuse an idle command if the controller has one
+	IOFWReadQuadCommand* result = (IOFWReadQuadCommand*)getOwner ()->getController()->getCommandPool()->checkoutCommand( OSTypeID(IOFWReadQuadCommand), NULL ) ;
+	if ( result )
+	{
+		if ( result->reinit( generation, devAddress, quads, numQuads, completion, refcon ) != kIOReturnSuccess )
+		{
+			result->release() ;
+			result = NULL ;
+		}
+		
+		return result ;
+	}
+	
+	result = OSTypeAlloc( IOFWReadQuadCommand );
 	if ( result && !result->initAll( getOwner ()->getController(), generation, devAddress, quads, numQuads, completion, refcon ) )
 	{
 		result->release() ;
@@ -3795,7 +4147,20 @@ IOFireWireUserClient::createWriteCommand(
 	FWDeviceCallback 		completion,
 	void*					refcon ) const
 {
-	IOFWWriteCommand* result = OSTypeAlloc( IOFWWriteCommand );
+	// reuse an idle command if the controller has one
+	IOFWWriteCommand* result = (IOFWWriteCommand*)getOwner ()->getController()->getCommandPool()->checkoutCommand( OSTypeID(IOFWWriteCommand), NULL ) ;
+	if ( result )
+	{
+		if ( result->reinit( generation, devAddress, hostMem, completion, refcon ) != kIOReturnSuccess )
+		{
+			result->release() ;
+			result = NULL ;
+		}
+		
+		return result ;
+	}
+	
+	result = OSTypeAlloc( IOFWWriteCommand );
 	if ( result && !result->initAll( getOwner ()->getController(), generation, devAddress, hostMem, completion, refcon ) )
 	{
 		result->release() ;
@@ -3814,7 +4179,20 @@ IOFireWireUserClient::createWriteQuadCommand(
 	FWDeviceCallback 		completion,
 	void *					refcon ) const
 {
-	IOFWWriteQuadCommand* result = OSTypeAlloc( IOFWWriteQuadCommand );
+	// reuse an idle command if the controller has one
+	IOFWWriteQuadCommand* result = (IOFWWriteQuadCommand*)getOwner ()->getController()->getCommandPool()->checkoutCommand( OSTypeID(IOFWWriteQuadCommand), NULL ) ;
+	if ( result )
+	{
+		if ( result->reinit( generation, devAddress, quads, numQuads, completion, refcon ) != kIOReturnSuccess )
+		{
+			result->release() ;
+			result = NULL ;
+		}
+		
+		return result ;
+	}
+	
+	result = OSTypeAlloc( IOFWWriteQuadCommand );
 	if ( result && !result->initAll( getOwner ()->getController(), generation, devAddress, quads, numQuads, completion, refcon ) )
 	{
 		result->release() ;
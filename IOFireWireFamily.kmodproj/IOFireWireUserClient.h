@@ -221,6 +221,14 @@ class IOFireWireUserClient : public IOUserClient
 #endif
 
 		IOFireWireLib::UserObjectHandle		fSessionRef;
+
+		// completion queue, touched under the workloop gate
+		IOMemoryDescriptor *				fCompletionQueueDesc ;
+		IOMemoryMap *						fCompletionQueueMap ;
+		CompletionQueueHeader *				fCompletionQueue ;
+		UInt32								fCompletionQueueEntryCount ;
+		UInt32								fCompletionQueueProducer ;
+		OSAsyncReference64					fCompletionQueueAsyncRef ;
 	
 	public:
 	
@@ -371,6 +379,10 @@ class IOFireWireUserClient : public IOUserClient
 												UserObjectHandle		inAddrSpaceRef,
 												FWClientCommandID		inCommandID,
 												IOReturn				inResult ) ;	
+		IOReturn						addressSpace_ClientCommandsAreComplete (
+												UserObjectHandle		inAddrSpaceRef,
+												FWClientCommandID		inLastCommandID,
+												IOReturn				inResult ) ;
 
 		IOReturn						setAsyncStreamRef_Packet (
 												OSAsyncReference64		asyncRef,
@@ -458,6 +470,18 @@ class IOFireWireUserClient : public IOUserClient
 												IOReturn 							status, 
 												IOFireWireNub *						device, 
 												IOFWCommand *						fwCmd ) ;
+		IOReturn						setCompletionQueue(
+												OSAsyncReference64					asyncRef,
+												mach_vm_address_t					inCallback,
+												io_user_reference_t					inRefCon,
+												mach_vm_address_t					address,
+												mach_vm_size_t						size ) ;
+		void							releaseCompletionQueue() ;
+		IOReturn						queueCompletion(
+												OSAsyncReference64					asyncRef,
+												IOReturn							status,
+												io_user_reference_t					args[],
+												UInt32								numArgs ) ;
 		
 #pragma mark -
 		// config directory functions
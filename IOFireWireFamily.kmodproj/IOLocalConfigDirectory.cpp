@@ -59,6 +59,11 @@ bool IOLocalConfigDirectory::init()
     fEntries = OSArray::withCapacity(2);
     if(!fEntries)
         return false;
+    reserved = (ExpansionData *)IOMalloc( sizeof(ExpansionData) );
+    if(!reserved)
+        return false;
+    bzero( reserved, sizeof(ExpansionData) );
+    reserved->fDirty = true;
     return true;
 }
 
@@ -72,6 +77,13 @@ void IOLocalConfigDirectory::free()
         fEntries->release();
     if(fROM)
         fROM->release();
+    if(reserved)
+    {
+        if(reserved->fImage)
+            reserved->fImage->release();
+        IOFree( reserved, sizeof(ExpansionData) );
+        reserved = NULL;
+    }
 IOConfigDirectory::free();
 }
 
@@ -192,6 +204,7 @@ IOReturn IOLocalConfigDirectory::incrementGeneration( void )
         if( (entry->fType == kConfigImmediateKeyType) && (entry->fKey == kConfigGenerationKey) )
 		{
 			entry->fValue++;
+			reserved->fDirty = true;
 		}
 	}
 
@@ -200,142 +213,217 @@ IOReturn IOLocalConfigDirectory::incrementGeneration( void )
 
 // compile
 //
-//
-	
+// appends this directory and everything below it to rom. entries point at their
+// leaves and subdirectories with offsets relative to themselves, so a subtree that
+// hasn't changed is copied in as it was last built rather than serialized again.
+
 IOReturn IOLocalConfigDirectory::compile(OSData *rom)
 {
-    UInt32 header;
-    UInt32 big_header;
-	UInt16 crc = 0;
-    OSData *tmp;	// Temporary data for directory entries.
-    unsigned int size;
-    unsigned int numEntries;
-    unsigned int i;
-    unsigned int offset = 0;
-    if(fROM)
-        fROM->release();
-    fROM = rom;
-    rom->retain();
-    size = fROM->getLength();
-    fStart = size/sizeof(UInt32);
-    numEntries = fEntries->getCount();
-    
-    /*
-     * We can't just compile into the rom, because the CRC for the directory
-     * depends on the entry data, and we can't (legally) overwrite data in an
-     * OSData (it needs an overwriteBytes() method).
-     * So compile into tmp, then calculate crc, then append lenth|crc and tmp.
-     */
-
-    rom->ensureCapacity(size + sizeof(UInt32)*(1+numEntries));
-    tmp = OSData::withCapacity(sizeof(UInt32)*(numEntries));
-    for( i = 0; i < numEntries; i++ ) 
+	bool changed;
+	IOReturn status = buildImage( changed );
+	if( status != kIOReturnSuccess )
+		return status;
+
+	UInt32 start = rom->getLength() / sizeof(UInt32);
+	if( !rom->appendBytes( reserved->fImage ) )
+		return kIOReturnNoMemory;
+
+	place( rom, start );
+
+	return kIOReturnSuccess;
+}
+
+// buildImage
+//
+// rebuilds fImage if our entries changed or any subdirectory's image was rebuilt,
+// since a subdirectory that changed size moves everything after it
+
+IOReturn IOLocalConfigDirectory::buildImage( bool & changed )
+{
+	IOReturn status = kIOReturnSuccess;
+	unsigned int numEntries = fEntries->getCount();
+	unsigned int i;
+	bool dirty = reserved->fDirty || (reserved->fImage == NULL);
+
+	changed = false;
+
+	for( i = 0; i < numEntries; i++ )
 	{
-        IOConfigEntry *entry = OSDynamicCast(IOConfigEntry, fEntries->getObject(i));
-        UInt32 val;
-		UInt32 big_val;
-        if(!entry)
+		IOConfigEntry * entry = OSDynamicCast( IOConfigEntry, fEntries->getObject(i) );
+		if( entry == NULL )
 		{
-			IOLog(__FILE__" %d internal error!\n", __LINE__ )  ;
-            return kIOReturnInternalError;	// Oops!
+			IOLog( __FILE__" %d internal error!\n", __LINE__ );
+			return kIOReturnInternalError;
 		}
-		
-        switch(entry->fType) 
+
+		if( entry->fType == kConfigDirectoryKeyType )
+		{
+			IOLocalConfigDirectory * dir = OSDynamicCast( IOLocalConfigDirectory, entry->fData );
+			if( dir == NULL )
+				return kIOReturnInternalError;
+
+			bool dir_changed;
+			status = dir->buildImage( dir_changed );
+			if( status != kIOReturnSuccess )
+				return status;
+
+			if( dir_changed )
+				dirty = true;
+		}
+	}
+
+	if( !dirty )
+		return kIOReturnSuccess;
+
+	/*
+	 * The CRC for the directory depends on the entry data, and we can't (legally)
+	 * overwrite data in an OSData. So compile the entries into tmp, calculate
+	 * the crc over it, then append length|crc and tmp.
+	 */
+
+	UInt16 crc;
+	unsigned int offset = 0;
+	OSData * tmp = OSData::withCapacity( sizeof(UInt32) * numEntries );
+	if( tmp == NULL )
+		return kIOReturnNoMemory;
+
+	for( i = 0; i < numEntries; i++ )
+	{
+		IOConfigEntry * entry = (IOConfigEntry*)fEntries->getObject(i);
+		UInt32 val;
+		UInt32 big_val;
+
+		switch( entry->fType )
 		{
-            case kConfigImmediateKeyType:
+			case kConfigImmediateKeyType:
 				val = entry->fValue;
-                break;
-            case kConfigOffsetKeyType:
-                val = (entry->fAddr.addressLo-kCSRRegisterSpaceBaseAddressLo)/sizeof(UInt32);
-                break;
-            case kConfigLeafKeyType:
-            case kConfigDirectoryKeyType:
-                val = numEntries-i+offset;
-                offset += entry->totalSize();
-                break;
-            default:
-				IOLog(__FILE__" %d internal error!\n", __LINE__ )  ;
-                return kIOReturnInternalError;	// Oops!
-        }
-		
-        val |= entry->fKey << kConfigEntryKeyValuePhase;
-        val |= entry->fType << kConfigEntryKeyTypePhase;
-		
+				break;
+			case kConfigOffsetKeyType:
+				val = (entry->fAddr.addressLo-kCSRRegisterSpaceBaseAddressLo)/sizeof(UInt32);
+				break;
+			case kConfigLeafKeyType:
+				val = numEntries-i+offset;
+				offset += entry->totalSize();
+				break;
+			case kConfigDirectoryKeyType:
+				val = numEntries-i+offset;
+				offset += ((IOLocalConfigDirectory*)entry->fData)->reserved->fImage->getLength() / sizeof(UInt32);
+				break;
+			default:
+				IOLog( __FILE__" %d internal error!\n", __LINE__ );
+				tmp->release();
+				return kIOReturnInternalError;
+		}
+
+		val |= entry->fKey << kConfigEntryKeyValuePhase;
+		val |= entry->fType << kConfigEntryKeyTypePhase;
+
 		big_val = OSSwapHostToBigInt32( val );
-        crc = FWUpdateCRC16(crc, big_val);
-		
-        tmp->appendBytes(&big_val, sizeof(UInt32));
-    }
-	
-    header = numEntries << kConfigLeafDirLengthPhase;
-    header |= crc;
-	big_header = OSSwapHostToBigInt32( header );
-    rom->appendBytes(&big_header, sizeof(UInt32));
-    rom->appendBytes(tmp);
-    tmp->release();
-
-    // Now (recursively) append each leaf and directory.
-    for(i=0; i<numEntries; i++) 
+		tmp->appendBytes( &big_val, sizeof(UInt32) );
+	}
+
+	crc = FWComputeCRC16( (const UInt32 *)tmp->getBytesNoCopy(), numEntries );
+
+	OSData * image = OSData::withCapacity( sizeof(UInt32) * (1 + numEntries + offset) );
+	if( image == NULL )
 	{
-        IOConfigEntry *entry = OSDynamicCast(IOConfigEntry, fEntries->getObject(i));
-        UInt32 val;
-		UInt32 big_val;
-        if(!entry)
+		tmp->release();
+		return kIOReturnNoMemory;
+	}
+
+	UInt32 big_header = OSSwapHostToBigInt32( (numEntries << kConfigLeafDirLengthPhase) | crc );
+	image->appendBytes( &big_header, sizeof(UInt32) );
+	image->appendBytes( tmp );
+	tmp->release();
+
+	// then each leaf and directory, in entry order
+	for( i = 0; i < numEntries && status == kIOReturnSuccess; i++ )
+	{
+		IOConfigEntry * entry = (IOConfigEntry*)fEntries->getObject(i);
+
+		if( entry->fType == kConfigLeafKeyType )
 		{
-            return kIOReturnInternalError;	// Oops!
-        }
-		switch(entry->fType) 
+			OSData * data = OSDynamicCast( OSData, entry->fData );
+			if( data == NULL )
+			{
+				status = kIOReturnInternalError;
+				break;
+			}
+
+			// the leaf is padded out to a quadlet with zeros, they are part of its CRC
+			const UInt32 * buffer = (const UInt32 *)data->getBytesNoCopy();
+			unsigned int len = data->getLength();
+			unsigned int pad = (4 - (len & 3)) & 3;
+			UInt32 tail = 0;
+
+			crc = FWComputeCRC16( buffer, len / 4 );
+			if( pad )
+			{
+				bcopy( buffer + (len / 4), &tail, len & 3 );
+				crc = FWUpdateCRC16( crc, tail );
+			}
+
+			UInt32 big_val = OSSwapHostToBigInt32( (((len + pad) / 4) << kConfigLeafDirLengthPhase) | crc );
+			image->appendBytes( &big_val, sizeof(UInt32) );
+			image->appendBytes( buffer, len - (len & 3) );
+			if( pad )
+				image->appendBytes( &tail, sizeof(UInt32) );
+		}
+		else if( entry->fType == kConfigDirectoryKeyType )
 		{
-            case kConfigImmediateKeyType:
-            case kConfigOffsetKeyType:
-                break;
-            case kConfigLeafKeyType:
-            {
-                OSData *data = OSDynamicCast(OSData, entry->fData);
-                const void *buffer;
-                unsigned int len, pad;
-                if(data) 
-				{
-                    len = data->getLength();
-                    pad = (4 - (len & 3)) & 3;
-                    if(pad) 
-					{
-                        len += pad;
-                        // Make sure the buffer is big enough for the CRC calc.
-                        data->ensureCapacity(len);
-                    }
-                    buffer = data->getBytesNoCopy();
-                }
-                else
-				{
-                    return kIOReturnInternalError;	// Oops!
-                }
-				
-				crc = FWComputeCRC16((const UInt32 *)buffer, len / 4);
-                val = (len/4) << kConfigLeafDirLengthPhase;
-                val |= crc;
-				big_val = OSSwapHostToBigInt32( val );
-				rom->appendBytes(&big_val, sizeof(UInt32));
-                rom->appendBytes(buffer, len);
-                break;
-            }
-            case kConfigDirectoryKeyType:
-            {
-                IOReturn res;
-                IOLocalConfigDirectory *dir = OSDynamicCast(IOLocalConfigDirectory,
-                                                         	entry->fData);
-                if(!dir)
-                    return kIOReturnInternalError;	// Oops!
-                res = dir->compile(rom);
-                if(kIOReturnSuccess != res)
-                    return res;
-                break;
-            }
-            default:
-                return kIOReturnInternalError;	// Oops!
-       }
-    }
-    return kIOReturnSuccess;                           
+			image->appendBytes( ((IOLocalConfigDirectory*)entry->fData)->reserved->fImage );
+		}
+	}
+
+	if( status != kIOReturnSuccess )
+	{
+		image->release();
+		return status;
+	}
+
+	if( reserved->fImage )
+		reserved->fImage->release();
+	reserved->fImage = image;
+	reserved->fDirty = false;
+
+	changed = true;
+
+	return kIOReturnSuccess;
+}
+
+// place
+//
+// points this directory and those below it at the compiled rom, start is where our
+// image was appended
+
+void IOLocalConfigDirectory::place( OSData * rom, UInt32 start )
+{
+	invalidateKeyIndex();
+
+	rom->retain();
+	if( fROM )
+		fROM->release();
+	fROM = rom;
+	fStart = start;
+
+	unsigned int numEntries = fEntries->getCount();
+	UInt32 offset = start + 1 + numEntries;
+
+	for( unsigned int i = 0; i < numEntries; i++ )
+	{
+		IOConfigEntry * entry = (IOConfigEntry*)fEntries->getObject(i);
+
+		if( entry->fType == kConfigLeafKeyType )
+		{
+			offset += entry->totalSize();
+		}
+		else if( entry->fType == kConfigDirectoryKeyType )
+		{
+			IOLocalConfigDirectory * dir = (IOLocalConfigDirectory*)entry->fData;
+			dir->place( rom, offset );
+			offset += dir->reserved->fImage->getLength() / sizeof(UInt32);
+		}
+	}
 }
 
 // addEntry
@@ -370,6 +458,7 @@ IOReturn IOLocalConfigDirectory::addEntry(int key, UInt32 value, OSString* desc
 	
 	// keep our count current...
 	fNumEntries = fEntries->getCount() ;
+	reserved->fDirty = true;
 	
 	return res;
 }
@@ -404,6 +493,7 @@ IOReturn IOLocalConfigDirectory::addEntry( int key, IOLocalConfigDirectory *valu
 
 	// keep our count current...
 	fNumEntries = fEntries->getCount() ;
+	reserved->fDirty = true;
 
 	return res;
 }
@@ -450,6 +540,7 @@ IOReturn IOLocalConfigDirectory::addEntry(int key, OSData *value, OSString* desc
 	
 	// keep our count current...
 	fNumEntries = fEntries->getCount() ;
+	reserved->fDirty = true;
 
 	return res;
 }
@@ -483,6 +574,7 @@ IOReturn IOLocalConfigDirectory::addEntry( int key, FWAddress value, OSString* d
 
 	// keep our count current...
 	fNumEntries = fEntries->getCount() ;
+	reserved->fDirty = true;
 
 	return res;
 }
@@ -525,6 +617,7 @@ IOReturn IOLocalConfigDirectory::addEntry(OSString *desc)
 
 	// keep our count current...
 	fNumEntries = fEntries->getCount() ;
+	reserved->fDirty = true;
 
     return res;
 }
@@ -553,6 +646,7 @@ IOReturn IOLocalConfigDirectory::removeSubDir(IOLocalConfigDirectory *value)
 
 				// keep our count current...
 				fNumEntries = fEntries->getCount() ;
+				reserved->fDirty = true;
 
 				return kIOReturnSuccess;
 			}
@@ -50,7 +50,11 @@ protected:
 /*! @struct ExpansionData
 	@discussion This structure will be used to expand the capablilties of the class in the future.
 	*/    
-	struct ExpansionData { };
+	struct ExpansionData 
+	{
+		OSData *	fImage;		// this directory and everything below it, as last compiled
+		bool		fDirty;		// entries changed since fImage was built
+	};
 
 /*! @var reserved
 	Reserved for future use.  (Internal use only)  */
@@ -99,6 +103,8 @@ protected:
 	virtual IOReturn addEntry(OSString *desc);
 
 	IOReturn	incrementGeneration( void );
+	IOReturn	buildImage( bool & changed );
+	void		place( OSData * rom, UInt32 start );
 	static void	exporterCleanup( const OSObject * self, IOFWUserObjectExporter * exporter ) ;
 		
 private:
@@ -75,6 +75,10 @@ public:
     */
     virtual IOReturn update(UInt32 offset, const UInt32 *&romBase);
 
+	// quad offset of the directory header from the start of the ROM
+	int getStart( void ) const
+		{ return fStart; };
+
 protected:
 	
 	virtual const UInt32 * lockData( void );
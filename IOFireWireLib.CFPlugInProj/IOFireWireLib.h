@@ -1225,6 +1225,14 @@ typedef struct IOFireWireDeviceInterface_t
 					using the contents of the backing store. The user process will not be notified of reads.</li>
 				<li>kFWAddressSpaceAutoCopyOnWrite -- Writes to this address space will be made directly
 					to the backing store at the same time the user process is notified of a write.</li>
+				<li>kFWAddressSpaceAutoRetireWrites -- Packets are handed to the client as they arrive rather than
+					one at a time, and must be completed in the order they were received. Calling ClientCommandIsComplete
+					completes the given packet and every packet received before it. Completing a write only frees
+					its queue space, which needs no call into the kernel, and skipped packets need not be
+					completed at all.</li>
+				<li>kFWAddressSpaceAutoLockReply -- Lock requests (mask swap, compare swap, fetch add, little add,
+					bounded add and wrap add, 32 or 64 bit) are carried out atomically on the backing store and
+					answered right away. The user process will not be notified of locks. Requires a backing store.</li>
 			</ul>
 		@param iid An ID number, of type CFUUIDBytes (see CFUUID.h), identifying the
 			type of interface to be returned for the created pseudo address space object.
@@ -1456,6 +1464,14 @@ typedef struct IOFireWireDeviceInterface_t
 				<li>kFWAddressSpaceExclusive -- Ensures that the allocation of this address space will fail if any portion
 					of this address range is already allocated. If the allocation is successful this flag ensures that any 
 					future allocations overlapping this range will fail even if allocted with kFWAddressSpaceShareIfExists.</li>
+				<li>kFWAddressSpaceAutoRetireWrites -- Packets are handed to the client as they arrive rather than
+					one at a time, and must be completed in the order they were received. Calling ClientCommandIsComplete
+					completes the given packet and every packet received before it. Completing a write only frees
+					its queue space, which needs no call into the kernel, and skipped packets need not be
+					completed at all.</li>
+				<li>kFWAddressSpaceAutoLockReply -- Lock requests (mask swap, compare swap, fetch add, little add,
+					bounded add and wrap add, 32 or 64 bit) are carried out atomically on the backing store and
+					answered right away. The user process will not be notified of locks. Requires a backing store.</li>
 			</ul>
 		@param iid An ID number, of type CFUUIDBytes (see CFUUID.h), identifying the
 			type of interface to be returned for the created pseudo address space object.
@@ -1961,7 +1977,9 @@ typedef enum
 	kFWAddressSpaceAutoReadReply	= (1 << 3) ,
 	kFWAddressSpaceAutoCopyOnWrite	= (1 << 4) ,
 	kFWAddressSpaceShareIfExists	= (1 << 5) ,
-	kFWAddressSpaceExclusive		= (1 << 6)
+	kFWAddressSpaceExclusive		= (1 << 6) ,
+	kFWAddressSpaceAutoRetireWrites	= (1 << 7) ,
+	kFWAddressSpaceAutoLockReply	= (1 << 8)
 } FWAddressSpaceFlags ;
 
 #ifndef KERNEL
@@ -2318,7 +2336,10 @@ enum
 	kFWCommandInterfaceSyncExecute			= (1 << 2),
 	kFWCommandInterfaceAbsolute				= (1 << 3),
 	kFWVectorCommandInterfaceOrdered		= (1 << 4),
-	kFWCommandInterfaceForceBlockRequest	= (1 << 5)
+	kFWCommandInterfaceForceBlockRequest	= (1 << 5),
+	kFWCommandInterfaceCompletionQueue		= (1 << 6),
+	kFWCommandInterfaceVectorBarrier		= (1 << 7),
+	kFWVectorCommandInterfaceProgress		= (1 << 8)
 } ;
 
 /*! @enum IOFireWireLib failOnReset Flags
@@ -3107,6 +3128,14 @@ enum {
 				<li>kFWCommandInterfaceForceBlockRequest -- Setting this flag causes read and write \
 					transactions to use block request packets even if the payload is 4 bytes. If this \
 					flag is not set 4 byte transactions will occur using quadlet transactions.</li> \
+				<li>kFWCommandInterfaceCompletionQueue -- Setting this flag causes the completion \
+					of an asynchronous command to be delivered through a queue shared with the kernel \
+					instead of its own message. One message wakes the run loop for any number of \
+					queued completions, which reduces the cost of running many small transactions. \
+					The completion callback is still called on the device interface's run loop.</li> \
+				<li>kFWCommandInterfaceVectorBarrier -- When the command is part of a vector command \
+					it is not sent until every command ahead of it in the vector has completed, and \
+					no command after it is sent until it has completed. Ignored outside a vector.</li> \
 			</ul>*/ \
 	void				(*SetFlags)(IOFireWireLibCommandRef self, UInt32 inFlags)
 
@@ -3589,11 +3618,16 @@ IOVirtualRangeMake( IOVirtualAddress address, IOByteCount length )
 
 /*!	@class
 	@abstract IOFireWireLib command object for grouping commands execution.
-	@discussion Read and Write commands can be attached in order to the vector command. When 
-		the vector command is submitted all the commands are sent to the kernel for execution.
-		When all the commands in a vector command are complete the vector command's completion is called.
-		The advantage over submitting and completeing each command simultaneously is that only one kernel transition
-		will be used for submission and one for completion, regardless of the number of commands in the vector.*/
+	@discussion Read, Write, ReadQuadlet, WriteQuadlet, CompareSwap and PHY commands, to any number of
+		nodes, can be attached in order to the vector command. When the vector command is submitted all the
+		commands are sent to the kernel for execution. Commands are sent to the bus together, limited only by
+		the transaction labels available for each node, unless kFWVectorCommandInterfaceOrdered or a command's
+		kFWCommandInterfaceVectorBarrier flag holds them back. When all the commands in a vector command are
+		complete each command's completion is called in vector order, followed by the vector command's
+		completion. The advantage over submitting and completeing each command simultaneously is that only one
+		kernel transition will be used for submission and one for completion, regardless of the number of
+		commands in the vector. Quadlet commands in a vector read and write their quads in place and compare
+		swap commands report their old value through Locked() as usual.*/
 typedef struct IOFireWireLibVectorCommandInterface_t
 {
 
@@ -3666,7 +3700,11 @@ typedef struct IOFireWireLibVectorCommandInterface_t
 					remove the need for a state machine.</li>
 				<li>kFWVectorCommandInterfaceOrdered - Normally all commands in a vector are executed
 				    simultaneously. Setting this flag will dispatch a command only after the prior 
-					command has completed.
+					command has completed.</li>
+				<li>kFWVectorCommandInterfaceProgress - Normally the commands' completions are called
+					once the whole vector has completed. Setting this flag calls each command's
+					completion as soon as the command completes, at the cost of a kernel transition
+					per command. The vector's completion is still called last.</li>
 			</ul>
 			@result void	*/
 	
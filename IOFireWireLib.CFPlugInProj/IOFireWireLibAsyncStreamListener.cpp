@@ -13,6 +13,7 @@
 #import "IOFireWireLibPriv.h"
 
 #import <IOKit/iokitmig.h>
+#import <libkern/OSAtomic.h>
 
 namespace IOFireWireLib {
 
@@ -40,6 +41,10 @@ namespace IOFireWireLib {
 		mRefInterface( reinterpret_cast<AsyncStreamListenerRef>( & GetInterface() ) )
 	{
 		userclient.AddRef() ;
+
+		mPendingPackets = ::CFDictionaryCreateMutable( kCFAllocatorDefault, 0, NULL, NULL ) ;
+		if (!mPendingPackets)
+			throw kIOReturnNoMemory ;
 	}
 	
 
@@ -53,9 +58,15 @@ namespace IOFireWireLib {
 								  inputs,1,
 								  NULL,&outputCnt);
 		
+		if( mPendingPackets )
+		{
+			::CFRelease( mPendingPackets );
+			mPendingPackets = 0;
+		}
+		
 		if( mBuffer and mBufferSize > 0 )	
 		{
-			delete[] mBuffer;
+			vm_deallocate( mach_task_self(), (vm_address_t) mBuffer, sizeof(PacketQueueHeader) + mBufferSize );
 			mBuffer		= 0;
 			mBufferSize = 0;
 		}
@@ -204,10 +215,36 @@ namespace IOFireWireLib {
 		mNotifyIsOn = false ;
 	}
 
+	void
+	AsyncStreamListener::QueuePacket( FWClientCommandID	commandID,
+									  unsigned long		offset,
+									  unsigned long		size )
+	{
+		::CFDictionarySetValue( mPendingPackets, commandID, (const void*)(offset - sizeof(PacketQueueHeader) + size) ) ;
+	}
+
+	void
+	AsyncStreamListener::RetirePacket( FWClientCommandID	commandID )
+	{
+		const void *	head ;
+		
+		if ( ::CFDictionaryGetValueIfPresent( mPendingPackets, commandID, & head ) )
+		{
+			::CFDictionaryRemoveValue( mPendingPackets, commandID ) ;
+			
+			// finish with the packet before the kernel may write over it
+			OSMemoryBarrier() ;
+			((PacketQueueHeader*)mBuffer)->head = (UInt32)(uintptr_t)head ;
+		}
+	}
+
 	void 
 	AsyncStreamListener::ClientCommandIsComplete ( AsyncStreamListenerRef	self,
 												   FWClientCommandID		commandID )
 	{
+		// hand the packet's queue space back, the kernel doesn't wait for the call below to reuse it
+		RetirePacket( commandID ) ;
+
 		uint32_t		outputCnt = 0;
 		const uint64_t	inputs[2] = {(const uint64_t)mKernAsyncStreamListenerRef, (const uint64_t)commandID};
 
@@ -284,6 +321,8 @@ namespace IOFireWireLib {
 	{
 		AsyncStreamListener* me = IOFireWireIUnknown::InterfaceMap<AsyncStreamListener>::GetThis(refcon) ;
 		
+		me->QueuePacket( args[0], (unsigned long)args[2], (unsigned long)args[1] ) ;
+		
 		if ( ! me->mListener )
 		{
 			me->ClientCommandIsComplete( (AsyncStreamListenerRef) refcon, args[0] ) ;
@@ -105,6 +105,10 @@ namespace IOFireWireLib {
 			AsyncStreamSkippedPacketHandler GetSkippedPacketHandler(
 											AsyncStreamListenerRef		self ) { return mSkippedPacketHandler;} ;	
 
+			void	QueuePacket( FWClientCommandID commandID, unsigned long offset, unsigned long size ) ;
+
+			void	RetirePacket( FWClientCommandID commandID ) ;
+
 			static void	Listener( AsyncStreamListenerRef refcon, IOReturn result, void** args, int numArgs) ;
 
 			static void	SkippedPacket( AsyncStreamListenerRef refCon, IOReturn result, FWClientCommandID commandID, UInt32 packetCount) ;
@@ -125,6 +129,7 @@ namespace IOFireWireLib {
 			void*						mUserRefCon ;
 			UInt32						mBufferSize ;
 			CFMutableDictionaryRef		mPendingLocks ;
+			CFMutableDictionaryRef		mPendingPackets ;	// commandID -> queue head once the packet is done
 			UInt32						mFlags;
 
 			AsyncStreamListenerHandler			mListener ;
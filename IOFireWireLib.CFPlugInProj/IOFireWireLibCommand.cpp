@@ -195,7 +195,8 @@ namespace IOFireWireLib {
 		mStatus( kIOReturnSuccess ),
 		mRefCon( inRefCon ),
 		mCallback( 0 ),
-		mParams(params)
+		mParams(params),
+		mSubmittedInPlace( false )
 	{
 		mUserClient.AddRef() ;
 		bzero(mParams, sizeof(*mParams)) ;
@@ -291,9 +292,10 @@ namespace IOFireWireLib {
 	}
 
 	IOReturn
-	Cmd::PrepareForVectorSubmit( CommandSubmitParams * submit_params )
+	Cmd::PrepareForVectorSubmit( VectorSubmitParams * submit_entry )
 	{
 		IOReturn status = kIOReturnSuccess;
+		CommandSubmitParams * submit_params = &submit_entry->params;
 		
 		// can't prep the vector if a command is still inflight
 		if( mIsExecuting )
@@ -301,24 +303,25 @@ namespace IOFireWireLib {
 			status = kIOReturnBusy;
 		}
 		
-		// we're not supporting synchronous operations 
-		// or inline data when using vectors
+		// we're not supporting synchronous operations when using vectors
 		
 		if( status == kIOReturnSuccess )
 		{
-			if( (mParams->flags & kFWCommandInterfaceSyncExecute) || 
-				(mParams->flags & kFireWireCommandUseCopy) )
+			if( mParams->flags & kFWCommandInterfaceSyncExecute )
 			{
 				status = kIOReturnBadArgument;
 			}
 		}
 
-		// we're only supportting read and write operations on vectors
+		// we're only supporting async read, write, lock and phy operations on vectors
 		
 		if( status == kIOReturnSuccess )
 		{
 			if( (mParams->type != kFireWireCommandType_Read) && 
 				(mParams->type != kFireWireCommandType_Write) && 
+				(mParams->type != kFireWireCommandType_ReadQuadlet) && 
+				(mParams->type != kFireWireCommandType_WriteQuadlet) && 
+				(mParams->type != kFireWireCommandType_CompareSwap) && 
 				(mParams->type != kFireWireCommandType_PHY) )
 			{
 				status = kIOReturnBadArgument;
@@ -390,6 +393,18 @@ namespace IOFireWireLib {
 
 			// copy params into vector
 			bcopy( mParams, submit_params, sizeof(CommandSubmitParams) );
+			
+			// a vector has no room for inline data, except the values of a compare swap,
+			// so the kernel reads and writes our buffer in place instead. it keeps one
+			// kind of buffer at a time, tell it to switch when we last ran inline.
+			if( (mParams->flags & kFireWireCommandUseCopy) && (mParams->type != kFireWireCommandType_CompareSwap) )
+			{
+				submit_params->flags &= ~kFireWireCommandUseCopy;
+				if( !mSubmittedInPlace )
+				{
+					submit_params->staleFlags |= kFireWireCommandStale_Buffer;
+				}
+			}
 					
 			// swap for Rosetta
 	#ifndef __LP64__		
@@ -426,7 +441,20 @@ namespace IOFireWireLib {
 	Cmd::VectorIsExecuting( void )
 	{
 		mIsExecuting = true ;
-		mParams->staleFlags = 0;		
+		mParams->staleFlags = 0;
+		mSubmittedInPlace = (mParams->flags & kFireWireCommandUseCopy) && (mParams->type != kFireWireCommandType_CompareSwap) ;
+	}
+	
+	void
+	Cmd::VectorIsComplete( const VectorSubmitResult * result )
+	{
+		// pack 'em up like the kernel would
+		void * args[3];
+		args[0] = (void*)(unsigned long)result->result.bytesTransferred;
+		args[1] = (void*)(unsigned long)result->result.ackCode;
+		args[2] = (void*)(unsigned long)result->result.responseCode;
+	
+		CommandCompletionHandler( this, result->result.result, args, 3 );
 	}
 	
 	IOReturn
@@ -441,6 +469,13 @@ namespace IOFireWireLib {
 		if (mParams->newMaxPacket > 0)
 			mParams->staleFlags |= kFireWireCommandStale_MaxPacket;
 
+		// a vector left the kernel reading our buffer in place, switch it back to inline data
+		if( mSubmittedInPlace )
+		{
+			mParams->staleFlags |= kFireWireCommandStale_Buffer;
+			mSubmittedInPlace = false;
+		}
+
 		CommandSubmitParams	* submit_params = params;
 		
 		IOReturn 			err = 0;
@@ -480,7 +515,13 @@ namespace IOFireWireLib {
 			}
 		);
 #endif
-	
+
+		if( !err && (mParams->flags & kFWCommandInterfaceCompletionQueue) && !mUserClient.CompletionQueueExists() )
+		{
+			// without a queue the kernel just sends this command's completion as a message
+			mUserClient.CreateCompletionQueue();
+		}
+
 		if( !err )
 		{
 			uint64_t refrncData[kOSAsyncRef64Count];
@@ -1349,6 +1390,7 @@ namespace IOFireWireLib {
 			// assign the new storage to the command object:
 			mParams			= (CommandSubmitParams*) newParamsExtra ;
 			mParamsExtra 	= newParamsExtra ;
+			mParams->newBuffer = (mach_vm_address_t)(mParams+1) ;
 		}
 	
 		// copy users quads to storage area (just past end of params...)
@@ -1546,6 +1588,37 @@ namespace IOFireWireLib {
 		return error ;
 	}
 
+	IOReturn
+	CompareSwapCmd::PrepareForVectorSubmit( VectorSubmitParams * submit_entry )
+	{
+		IOReturn status = Cmd::PrepareForVectorSubmit( submit_entry ) ;
+		
+		// cmpVal and newVal ride along in the vector entry
+		if ( status == kIOReturnSuccess )
+			bcopy( mParams + 1, submit_entry->inlineQuads, sizeof(submit_entry->inlineQuads) ) ;
+		
+		return status ;
+	}
+	
+	void
+	CompareSwapCmd::VectorIsComplete( const VectorSubmitResult * result )
+	{
+		bcopy( &result->lockInfo, &mSubmitResult.lockInfo, sizeof(mSubmitResult.lockInfo) ) ;
+		mSubmitResult.result			= result->result.result ;
+		mSubmitResult.bytesTransferred	= result->result.bytesTransferred ;
+		mSubmitResult.ackCode			= result->result.ackCode ;
+		mSubmitResult.responseCode		= result->result.responseCode ;
+		
+		mStatus 			= mSubmitResult.result ;
+		mBytesTransferred	= mSubmitResult.bytesTransferred ;
+		mAckCode			= mSubmitResult.ackCode;
+		mResponseCode		= mSubmitResult.responseCode;
+		mIsExecuting 		= false ;
+	
+		if (mCallback)
+			(*mCallback)(mRefCon, mStatus) ;
+	}
+
 	Boolean
 	CompareSwapCmd::DidLock()
 	{
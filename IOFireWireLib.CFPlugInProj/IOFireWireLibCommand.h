@@ -70,8 +70,9 @@ namespace IOFireWireLib {
 			virtual UInt32			GetResponseCode();
 			virtual void			SetMaxPacketSpeed( IOFWSpeed speed );
 
-			virtual IOReturn		PrepareForVectorSubmit( CommandSubmitParams * submit_params );
+			virtual IOReturn		PrepareForVectorSubmit( VectorSubmitParams * submit_entry );
 			virtual void			VectorIsExecuting( void );
+			virtual void			VectorIsComplete( const VectorSubmitResult * result );
 	
 			static void				CommandCompletionHandler( 
 											void*			refcon, 
@@ -125,6 +126,7 @@ namespace IOFireWireLib {
 			UInt32							mResponseCode;
 			
 			CommandSubmitParams* 			mParams ;
+			Boolean							mSubmittedInPlace ;		// a vector last ran our inline data from its buffer
 			
 	} ;
 
@@ -376,6 +378,8 @@ namespace IOFireWireLib {
 			virtual IOReturn				SetMaxPacket(
 													IOByteCount				inMaxBytes) ;
 			virtual IOReturn 				Submit() ;
+			virtual IOReturn				PrepareForVectorSubmit( VectorSubmitParams * submit_entry ) ;
+			virtual void					VectorIsComplete( const VectorSubmitResult * result ) ;
 	
 		// --- v2 ---
 			void							SetValues( UInt64 cmpVal, UInt64 newVal) ;
@@ -25,6 +25,7 @@
 
 #import <IOKit/iokitmig.h>
 #import <mach/mach.h>
+#import <libkern/OSAtomic.h>
 #import <System/libkern/OSCrossEndian.h>
 
 namespace IOFireWireLib {
@@ -59,6 +60,9 @@ namespace IOFireWireLib {
 		mIsochAsyncPort				= 0 ;
 		mIsochAsyncCFPort			= 0 ;
 
+		mCompletionQueue			= 0 ;
+		mCompletionQueueSize		= 0 ;
+
 		mDefaultDevice = service ;
 
 		IOReturn error = OpenDefaultConnection() ;
@@ -114,6 +118,12 @@ namespace IOFireWireLib {
 		{
 			IOServiceClose( mConnection ) ;
 		}
+
+		// the user client lets go of the completion queue when the connection closes
+		if ( mCompletionQueue )
+		{
+			vm_deallocate( mach_task_self(), (vm_address_t) mCompletionQueue, mCompletionQueueSize ) ;
+		}
 		
 		if (mIsInited)
 		{
@@ -570,6 +580,136 @@ namespace IOFireWireLib {
 			(me->mBusResetDoneHandler)( (IOFireWireLibDeviceRef)refCon, (FWClientCommandID) me) ;
 	}
 	
+	void
+	Device::CompletionQueueHandler(
+		void*							refCon,
+		IOReturn						result,
+		void**							args,
+		UInt32							numArgs)
+	{
+		Device *					me = (Device*)refCon ;
+		CompletionQueueHeader *		queue = me->mCompletionQueue ;
+		
+		if ( !queue )
+			return ;
+
+		if ( numArgs >= kCompletionQueueOverflowArgs )
+		{
+			// a completion that didn't fit, deliver what was queued ahead of it first.
+			// wakeupPending is left alone, a wakeup may already be on its way
+			me->DrainCompletionQueue( (UInt32)(uintptr_t)args[0] ) ;
+			
+			(*(IOAsyncCallback)(uintptr_t)args[1])( args[2], result, args + kCompletionQueueOverflowArgs, numArgs - kCompletionQueueOverflowArgs ) ;
+			return ;
+		}
+
+		// clear wakeupPending before looking at producer, the kernel sends another
+		// wakeup for anything it queues after this
+		queue->wakeupPending = 0 ;
+		OSMemoryBarrier() ;
+
+		UInt32 producer ;
+		while ( (producer = queue->producer) != queue->consumer )
+		{
+			me->DrainCompletionQueue( producer ) ;
+		}
+	}
+	
+	// DrainCompletionQueue
+	//
+	// calls out queued completions until consumer reaches producer
+
+	void
+	Device::DrainCompletionQueue(
+		UInt32							producer)
+	{
+		CompletionQueueHeader *		queue = mCompletionQueue ;
+		
+		UInt32 consumer = queue->consumer ;
+		while ( (SInt32)(producer - consumer) > 0 )
+		{
+			OSMemoryBarrier() ;
+
+			// copy the entry out and hand the slot back before calling out, the
+			// callback may well submit the command again
+			CompletionQueueEntry entry = ((CompletionQueueEntry*)(queue + 1))[ consumer & (queue->entryCount - 1) ] ;
+			OSMemoryBarrier() ;
+			queue->consumer = ++consumer ;
+
+#ifdef __LP64__
+			void ** args = (void**)entry.args ;
+#else
+			void * args[ kCompletionQueueMaxArgs ] ;
+			for( UInt32 i = 0; i < entry.argCount; i++ )
+				args[i] = (void*)(uintptr_t)entry.args[i] ;
+#endif
+
+			(*(IOAsyncCallback)entry.callback)( (void*)entry.refCon, entry.status, args, entry.argCount ) ;
+		}
+	}
+	
+	IOReturn
+	Device::CreateCompletionQueue()
+	{
+		IOReturn				result			= kIOReturnSuccess ;
+		vm_address_t			address			= 0 ;
+		vm_size_t				size			= sizeof(CompletionQueueHeader) + kCompletionQueueEntryCount * sizeof(CompletionQueueEntry) ;
+		
+		if ( mCompletionQueue )
+			return kIOReturnSuccess ;
+		
+		if ( !mConnection )
+			result = kIOReturnNoDevice ;
+		
+		if ( !AsyncPortsExist() )
+			result = kIOReturnNotReady ;
+
+#ifndef __LP64__
+		// entries are written in the kernel's byte order
+		ROSETTA_ONLY(
+			{
+				result = kIOReturnUnsupported ;
+			}
+		);
+#endif
+
+		if ( kIOReturnSuccess == result )
+		{
+			result = vm_allocate( mach_task_self(), & address, size, true /*anywhere*/ ) ;
+			if ( !address )
+				result = kIOReturnNoMemory ;
+		}
+		
+		if ( kIOReturnSuccess == result )
+		{
+			// vm_allocate hands back zeroed pages
+			((CompletionQueueHeader*)address)->entryCount = kCompletionQueueEntryCount ;
+		
+			uint64_t refrncData[kOSAsyncRef64Count];
+			refrncData[kIOAsyncCalloutFuncIndex] = (uint64_t) 0;
+			refrncData[kIOAsyncCalloutRefconIndex] = (unsigned long) 0;
+			const uint64_t inputs[4] = {(const uint64_t)& Device::CompletionQueueHandler,(const uint64_t)this,(const uint64_t)address,(const uint64_t)size};
+			uint32_t outputCnt = 0;
+			result = IOConnectCallAsyncScalarMethod(mConnection,
+													kCommandCompletionQueue_Set,
+													mAsyncPort, 
+													refrncData,kOSAsyncRef64Count,
+													inputs,4,
+													NULL,&outputCnt);
+			if ( kIOReturnSuccess == result )
+			{
+				mCompletionQueue = (CompletionQueueHeader*)address ;
+				mCompletionQueueSize = size ;
+			}
+			else
+			{
+				vm_deallocate( mach_task_self(), address, size ) ;
+			}
+		}
+		
+		return result ;
+	}
+	
 #pragma mark -
 	IOReturn
 	Device::Read(
@@ -1210,14 +1350,15 @@ namespace IOFireWireLib {
 		
 		IOFireWireLibPseudoAddressSpaceRef				result = 0 ;
 	
+		// the queue starts with a PacketQueueHeader, vm_allocate hands it back zeroed
 		void*	queueBuffer = nil ;
 		if ( inQueueBufferSize > 0 )
-			queueBuffer	= new Byte[inQueueBufferSize] ;
+			vm_allocate( mach_task_self(), (vm_address_t*) & queueBuffer, sizeof(PacketQueueHeader) + inQueueBufferSize, true /*anywhere*/ ) ;
 	
 		AddressSpaceCreateParams	params ;
 		params.size 			= inSize ;
 		params.queueBuffer 		= (mach_vm_address_t) queueBuffer ;
-		params.queueSize		= (UInt32) inQueueBufferSize ;
+		params.queueSize		= queueBuffer ? sizeof(PacketQueueHeader) + inQueueBufferSize : 0 ;
 		params.backingStore 	= (mach_vm_address_t) inBackingStore ;
 		params.refCon			= (mach_vm_address_t)this ;  //zzz is this even used?
 		params.flags			= inFlags ;
@@ -1257,7 +1398,7 @@ namespace IOFireWireLib {
 		{
 			// we allocate a user space pseudo address space with the reference we
 			// got from the kernel
-			IUnknownVTbl**	iUnknown = PseudoAddressSpace::Alloc(*this, addrSpaceRef, queueBuffer, inQueueBufferSize, inBackingStore, inRefCon) ;
+			IUnknownVTbl**	iUnknown = PseudoAddressSpace::Alloc(*this, addrSpaceRef, queueBuffer, inQueueBufferSize, inBackingStore, inRefCon, inFlags) ;
 			
 			// we got a new iUnknown from the object. Query it for the interface
 			// requested in iid...
@@ -1268,6 +1409,10 @@ namespace IOFireWireLib {
 			(*iUnknown)->Release(iUnknown) ;
 			
 		}
+		else if ( queueBuffer )
+		{
+			vm_deallocate( mach_task_self(), (vm_address_t) queueBuffer, sizeof(PacketQueueHeader) + inQueueBufferSize ) ;
+		}
 		
 		return result ;
 	}
@@ -1779,15 +1924,16 @@ namespace IOFireWireLib {
 		
 		IOFWAsyncStreamListenerInterfaceRef		result = 0 ;
 	
+		// the queue starts with a PacketQueueHeader, vm_allocate hands it back zeroed
 		void*	queueBuffer = nil ;
 		if ( inQueueBufferSize > 0 )
-			queueBuffer	= new Byte[inQueueBufferSize] ;
+			vm_allocate( mach_task_self(), (vm_address_t*) & queueBuffer, sizeof(PacketQueueHeader) + inQueueBufferSize, true /*anywhere*/ ) ;
 	
 		FWUserAsyncStreamListenerCreateParams	params ;
 		
 		params.channel			= channel;
 		params.queueBuffer 		= (mach_vm_address_t) queueBuffer ;
-		params.queueSize		= (UInt32) inQueueBufferSize ;
+		params.queueSize		= queueBuffer ? sizeof(PacketQueueHeader) + inQueueBufferSize : 0 ;
 		params.flags			= 0 ;
 		params.callback			= (mach_vm_address_t)callback;
 		params.refCon			= (mach_vm_address_t)this ;
@@ -1839,6 +1985,10 @@ namespace IOFireWireLib {
 			(*iUnknown)->Release(iUnknown) ;
 			
 		}
+		else if ( queueBuffer )
+		{
+			vm_deallocate( mach_task_self(), (vm_address_t) queueBuffer, sizeof(PacketQueueHeader) + inQueueBufferSize ) ;
+		}
 		
 		return result ;
 	}
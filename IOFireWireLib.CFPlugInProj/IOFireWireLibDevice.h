@@ -119,6 +119,10 @@ namespace IOFireWireLib {
 			CFRunLoopRef				mIsochRunLoop ;
 			CFRunLoopSourceRef			mIsochRunLoopSource ;
 			CFStringRef					mIsochRunLoopMode ;
+			
+			// completion queue shared with the user client
+			CompletionQueueHeader *		mCompletionQueue ;
+			vm_size_t					mCompletionQueueSize ;
 
 		public:
 									Device( const IUnknownVTbl & interface, CFDictionaryRef propertyTable, io_service_t service ) ;
@@ -166,6 +170,13 @@ namespace IOFireWireLib {
 			static void				BusResetDoneHandler(
 											void*				refCon,
 											IOReturn			result) ;
+			static void				CompletionQueueHandler(
+											void*				refCon,
+											IOReturn			result,
+											void**				args,
+											UInt32				numArgs) ;
+			void					DrainCompletionQueue(
+											UInt32				producer) ;
 															
 			// Call this function when you have completed processing a notification.
 			void					ClientCommandIsComplete(
@@ -331,6 +342,8 @@ namespace IOFireWireLib {
 			const mach_port_t		GetIsochAsyncPort() const 			{ return mIsochAsyncPort ; }
 			IOReturn				CreateIsochAsyncPorts() ;
 			const Boolean			IsochAsyncPortsExist() const		{ return ((mIsochAsyncCFPort != 0) && (mIsochAsyncPort != 0)); }
+			IOReturn				CreateCompletionQueue() ;
+			Boolean					CompletionQueueExists() const		{ return (mCompletionQueue != 0); }
 		
 			IOReturn				CreateCFStringWithOSStringRef(
 											UserObjectHandle	inStringRef,
@@ -383,7 +396,8 @@ namespace IOFireWireLib {
 			IOReturn				ClipMaxRec2K( Boolean clipMaxRec ) ;
 			IOFireWireSessionRef	GetSessionRef() ;
 
-			static inline MethodSelector	MakeSelectorWithObject( MethodSelector selector, UserObjectHandle obj )		{ return (MethodSelector)( (unsigned long)obj << 16 | selector & 0xFFFF ) ; }		
+			// only the handle's index fits in a selector, its generation is left behind
+			static inline MethodSelector	MakeSelectorWithObject( MethodSelector selector, UserObjectHandle obj )		{ return (MethodSelector)( ((unsigned long)obj & 0xFFFF) << 16 | selector & 0xFFFF ) ; }		
 			
 			IOFireWireLibVectorCommandRef CreateVectorCommand( IOFireWireLibCommandCallback callback, void* inRefCon,  REFIID iid );
 			
@@ -346,6 +346,72 @@ namespace IOFireWireLib {
 		UInt32						responseCode;
 		FWCompareSwapLockInfo		lockInfo ;
 	}  __attribute__ ((packed));
+
+	//
+	// vector commands
+	//
+	// The submit buffer holds one VectorSubmitParams per command and the kernel writes
+	// each command's VectorSubmitResult at the same index of the result buffer, whatever
+	// order the commands complete in. Compare swap commands carry their values in
+	// inlineQuads and get the old value back in lockInfo.
+	//
+	
+	enum
+	{
+		kVectorCommandInlineQuads	= 4		// cmpVal and newVal of a 64 bit compare swap
+	} ;
+	
+	struct VectorSubmitParams
+	{
+		CommandSubmitParams			params ;
+		UInt32						inlineQuads[ kVectorCommandInlineQuads ] ;
+	} __attribute__ ((packed));
+	
+	struct VectorSubmitResult
+	{
+		CommandSubmitResult			result ;
+		FWCompareSwapLockInfo		lockInfo ;
+	} __attribute__ ((packed));
+
+	//
+	// completion queue
+	//
+	// Shared with the user client by kCommandCompletionQueue_Set. The kernel appends the
+	// completions of commands submitted with kFWCommandInterfaceCompletionQueue and only
+	// sends a wakeup message when wakeupPending is clear. The library clears wakeupPending
+	// and then drains entries until consumer catches up with producer. producer and
+	// consumer run freely and are masked by entryCount - 1.
+	//
+	// A completion that doesn't fit in the queue is sent to the queue's own callback
+	// with producer, callback and refCon ahead of its args. The library drains the
+	// entries queued before it, up to that producer index, and then calls it out.
+	//
+	
+	enum
+	{
+		kCompletionQueueMaxArgs		= 16,		// same as the kernel's kMaxAsyncArgs
+		kCompletionQueueEntryCount	= 256,
+		kCompletionQueueOverflowArgs	= 3			// producer, callback, refCon
+	} ;
+	
+	struct CompletionQueueEntry
+	{
+		mach_vm_address_t			callback ;
+		mach_vm_address_t			refCon ;
+		IOReturn					status ;
+		UInt32						argCount ;
+		UInt64						args[ kCompletionQueueMaxArgs ] ;
+	} ;
+	
+	struct CompletionQueueHeader
+	{
+		volatile UInt32				producer ;			// written by the kernel
+		volatile UInt32				consumer ;			// written by the library
+		volatile UInt32				wakeupPending ;
+		UInt32						entryCount ;		// power of 2, read once by the kernel
+		volatile UInt32				overflows ;			// completions sent as messages instead
+		UInt32						reserved[3] ;
+	} ;
 		
 	//
 	// DCL stuff
@@ -405,7 +471,33 @@ namespace IOFireWireLib {
 		mach_vm_address_t		callback ;
 		mach_vm_address_t		refCon ;
 	}  __attribute__ ((packed));
-	
+
+	//
+	// packet queue
+	//
+	// Starts the queueBuffer of pseudo address spaces and async stream listeners. The
+	// kernel writes packets after the header and advances tail, the library advances
+	// head past each packet as the client completes it, so neither side waits on the
+	// other to reuse queue space. Both are offsets from the end of the header, packet
+	// offsets handed to the library are from the start of the queue buffer. retired
+	// counts the packets the library has moved head past, which is how the kernel
+	// tells that a particular packet is done with.
+	//
+
+	enum
+	{
+		kPacketQueueCacheLineSize = 64
+	} ;
+
+	struct PacketQueueHeader
+	{
+		volatile UInt32			tail ;			// written by the kernel
+		UInt8					tailLine[ kPacketQueueCacheLineSize - sizeof(UInt32) ] ;
+		volatile UInt32			head ;			// written by the library
+		volatile UInt32			retired ;		// written by the library
+		UInt8					headLine[ kPacketQueueCacheLineSize - 2 * sizeof(UInt32) ] ;
+	} ;
+
 //	struct PhysicalAddressSpaceCreateParams
 //	{
 //		UInt32		size ;
@@ -575,6 +667,8 @@ namespace IOFireWireLib {
 		kPHYPacketListenerActivate,
 		kPHYPacketListenerDeactivate,
 		kPHYPacketListenerClientCommandIsComplete,
+		kCommandCompletionQueue_Set,
+		kPseudoAddrSpace_ClientCommandsAreComplete,
 		kNumMethods
 	} ;
 
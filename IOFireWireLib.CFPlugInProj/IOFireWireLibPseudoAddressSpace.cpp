@@ -33,6 +33,7 @@
 
 #import <IOKit/iokitmig.h>
 #import <System/libkern/OSCrossEndian.h>
+#import <libkern/OSAtomic.h>
 
 namespace IOFireWireLib {
 	
@@ -55,12 +56,12 @@ namespace IOFireWireLib {
 	
 	IUnknownVTbl** 
 	PseudoAddressSpace::Alloc( Device& userclient, UserObjectHandle inKernAddrSpaceRef, void* inBuffer, UInt32 inBufferSize, 
-			void* inBackingStore, void* inRefCon )
+			void* inBackingStore, void* inRefCon, UInt32 inFlags )
 	{
 		PseudoAddressSpace* me = nil ;
 		
 		try {
-			me = new PseudoAddressSpace(userclient, inKernAddrSpaceRef, inBuffer, inBufferSize, inBackingStore, inRefCon) ;
+			me = new PseudoAddressSpace(userclient, inKernAddrSpaceRef, inBuffer, inBufferSize, inBackingStore, inRefCon, inFlags) ;
 		} catch (...) {
 		}
 		
@@ -170,7 +171,7 @@ namespace IOFireWireLib {
 	// ============================================================
 	
 	PseudoAddressSpace::PseudoAddressSpace( Device& userclient, UserObjectHandle inKernAddrSpaceRef,
-												void* inBuffer, UInt32 inBufferSize, void* inBackingStore, void* inRefCon) 
+												void* inBuffer, UInt32 inBufferSize, void* inBackingStore, void* inRefCon, UInt32 inFlags) 
 	: IOFireWireIUnknown( reinterpret_cast<const IUnknownVTbl &>( sInterface ) ),
 		mNotifyIsOn(false),
 		mWriter( nil ),
@@ -181,14 +182,27 @@ namespace IOFireWireLib {
 		mBuffer((char*)inBuffer),
 		mBufferSize(inBufferSize),
 		mBackingStore(inBackingStore),
-		mRefCon(inRefCon)
+		mRefCon(inRefCon),
+		mFlags(inFlags),
+		mPendingResponses(0)
 	{
 		userclient.AddRef() ;
 
 		mPendingLocks = ::CFDictionaryCreateMutable( kCFAllocatorDefault, 0, NULL, NULL ) ;
 		if (!mPendingLocks)
 			throw kIOReturnNoMemory ;
-	
+
+		mPendingPackets = ::CFDictionaryCreateMutable( kCFAllocatorDefault, 0, NULL, NULL ) ;
+		if (!mPendingPackets)
+			throw kIOReturnNoMemory ;
+		
+		if ( mFlags & kFWAddressSpaceAutoRetireWrites )
+		{
+			mPendingResponses = ::CFSetCreateMutable( kCFAllocatorDefault, 0, NULL ) ;
+			if (!mPendingResponses)
+				throw kIOReturnNoMemory ;
+		}
+
 		AddressSpaceInfo info ;
 
 		IOReturn error ;
@@ -243,10 +257,22 @@ namespace IOFireWireLib {
 			::CFRelease( mPendingLocks );
 			mPendingLocks = 0;
 		}
-			
+		
+		if( mPendingPackets )
+		{
+			::CFRelease( mPendingPackets );
+			mPendingPackets = 0;
+		}
+		
+		if( mPendingResponses )
+		{
+			::CFRelease( mPendingResponses );
+			mPendingResponses = 0;
+		}
+
 		if( mBuffer and mBufferSize > 0 )	
 		{
-			delete[] mBuffer;
+			vm_deallocate( mach_task_self(), (vm_address_t) mBuffer, sizeof(PacketQueueHeader) + mBufferSize );
 			mBuffer		= 0;
 			mBufferSize = 0;
 		}
@@ -401,6 +427,41 @@ namespace IOFireWireLib {
 		mNotifyIsOn = false ;
 	}
 	
+	void
+	PseudoAddressSpace::QueuePacket(
+		FWClientCommandID				commandID,
+		unsigned long					offset,
+		unsigned long					size )
+	{
+		if ( mBuffer )
+			::CFDictionarySetValue( mPendingPackets, commandID, (const void*)(offset - sizeof(PacketQueueHeader) + size) ) ;
+	}
+	
+	void
+	PseudoAddressSpace::RetirePacket(
+		FWClientCommandID				commandID )
+	{
+		const void *	head ;
+		
+		if ( ::CFDictionaryGetValueIfPresent( mPendingPackets, commandID, & head ) )
+		{
+			::CFDictionaryRemoveValue( mPendingPackets, commandID ) ;
+			
+			// finish with the packet before the kernel may write over it
+			OSMemoryBarrier() ;
+			((PacketQueueHeader*)mBuffer)->head = (UInt32)(uintptr_t)head ;
+			((PacketQueueHeader*)mBuffer)->retired = ((PacketQueueHeader*)mBuffer)->retired + 1 ;
+		}
+	}
+	
+	void
+	PseudoAddressSpace::ExpectResponse(
+		FWClientCommandID				commandID )
+	{
+		if ( mPendingResponses )
+			::CFSetAddValue( mPendingResponses, commandID ) ;
+	}
+
 	void
 	PseudoAddressSpace::ClientCommandIsComplete(
 		FWClientCommandID				commandID,
@@ -442,7 +503,23 @@ namespace IOFireWireLib {
 				
 			delete[] (args-1) ;
 		}
-	
+		
+		// hand the packet's queue space back, the kernel doesn't wait for the call below to reuse it
+		RetirePacket( commandID ) ;
+		
+		// with kFWAddressSpaceAutoRetireWrites only reads and locks need the kernel, which
+		// retires every packet before this one along with it. Anything else has been retired
+		// already or will be once the kernel sees the queue head has moved past it.
+		uint32_t selector = kPseudoAddrSpace_ClientCommandIsComplete ;
+		if ( mPendingResponses )
+		{
+			if ( !::CFSetContainsValue( mPendingResponses, commandID ) )
+				return ;
+			
+			::CFSetRemoveValue( mPendingResponses, commandID ) ;
+			selector = kPseudoAddrSpace_ClientCommandsAreComplete ;
+		}
+		
 		uint32_t outputCnt = 0;		
 		const uint64_t inputs[3] = {(const uint64_t)mKernAddrSpaceRef, (const uint64_t)commandID, status};
 
@@ -451,7 +528,7 @@ namespace IOFireWireLib {
 		#endif
 		
 		IOConnectCallScalarMethod(mUserClient.GetUserClientConnection(), 
-								  kPseudoAddrSpace_ClientCommandIsComplete,
+								  selector,
 								  inputs,3,
 								  NULL,&outputCnt);
 
@@ -467,6 +544,10 @@ namespace IOFireWireLib {
 	{
 		PseudoAddressSpace* me = IOFireWireIUnknown::InterfaceMap<PseudoAddressSpace>::GetThis(refcon) ;
 	
+		me->QueuePacket( args[0], (unsigned long)args[2], (unsigned long)args[1] ) ;
+		if ( (bool)args[7] )
+			me->ExpectResponse( args[0] ) ;
+
 		if ( !me->mWriter || ( (bool)args[7] && !me->mReader) )
 		{
 			me->ClientCommandIsComplete( args[0], kFWResponseTypeError) ;
@@ -522,8 +603,9 @@ namespace IOFireWireLib {
 	PseudoAddressSpace::Reader( AddressSpaceRef	refcon, IOReturn result, void** args, int numArgs )
 	{
 		PseudoAddressSpace* me = IOFireWireIUnknown::InterfaceMap<PseudoAddressSpace>::GetThis(refcon) ;
-
-	
+		
+		me->ExpectResponse( args[0] ) ;
+		
 		if (me->mReader)
 		{
 			(me->mReader)( (AddressSpaceRef) refcon,
@@ -49,7 +49,7 @@ namespace IOFireWireLib {
 			// static allocator
 			static IUnknownVTbl** 	Alloc( Device& userclient, UserObjectHandle inKernAddrSpaceRef, 
 											void* inBuffer, UInt32 inBufferSize, void* inBackingStore, 
-											void* inRefCon) ;
+											void* inRefCon, UInt32 inFlags = 0 ) ;
 		
 			// QueryInterface
 			virtual HRESULT	QueryInterface(REFIID iid, void **ppv );
@@ -94,8 +94,14 @@ namespace IOFireWireLib {
 											void*							inBuffer,
 											UInt32							inBufferSize,
 											void*							inBackingStore,
-											void*							inRefCon = 0) ;
+											void*							inRefCon = 0,
+											UInt32							inFlags = 0 ) ;
 			virtual					~PseudoAddressSpace() ;
+
+			// --- packet queue ----------------
+			void					QueuePacket( FWClientCommandID commandID, unsigned long offset, unsigned long size ) ;
+			void					RetirePacket( FWClientCommandID commandID ) ;
+			void					ExpectResponse( FWClientCommandID commandID ) ;
 					
 			// --- callback methods ----------------
 			static void				Writer( AddressSpaceRef refcon, IOReturn result, void** args,
@@ -140,7 +146,11 @@ namespace IOFireWireLib {
 		
 			void*							mBackingStore ;
 			void*							mRefCon ;
-			
+			UInt32							mFlags ;
+
 			CFMutableDictionaryRef			mPendingLocks ;
+			CFMutableDictionaryRef			mPendingPackets ;	// commandID -> queue head once the packet is done
+			CFMutableSetRef					mPendingResponses ;	// reads and locks the kernel still has to answer,
+																// only kept with kFWAddressSpaceAutoRetireWrites
 	} ;	
 }
@@ -93,6 +93,7 @@ namespace IOFireWireLib
 		mCallback( inCallback ),
 		mFlags( 0 ),
 		mInflightCount( 0 ),
+		mCompletedEntries( NULL ),
 		mSubmitBuffer( NULL ),
 		mSubmitBufferSize( 0 ),
 		mResultBuffer( NULL ),
@@ -108,6 +109,12 @@ namespace IOFireWireLib
 			throw kIOReturnNoMemory;
 		}
 
+		mCompletedEntries = CFBitVectorCreateMutable( kCFAllocatorDefault, 0 );
+		if( mCompletedEntries == NULL )
+		{
+			throw kIOReturnNoMemory;
+		}
+
 		// output data
 		UserObjectHandle kernel_ref = 0;
 		size_t outputStructCnt = sizeof(kernel_ref);
@@ -166,6 +173,12 @@ namespace IOFireWireLib
 			mCommandArray = NULL;
 		}
 		
+		if( mCompletedEntries )
+		{
+			CFRelease( mCompletedEntries );
+			mCompletedEntries = NULL;
+		}
+		
 		mUserClient.Release();
 	}
 
@@ -209,8 +222,8 @@ namespace IOFireWireLib
 	{
 		IOReturn status = kIOReturnSuccess;
 		
-		mach_vm_size_t required_submit_size = capacity * sizeof(CommandSubmitParams);
-		mach_vm_size_t required_result_size = capacity * sizeof(CommandSubmitResult);
+		mach_vm_size_t required_submit_size = capacity * sizeof(VectorSubmitParams);
+		mach_vm_size_t required_result_size = capacity * sizeof(VectorSubmitResult);
 		
 		// do we have enough space?
 		if( (mSubmitBufferSize < required_submit_size) ||
@@ -289,10 +302,10 @@ namespace IOFireWireLib
 			
 			if( status == kIOReturnSuccess )
 			{
-				mSubmitBuffer = (CommandSubmitParams*)submit_buffer;
+				mSubmitBuffer = (VectorSubmitParams*)submit_buffer;
 				mSubmitBufferSize = required_submit_size;
 
-				mResultBuffer = (CommandSubmitResult*)result_buffer;
+				mResultBuffer = (VectorSubmitResult*)result_buffer;
 				mResultBufferSize = required_result_size;
 			}
 		}
@@ -324,6 +337,14 @@ namespace IOFireWireLib
 		if( status == kIOReturnSuccess )
 		{
 			count = CFArrayGetCount( mCommandArray );
+			if( count == 0 )
+			{
+				status = kIOReturnBadArgument;
+			}
+		}
+		
+		if( status == kIOReturnSuccess )
+		{
 			status = EnsureCapacity( count );
 		}
 
@@ -352,8 +373,10 @@ namespace IOFireWireLib
 			async_ref[kIOAsyncCalloutRefconIndex] = (unsigned long) 0;
 
 			// inputs
-			const uint64_t inputs[2] = { (const uint64_t)&SVectorCompletionHandler,
-										 (const uint64_t)this };
+			const uint64_t inputs[4] = { (const uint64_t)&SVectorCompletionHandler,
+										 (const uint64_t)this,
+										 (const uint64_t)count,
+										 (const uint64_t)mFlags };
 			// outputs
 			uint32_t output_count = 0;
 
@@ -361,11 +384,17 @@ namespace IOFireWireLib
 												  mUserClient.MakeSelectorWithObject( kVectorCommandSubmit, mKernCommandRef ),
 												  mUserClient.GetAsyncPort(),
 												  async_ref, kOSAsyncRef64Count,
-												  inputs, 2,
+												  inputs, 4,
 												  NULL, &output_count);
+		}
 
+		if( status == kIOReturnSuccess )
+		{
 			mInflightCount = count;
 			
+			CFBitVectorSetCount( mCompletedEntries, count );
+			CFBitVectorSetAllBits( mCompletedEntries, 0 );
+			
 //			printf( "VectorCommand::Submit - IOConnectCallAsyncStructMethod status = 0x%08lx\n", status );
 		}
 
@@ -439,6 +468,10 @@ namespace IOFireWireLib
 		me->VectorCompletionHandler( result, quads, numQuads );		
 	}
 
+	// the kernel sends a message with the entry's index as each entry completes when
+	// kFWVectorCommandInterfaceProgress is set, then one without arguments once the
+	// whole vector is done
+
 	void
 	VectorCommand::VectorCompletionHandler(
 		IOReturn			result,
@@ -447,31 +480,51 @@ namespace IOFireWireLib
 	{
 		//printf( "VectorCommand::VectorCompletionHandler - status = 0x%08lx\n", result );
 
-		CFIndex count = CFArrayGetCount( mCommandArray );
-			
-		for( CFIndex index = 0; (index < count); index++ )
+		CFIndex count = CFBitVectorGetCount( mCompletedEntries );
+		
+		if( numQuads == 1 )
 		{
-			Cmd * cmd = (Cmd*)mResultBuffer[index].refCon;
-			
-			IOReturn status = mResultBuffer[index].result;
-			
-			// pack 'em up like the kernel would
-			void * args[3];
-			args[0] = (void*)mResultBuffer[index].bytesTransferred;
-			args[1] = (void*)mResultBuffer[index].ackCode;
-			args[2] = (void*)mResultBuffer[index].responseCode;
-		
-			// call the completion routine
-			cmd->CommandCompletionHandler( cmd, status, args, 3 );
-			
-			if( mInflightCount > 0 )
+			CFIndex index = (unsigned long)quads[0];
+			if( index < count )
 			{
-				mInflightCount--;
+				CompleteEntry( index );
 			}
+			
+			return;
 		}
 		
+		// results are at the index of their command, complete the rest in vector order
+		for( CFIndex index = 0; (index < count); index++ )
+		{
+			CompleteEntry( index );
+		}
+		
+		mStatus = result;
+		mInflightCount = 0;
+		
 		(*mCallback)( mRefCon, mStatus );
 	}
+
+	// CompleteEntry
+	//
+	//
+	
+	void
+	VectorCommand::CompleteEntry( CFIndex index )
+	{
+		if( CFBitVectorGetBitAtIndex( mCompletedEntries, index ) || (index >= CFArrayGetCount( mCommandArray )) )
+		{
+			return;
+		}
+		
+		CFBitVectorSetBitAtIndex( mCompletedEntries, index, 1 );
+		
+		IOFireWireLibCommandRef command = (IOFireWireLibCommandRef)CFArrayGetValueAtIndex( mCommandArray, index );
+		Cmd * cmd = IOFireWireIUnknown::InterfaceMap<Cmd>::GetThis(command);
+		
+		// call the completion routine
+		cmd->VectorIsComplete( &mResultBuffer[index] );
+	}
 		
 	// SetCallback
 	//
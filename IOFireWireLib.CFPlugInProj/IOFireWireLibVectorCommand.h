@@ -45,11 +45,12 @@ namespace IOFireWireLib
 			UInt32							mFlags;
 			UInt32							mInflightCount;
 			IOReturn						mStatus;
+			CFMutableBitVectorRef			mCompletedEntries;
 			
-			CommandSubmitParams *			mSubmitBuffer;
+			VectorSubmitParams *			mSubmitBuffer;
 			vm_size_t						mSubmitBufferSize;
 
-			CommandSubmitResult *			mResultBuffer;
+			VectorSubmitResult *			mResultBuffer;
 			vm_size_t						mResultBufferSize;
 						
 		public:
@@ -86,6 +87,8 @@ namespace IOFireWireLib
 			virtual void VectorCompletionHandler(	IOReturn			result,
 													void*				quads[],
 													UInt32				numQuads );
+
+			void CompleteEntry( CFIndex index );
 																										
 			static void SSetRefCon( IOFireWireLibVectorCommandRef self, void* refCon );
 